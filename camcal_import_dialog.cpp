@@ -224,6 +224,8 @@ void CamCalImportDialog::OnOk(wxCommandEvent& evt)
         if (wxCopyFile(sourceName, destName, true))
         {
             Debug.Write(wxString::Format("Dark library imported from profile %d to profile %d\n", m_sourceDarksProfileId, m_thisProfileId));
+            // rebuilt from the FITS file on the next load
+            DarkLibraryCache::Remove(destName);
             if (!bpmLoaded)
             {
                 pFrame->LoadDarkHandler(true);
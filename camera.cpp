@@ -757,6 +757,7 @@ void CameraConfigDialogPane::LayoutControls(GuideCamera *pCamera, BrainCtrlIdMap
     wxSizerFlags def_flags = wxSizerFlags(0).Border(wxALL, 10).Expand();
     pTopline->Add(GetSizerCtrl(CtrlMap, AD_szNoiseReduction));
     pTopline->Add(GetSizerCtrl(CtrlMap, AD_szTimeLapse), wxSizerFlags(0).Border(wxLEFT, 110).Expand());
+    pTopline->Add(GetSizerCtrl(CtrlMap, AD_szPipelineDepth), wxSizerFlags(0).Border(wxLEFT, 40).Expand());
     pGenGroup->Add(pTopline, def_flags);
     pGenGroup->Add(GetSizerCtrl(CtrlMap, AD_szAutoExposure), def_flags);
     pGenGroup->Layout();
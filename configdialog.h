@@ -51,6 +51,7 @@ enum BRAIN_CTRL_IDS
     AD_szAutoExposure,
     AD_szCameraTimeout,
     AD_szTimeLapse,
+    AD_szPipelineDepth,
     AD_szPixelSize,
     AD_szGain,
     AD_szDelay,
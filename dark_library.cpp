@@ -0,0 +1,320 @@
+/*
+ *  dark_library.cpp
+ *  PHD Guiding
+ *
+ *  Created by Arran Dengate
+ *  Copyright (c) 2017 Arran Dengate
+ *  All rights reserved.
+ *
+ *  This source code is distributed under the following "BSD" license
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *    Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *    Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *    Neither the name of Bret McKee, Dad Dog Development,
+ *     Craig Stark, Stark Labs nor the names of its
+ *     contributors may be used to endorse or promote products derived from
+ *     this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "phd.h"
+
+#include <wx/file.h>
+#include <wx/filename.h>
+
+#ifdef __WINDOWS__
+# include <wx/msw/wrapwin.h>
+#else
+# include <sys/mman.h>
+# include <sys/stat.h>
+# include <fcntl.h>
+# include <unistd.h>
+#endif
+
+// The cache file header. fitSize and fitHash identify the FITS file it was
+// made from; if the FITS file has changed since, the cache is stale and is
+// rebuilt. A directory of count entries follows, then the frames, each
+// width x height 16 bit pixels starting at a multiple of DARK_LIB_ALIGN.
+struct DarkLibHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t count;
+    uint32_t width;
+    uint32_t height;
+    uint64_t fitSize;
+    uint64_t fitHash;
+};
+
+struct DarkLibEntry
+{
+    int32_t expDur;
+    uint32_t reserved;
+    uint64_t offset;
+};
+
+static const char DarkLibMagic[8] = { 'P', 'H', 'D', '2', 'D', 'L', 'B', 0 };
+enum { DARK_LIB_VERSION = 2, DARK_LIB_ALIGN = 4096 };
+
+static uint64_t AlignUp(uint64_t n)
+{
+    return (n + DARK_LIB_ALIGN - 1) & ~(uint64_t) (DARK_LIB_ALIGN - 1);
+}
+
+// A private, copy-on-write mapping of a whole file
+class MappedFile
+{
+    char *m_data;
+    size_t m_size;
+
+public:
+
+    MappedFile() : m_data(0), m_size(0) { }
+    ~MappedFile();
+
+    bool Open(const wxString& filename);
+    char *Data() const { return m_data; }
+    size_t Size() const { return m_size; }
+};
+
+#ifdef __WINDOWS__
+
+bool MappedFile::Open(const wxString& filename)
+{
+    HANDLE file = CreateFileW(filename.wc_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+        FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE)
+        return false;
+
+    LARGE_INTEGER size;
+    HANDLE mapping = NULL;
+    if (GetFileSizeEx(file, &size) && size.QuadPart > 0)
+        mapping = CreateFileMappingW(file, NULL, PAGE_WRITECOPY, 0, 0, NULL);
+    CloseHandle(file);
+    if (!mapping)
+        return false;
+
+    // the view keeps the mapping open
+    void *p = MapViewOfFile(mapping, FILE_MAP_COPY, 0, 0, 0);
+    CloseHandle(mapping);
+    if (!p)
+        return false;
+
+    m_data = static_cast<char *>(p);
+    m_size = (size_t) size.QuadPart;
+    return true;
+}
+
+MappedFile::~MappedFile()
+{
+    if (m_data)
+        UnmapViewOfFile(m_data);
+}
+
+#else
+
+bool MappedFile::Open(const wxString& filename)
+{
+    int fd = open(filename.fn_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    void *p = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+        p = mmap(0, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+        return false;
+
+    m_data = static_cast<char *>(p);
+    m_size = st.st_size;
+    return true;
+}
+
+MappedFile::~MappedFile()
+{
+    if (m_data)
+        munmap(m_data, m_size);
+}
+
+#endif
+
+wxString DarkLibraryCache::CacheFileName(const wxString& fitName)
+{
+    wxString name = fitName;
+    wxString base;
+    if (name.EndsWith(".fit", &base))
+        name = base;
+    return name + ".dlib";
+}
+
+bool DarkLibraryCache::Load(GuideCamera *camera, const wxString& fitName)
+{
+    wxString filename = CacheFileName(fitName);
+    if (!wxFileExists(filename))
+        return false;
+
+    std::shared_ptr<MappedFile> map(new MappedFile());
+    if (!map->Open(filename))
+    {
+        Debug.AddLine(wxString::Format("DarkLibraryCache: could not map %s", filename));
+        return false;
+    }
+
+    if (map->Size() < sizeof(DarkLibHeader))
+    {
+        Debug.AddLine(wxString::Format("DarkLibraryCache: %s is truncated", filename));
+        return false;
+    }
+
+    DarkLibHeader hdr;
+    memcpy(&hdr, map->Data(), sizeof(hdr));
+
+    if (memcmp(hdr.magic, DarkLibMagic, sizeof(hdr.magic)) != 0 || hdr.version != DARK_LIB_VERSION)
+    {
+        Debug.AddLine(wxString::Format("DarkLibraryCache: ignoring %s, unknown format", filename));
+        return false;
+    }
+    uint64_t fitHash;
+    if (hdr.fitSize != wxFileName::GetSize(fitName).GetValue() || !HashFile(fitName, &fitHash) ||
+        hdr.fitHash != fitHash)
+    {
+        Debug.AddLine(wxString::Format("DarkLibraryCache: %s is out of date", filename));
+        return false;
+    }
+
+    uint64_t const frameBytes = (uint64_t) hdr.width * hdr.height * sizeof(unsigned short);
+    if (hdr.count == 0 || frameBytes == 0 ||
+        hdr.count > (map->Size() - sizeof(hdr)) / sizeof(DarkLibEntry))
+    {
+        Debug.AddLine(wxString::Format("DarkLibraryCache: %s is truncated", filename));
+        return false;
+    }
+
+    std::vector<DarkLibEntry> entries(hdr.count);
+    memcpy(entries.data(), map->Data() + sizeof(hdr), entries.size() * sizeof(DarkLibEntry));
+
+    for (size_t i = 0; i < entries.size(); i++)
+    {
+        if (entries[i].offset % DARK_LIB_ALIGN != 0 || entries[i].offset > map->Size() ||
+            map->Size() - entries[i].offset < frameBytes)
+        {
+            Debug.AddLine(wxString::Format("DarkLibraryCache: %s is truncated", filename));
+            return false;
+        }
+    }
+
+    wxSize const size(hdr.width, hdr.height);
+    for (size_t i = 0; i < entries.size(); i++)
+    {
+        usImage *img = new usImage();
+        img->SetData(reinterpret_cast<unsigned short *>(map->Data() + entries[i].offset), size, map);
+        img->ImgExpDur = entries[i].expDur;
+        Debug.Write(wxString::Format("mapped dark frame exposure = %d\n", img->ImgExpDur));
+        camera->AddDark(img);
+    }
+
+    Debug.AddLine(wxString::Format("Mapped %u dark frames from %s", hdr.count, filename));
+    return true;
+}
+
+void DarkLibraryCache::Save(const ExposureImgMap& darks, const wxString& fitName)
+{
+    wxString filename = CacheFileName(fitName);
+
+    if (darks.empty())
+    {
+        Remove(fitName);
+        return;
+    }
+
+    wxSize const size = darks.begin()->second->Size;
+    for (ExposureImgMap::const_iterator it = darks.begin(); it != darks.end(); ++it)
+    {
+        if (it->second->Size != size || !it->second->ImageData)
+        {
+            Debug.AddLine("DarkLibraryCache: dark frames differ in size, not saving the cache");
+            Remove(fitName);
+            return;
+        }
+    }
+
+    DarkLibHeader hdr;
+    memcpy(hdr.magic, DarkLibMagic, sizeof(hdr.magic));
+    hdr.version = DARK_LIB_VERSION;
+    hdr.count = darks.size();
+    hdr.width = size.GetWidth();
+    hdr.height = size.GetHeight();
+    hdr.fitSize = wxFileName::GetSize(fitName).GetValue();
+    if (!HashFile(fitName, &hdr.fitHash))
+    {
+        Debug.AddLine(wxString::Format("DarkLibraryCache: could not read %s, not saving the cache", fitName));
+        Remove(fitName);
+        return;
+    }
+
+    size_t const frameBytes = (size_t) hdr.width * hdr.height * sizeof(unsigned short);
+    std::vector<DarkLibEntry> entries;
+    uint64_t offset = AlignUp(sizeof(hdr) + darks.size() * sizeof(DarkLibEntry));
+    for (ExposureImgMap::const_iterator it = darks.begin(); it != darks.end(); ++it)
+    {
+        DarkLibEntry entry;
+        entry.expDur = it->first;
+        entry.reserved = 0;
+        entry.offset = offset;
+        entries.push_back(entry);
+        offset += AlignUp(frameBytes);
+    }
+
+    // Write a new file and rename it over the old one, which may still be
+    // mapped. Where the old one cannot be replaced it is left stale and gets
+    // rebuilt on the next load.
+    wxString tmpName = filename + ".tmp";
+    bool ok;
+    { // file scope
+        wxFile file(tmpName, wxFile::write);
+        ok = file.IsOpened() && file.Write(&hdr, sizeof(hdr)) == sizeof(hdr) &&
+            file.Write(entries.data(), entries.size() * sizeof(DarkLibEntry)) == entries.size() * sizeof(DarkLibEntry);
+        size_t i = 0;
+        for (ExposureImgMap::const_iterator it = darks.begin(); ok && it != darks.end(); ++it, ++i)
+        {
+            ok = file.Seek(entries[i].offset) == (wxFileOffset) entries[i].offset &&
+                file.Write(it->second->ImageData, frameBytes) == frameBytes;
+        }
+        ok = ok && file.Close();
+    } // file scope
+
+    if (!ok || !wxRenameFile(tmpName, filename, true))
+    {
+        Debug.AddLine(wxString::Format("DarkLibraryCache: failed to write %s", filename));
+        if (wxFileExists(tmpName))
+            wxRemoveFile(tmpName);
+        return;
+    }
+
+    Debug.AddLine(wxString::Format("Saved %u dark frames to %s", hdr.count, filename));
+}
+
+void DarkLibraryCache::Remove(const wxString& fitName)
+{
+    wxString filename = CacheFileName(fitName);
+    if (wxFileExists(filename))
+        wxRemoveFile(filename);
+}
@@ -0,0 +1,60 @@
+/*
+ *  dark_library.h
+ *  PHD Guiding
+ *
+ *  Created by Arran Dengate
+ *  Copyright (c) 2017 Arran Dengate
+ *  All rights reserved.
+ *
+ *  This source code is distributed under the following "BSD" license
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *    Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *    Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *    Neither the name of Bret McKee, Dad Dog Development,
+ *     Craig Stark, Stark Labs nor the names of its
+ *     contributors may be used to endorse or promote products derived from
+ *     this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef DARK_LIBRARY_H_INCLUDED
+#define DARK_LIBRARY_H_INCLUDED
+
+class GuideCamera;
+
+// Uncompressed copy of the dark library FITS file, kept next to it and
+// memory-mapped when the darks are loaded. Each exposure's frame starts on
+// a page boundary and the darks handed to the camera point straight into
+// the mapping, so loading costs no parsing or copying, and only the frame
+// that SelectDark picks is ever read from disk. The mapping is copy-on-write,
+// so the darks can be treated like any other image.
+class DarkLibraryCache
+{
+public:
+    static wxString CacheFileName(const wxString& fitName);
+
+    // Returns true if the cache is up to date with fitName and its darks
+    // were added to the camera
+    static bool Load(GuideCamera *camera, const wxString& fitName);
+
+    static void Save(const ExposureImgMap& darks, const wxString& fitName);
+    static void Remove(const wxString& fitName);
+};
+
+#endif // DARK_LIBRARY_H_INCLUDED
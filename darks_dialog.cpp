@@ -495,7 +495,11 @@ bool DarksDialog::CreateMasterDarkFrame(usImage& darkFrame, int expTime, int fra
     darkFrame.ImgExpDur = expTime;
     darkFrame.ImgStackCnt = frameCount;
 
-    unsigned int *avgimg = 0;
+    // each frame is folded in as soon as it is captured, so memory stays at one
+    // frame plus the running totals however many frames are taken. Defect map
+    // darks drop each pixel's highest and lowest sample so that a cosmic ray
+    // hit in a single frame does not turn into a hot pixel.
+    DarkStacker stacker(!buildDarkLib);
 
     for (int j = 1; j <= frameCount; j++)
     {
@@ -523,32 +527,23 @@ bool DarksDialog::CreateMasterDarkFrame(usImage& darkFrame, int expTime, int fra
         h.Dump();
         wxYield();
 
-        if (!avgimg)
+        err = stacker.Add(darkFrame);
+        if (err)
         {
-            avgimg = new unsigned int[darkFrame.NPixels];
-            memset(avgimg, 0, darkFrame.NPixels * sizeof(*avgimg));
+            ShowStatus(wxString::Format(_("%.1f s dark FAILED"), (double)expTime / 1000.0), true);
+            break;
         }
-
-        unsigned int *iptr = avgimg;
-        const unsigned short *usptr = darkFrame.ImageData;
-        for (int i = 0; i < darkFrame.NPixels; i++)
-            *iptr++ += *usptr++;
     }
 
     if (!m_cancelling && !err)
     {
         ShowStatus(_("Dark frames complete"), true);
-        const unsigned int *iptr = avgimg;
-        unsigned short *usptr = darkFrame.ImageData;
-        for (int i = 0; i < darkFrame.NPixels; i++)
-            *usptr++ = (unsigned short)(*iptr++ / frameCount);
+        err = stacker.GetResult(darkFrame);
     }
 
     m_pProgress->SetValue(m_pProgress->GetValue() + expTime);
     wxYield();
 
-    delete[] avgimg;
-
     return err;
 }
 
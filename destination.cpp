@@ -1,14 +1,9 @@
 #include "phd.h"
-#include <cstdio>
-#include <fstream>
-#include <iostream>
-#include <regex>
+#include "sky_calc.h"
 #include <sstream>
 #include <string>
 #include <vector>
 
-const char SKYFIELD_RESULT_FILENAME[] = "/dev/shm/phd2/goto/skyfield-result"; 
-
 Destination::Destination() {
     initialised = false;
 }
@@ -29,104 +24,41 @@ Destination::Destination(const std::string &input) {
 
     if (! isdigit(values[1][0])) {
         type = values[1];
-        LookupEphemeral(name, ra, dec, alt, az);
         ephemeral = true;
+        if (!LookupEphemeral(name, ra, dec, alt, az)) {
+            Debug.AddLine(wxString::Format("Destination: no ephemeris for %s", name));
+        }
     } else {
         type = "Star";
         ra  = stod(values[1]);
         dec = stod(values[2]);
         ephemeral=false;
-        EquatorialToHorizontal(ra, dec, alt, az, false);
-    }
-}
-
-bool Destination::CheckForUpdate() {
-    vector<string> skyfieldResults;
-    std::ifstream file( SKYFIELD_RESULT_FILENAME );
-    string tok;
-    if ( file ) {
-        std::stringstream ss;
-        ss << file.rdbuf();
-        file.close();
-        while(getline(ss, tok, ',')) {
-            skyfieldResults.push_back(tok);
-        }
-    }
-    if (skyfieldResults.size() > 0) {
-        alt = stod(skyfieldResults[0]);
-        az  = stod(skyfieldResults[1]);
-        if (ephemeral) {
-            ra  = stod(skyfieldResults[2]);
-            dec = stod(skyfieldResults[3]);
-        }
+        EquatorialToHorizontal(ra, dec, alt, az);
     }
 }
 
-bool Destination::NonBlockingUpdate() {
+bool Destination::Update() {
+    // Recompute the position for the current time. This used to be done by
+    // running sky.py in the background and reading its result file a tick
+    // later, but the native calculation is quick enough to do inline.
     if (!initialised) return false;
-    std::string command;
     if (ephemeral) {
-        command = "/usr/local/skyfield/sky.py --planet=" + name + " &";
-    } else {
-        command = "/usr/local/skyfield/sky.py --ra=" + std::to_string(ra) + " --dec=" + std::to_string(dec) + " &";
+        return LookupEphemeral(name, ra, dec, alt, az);
     }
-    system(command.c_str());
-    return true;
+    return EquatorialToHorizontal(ra, dec, alt, az);
 }
 
-bool Destination::EquatorialToHorizontal(double inRa, double inDec, double &outAlt, double &outAz, bool useStoredTimestamp) {
-    std::string command = "/usr/local/skyfield/sky.py --ra=" + std::to_string(inRa) + " --dec=" + std::to_string(inDec);
-    if ( useStoredTimestamp ) {
-        // command += " --use-stored"; TODO re-enable this if it's not the cause of our problems...
-    }
-    std::string skyOutput;
-    FILE *in;
-    char buf[200];
-
-    if(!(in = popen(command.c_str(), "r"))) {
-        Debug.AddLine(wxString::Format("Guider: Skyfield threw error while converting equatorial to horizontal coordinates"));
-        return 1;
-    }
-    while(fgets(buf, sizeof(buf), in)!=NULL) {
-        cout << buf;
-        skyOutput += buf;
-    }
-    pclose(in);
-
-    std::vector<std::string> values;
-    SplitString(skyOutput, ',', values);
-    outAlt = stod(values[0]);
-    outAz  = stod(values[1]);
+bool Destination::EquatorialToHorizontal(double inRa, double inDec, double &outAlt, double &outAz) {
+    double jd = SkyCalc::JulianDateNow();
+    SkyCalc::EquatorialToHorizontal(jd, SkyObserver::FromProfile(), inRa, inDec, &outAlt, &outAz);
 
     Debug.AddLine(wxString::Format("Finishing eq2horz with ra %f, dec %f, outAlt %f, outAz %f", inRa, inDec, outAlt, outAz));
 
-    return 0;
+    return true;
 }
 
 bool Destination::LookupEphemeral(const std::string &ephemeral, double &outRa, double &outDec, double &outAlt, double &outAz) {
-    std::string command = "/usr/local/skyfield/sky.py --planet=" + ephemeral;
-    std::string skyOutput;
-    FILE *in;
-    char buf[200];
-
-    if(!(in = popen(command.c_str(), "r"))) {
-        Debug.AddLine(wxString::Format("Guider: Skyfield threw error while looking up ephemeral for horizontal coordinates"));
-        return false;
-    }
-    while(fgets(buf, sizeof(buf), in)!=NULL) {
-        cout << buf;
-        skyOutput += buf;
-    }
-    pclose(in);
-
-    std::vector<std::string> values;
-    SplitString(skyOutput, ',', values);
-    outAlt  = stod(values[0]);
-    outAz   = stod(values[1]);
-    outRa   = stod(values[2]);
-    outDec  = stod(values[3]);
-    
-    return true;
+    return SkyCalc::BodyPosition(ephemeral, SkyCalc::JulianDateNow(), SkyObserver::FromProfile(), &outRa, &outDec, &outAlt, &outAz);
 }
 
 void Destination::SplitString(const std::string &s, char delim, std::vector<std::string> &elems) {
@@ -11,15 +11,14 @@ class Destination {
     void DegreesToHMS(double degrees, double &hours, double &minutes, double &seconds);
     public:
     static void SplitString(const std::string &s, char delim, std::vector<std::string> &elems);
-    static bool EquatorialToHorizontal(double inRa, double inDec, double &outAlt, double &outAz, bool useStoredTimestamp);
+    static bool EquatorialToHorizontal(double inRa, double inDec, double &outAlt, double &outAz);
     void GetAltDMS(double &hours, double &minutes, double &seconds);
     void GetAzDMS(double &hours, double &minutes, double &seconds);
     void GetRaHMS(double &hours, double &minutes, double &seconds);
     void GetDecDMS(double &hours, double &minutes, double &seconds);
     Destination();
     Destination(const std::string &input);
-    bool NonBlockingUpdate();
-    bool CheckForUpdate();
+    bool Update();
     double ra;
     double dec;
     double alt;
@@ -33,9 +33,13 @@
  */
 
 #include "phd.h"
+#include "plate_solver.h"
 
 #include <wx/sstream.h>
 #include <wx/sckstrm.h>
+#include <algorithm>
+#include <cstdarg>
+#include <deque>
 #include <sstream>
 #include <string>
 
@@ -44,6 +48,7 @@ EventServer EvtServer;
 BEGIN_EVENT_TABLE(EventServer, wxEvtHandler)
     EVT_SOCKET(EVENT_SERVER_ID, EventServer::OnEventServerEvent)
     EVT_SOCKET(EVENT_SERVER_CLIENT_ID, EventServer::OnEventServerClientEvent)
+    EVT_THREAD(EVENT_SERVER_OVERFLOW_ID, EventServer::OnClientOverflow)
 END_EVENT_TABLE()
 
 enum
@@ -51,9 +56,12 @@ enum
     MSG_PROTOCOL_VERSION = 1,
 };
 
-static const wxString literal_null("null");
-static const wxString literal_true("true");
-static const wxString literal_false("false");
+// Responses and events are written straight into UTF-8 byte strings, ready
+// to send, rather than assembled as wxStrings and converted afterwards.
+
+static const std::string literal_null("null");
+static const std::string literal_true("true");
+static const std::string literal_false("false");
 
 static wxString state_name(EXPOSED_STATE st)
 {
@@ -70,121 +78,165 @@ static wxString state_name(EXPOSED_STATE st)
     }
 }
 
-static wxString json_escape(const wxString& s)
+static std::string json_format_num(const char *fmt, ...)
+{
+    char buf[64];
+    va_list ap;
+    va_start(ap, fmt);
+    vsnprintf(buf, sizeof(buf), fmt, ap);
+    va_end(ap);
+    return buf;
+}
+
+// appends s as a quoted JSON string
+static void json_quote(std::string& out, const char *s)
 {
-    wxString t(s);
-    static const wxString BACKSLASH("\\");
-    static const wxString BACKSLASHBACKSLASH("\\\\");
-    static const wxString DQUOT("\"");
-    static const wxString BACKSLASHDQUOT("\\\"");
-    t.Replace(BACKSLASH, BACKSLASHBACKSLASH);
-    t.Replace(DQUOT, BACKSLASHDQUOT);
-    return t;
+    out += '"';
+    for (; *s; s++)
+    {
+        if (*s == '\\' || *s == '"')
+            out += '\\';
+        out += *s;
+    }
+    out += '"';
+}
+
+static std::string json_quote(const char *s)
+{
+    std::string out;
+    json_quote(out, s);
+    return out;
 }
 
 template<char LDELIM, char RDELIM>
 struct JSeq
 {
-    wxString m_s;
+    std::string m_s;
     bool m_first;
     bool m_closed;
-    JSeq() : m_first(true), m_closed(false) { m_s << LDELIM; }
-    void close() { m_s << RDELIM; m_closed = true; }
-    wxString str() { if (!m_closed) close(); return m_s; }
+    JSeq() : m_first(true), m_closed(false) { m_s += LDELIM; }
+    void close() { m_s += RDELIM; m_closed = true; }
+    const std::string& str() { if (!m_closed) close(); return m_s; }
+    // the closed sequence with the line terminator, ready to send
+    std::string line() const
+    {
+        std::string s;
+        s.reserve(m_s.size() + 3);
+        s += m_s;
+        if (!m_closed)
+            s += RDELIM;
+        s += "\r\n";
+        return s;
+    }
 };
 
 typedef JSeq<'[', ']'> JAry;
 typedef JSeq<'{', '}'> JObj;
 
-static JAry& operator<<(JAry& a, const wxString& str)
+// appends already formatted JSON
+static JAry& operator<<(JAry& a, const std::string& json)
 {
     if (a.m_first)
         a.m_first = false;
     else
-        a.m_s << ',';
-    a.m_s << str;
+        a.m_s += ',';
+    a.m_s += json;
     return a;
 }
 
 static JAry& operator<<(JAry& a, double d)
 {
-    return a << wxString::Format("%.2f", d);
+    return a << json_format_num("%.2f", d);
 }
 
 static JAry& operator<<(JAry& a, int i)
 {
-    return a << wxString::Format("%d", i);
+    return a << json_format_num("%d", i);
 }
 
-static wxString json_format(const json_value *j)
+static void json_format(std::string& out, const json_value *j)
 {
     if (!j)
-        return literal_null;
+    {
+        out += literal_null;
+        return;
+    }
 
     switch (j->type) {
     default:
-    case JSON_NULL: return literal_null;
+    case JSON_NULL: out += literal_null; break;
     case JSON_OBJECT: {
-        wxString ret("{");
+        out += '{';
         bool first = true;
         json_for_each (jj, j)
         {
             if (first)
                 first = false;
             else
-                ret << ",";
-            ret << '"' << jj->name << "\":" << json_format(jj);
+                out += ',';
+            out += '"';
+            out += jj->name;
+            out += "\":";
+            json_format(out, jj);
         }
-        ret << "}";
-        return ret;
+        out += '}';
+        break;
     }
     case JSON_ARRAY: {
-        wxString ret("[");
+        out += '[';
         bool first = true;
         json_for_each (jj, j)
         {
             if (first)
                 first = false;
             else
-                ret << ",";
-            ret << json_format(jj);
+                out += ',';
+            json_format(out, jj);
         }
-        ret << "]";
-        return ret;
+        out += ']';
+        break;
     }
-    case JSON_STRING: return '"' + json_escape(j->string_value) + '"';
-    case JSON_INT:    return wxString::Format("%d", j->int_value);
-    case JSON_FLOAT:  return wxString::Format("%g", (double) j->float_value);
-    case JSON_BOOL:   return j->int_value ? literal_true : literal_false;
+    case JSON_STRING: json_quote(out, j->string_value); break;
+    case JSON_INT:    out += json_format_num("%d", j->int_value); break;
+    case JSON_FLOAT:  out += json_format_num("%g", (double) j->float_value); break;
+    case JSON_BOOL:   out += j->int_value ? literal_true : literal_false; break;
     }
 }
 
+static std::string json_format(const json_value *j)
+{
+    std::string out;
+    json_format(out, j);
+    return out;
+}
+
 struct NULL_TYPE { } NULL_VALUE;
 
-// name-value pair
+// name-value pair, the value already formatted as JSON
 struct NV
 {
-    wxString n;
-    wxString v;
-    NV(const wxString& n_, const wxString& v_) : n(n_), v('"' + json_escape(v_) + '"') { }
-    NV(const wxString& n_, const char *v_) : n(n_), v('"' + json_escape(v_) + '"') { }
-    NV(const wxString& n_, const wchar_t *v_) : n(n_), v('"' + json_escape(v_) + '"') { }
-    NV(const wxString& n_, int v_) : n(n_), v(wxString::Format("%d", v_)) { }
-    NV(const wxString& n_, double v_) : n(n_), v(wxString::Format("%g", v_)) { }
-    NV(const wxString& n_, double v_, int prec) : n(n_), v(wxString::Format("%.*f", prec, v_)) { }
-    NV(const wxString& n_, bool v_) : n(n_), v(v_ ? literal_true : literal_false) { }
+    const char *n;
+    std::string v;
+    NV(const char *n_, const wxString& v_) : n(n_), v(json_quote(v_.utf8_str())) { }
+    NV(const char *n_, const std::string& v_) : n(n_), v(json_quote(v_.c_str())) { }
+    NV(const char *n_, const char *v_) : n(n_), v(json_quote(v_)) { }
+    NV(const char *n_, const wchar_t *v_) : n(n_), v(json_quote(wxString(v_).utf8_str())) { }
+    NV(const char *n_, int v_) : n(n_), v(json_format_num("%d", v_)) { }
+    NV(const char *n_, double v_) : n(n_), v(json_format_num("%g", v_)) { }
+    NV(const char *n_, double v_, int prec) : n(n_), v(json_format_num("%.*f", prec, v_)) { }
+    NV(const char *n_, bool v_) : n(n_), v(v_ ? literal_true : literal_false) { }
     template<typename T>
-    NV(const wxString& n_, const std::vector<T>& vec);
-    NV(const wxString& n_, JAry& ary) : n(n_), v(ary.str()) { }
-    NV(const wxString& n_, JObj& obj) : n(n_), v(obj.str()) { }
-    NV(const wxString& n_, const json_value *v_) : n(n_), v(json_format(v_)) { }
-    NV(const wxString& n_, const PHD_Point& p) : n(n_) { JAry ary; ary << p.X << p.Y; v = ary.str(); }
-    NV(const wxString& n_, const wxPoint& p) : n(n_) { JAry ary; ary << p.x << p.y; v = ary.str(); }
-    NV(const wxString& n_, const NULL_TYPE& nul) : n(n_), v(literal_null) { }
+    NV(const char *n_, const std::vector<T>& vec);
+    NV(const char *n_, JAry& ary) : n(n_), v(ary.str()) { }
+    NV(const char *n_, JObj& obj) : n(n_), v(obj.str()) { }
+    NV(const char *n_, const json_value *v_) : n(n_), v(json_format(v_)) { }
+    NV(const char *n_, const PHD_Point& p) : n(n_) { JAry ary; ary << p.X << p.Y; v = ary.str(); }
+    NV(const char *n_, const wxPoint& p) : n(n_) { JAry ary; ary << p.x << p.y; v = ary.str(); }
+    NV(const char *n_, const NULL_TYPE& nul) : n(n_), v(literal_null) { }
 };
 
 template<typename T>
-NV::NV(const wxString& n_, const std::vector<T>& vec)
+NV::NV(const char *n_, const std::vector<T>& vec)
     : n(n_)
 {
     std::ostringstream os;
@@ -204,8 +256,11 @@ static JObj& operator<<(JObj& j, const NV& nv)
     if (j.m_first)
         j.m_first = false;
     else
-        j.m_s << ',';
-    j.m_s << '"' << nv.n << "\":" << nv.v;
+        j.m_s += ',';
+    j.m_s += '"';
+    j.m_s += nv.n;
+    j.m_s += "\":";
+    j.m_s += nv.v;
     return j;
 }
 
@@ -323,23 +378,126 @@ static Ev ev_settle_done(const wxString& errorMsg)
     return ev;
 }
 
+// Splits a client's input into newline-terminated requests. Input is kept
+// across reads until a request is complete, so a request may arrive in
+// pieces and any number of requests may arrive together. A request longer
+// than MAX_REQUEST gets an error and the rest of it, up to the next newline,
+// is skipped.
 struct ClientReadBuf
 {
-    enum { SIZE = 1024 };
-    char buf[SIZE];
-    char *dest;
+    enum { READ_SIZE = 4096, MAX_REQUEST = 1024 * 1024 };
+    std::vector<char> buf;
+    size_t start;    // first byte not yet handed out
+    size_t scanned;  // bytes already searched for a newline
+    size_t len;      // bytes of input in buf
+    bool skipping;   // dropping the rest of an over-long request
+    bool toobig;     // an over-long request was seen since the last prepare_read
+    bool busy;       // handle_cli_input is running for this client
+
+    ClientReadBuf() : buf(READ_SIZE), start(0), scanned(0), len(0), skipping(false), toobig(false), busy(false) { }
+
+    // Returns the next complete request, null-terminated in place, or NULL.
+    // Requests stay valid until prepare_read is called.
+    char *next()
+    {
+        while (scanned < len)
+        {
+            char& c = buf[scanned++];
+            if (c != '\r' && c != '\n')
+                continue;
+            c = 0;
+            char *req = &buf[start];
+            size_t const reqlen = scanned - 1 - start;
+            start = scanned;
+            if (skipping)
+                skipping = false;
+            else if (reqlen > MAX_REQUEST)
+                toobig = true;
+            else if (reqlen > 0)
+                return req;
+        }
+        return NULL;
+    }
+
+    // Moves the incomplete request to the front and makes room for READ_SIZE
+    // more bytes. Returns false if a request was too big.
+    bool prepare_read()
+    {
+        len -= start;
+        scanned -= start;
+        memmove(&buf[0], &buf[start], len);
+        start = 0;
+
+        if (len > MAX_REQUEST)
+        {
+            skipping = true;
+            toobig = true;
+        }
+        bool const ok = !toobig;
+        toobig = false;
+        if (skipping)
+            len = scanned = 0;
+
+        if (len == 0 && buf.size() > 4 * READ_SIZE)
+            std::vector<char>(READ_SIZE).swap(buf);
+        else if (buf.size() - len < READ_SIZE)
+            buf.resize(len + READ_SIZE);
+
+        return ok;
+    }
+
+    char *dest() { return &buf[len]; }
+    size_t avail() const { return buf.size() - len; }
+};
+
+// An outgoing message. The bytes are shared by every client the message is
+// queued for. Messages with a latest key are telemetry where only the
+// newest one matters; the rest are delivered no matter what.
+struct OutMsg
+{
+    std::shared_ptr<const std::string> buf;
+    const char *latest;
+};
 
-    ClientReadBuf() { reset(); }
-    size_t avail() const { return &buf[SIZE] - dest; }
-    void reset() { dest = &buf[0]; }
+// Messages waiting to be written to a client. Socket writes never block:
+// whatever the socket does not take stays queued and is written when the
+// socket reports it can take more, so a slow client cannot hold up the
+// guider. Past SOFT_LIMIT queued bytes, telemetry is dropped oldest first
+// and no more requests are read from the client until it catches up. A
+// client that lets HARD_LIMIT bytes of messages that cannot be dropped pile
+// up is not reading at all and is disconnected.
+struct ClientOutQueue
+{
+    enum { SOFT_LIMIT = 256 * 1024, HARD_LIMIT = 8 * 1024 * 1024 };
+    std::deque<OutMsg> msgs;
+    size_t pos;          // bytes of the front message already written
+    size_t bytes;        // bytes waiting
+    bool wantOutput;     // wxSOCKET_OUTPUT notifications are on
+    bool overflowed;     // past HARD_LIMIT, waiting to be disconnected
+
+    // counters reported by get_client_stats
+    unsigned int sent;
+    unsigned int dropped;
+    unsigned int coalesced;
+    size_t maxBytes;
+
+    ClientOutQueue() : pos(0), bytes(0), wantOutput(false), overflowed(false), sent(0), dropped(0), coalesced(0), maxBytes(0) { }
+    bool backlogged() const { return overflowed || bytes > SOFT_LIMIT; }
 };
 
+// clients disconnected for passing HARD_LIMIT, reported by get_client_stats
+static unsigned int s_overflowDisconnects;
+
 struct ClientData
 {
     wxSocketClient *cli;
     int refcnt;
     ClientReadBuf rdbuf;
+    ClientOutQueue outq;
     wxMutex wrlock;
+    // each client parses into its own arena, so a handler that runs the
+    // event loop keeps its request intact while other clients are served
+    JsonParser parser;
 
     ClientData(wxSocketClient *cli_) : cli(cli_), refcnt(1) { }
     void AddRef() { ++refcnt; }
@@ -361,40 +519,128 @@ struct ClientDataGuard
     ClientData *operator->() const { return cd; }
 };
 
-inline static wxMutex *client_wrlock(wxSocketClient *cli)
+inline static ClientData *client_data(const wxSocketClient *cli)
 {
-    return &((ClientData *) cli->GetClientData())->wrlock;
+    return (ClientData *) cli->GetClientData();
 }
 
-static void send_buf(wxSocketClient *client, const wxCharBuffer& buf)
+// Writes queued messages until the socket stops taking data. Called with
+// wrlock held.
+static void flush_output(ClientData *cd)
 {
-    wxMutexLocker lock(*client_wrlock(client));
-    client->Write(buf.data(), buf.length());
-    if (client->LastWriteCount() != buf.length())
+    ClientOutQueue& q = cd->outq;
+
+    while (!q.msgs.empty())
     {
-        Debug.Write(wxString::Format("evsrv: cli %p short write %u/%u\n",
-            client, client->LastWriteCount(), (unsigned int) buf.length()));
+        const std::string& s = *q.msgs.front().buf;
+        cd->cli->Write(s.data() + q.pos, s.size() - q.pos);
+        size_t const n = cd->cli->LastWriteCount();
+        q.pos += n;
+        q.bytes -= n;
+        if (q.pos < s.size())
+            break;
+        q.msgs.pop_front();
+        q.pos = 0;
+        ++q.sent;
+    }
+
+    bool const want = !q.msgs.empty();
+    if (want != q.wantOutput)
+    {
+        cd->cli->SetNotify(wxSOCKET_LOST_FLAG | wxSOCKET_INPUT_FLAG | (want ? wxSOCKET_OUTPUT_FLAG : 0));
+        q.wantOutput = want;
     }
 }
 
+static void send_buf(wxSocketClient *client, const std::shared_ptr<const std::string>& buf, const char *latest = 0)
+{
+    ClientData *cd = client_data(client);
+    wxMutexLocker lock(cd->wrlock);
+    ClientOutQueue& q = cd->outq;
+
+    if (q.overflowed)
+        return;
+
+    if (latest)
+    {
+        // replace an older copy not yet being written
+        for (std::deque<OutMsg>::iterator it = q.msgs.begin(); it != q.msgs.end(); ++it)
+        {
+            if (it->latest && strcmp(it->latest, latest) == 0 && (it != q.msgs.begin() || q.pos == 0))
+            {
+                q.bytes -= it->buf->size();
+                q.msgs.erase(it);
+                ++q.coalesced;
+                break;
+            }
+        }
+    }
+
+    OutMsg msg = { buf, latest };
+    q.msgs.push_back(msg);
+    q.bytes += buf->size();
+
+    if (q.backlogged())
+    {
+        for (std::deque<OutMsg>::iterator it = q.msgs.begin(); it != q.msgs.end() && q.backlogged(); )
+        {
+            if (it->latest && (it != q.msgs.begin() || q.pos == 0))
+            {
+                q.bytes -= it->buf->size();
+                it = q.msgs.erase(it);
+                ++q.dropped;
+            }
+            else
+                ++it;
+        }
+    }
+
+    q.maxBytes = std::max(q.maxBytes, q.bytes);
+
+    if (q.bytes > ClientOutQueue::HARD_LIMIT)
+    {
+        Debug.Write(wxString::Format("evsrv: cli %p not reading, %u bytes queued in %u msgs, disconnecting\n",
+            client, (unsigned int) q.bytes, (unsigned int) q.msgs.size()));
+
+        q.msgs.clear();
+        q.pos = 0;
+        q.bytes = 0;
+        q.overflowed = true;
+        ++s_overflowDisconnects;
+
+        // the client may be in the middle of being notified or handled, so
+        // it is removed from the event loop; the event holds a reference
+        cd->AddRef();
+        wxThreadEvent *evt = new wxThreadEvent(wxEVT_THREAD, EVENT_SERVER_OVERFLOW_ID);
+        evt->SetPayload<wxSocketClient *>(client);
+        wxQueueEvent(&EvtServer, evt);
+        return;
+    }
+
+    flush_output(cd);
+}
+
 static void do_notify1(wxSocketClient *client, const JAry& ary)
 {
-    send_buf(client, (JAry(ary).str() + "\r\n").ToUTF8());
+    send_buf(client, std::make_shared<const std::string>(ary.line()));
 }
 
 static void do_notify1(wxSocketClient *client, const JObj& j)
 {
-    send_buf(client, (JObj(j).str() + "\r\n").ToUTF8());
+    send_buf(client, std::make_shared<const std::string>(j.line()));
 }
 
-static void do_notify(const EventServer::CliSockSet& cli, const JObj& jj)
+// The event is serialized once and the same bytes are queued for every
+// client. latest names telemetry events where a client that is behind only
+// needs the newest one.
+static void do_notify(const EventServer::CliSockSet& cli, const JObj& jj, const char *latest = 0)
 {
-    wxCharBuffer buf = (JObj(jj).str() + "\r\n").ToUTF8();
+    std::shared_ptr<const std::string> buf(std::make_shared<const std::string>(jj.line()));
 
     for (EventServer::CliSockSet::const_iterator it = cli.begin();
         it != cli.end(); ++it)
     {
-        send_buf(*it, buf);
+        send_buf(*it, buf, latest);
     }
 }
 
@@ -458,30 +704,6 @@ static void destroy_client(wxSocketClient *cli)
     buf->RemoveRef();
 }
 
-static void drain_input(wxSocketInputStream& sis)
-{
-    while (sis.CanRead())
-    {
-        char buf[1024];
-        if (sis.Read(buf, sizeof(buf)).LastRead() == 0)
-            break;
-    }
-}
-
-static bool find_eol(char *p, size_t len)
-{
-    const char *end = p + len;
-    for (; p < end; p++)
-    {
-        if (*p == '\r' || *p == '\n')
-        {
-            *p = 0;
-            return true;
-        }
-    }
-    return false;
-}
-
 enum {
     JSONRPC_PARSE_ERROR = -32700,
     JSONRPC_INVALID_REQUEST = -32600,
@@ -1531,14 +1753,81 @@ static void get_camera_binning(JObj& response, const json_value *params)
         response << jrpc_error(1, "camera not connected");
 }
 
+static void get_client_stats(JObj& response, const json_value *params)
+{
+    JAry ary;
+    const EventServer::CliSockSet& clients = EvtServer.Clients();
+    for (EventServer::CliSockSet::const_iterator it = clients.begin(); it != clients.end(); ++it)
+    {
+        ClientData *cd = client_data(*it);
+        wxMutexLocker lock(cd->wrlock);
+        const ClientOutQueue& q = cd->outq;
+
+        wxIPV4address addr;
+        (*it)->GetPeer(addr);
+
+        JObj t;
+        t << NV("peer", wxString::Format("%s:%u", addr.IPAddress(), (unsigned int) addr.Service()))
+          << NV("queued_msgs", (int) q.msgs.size())
+          << NV("queued_bytes", (int) q.bytes)
+          << NV("max_queued_bytes", (int) q.maxBytes)
+          << NV("sent", (int) q.sent)
+          << NV("dropped", (int) q.dropped)
+          << NV("coalesced", (int) q.coalesced);
+        ary << t;
+    }
+
+    JObj rslt;
+    rslt << NV("clients", ary)
+         << NV("overflow_disconnects", (int) s_overflowDisconnects);
+    response << jrpc_result(rslt);
+}
+
+static void add_move_stats(JAry& ary, const Mount *mount)
+{
+    if (!mount)
+        return;
+
+    const MoveLatencyStats& s = mount->GetMoveStats();
+
+    JAry limits, queued, execute;
+    for (int i = 0; i < MoveLatencyStats::BUCKETS - 1; i++)
+        limits << MoveLatencyStats::BucketLimitMs[i];
+    for (int i = 0; i < MoveLatencyStats::BUCKETS; i++)
+    {
+        queued << (int) s.queued[i];
+        execute << (int) s.execute[i];
+    }
+
+    JObj t;
+    t << NV("mount", mount->GetMountClassName())
+      << NV("moves", (int) s.moves)
+      << NV("merged", (int) s.merged)
+      << NV("late", (int) s.late)
+      << NV("bucket_limits_ms", limits)
+      << NV("queued", queued)
+      << NV("execute", execute)
+      << NV("max_queued_ms", (int) s.maxQueuedMs)
+      << NV("max_execute_ms", (int) s.maxExecuteMs);
+    ary << t;
+}
+
+static void get_move_stats(JObj& response, const json_value *params)
+{
+    JAry ary;
+    add_move_stats(ary, pMount);
+    add_move_stats(ary, pSecondaryMount);
+    response << jrpc_result(ary);
+}
+
 static void dump_request(const wxSocketClient *cli, const json_value *req)
 {
-    Debug.Write(wxString::Format("evsrv: cli %p request: %s\n", cli, json_format(req)));
+    Debug.Write(wxString::Format("evsrv: cli %p request: %s\n", cli, wxString::FromUTF8(json_format(req).c_str())));
 }
 
 static void dump_response(const wxSocketClient *cli, const JRpcResponse& resp)
 {
-    Debug.Write(wxString::Format("evsrv: cli %p response: %s\n", cli, const_cast<JRpcResponse&>(resp).str()));
+    Debug.Write(wxString::Format("evsrv: cli %p response: %s\n", cli, wxString::FromUTF8(const_cast<JRpcResponse&>(resp).str().c_str())));
 }
 
 static bool handle_request(const wxSocketClient *cli, JObj& response, const json_value *req)
@@ -1557,10 +1846,11 @@ static bool handle_request(const wxSocketClient *cli, JObj& response, const json
         return true;
     }
 
-    static struct {
+    struct Method {
         const char *name;
         void (*fn)(JObj& response, const json_value *params);
-    } methods[] = {
+    };
+    static Method methods[] = {
         { "clear_calibration", &clear_calibration, },
         { "deselect_star", &deselect_star, },
         { "get_exposure", &get_exposure, },
@@ -1595,22 +1885,30 @@ static bool handle_request(const wxSocketClient *cli, JObj& response, const json
         { "get_search_region", &get_search_region, },
         { "shutdown", &shutdown, },
         { "get_camera_binning", &get_camera_binning, },
+        { "get_client_stats", &get_client_stats, },
+        { "get_move_stats", &get_move_stats, },
     };
 
-    for (unsigned int i = 0; i < WXSIZEOF(methods); i++)
+    // sorted by name the first time through, so a lookup is a binary search
+    static Method *const methods_end = methods + WXSIZEOF(methods);
+    static bool const sorted = (std::sort(methods, methods_end,
+        [](const Method& a, const Method& b) { return strcmp(a.name, b.name) < 0; }), true);
+    POSSIBLY_UNUSED(sorted);
+
+    const Method *m = std::lower_bound(methods, methods_end, method->string_value,
+        [](const Method& a, const char *name) { return strcmp(a.name, name) < 0; });
+
+    if (m != methods_end && strcmp(m->name, method->string_value) == 0)
     {
-        if (strcmp(method->string_value, methods[i].name) == 0)
+        (*m->fn)(response, params);
+        if (id)
         {
-            (*methods[i].fn)(response, params);
-            if (id)
-            {
-                response << jrpc_id(id);
-                return true;
-            }
-            else
-            {
-                return false;
-            }
+            response << jrpc_id(id);
+            return true;
+        }
+        else
+        {
+            return false;
         }
     }
 
@@ -1673,7 +1971,13 @@ static void handle_cli_input_complete(wxSocketClient *cli, char *input, JsonPars
     }
 }
 
-static void handle_cli_input(wxSocketClient *cli, JsonParser& parser)
+static bool output_backlogged(ClientData *cd)
+{
+    wxMutexLocker lock(cd->wrlock);
+    return cd->outq.backlogged();
+}
+
+static void handle_cli_input(wxSocketClient *cli)
 {
     // Bump refcnt to protect against reentrancy.
     //
@@ -1685,37 +1989,44 @@ static void handle_cli_input(wxSocketClient *cli, JsonParser& parser)
 
     ClientReadBuf *rdbuf = &clidata->rdbuf;
 
+    // Input that arrives while a request handler runs the event loop is left
+    // in the socket and picked up by the loop below once the handler returns.
+    if (rdbuf->busy)
+        return;
+    rdbuf->busy = true;
+
+    // Requests are handled in order as they complete. Nothing more is read
+    // from the socket while they are being handled, so a client sending
+    // faster than we respond is held back by TCP flow control rather than
+    // having its requests dropped.
     wxSocketInputStream sis(*cli);
-    size_t avail = rdbuf->avail();
 
-    while (sis.CanRead())
+    while (true)
     {
-        if (avail == 0)
-        {
-            drain_input(sis);
+        // A client that is not reading its responses gets no more of them
+        // until it does; the OUTPUT handler picks up from here
+        char *req;
+        while (!output_backlogged(clidata.cd) && (req = rdbuf->next()) != NULL)
+            handle_cli_input_complete(cli, req, clidata->parser);
+        if (output_backlogged(clidata.cd))
+            break;
 
+        if (!rdbuf->prepare_read())
+        {
             JRpcResponse response;
             response << jrpc_error(JSONRPC_INTERNAL_ERROR, "too big") << jrpc_id(0);
             do_notify1(cli, response);
+        }
 
-            rdbuf->reset();
+        if (!sis.CanRead())
             break;
-        }
-        size_t n = sis.Read(rdbuf->dest, avail).LastRead();
+        size_t n = sis.Read(rdbuf->dest(), rdbuf->avail()).LastRead();
         if (n == 0)
             break;
-
-        if (find_eol(rdbuf->dest, n))
-        {
-            drain_input(sis);
-            handle_cli_input_complete(cli, &rdbuf->buf[0], parser);
-            rdbuf->reset();
-            break;
-        }
-
-        rdbuf->dest += n;
-        avail -= n;
+        rdbuf->len += n;
     }
+
+    rdbuf->busy = false;
 }
 
 EventServer::EventServer()
@@ -1810,12 +2121,28 @@ void EventServer::OnEventServerClientEvent(wxSocketEvent& event)
         unsigned int const n = m_eventServerClients.erase(cli);
         if (n != 1)
             Debug.AddLine("client disconnected but not present in client set!");
-
-        destroy_client(cli);
+        else
+            destroy_client(cli);
     }
     else if (event.GetSocketEvent() == wxSOCKET_INPUT)
     {
-        handle_cli_input(cli, m_parser);
+        handle_cli_input(cli);
+    }
+    else if (event.GetSocketEvent() == wxSOCKET_OUTPUT)
+    {
+        ClientDataGuard clidata(cli);
+
+        bool resume;
+        { // lock scope
+            wxMutexLocker lock(clidata->wrlock);
+            bool const wasBacklogged = clidata->outq.backlogged();
+            flush_output(clidata.cd);
+            resume = wasBacklogged && !clidata->outq.backlogged();
+        } // lock scope
+
+        // handle any requests held back while the client was behind
+        if (resume)
+            handle_cli_input(cli);
     }
     else
     {
@@ -1823,6 +2150,22 @@ void EventServer::OnEventServerClientEvent(wxSocketEvent& event)
     }
 }
 
+void EventServer::OnClientOverflow(wxThreadEvent& event)
+{
+    wxSocketClient *cli = event.GetPayload<wxSocketClient *>();
+
+    // unless it disconnected or the server stopped in the meantime
+    if (m_eventServerClients.erase(cli) == 1)
+    {
+        Debug.Write(wxString::Format("evsrv: cli %p disconnect, output overflow\n", cli));
+        cli->Notify(false);
+        destroy_client(cli);
+    }
+
+    // the reference taken by send_buf
+    destroy_client(cli);
+}
+
 void EventServer::NotifyStartCalibration(Mount *mount)
 {
     SIMPLE_NOTIFY_EV(ev_start_calibration(mount));
@@ -1866,7 +2209,7 @@ void EventServer::NotifyLooping(unsigned int exposure)
     Ev ev("LoopingExposures");
     ev << NV("Frame", (int) exposure);
 
-    do_notify(m_eventServerClients, ev);
+    do_notify(m_eventServerClients, ev, "LoopingExposures");
 }
 
 void EventServer::NotifyLoopingStopped()
@@ -1898,7 +2241,7 @@ void EventServer::NotifyStarLost(const FrameDroppedInfo& info)
     if (!info.status.IsEmpty())
         ev << NV("Status", info.status);
 
-    do_notify(m_eventServerClients, ev);
+    do_notify(m_eventServerClients, ev, "StarLost");
 }
 
 void EventServer::NotifyStartGuiding()
@@ -1968,7 +2311,7 @@ void EventServer::NotifyGuideStep(const GuideStepInfo& step)
     if (step.decLimited)
         ev << NV("DecLimited", true);
 
-    do_notify(m_eventServerClients, ev);
+    do_notify(m_eventServerClients, ev, "GuideStep");
 }
 
 void EventServer::NotifyGuidingDithered(double dx, double dy)
@@ -2000,7 +2343,7 @@ void EventServer::NotifyAppState()
     if (m_eventServerClients.empty())
         return;
 
-    do_notify(m_eventServerClients, ev_app_state());
+    do_notify(m_eventServerClients, ev_app_state(), "AppState");
 }
 
 void EventServer::NotifySettling(double distance, double time, double settleTime)
@@ -2010,9 +2353,9 @@ void EventServer::NotifySettling(double distance, double time, double settleTime
 
     Ev ev(ev_settling(distance, time, settleTime));
 
-    Debug.Write(wxString::Format("evsrv: %s\n", ev.str()));
+    Debug.Write(wxString::Format("evsrv: %s\n", wxString::FromUTF8(ev.str().c_str())));
 
-    do_notify(m_eventServerClients, ev);
+    do_notify(m_eventServerClients, ev, "Settling");
 }
 
 void EventServer::NotifySettleDone(const wxString& errorMsg)
@@ -2022,7 +2365,7 @@ void EventServer::NotifySettleDone(const wxString& errorMsg)
 
     Ev ev(ev_settle_done(errorMsg));
 
-    Debug.Write(wxString::Format("evsrv: %s\n", ev.str()));
+    Debug.Write(wxString::Format("evsrv: %s\n", wxString::FromUTF8(ev.str().c_str())));
 
     do_notify(m_eventServerClients, ev);
 }
@@ -2057,3 +2400,29 @@ void EventServer::NotifyAlert(const wxString& msg, int type)
 
     do_notify(m_eventServerClients, ev);
 }
+
+void EventServer::NotifyPlateSolve(const PlateSolveResult& result)
+{
+    if (m_eventServerClients.empty())
+        return;
+
+    Ev ev(result.success ? "PlateSolved" : "PlateSolveFailed");
+    ev << NV("Id", (int) result.id)
+       << NV("FrameTime", result.frameTime, 6)
+       << NV("Elapsed", result.elapsed, 3);
+
+    if (result.success)
+    {
+        ev << NV("Solver", result.solver)
+           << NV("RA", result.ra, 6)
+           << NV("Dec", result.dec, 6)
+           << NV("Rotation", result.rotation, 3)
+           << NV("PixelScale", result.pixelScale, 3);
+    }
+    else
+    {
+        ev << NV("Error", result.error);
+    }
+
+    do_notify(m_eventServerClients, ev);
+}
@@ -38,13 +38,14 @@
 #include <set>
 #include "json_parser.h"
 
+struct PlateSolveResult;
+
 class EventServer : public wxEvtHandler
 {
 public:
     typedef std::set<wxSocketClient *> CliSockSet;
 
 private:
-    JsonParser m_parser;
     wxSocketServer *m_serverSocket;
     CliSockSet m_eventServerClients;
 
@@ -55,6 +56,8 @@ public:
     bool EventServerStart(unsigned int instanceId);
     void EventServerStop();
 
+    const CliSockSet& Clients() const { return m_eventServerClients; }
+
     void NotifyStartCalibration(Mount *pCalibrationMount);
     void NotifyCalibrationFailed(Mount *pCalibrationMount, const wxString& msg);
     void NotifyCalibrationComplete(Mount *pCalibrationMount);
@@ -75,10 +78,12 @@ public:
     void NotifySettling(double distance, double time, double settleTime);
     void NotifySettleDone(const wxString& errorMsg);
     void NotifyAlert(const wxString& msg, int type);
+    void NotifyPlateSolve(const PlateSolveResult& result);
 
 private:
     void OnEventServerEvent(wxSocketEvent& evt);
     void OnEventServerClientEvent(wxSocketEvent& evt);
+    void OnClientOverflow(wxThreadEvent& evt);
 
     wxDECLARE_EVENT_TABLE();
 };
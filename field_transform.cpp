@@ -0,0 +1,311 @@
+/*
+ *  field_transform.cpp
+ *  PHD Guiding
+ *
+ *  Created by Arran Dengate
+ *  Copyright (c) 2017 Arran Dengate
+ *  All rights reserved.
+ *
+ *  This source code is distributed under the following "BSD" license
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *    Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *    Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *    Neither the name of Bret McKee, Dad Dog Development,
+ *     Craig Stark, Stark Labs nor the names of its
+ *     contributors may be used to endorse or promote products derived from
+ *     this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "phd.h"
+
+static const double DefaultTolerance = 1.5;         // pixels
+static const double DefaultRotationDrift = 0.002;   // degrees per frame
+static const unsigned int MaxIterations = 50;
+static const double MinPairSeparation = 10.0;       // pixels; closer pairs give a poor rotation
+
+FieldTransform::FieldTransform(void)
+    : dx(0.0), dy(0.0), rotation(0.0), scale(1.0), rms(0.0), inliers(0)
+{
+    for (int i = 0; i < 4; i++)
+        for (int j = 0; j < 4; j++)
+            cov[i][j] = 0.0;
+}
+
+FieldTransformEstimator::FieldTransformEstimator(void)
+    : m_tolerance(DefaultTolerance), m_seed(1)
+{
+    Reset();
+}
+
+void FieldTransformEstimator::SetTolerance(double pixels)
+{
+    m_tolerance = pixels > 0.0 ? pixels : DefaultTolerance;
+}
+
+void FieldTransformEstimator::Reset(void)
+{
+    m_haveLast = false;
+    m_lastA = 1.0;
+    m_lastB = 0.0;
+    m_lastTx = m_lastTy = 0.0;
+}
+
+void FieldTransformEstimator::Clear(void)
+{
+    m_from.clear();
+    m_to.clear();
+    m_weight.clear();
+}
+
+void FieldTransformEstimator::Add(const PHD_Point& from, const PHD_Point& to, double weight)
+{
+    m_from.push_back(from);
+    m_to.push_back(to);
+    m_weight.push_back(weight);
+}
+
+// Small LCG, so that a given set of stars always gives the same solution
+unsigned int FieldTransformEstimator::Random(unsigned int n)
+{
+    m_seed = m_seed * 1103515245 + 12345;
+    return (m_seed >> 16) % n;
+}
+
+// The transform maps (x, y) to (a x - b y + tx, b x + a y + ty). Returns the
+// total weight of the stars that fit within the tolerance, and flags them.
+double FieldTransformEstimator::Score(double a, double b, double tx, double ty, std::vector<char>& inlier) const
+{
+    double tol2 = m_tolerance * m_tolerance;
+    double sum = 0.0;
+
+    for (unsigned int i = 0; i < m_from.size(); i++)
+    {
+        const PHD_Point& p = m_from[i];
+        const PHD_Point& q = m_to[i];
+        double rx = q.X - (a * p.X - b * p.Y + tx);
+        double ry = q.Y - (b * p.X + a * p.Y + ty);
+        inlier[i] = rx * rx + ry * ry <= tol2;
+        if (inlier[i])
+            sum += m_weight[i];
+    }
+
+    return sum;
+}
+
+// Weighted least-squares fit over the flagged stars. With the coordinates
+// taken about the weighted centroids the normal equations are diagonal, so
+// the parameter covariance follows directly from the residual variance.
+bool FieldTransformEstimator::Fit(const std::vector<char>& use, double *a, double *b, double *tx, double *ty,
+                                  FieldTransform *result) const
+{
+    unsigned int n = 0;
+    double W = 0.0, px = 0.0, py = 0.0, qx = 0.0, qy = 0.0;
+
+    for (unsigned int i = 0; i < m_from.size(); i++)
+    {
+        if (!use[i])
+            continue;
+        double w = m_weight[i];
+        W += w;
+        px += w * m_from[i].X;
+        py += w * m_from[i].Y;
+        qx += w * m_to[i].X;
+        qy += w * m_to[i].Y;
+        ++n;
+    }
+
+    if (n < 3 || W <= 0.0)
+        return false;
+
+    px /= W;
+    py /= W;
+    qx /= W;
+    qy /= W;
+
+    double A = 0.0, B = 0.0, S = 0.0;
+    for (unsigned int i = 0; i < m_from.size(); i++)
+    {
+        if (!use[i])
+            continue;
+        double w = m_weight[i];
+        double fx = m_from[i].X - px, fy = m_from[i].Y - py;
+        double gx = m_to[i].X - qx, gy = m_to[i].Y - qy;
+        A += w * (fx * gx + fy * gy);
+        B += w * (fx * gy - fy * gx);
+        S += w * (fx * fx + fy * fy);
+    }
+
+    if (S <= 0.0)
+        return false;
+
+    double fa = A / S;
+    double fb = B / S;
+    double scale = hypot(fa, fb);
+    if (scale <= 0.0)
+        return false;
+
+    double wr2 = 0.0, r2 = 0.0;
+    for (unsigned int i = 0; i < m_from.size(); i++)
+    {
+        if (!use[i])
+            continue;
+        double fx = m_from[i].X - px, fy = m_from[i].Y - py;
+        double rx = m_to[i].X - qx - (fa * fx - fb * fy);
+        double ry = m_to[i].Y - qy - (fb * fx + fa * fy);
+        wr2 += m_weight[i] * (rx * rx + ry * ry);
+        r2 += rx * rx + ry * ry;
+    }
+
+    // variance of unit weight; four parameters from 2n coordinates
+    double s2 = wr2 / (2 * n - 4);
+    double deg = degrees(1.0);
+
+    *a = fa;
+    *b = fb;
+    *tx = qx - (fa * px - fb * py);
+    *ty = qy - (fb * px + fa * py);
+
+    FieldTransform t;
+    t.dx = qx - px;
+    t.dy = qy - py;
+    t.rotation = degrees(atan2(fb, fa));
+    t.scale = scale;
+    t.cov[0][0] = t.cov[1][1] = s2 / W;
+    t.cov[2][2] = s2 / (S * scale * scale) * deg * deg;
+    t.cov[3][3] = s2 / S;
+    t.rms = sqrt(r2 / n);
+    t.inliers = n;
+    *result = t;
+
+    return true;
+}
+
+bool FieldTransformEstimator::Solve(FieldTransform *result)
+{
+    unsigned int n = m_from.size();
+    if (n < 3)
+        return false;
+
+    m_inlier.resize(n);
+    m_best.resize(n);
+
+    double total = 0.0;
+    for (unsigned int i = 0; i < n; i++)
+        total += m_weight[i];
+    double complete = total * (1.0 - 1e-9);
+
+    double best = -1.0;
+    if (m_haveLast)
+    {
+        best = Score(m_lastA, m_lastB, m_lastTx, m_lastTy, m_best);
+    }
+
+    for (unsigned int iter = 0; iter < MaxIterations && best < complete; iter++)
+    {
+        unsigned int i = Random(n);
+        unsigned int j = Random(n - 1);
+        if (j >= i)
+            ++j;
+
+        double dx = m_from[j].X - m_from[i].X, dy = m_from[j].Y - m_from[i].Y;
+        double d2 = dx * dx + dy * dy;
+        if (d2 < MinPairSeparation * MinPairSeparation)
+            continue;
+        double ex = m_to[j].X - m_to[i].X, ey = m_to[j].Y - m_to[i].Y;
+
+        // the pair fixes the transform exactly: (a + ib) = e / d
+        double a = (ex * dx + ey * dy) / d2;
+        double b = (ey * dx - ex * dy) / d2;
+        double tx = m_to[i].X - (a * m_from[i].X - b * m_from[i].Y);
+        double ty = m_to[i].Y - (b * m_from[i].X + a * m_from[i].Y);
+
+        double score = Score(a, b, tx, ty, m_inlier);
+        if (score > best)
+        {
+            best = score;
+            m_best.swap(m_inlier);
+        }
+    }
+
+    double a, b, tx, ty;
+    FieldTransform t;
+    if (best <= 0.0 || !Fit(m_best, &a, &b, &tx, &ty, &t))
+        return false;
+
+    // the fit to the consensus set may admit or drop a few borderline stars
+    Score(a, b, tx, ty, m_inlier);
+    if (m_inlier != m_best)
+    {
+        FieldTransform t2;
+        double a2, b2, tx2, ty2;
+        if (Fit(m_inlier, &a2, &b2, &tx2, &ty2, &t2))
+        {
+            a = a2; b = b2; tx = tx2; ty = ty2;
+            t = t2;
+        }
+    }
+
+    m_haveLast = true;
+    m_lastA = a;
+    m_lastB = b;
+    m_lastTx = tx;
+    m_lastTy = ty;
+
+    *result = t;
+    return true;
+}
+
+RotationFilter::RotationFilter(void)
+    : m_drift(DefaultRotationDrift)
+{
+    Reset();
+}
+
+void RotationFilter::SetDrift(double degreesPerFrame)
+{
+    m_drift = degreesPerFrame > 0.0 ? degreesPerFrame : DefaultRotationDrift;
+}
+
+void RotationFilter::Reset(void)
+{
+    m_value = 0.0;
+    m_variance = 0.0;
+    m_started = false;
+}
+
+double RotationFilter::Update(double measurement, double variance)
+{
+    variance = std::max(variance, 1e-12);
+
+    if (!m_started)
+    {
+        m_value = measurement;
+        m_variance = variance;
+        m_started = true;
+        return m_value;
+    }
+
+    double p = m_variance + m_drift * m_drift;
+    double k = p / (p + variance);
+    m_value += k * (measurement - m_value);
+    m_variance = (1.0 - k) * p;
+
+    return m_value;
+}
@@ -0,0 +1,123 @@
+/*
+ *  field_transform.h
+ *  PHD Guiding
+ *
+ *  Created by Arran Dengate
+ *  Copyright (c) 2017 Arran Dengate
+ *  All rights reserved.
+ *
+ *  This source code is distributed under the following "BSD" license
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *    Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *    Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *    Neither the name of Bret McKee, Dad Dog Development,
+ *     Craig Stark, Stark Labs nor the names of its
+ *     contributors may be used to endorse or promote products derived from
+ *     this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef FIELD_TRANSFORM_H_INCLUDED
+#define FIELD_TRANSFORM_H_INCLUDED
+
+// Motion of the star field between a reference frame and the current frame:
+// a shift, a rotation and a change of scale
+struct FieldTransform
+{
+    double dx;              // shift of the weighted centroid of the stars, pixels
+    double dy;
+    double rotation;        // degrees, in the sense of PHD_Point::Angle
+    double scale;
+    double cov[4][4];       // covariance of dx, dy, rotation, scale, in that order
+    double rms;             // rms residual of the inliers, pixels
+    unsigned int inliers;
+
+    FieldTransform(void);
+};
+
+// Weighted least-squares (Procrustes) fit of a FieldTransform to pairs of
+// star positions. Stars that moved inconsistently with the rest, such as a
+// star swapped for a neighbour or a hot pixel, are rejected by RANSAC before
+// the final fit. The previous frame's solution is tried as the first
+// hypothesis, so in steady guiding the search usually ends at once.
+class FieldTransformEstimator
+{
+    std::vector<PHD_Point> m_from;
+    std::vector<PHD_Point> m_to;
+    std::vector<double> m_weight;
+    std::vector<char> m_inlier;
+    std::vector<char> m_best;
+
+    double m_tolerance;
+    unsigned int m_seed;
+    bool m_haveLast;
+    double m_lastA;
+    double m_lastB;
+    double m_lastTx;
+    double m_lastTy;
+
+    unsigned int Random(unsigned int n);
+    double Score(double a, double b, double tx, double ty, std::vector<char>& inlier) const;
+    bool Fit(const std::vector<char>& use, double *a, double *b, double *tx, double *ty, FieldTransform *result) const;
+
+public:
+    FieldTransformEstimator(void);
+
+    // residual beyond which a star is an outlier, pixels
+    void SetTolerance(double pixels);
+    double GetTolerance(void) const { return m_tolerance; }
+
+    // forget the previous solution, at the start of guiding
+    void Reset(void);
+
+    // start a new set of star pairs
+    void Clear(void);
+    // weight is the inverse of the position variance, e.g. SNR squared
+    void Add(const PHD_Point& from, const PHD_Point& to, double weight);
+    unsigned int Count(void) const { return m_from.size(); }
+
+    // Needs at least three consistent stars, otherwise returns false
+    bool Solve(FieldTransform *result);
+};
+
+// Recursive (Kalman) filter for the field rotation. The rotation is modelled
+// as a slow random walk and each measurement is weighted by its variance, so
+// the update is O(1) and a noisy frame moves the estimate less than a good one.
+class RotationFilter
+{
+    double m_value;
+    double m_variance;
+    double m_drift;         // degrees per frame, 1 sigma
+    bool m_started;
+
+public:
+    RotationFilter(void);
+
+    void SetDrift(double degreesPerFrame);
+    double GetDrift(void) const { return m_drift; }
+
+    void Reset(void);
+    double Update(double measurement, double variance);
+
+    bool IsStarted(void) const { return m_started; }
+    double Value(void) const { return m_value; }
+    double Variance(void) const { return m_variance; }
+};
+
+#endif // FIELD_TRANSFORM_H_INCLUDED
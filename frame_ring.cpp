@@ -0,0 +1,122 @@
+/*
+ *  frame_ring.cpp
+ *  PHD Guiding
+ *
+ *  Created by Arran Dengate
+ *  Copyright (c) 2017 Arran Dengate
+ *  All rights reserved.
+ *
+ *  This source code is distributed under the following "BSD" license
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *    Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *    Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *    Neither the name of Bret McKee, Dad Dog Development,
+ *     Craig Stark, Stark Labs nor the names of its
+ *     contributors may be used to endorse or promote products derived from
+ *     this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "phd.h"
+
+#include <atomic>
+
+FrameRing::FrameRing(void)
+    : m_published(0)
+{
+}
+
+unsigned int FrameRing::Publish(usImage *img)
+{
+    return Publish(FramePtr(img));
+}
+
+unsigned int FrameRing::Publish(const FramePtr& img)
+{
+    FramePtr frame(img);
+    FramePtr dropped;
+    unsigned int sequence;
+
+    {
+        wxCriticalSectionLocker lock(m_lock);
+        sequence = m_published++;
+        // the oldest frame is released outside the lock
+        dropped.swap(m_frames[sequence % DEPTH]);
+        m_frames[sequence % DEPTH].swap(frame);
+    }
+
+    return sequence;
+}
+
+FrameRef FrameRing::Latest(void) const
+{
+    wxCriticalSectionLocker lock(m_lock);
+    if (m_published == 0)
+        return FrameRef();
+    return m_frames[(m_published - 1) % DEPTH];
+}
+
+FrameRef FrameRing::Get(unsigned int sequence) const
+{
+    wxCriticalSectionLocker lock(m_lock);
+    if (sequence >= m_published || m_published - sequence > DEPTH)
+        return FrameRef();
+    return m_frames[sequence % DEPTH];
+}
+
+unsigned int FrameRing::Published(void) const
+{
+    wxCriticalSectionLocker lock(m_lock);
+    return m_published;
+}
+
+FramePool::FramePool(void)
+    : m_next(0),
+      m_misses(0)
+{
+}
+
+FramePtr FramePool::Acquire(void)
+{
+    wxCriticalSectionLocker lock(m_lock);
+
+    for (unsigned int i = 0; i < SLOTS; i++)
+    {
+        FramePtr& slot = m_slots[(m_next + i) % SLOTS];
+
+        if (!slot)
+            slot = std::make_shared<usImage>();
+        else if (slot.use_count() == 1)
+        {
+            // only the pool refers to it, so no other thread can get hold
+            // of it again; see the last holder's writes before reusing it
+            std::atomic_thread_fence(std::memory_order_acquire);
+            slot->Recycle();
+        }
+        else
+            continue;
+
+        m_next = (m_next + i + 1) % SLOTS;
+        return slot;
+    }
+
+    Debug.Write(wxString::Format("FramePool: all %d slots in use, unpooled frame %u\n", SLOTS, ++m_misses));
+
+    return std::make_shared<usImage>();
+}
@@ -0,0 +1,100 @@
+/*
+ *  frame_ring.h
+ *  PHD Guiding
+ *
+ *  Created by Arran Dengate
+ *  Copyright (c) 2017 Arran Dengate
+ *  All rights reserved.
+ *
+ *  This source code is distributed under the following "BSD" license
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *    Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *    Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *    Neither the name of Bret McKee, Dad Dog Development,
+ *     Craig Stark, Stark Labs nor the names of its
+ *     contributors may be used to endorse or promote products derived from
+ *     this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef FRAME_RING_H_INCLUDED
+#define FRAME_RING_H_INCLUDED
+
+// A published frame. Published frames are never modified, so any thread
+// holding a reference may read the pixels without locking or copying.
+typedef std::shared_ptr<const usImage> FrameRef;
+
+// A frame being captured. The holder may write to it until it is published.
+typedef std::shared_ptr<usImage> FramePtr;
+
+// The most recent guide frames, shared by reference count between the guide
+// loop and its consumers (plate solver, image savers, remote viewers). A
+// consumer that needs a frame for longer than one guide cycle just keeps its
+// FrameRef; the frame is freed when the last reference goes.
+class FrameRing
+{
+public:
+    enum { DEPTH = 4 };
+
+private:
+    mutable wxCriticalSection m_lock;
+    std::shared_ptr<usImage> m_frames[DEPTH];
+    unsigned int m_published;   // frames published so far; the latest has sequence m_published - 1
+
+public:
+    FrameRing(void);
+
+    // Takes ownership of img, which must not be modified once published.
+    // Returns the frame's sequence number.
+    unsigned int Publish(usImage *img);
+    unsigned int Publish(const FramePtr& frame);
+
+    // Latest frame, or an empty reference if nothing was published yet
+    FrameRef Latest(void) const;
+    // Frame with the given sequence number, if still in the ring
+    FrameRef Get(unsigned int sequence) const;
+    // Number of frames published so far
+    unsigned int Published(void) const;
+};
+
+// Recycles the images that guide frames are captured into. An image goes
+// back to the pool when the last FramePtr or FrameRef to it is released, and
+// keeps its pixel buffer, so once every slot has been used at the current
+// frame size the capture loop no longer allocates.
+class FramePool
+{
+public:
+    // enough for a full ring, the pipelined exposures and a few consumers
+    enum { SLOTS = FrameRing::DEPTH + 6 };
+
+private:
+    wxCriticalSection m_lock;
+    FramePtr m_slots[SLOTS];
+    unsigned int m_next;        // slot to look at first
+    unsigned int m_misses;      // images handed out unpooled because every slot was busy
+
+public:
+    FramePool(void);
+
+    // An image no one else refers to. Never blocks: if every slot is in
+    // use a new image is returned that is not kept in the pool.
+    FramePtr Acquire(void);
+};
+
+#endif // FRAME_RING_H_INCLUDED
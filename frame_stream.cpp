@@ -0,0 +1,616 @@
+/*
+ *  frame_stream.cpp
+ *  PHD Guiding
+ *
+ *  Created by Arran Dengate
+ *  Copyright (c) 2017 Arran Dengate
+ *  All rights reserved.
+ *
+ *  This source code is distributed under the following "BSD" license
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *    Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *    Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *    Neither the name of Bret McKee, Dad Dog Development,
+ *     Craig Stark, Stark Labs nor the names of its
+ *     contributors may be used to endorse or promote products derived from
+ *     this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "phd.h"
+
+FrameStreamServer FrameStream;
+
+BEGIN_EVENT_TABLE(FrameStreamServer, wxEvtHandler)
+    EVT_SOCKET(FRAME_STREAM_ID, FrameStreamServer::OnServerEvent)
+    EVT_SOCKET(FRAME_STREAM_CLIENT_ID, FrameStreamServer::OnClientEvent)
+    EVT_THREAD(FRAME_STREAM_ENCODED_ID, FrameStreamServer::OnFrameEncoded)
+END_EVENT_TABLE()
+
+enum
+{
+    FRAME_STREAM_VERSION = 1,
+    FRAME_HEADER_SIZE = 48,
+    MAX_REQUEST_SIZE = 4096,
+    MAX_FPS = 30,
+    MAX_PENDING_JOBS = 2,   // one being encoded, one waiting
+};
+
+enum FrameKind
+{
+    KIND_FRAME = 0,
+    KIND_CROP = 1,
+};
+
+enum FrameEncoding
+{
+    ENCODING_RAW = 0,
+    ENCODING_DELTA = 1,
+};
+
+typedef std::shared_ptr<const std::string> FrameBuf;
+
+struct FrameStreamClient
+{
+    enum Mode { MODE_NONE, MODE_CROP, MODE_FRAME };
+
+    unsigned int serial;    // tells a new client from an old one at the same address
+    Mode mode;
+    int cropSize;
+    int minIntervalMs;
+    FrameEncoding encoding;
+    wxLongLong lastQueued;
+
+    std::string request;    // partial subscription request
+    FrameBuf sending;       // frame being written
+    size_t pos;             // bytes of it already written
+    FrameBuf waiting;       // the next frame, replaced if a newer one comes first
+    bool wantOutput;
+
+    unsigned int sent;
+    unsigned int replaced;
+
+    FrameStreamClient(unsigned int serial_)
+        : serial(serial_), mode(MODE_NONE), cropSize(63), minIntervalMs(200), encoding(ENCODING_RAW), lastQueued(0),
+        pos(0), wantOutput(false), sent(0), replaced(0)
+    {
+    }
+};
+
+inline static FrameStreamClient *client_data(wxSocketClient *cli)
+{
+    return (FrameStreamClient *) cli->GetClientData();
+}
+
+// One form of a frame that some clients want: a crop or the whole frame, in
+// one encoding
+struct FrameForm
+{
+    wxRect rect;
+    FrameKind kind;
+    FrameEncoding encoding;
+    FrameBuf buf;           // filled in by the stream thread
+};
+
+struct FrameTarget
+{
+    wxSocketClient *cli;
+    unsigned int serial;
+    size_t form;
+};
+
+// A frame handed to the stream thread, and handed back encoded
+struct FrameEncodeJob
+{
+    FrameRef frame;
+    unsigned int sequence;
+    unsigned int frameNumber;
+    wxLongLong now;
+    PHD_Point star;
+    std::vector<FrameForm> forms;
+    std::vector<FrameTarget> targets;
+};
+
+static void put8(std::string& s, unsigned int v)
+{
+    s += (char) (v & 0xff);
+}
+
+static void put16(std::string& s, unsigned int v)
+{
+    put8(s, v);
+    put8(s, v >> 8);
+}
+
+static void put32(std::string& s, uint32_t v)
+{
+    put16(s, v & 0xffff);
+    put16(s, v >> 16);
+}
+
+static void put64(std::string& s, uint64_t v)
+{
+    put32(s, (uint32_t) v);
+    put32(s, (uint32_t) (v >> 32));
+}
+
+// A zigzag varint of the difference of two 16 bit pixels takes at most
+// 3 bytes
+enum { MAX_VARINT_SIZE = 3 };
+
+inline static unsigned char *put_varint(unsigned char *out, int delta)
+{
+    uint32_t v = ((uint32_t) delta << 1) ^ (uint32_t) (delta >> 31); // zigzag
+    while (v >= 0x80)
+    {
+        *out++ = (unsigned char) (v | 0x80);
+        v >>= 7;
+    }
+    *out++ = (unsigned char) v;
+    return out;
+}
+
+static FrameBuf EncodeFrame(const usImage& img, const wxRect& rect, FrameKind kind, FrameEncoding encoding,
+    unsigned int sequence, unsigned int frameNumber, wxLongLong now, const PHD_Point& star)
+{
+    int const width = rect.GetWidth();
+    size_t const maxPayload = (size_t) width * rect.GetHeight() *
+        (encoding == ENCODING_RAW ? sizeof(unsigned short) : MAX_VARINT_SIZE);
+
+    std::string s;
+    s.reserve(FRAME_HEADER_SIZE + maxPayload);
+
+    s += "PHDF";
+    put8(s, FRAME_STREAM_VERSION);
+    put8(s, kind);
+    put8(s, encoding);
+    put8(s, 0);
+    put32(s, sequence);
+    put32(s, frameNumber);
+    put16(s, img.Size.GetWidth());
+    put16(s, img.Size.GetHeight());
+    put16(s, rect.GetLeft());
+    put16(s, rect.GetTop());
+    put16(s, rect.GetWidth());
+    put16(s, rect.GetHeight());
+    put32(s, 0); // payload size, filled in below
+    put64(s, now.GetValue());
+    put32(s, star.IsValid() ? (int32_t) (star.X * 1000.0) : -1);
+    put32(s, star.IsValid() ? (int32_t) (star.Y * 1000.0) : -1);
+
+    // The payload is written through a pointer into the buffer sized for the
+    // worst case, then trimmed
+    s.resize(FRAME_HEADER_SIZE + maxPayload);
+    unsigned char *const start = (unsigned char *) &s[FRAME_HEADER_SIZE];
+    unsigned char *out = start;
+
+    for (int y = rect.GetTop(); y <= rect.GetBottom(); y++)
+    {
+        const unsigned short *p = &img.Pixel(rect.GetLeft(), y);
+        if (encoding == ENCODING_RAW)
+        {
+#if wxBYTE_ORDER == wxLITTLE_ENDIAN
+            memcpy(out, p, width * sizeof(unsigned short));
+            out += width * sizeof(unsigned short);
+#else
+            for (int x = 0; x < width; x++)
+            {
+                *out++ = (unsigned char) (p[x] & 0xff);
+                *out++ = (unsigned char) (p[x] >> 8);
+            }
+#endif
+        }
+        else
+        {
+            int prev = y > rect.GetTop() ? p[-img.Size.GetWidth()] : 0;
+            for (int x = 0; x < width; x++)
+            {
+                out = put_varint(out, (int) p[x] - prev);
+                prev = p[x];
+            }
+        }
+    }
+
+    uint32_t const payload = out - start;
+    s.resize(FRAME_HEADER_SIZE + payload);
+    for (int i = 0; i < 4; i++)
+        s[28 + i] = (char) ((payload >> (8 * i)) & 0xff);
+
+    return std::make_shared<const std::string>(std::move(s));
+}
+
+// Writes until the socket stops taking data, then waits for an output event
+static void flush_output(wxSocketClient *cli)
+{
+    FrameStreamClient *cd = client_data(cli);
+
+    while (cd->sending)
+    {
+        const std::string& s = *cd->sending;
+        cli->Write(s.data() + cd->pos, s.size() - cd->pos);
+        cd->pos += cli->LastWriteCount();
+        if (cd->pos < s.size())
+            break;
+        ++cd->sent;
+        cd->sending = cd->waiting;
+        cd->waiting.reset();
+        cd->pos = 0;
+    }
+
+    bool const want = (bool) cd->sending;
+    if (want != cd->wantOutput)
+    {
+        cli->SetNotify(wxSOCKET_LOST_FLAG | wxSOCKET_INPUT_FLAG | (want ? wxSOCKET_OUTPUT_FLAG : 0));
+        cd->wantOutput = want;
+    }
+}
+
+static bool parse_subscription(FrameStreamClient *cd, const json_value *root)
+{
+    if (root->type != JSON_OBJECT)
+        return false;
+
+    FrameStreamClient sub(*cd);
+
+    json_for_each (t, root)
+    {
+        if (!t->name)
+            continue;
+        if (strcmp(t->name, "subscribe") == 0 && t->type == JSON_STRING)
+        {
+            if (strcmp(t->string_value, "none") == 0)
+                sub.mode = FrameStreamClient::MODE_NONE;
+            else if (strcmp(t->string_value, "crop") == 0)
+                sub.mode = FrameStreamClient::MODE_CROP;
+            else if (strcmp(t->string_value, "frame") == 0)
+                sub.mode = FrameStreamClient::MODE_FRAME;
+            else
+                return false;
+        }
+        else if (strcmp(t->name, "size") == 0 && t->type == JSON_INT)
+        {
+            if (t->int_value < 15 || t->int_value > 255)
+                return false;
+            sub.cropSize = t->int_value | 1;
+        }
+        else if (strcmp(t->name, "fps") == 0 && (t->type == JSON_INT || t->type == JSON_FLOAT))
+        {
+            double fps = t->type == JSON_INT ? t->int_value : t->float_value;
+            if (fps <= 0.0)
+                return false;
+            sub.minIntervalMs = (int) (1000.0 / wxMin(fps, (double) MAX_FPS));
+        }
+        else if (strcmp(t->name, "encoding") == 0 && t->type == JSON_STRING)
+        {
+            if (strcmp(t->string_value, "raw") == 0)
+                sub.encoding = ENCODING_RAW;
+            else if (strcmp(t->string_value, "delta") == 0)
+                sub.encoding = ENCODING_DELTA;
+            else
+                return false;
+        }
+    }
+
+    cd->mode = sub.mode;
+    cd->cropSize = sub.cropSize;
+    cd->minIntervalMs = sub.minIntervalMs;
+    cd->encoding = sub.encoding;
+    return true;
+}
+
+FrameStreamServer::FrameStreamServer()
+    :
+    m_serverSocket(0),
+    m_sequence(0),
+    m_nextSerial(0),
+    m_pending(0)
+{
+}
+
+FrameStreamServer::~FrameStreamServer()
+{
+}
+
+bool FrameStreamServer::Start(unsigned int instanceId)
+{
+    if (m_serverSocket)
+    {
+        Debug.AddLine("attempt to start frame stream server when it is already started?");
+        return false;
+    }
+
+    unsigned int port = 4500 + instanceId - 1;
+    wxIPV4address addr;
+    addr.Service(port);
+    m_serverSocket = new wxSocketServer(addr);
+
+    if (!m_serverSocket->Ok())
+    {
+        Debug.Write(wxString::Format("Frame stream server failed to start - Could not listen at port %u\n", port));
+        delete m_serverSocket;
+        m_serverSocket = NULL;
+        return true;
+    }
+
+    m_serverSocket->SetEventHandler(*this, FRAME_STREAM_ID);
+    m_serverSocket->SetNotify(wxSOCKET_CONNECTION_FLAG);
+    m_serverSocket->Notify(true);
+
+    if (CreateThread() != wxTHREAD_NO_ERROR || GetThread()->Run() != wxTHREAD_NO_ERROR)
+    {
+        Debug.AddLine("frame stream server: could not start stream thread");
+        delete m_serverSocket;
+        m_serverSocket = NULL;
+        return true;
+    }
+
+    Debug.Write(wxString::Format("frame stream server started, listening on port %u\n", port));
+
+    return false;
+}
+
+void FrameStreamServer::Stop()
+{
+    if (!m_serverSocket)
+        return;
+
+    for (CliSockSet::const_iterator it = m_clients.begin(); it != m_clients.end(); ++it)
+        DestroyClient(*it);
+    m_clients.clear();
+
+    delete m_serverSocket;
+    m_serverSocket = NULL;
+
+    if (GetThread())
+    {
+        m_queue.Post(0);   // tells the thread to exit
+        GetThread()->Wait();
+    }
+
+    Debug.AddLine("frame stream server stopped");
+}
+
+void FrameStreamServer::DestroyClient(wxSocketClient *cli)
+{
+    FrameStreamClient *cd = client_data(cli);
+    Debug.Write(wxString::Format("frmsrv: cli %p sent %u frames, replaced %u\n", cli, cd->sent, cd->replaced));
+    delete cd;
+    cli->SetClientData(0);
+    cli->Destroy();
+}
+
+void FrameStreamServer::OnServerEvent(wxSocketEvent& event)
+{
+    wxSocketServer *server = static_cast<wxSocketServer *>(event.GetSocket());
+
+    if (event.GetSocketEvent() != wxSOCKET_CONNECTION)
+        return;
+
+    wxSocketClient *client = static_cast<wxSocketClient *>(server->Accept(false));
+
+    if (!client)
+        return;
+
+    Debug.Write(wxString::Format("frmsrv: cli %p connect\n", client));
+
+    client->SetEventHandler(*this, FRAME_STREAM_CLIENT_ID);
+    client->SetNotify(wxSOCKET_LOST_FLAG | wxSOCKET_INPUT_FLAG);
+    client->SetFlags(wxSOCKET_NOWAIT);
+    client->Notify(true);
+    client->SetClientData(new FrameStreamClient(++m_nextSerial));
+
+    m_clients.insert(client);
+}
+
+void FrameStreamServer::OnClientEvent(wxSocketEvent& event)
+{
+    wxSocketClient *cli = static_cast<wxSocketClient *>(event.GetSocket());
+
+    if (m_clients.find(cli) == m_clients.end())
+        return;
+
+    switch (event.GetSocketEvent())
+    {
+    case wxSOCKET_LOST:
+        Debug.Write(wxString::Format("frmsrv: cli %p disconnect\n", cli));
+        m_clients.erase(cli);
+        DestroyClient(cli);
+        break;
+    case wxSOCKET_INPUT:
+        HandleInput(cli);
+        break;
+    case wxSOCKET_OUTPUT:
+        flush_output(cli);
+        break;
+    default:
+        break;
+    }
+}
+
+void FrameStreamServer::HandleInput(wxSocketClient *cli)
+{
+    FrameStreamClient *cd = client_data(cli);
+
+    char buf[512];
+    while (true)
+    {
+        cli->Read(buf, sizeof(buf));
+        size_t n = cli->LastReadCount();
+        if (n == 0)
+            break;
+
+        for (size_t i = 0; i < n; i++)
+        {
+            if (buf[i] != '\r' && buf[i] != '\n')
+            {
+                if (cd->request.size() < MAX_REQUEST_SIZE)
+                    cd->request += buf[i];
+                continue;
+            }
+            if (cd->request.empty())
+                continue;
+
+            std::vector<char> req(cd->request.begin(), cd->request.end());
+            req.push_back(0);
+            cd->request.clear();
+
+            if (m_parser.Parse(&req[0]) && parse_subscription(cd, m_parser.Root()))
+            {
+                Debug.Write(wxString::Format("frmsrv: cli %p subscription mode %d size %d interval %d ms encoding %d\n",
+                    cli, cd->mode, cd->cropSize, cd->minIntervalMs, cd->encoding));
+                cd->lastQueued = 0;
+            }
+            else
+                Debug.Write(wxString::Format("frmsrv: cli %p ignoring invalid request\n", cli));
+        }
+    }
+}
+
+void FrameStreamServer::NotifyFrame(const FrameRef& frame, unsigned int frameNumber, const PHD_Point& star)
+{
+    unsigned int const sequence = m_sequence++;
+
+    if (m_clients.empty() || !frame || !frame->ImageData)
+        return;
+    if (m_pending >= MAX_PENDING_JOBS)
+        return;
+
+    const usImage& img = *frame;
+    wxRect const valid = img.Subframe.IsEmpty() ? wxRect(img.Size) : img.Subframe;
+    wxLongLong const now = ::wxGetUTCTimeMillis();
+
+    FrameEncodeJob *job = new FrameEncodeJob();
+
+    for (CliSockSet::const_iterator it = m_clients.begin(); it != m_clients.end(); ++it)
+    {
+        FrameStreamClient *cd = client_data(*it);
+
+        if (cd->mode == FrameStreamClient::MODE_NONE)
+            continue;
+        if (cd->mode == FrameStreamClient::MODE_CROP && !star.IsValid())
+            continue;
+        if (cd->lastQueued != 0 && now - cd->lastQueued < cd->minIntervalMs)
+            continue;
+
+        FrameForm form;
+        form.encoding = cd->encoding;
+        if (cd->mode == FrameStreamClient::MODE_CROP)
+        {
+            int const half = cd->cropSize / 2;
+            form.rect = wxRect((int) rint(star.X) - half, (int) rint(star.Y) - half, cd->cropSize, cd->cropSize);
+            form.rect.Intersect(valid);
+            if (form.rect.IsEmpty())
+                continue;
+            form.kind = KIND_CROP;
+        }
+        else
+        {
+            form.rect = wxRect(img.Size);
+            form.kind = KIND_FRAME;
+        }
+
+        // each form of the frame is encoded at most once
+        size_t i;
+        for (i = 0; i < job->forms.size(); i++)
+        {
+            const FrameForm& f = job->forms[i];
+            if (f.rect == form.rect && f.kind == form.kind && f.encoding == form.encoding)
+                break;
+        }
+        if (i == job->forms.size())
+            job->forms.push_back(form);
+
+        FrameTarget target = { *it, cd->serial, i };
+        job->targets.push_back(target);
+        cd->lastQueued = now;
+    }
+
+    if (job->targets.empty())
+    {
+        delete job;
+        return;
+    }
+
+    job->frame = frame;
+    job->sequence = sequence;
+    job->frameNumber = frameNumber;
+    job->now = now;
+    job->star = star;
+
+    ++m_pending;
+    m_queue.Post(job);
+}
+
+wxThread::ExitCode FrameStreamServer::Entry()
+{
+    while (true)
+    {
+        FrameEncodeJob *job = 0;
+        if (m_queue.Receive(job) != wxMSGQUEUE_NO_ERROR || !job)
+            break;
+
+        for (std::vector<FrameForm>::iterator it = job->forms.begin(); it != job->forms.end(); ++it)
+        {
+            it->buf = EncodeFrame(*job->frame, it->rect, it->kind, it->encoding, job->sequence,
+                job->frameNumber, job->now, job->star);
+        }
+
+        wxThreadEvent *evt = new wxThreadEvent(wxEVT_THREAD, FRAME_STREAM_ENCODED_ID);
+        evt->SetPayload<FrameEncodeJob *>(job);
+        wxQueueEvent(this, evt);
+    }
+
+    return 0;
+}
+
+// Back on the main thread, queues the encoded frame for each client that is
+// still connected
+void FrameStreamServer::OnFrameEncoded(wxThreadEvent& event)
+{
+    FrameEncodeJob *job = event.GetPayload<FrameEncodeJob *>();
+
+    if (m_pending > 0)
+        --m_pending;
+
+    for (std::vector<FrameTarget>::const_iterator it = job->targets.begin(); it != job->targets.end(); ++it)
+    {
+        if (m_clients.find(it->cli) == m_clients.end())
+            continue;
+        FrameStreamClient *cd = client_data(it->cli);
+        if (cd->serial != it->serial)
+            continue;
+
+        const FrameBuf& buf = job->forms[it->form].buf;
+        if (!cd->sending)
+        {
+            cd->sending = buf;
+            cd->pos = 0;
+        }
+        else
+        {
+            if (cd->waiting)
+                ++cd->replaced;
+            cd->waiting = buf;
+        }
+
+        flush_output(it->cli);
+    }
+
+    delete job;
+}
@@ -0,0 +1,121 @@
+/*
+ *  frame_stream.h
+ *  PHD Guiding
+ *
+ *  Created by Arran Dengate
+ *  Copyright (c) 2017 Arran Dengate
+ *  All rights reserved.
+ *
+ *  This source code is distributed under the following "BSD" license
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *    Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *    Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *    Neither the name of Bret McKee, Dad Dog Development,
+ *     Craig Stark, Stark Labs nor the names of its
+ *     contributors may be used to endorse or promote products derived from
+ *     this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef FRAME_STREAM_H_INCLUDED
+#define FRAME_STREAM_H_INCLUDED
+
+#include <set>
+#include "json_parser.h"
+
+struct FrameStreamClient;
+struct FrameEncodeJob;
+
+// Pushes guide frames to remote displays over a binary side channel, on port
+// 4500 + instance - 1. A client subscribes by sending a line of JSON, and may
+// send another at any time to change its subscription:
+//
+//   {"subscribe":"crop","size":63,"fps":10,"encoding":"delta"}
+//   {"subscribe":"frame","fps":2,"encoding":"raw"}
+//   {"subscribe":"none"}
+//
+// "crop" is a size x size square around the guide star (size odd, 15..255),
+// sent only while there is a star; "frame" is the whole image. fps caps the
+// rate (at most 30). From then on the server sends one message per frame:
+// a 48 byte little-endian header followed by the pixels.
+//
+//   0  'P' 'H' 'D' 'F'
+//   4  u8  version (1)
+//   5  u8  kind: 0 = full frame, 1 = star crop
+//   6  u8  encoding: 0 = raw, 1 = delta
+//   7  u8  reserved
+//   8  u32 sequence, counts every frame published, so gaps show skipped frames
+//   12 u32 frame number, as in the event server's GuideStep events
+//   16 u16 image width, u16 image height
+//   20 u16 x, u16 y of the pixels sent within the image
+//   24 u16 width, u16 height of the pixels sent
+//   28 u32 payload bytes
+//   32 u64 time published, ms since the epoch (UTC)
+//   40 i32 star x, i32 star y within the image, in 1/1000 pixel, or -1
+//
+// Raw payloads are 16 bit pixels, row by row. Delta payloads hold, for each
+// pixel, its difference from the pixel to its left (the pixel above for the
+// first pixel of a row, 0 for the very first pixel), zigzag encoded as a
+// LEB128 varint.
+//
+// A frame is encoded once for all clients that want it in the same form,
+// on the stream's own thread; the guider only hands over a reference to the
+// frame. A client still receiving one frame when the next arrives has the
+// frame waiting behind it replaced, so a slow client sees a lower frame rate
+// and never holds up the guider. Frames that arrive while the thread is
+// behind are skipped.
+class FrameStreamServer : public wxEvtHandler, public wxThreadHelper
+{
+public:
+    typedef std::set<wxSocketClient *> CliSockSet;
+
+private:
+    wxSocketServer *m_serverSocket;
+    CliSockSet m_clients;
+    JsonParser m_parser;
+    unsigned int m_sequence;
+    unsigned int m_nextSerial;
+    wxMessageQueue<FrameEncodeJob *> m_queue;
+    unsigned int m_pending;     // jobs handed to the thread and not yet delivered
+
+public:
+    FrameStreamServer();
+    ~FrameStreamServer();
+
+    bool Start(unsigned int instanceId);
+    void Stop();
+
+    void NotifyFrame(const FrameRef& frame, unsigned int frameNumber, const PHD_Point& star);
+
+protected:
+    wxThread::ExitCode Entry();
+
+private:
+    void OnServerEvent(wxSocketEvent& evt);
+    void OnClientEvent(wxSocketEvent& evt);
+    void OnFrameEncoded(wxThreadEvent& evt);
+    void HandleInput(wxSocketClient *cli);
+    void DestroyClient(wxSocketClient *cli);
+
+    wxDECLARE_EVENT_TABLE();
+};
+
+extern FrameStreamServer FrameStream;
+
+#endif // FRAME_STREAM_H_INCLUDED
@@ -34,6 +34,7 @@
  */
 
 #include "phd.h"
+#include "plate_solver.h"
 #include "goto_dialog.h"
 #include "cam_simulator.h" // To determine if current camera is simulator
 #include "destination_dialog.h"
@@ -42,7 +43,6 @@
 #include <cstdio>
 #include <fstream>
 #include <iostream>
-#include <regex>
 #include <string>
 #include <tuple>
 #include <vector>
@@ -52,24 +52,28 @@
 #include <wx/listctrl.h>
 #include <wx/srchctrl.h>
 #include <wx/checkbox.h>
-#include <wx/progdlg.h>
 #include <stdlib.h> 
 #include <ctime>
 
 
-const char IMAGE_DIRECTORY[]          = "/dev/shm/phd2/goto";
-const char IMAGE_PARENT_DIRECTORY[]   = "/dev/shm/phd2";
-const char IMAGE_FILENAME[]           = "/dev/shm/phd2/goto/guide-scope-image.fits";
-const char SOLVER_FILENAME[]          = "/usr/local/astrometry/bin/solve-field";
 const char CATALOG_FILENAME[]         = "/usr/local/phd2/goto/catalog.csv";
-const char MOVE_COMPLETE_FILENAME[]   = "/dev/shm/phd2/goto/done";
 
 GotoDialog::GotoDialog(void)
     : wxDialog(pFrame, wxID_ANY, _("Go to..."), wxDefaultPosition, wxSize(800, 400), wxCAPTION | wxCLOSE_BOX)
 {   
-    m_doAccuracyMap = false;
-    gotoInProgress = false;
     calibrated = false;
+    m_calState = CALIBRATION_IDLE;
+    m_calIndex = 0;
+    m_surveying = false;
+
+    m_solver = new PlateSolver(this);
+    m_solver->SetTimeout(pConfig->Profile.GetInt("/goto/SolveTimeout", 60000));
+    Bind(PLATESOLVE_PROGRESS_EVENT, &GotoDialog::OnSolveProgress, this);
+    Bind(PLATESOLVE_RESULT_EVENT, &GotoDialog::OnSolveResult, this);
+
+    m_gotoEngine = new GotoEngine(this, m_solver);
+    m_gotoStatus = "Idle";
+    Bind(GOTO_ENGINE_EVENT, &GotoDialog::OnGotoEvent, this);
 
     // Now set up GUI.
 
@@ -176,10 +180,10 @@ GotoDialog::GotoDialog(void)
     cancelButton->Bind(wxEVT_COMMAND_BUTTON_CLICKED, &GotoDialog::OnClose, this);
     buttonSizer->Add(cancelButton);
 
-    //m_debugButton = new wxButton(this, wxID_ANY, _("Debug"));
-    //m_debugButton->Bind(wxEVT_COMMAND_BUTTON_CLICKED, &GotoDialog::OnDebug, this);
-    //m_debugButton->SetToolTip(_("Take a series of exposures at different positions to map goto error"));
-    //buttonSizer->Add(m_debugButton);
+    m_debugButton = new wxButton(this, wxID_ANY, _("Map pointing"));
+    m_debugButton->Bind(wxEVT_COMMAND_BUTTON_CLICKED, &GotoDialog::OnDebug, this);
+    m_debugButton->SetToolTip(_("Take a series of exposures at different positions to map goto error"));
+    buttonSizer->Add(m_debugButton);
 
     m_calibrateButton = new wxButton(this, wxID_ANY, _("Calibrate"));
     m_calibrateButton->Bind(wxEVT_COMMAND_BUTTON_CLICKED, &GotoDialog::OnCalibrate, this);
@@ -200,9 +204,6 @@ GotoDialog::GotoDialog(void)
     Bind(wxEVT_TIMER, &GotoDialog::OnTimer, this);
     m_timer->Start(1000); // Timer goes off every x milliseconds
 
-    // Ask the guider to start saving images - astrometry may soon request one.
-    pFrame->pGuider->RequestSaveImage();
-
     prevExposureDuration = 0;
     //int * prevExposureDuration_ptr = &prevExposureDuration;
     //bool * ignored_ptr = &ignored;
@@ -218,33 +219,35 @@ GotoDialog::GotoDialog(void)
 }
 
 void GotoDialog::OnTimer(wxTimerEvent& event) {
-    destination.NonBlockingUpdate();
-    destination.CheckForUpdate();
+    destination.Update();
     UpdateStatusText();
     UpdateDestinationText();
 
-    if ( m_doAccuracyMap ) AccuracyMap();
-
-    // DISABLED until we make goto idempotent. Currently it slows the mount unto death.
-    //if (gotoInProgress) Goto();  
-
-    /*if ( m_gotoInProgress ) {
-        struct stat info;
-        Debug.AddLine("Goto: in progress, waiting for 'done' file...");
-        if ( stat( MOVE_COMPLETE_FILENAME , &info ) == 0 ) {  // TODO: Get application executable path & use that, rather than absolute path! 
-            Calibrate();
-            pMount->HexGoto(destination.alt, destination.az);
-            m_gotoInProgress = false;
-            Debug.AddLine("Goto: Sent second move command; complete!");
-        } 
-    }*/
+    UpdateCalibration();
+}
+
+void GotoDialog::OnGotoEvent(wxThreadEvent& event) {
+    m_gotoStatus = event.GetString();
+    UpdateStatusText();
+
+    GotoEngine::State state = (GotoEngine::State) event.GetInt();
+    if (state == GotoEngine::GOTO_DONE || state == GotoEngine::GOTO_FAILED || state == GotoEngine::GOTO_IDLE) {
+        m_calibrateButton->Enable();
+        m_debugButton->Enable();
+    }
 }
 
 void GotoDialog::UpdateStatusText(void) {
     std::time_t result = std::time(nullptr);
     m_timeText->SetLabel(std::ctime(&result));
     (calibrated) ? m_skyPosText->SetLabel("Calibrated") : m_skyPosText->SetLabel("Not calibrated");
-    (gotoInProgress) ? m_stateText->SetLabel("Goto in progress") : m_stateText->SetLabel("Idle"); 
+    if (m_calState != CALIBRATION_IDLE) {
+        m_stateText->SetLabel(wxString::Format("%s (%u/%u)\n%s", m_surveying ? "Mapping pointing" : "Calibrating",
+                                               (unsigned int) m_calIndex + 1, (unsigned int) m_calLocations.size(),
+                                               m_solveStatus));
+    } else {
+        m_stateText->SetLabel(m_gotoStatus);
+    }
 
 }
 
@@ -316,102 +319,243 @@ void GotoDialog::OnChangeDestination(wxCommandEvent&) {
     ShowDestinationDialog();
 }
 
-void GotoDialog::AccuracyMap() {
-    // I started writing something that would go to a variety of alt az locations, and test the actual astrometric alt az
-    // results. If there's repeatable, systematic error, we could perhaps interpolate this map to compensate for the error.
-/*    if ( not pFrame->pGuider->IsImageSaved() ) {
-        pFrame->pGuider->RequestSaveImage();
-        Debug.AddLine("Goto: image not ready yet");
+void GotoDialog::StartSurvey() {
+    if (m_calState != CALIBRATION_IDLE) {
+        Debug.AddLine("Goto: calibration already in progress");
+        return;
+    }
+    if (m_gotoEngine->IsActive()) {
+        Debug.AddLine("Goto: goto in progress, calibration not started");
         return;
     }
 
-    double ra, dec, astroRotationAngle;
-    if ( m_solveTriesRemaining > 0) {
-        if ( ! AstroSolveCurrentLocation(ra, dec, astroRotationAngle) ) {
-            m_solveTriesRemaining --;
-            pFrame->pGuider->RequestSaveImage();
-            Debug.AddLine("Goto accMap: failed to solve");
-            return; 
-        } else {
-            Debug.AddLine(wxString::Format("Goto accMap: solved ra %f dec %f rot %f", ra, dec, astroRotationAngle));
-            double alt, az;
-            EquatorialToHorizontal(ra, dec, alt, az, false);
-            Debug.AddLine(wxString::Format("Goto accMap: sky.py alt %f az %f", alt, az));
+    // A grid covering the sky the hexapod can reach, visited in a zigzag so
+    // that each slew is short
+    m_calLocations.clear();
+    bool reverse = false;
+    for (int alt = 75; alt >= 30; alt -= 15) {
+        for (int i = 0; i < 6; i++) {
+            int az = 60 * (reverse ? 5 - i : i);
+            m_calLocations.emplace_back(alt, az);
         }
+        reverse = !reverse;
     }
 
-    m_solveTriesRemaining = 3;
-    
-    Debug.AddLine("Goto: points remaining:");
-    for (std::pair<double,double> p : m_pointsToVisit) {
-        Debug.AddLine(wxString::Format("Goto: point %f %f", std::get<0>(p), std::get<1>(p)));
-    }
+    m_surveying = true;
+    m_calSolves.clear();
+    m_solveStatus = "Slewing";
+    m_calibrateButton->Disable();
+    m_debugButton->Disable();
+    SlewToCalibrationLocation(0);
+}
 
-    if ( m_pointsToVisit.size() > 0 ) {
-        std::pair<double,double> destination = m_pointsToVisit.back();
-        m_pointsToVisit.pop_back();
-        pMount->HexGoto(std::get<0>(destination), std::get<1>(destination));
-        Debug.AddLine(wxString::Format("Goto accMap: Goto %f %f", std::get<0>(destination), std::get<1>(destination)));
-        sleep(10);
-        pFrame->pGuider->RequestSaveImage();
-    } else {
-        Debug.AddLine("Goto accMap: finished");
-        m_doAccuracyMap = false;
+void GotoDialog::FinishSurvey() {
+    m_calState = CALIBRATION_IDLE;
+    m_surveying = false;
+    m_calibrateButton->Enable();
+    m_debugButton->Enable();
+    UpdateStatusText();
+
+    PointingModel& model = pMount->GetPointingModel();
+    double rawRms, modelRms;
+    model.Residuals(&rawRms, &modelRms);
+    Debug.AddLine(wxString::Format("Goto: pointing survey done, %u observations, rms %.3f deg raw, %.3f deg with model",
+                                   model.Count(), rawRms, modelRms));
+
+    wxString contents = wxString::Format("Pointing survey finished.\n"
+                                         "Pointing error over %u positions: %.2f deg uncorrected, %.2f deg with the pointing model.",
+                                         model.Count(), rawRms, modelRms);
+    wxMessageDialog * alert = new wxMessageDialog(pFrame, contents, wxString::Format("Goto"), wxOK|wxCENTRE, wxDefaultPosition);
+    alert->ShowModal();
+}
+
+// Every solve of a frame taken where the mount was sent is a pointing model observation
+void GotoDialog::RecordSolve(size_t index, const PlateSolveResult& result) {
+    SkyObserver observer = SkyObserver::FromProfile();
+    double alt, az;
+    SkyCalc::EquatorialToHorizontal(result.frameTime, observer, result.ra, result.dec, &alt, &az);
+
+    PointingModel& model = pMount->GetPointingModel();
+    if (model.AddObservation(m_calMount[index].first, m_calMount[index].second, alt, az))
+        model.Save();
+}
+
+void GotoDialog::StartCalibration() {
+    if (m_calState != CALIBRATION_IDLE) {
+        Debug.AddLine("Goto: calibration already in progress");
+        return;
+    }
+    if (m_gotoEngine->IsActive()) {
+        Debug.AddLine("Goto: goto in progress, calibration not started");
         return;
     }
-    */
+
+    m_calLocations.clear();
+    m_calLocations.emplace_back(90.0, 0.0);
+    m_calLocations.emplace_back(80.0, 0.0);
+    m_calLocations.emplace_back(80.0, 90.0);
+    m_calLocations.emplace_back(80.0, 180.0);
+    m_calLocations.emplace_back(80.0, 270.0);
+    m_calLocations.emplace_back(70.0, 270.0);
+    m_calLocations.emplace_back(70.0, 180.0);
+    m_calLocations.emplace_back(70.0, 90.0);
+    m_calLocations.emplace_back(70.0, 0.0);
+
+    m_surveying = false;
+    m_calSolves.clear();
+    m_solveStatus = "Slewing";
+    m_calibrateButton->Disable();
+    m_debugButton->Disable();
+    SlewToCalibrationLocation(0);
 }
 
-bool GotoDialog::Calibrate() {
-    // Create directory if does not exist
-    struct stat info;
-    if( stat( IMAGE_DIRECTORY, &info ) != 0 ) {
-        mkdir(IMAGE_PARENT_DIRECTORY, 0755);
-        mkdir(IMAGE_DIRECTORY, 0755);
-    }
-    double startRa  = 0;
-    double startDec = 0;
-    double startAlt = 0;
-    double startAz  = 0;
-    double astroRotationAngle = 0;
-
-    std::vector<std::tuple<double, double>> calLocations;
-    calLocations.emplace_back(90.0, 0.0);
-    calLocations.emplace_back(80.0, 0.0);
-    calLocations.emplace_back(80.0, 90.0);
-    calLocations.emplace_back(80.0, 180.0);
-    calLocations.emplace_back(80.0, 270.0);
-    calLocations.emplace_back(70.0, 270.0);
-    calLocations.emplace_back(70.0, 180.0);
-    calLocations.emplace_back(70.0, 90.0);
-    calLocations.emplace_back(70.0, 0.0);
-    bool calibrateSuccess = false;
-
-    for (int i = 0; i < calLocations.size(); i++) {
-        Debug.AddLine(wxString::Format("Goto: trying location %f %f", get<0>(calLocations[i]), get<1>(calLocations[i])));
-        pMount->HexGoto(get<0>(calLocations[i]), get<1>(calLocations[i]));
-        sleep(15); // Allow some time for the goto to finish and a clear exposure to happen
-        if ( AstroSolveCurrentLocation(startRa, startDec, astroRotationAngle)) {
-            Destination::EquatorialToHorizontal(startRa, startDec, startAlt, startAz, true);
-            wxString contents = wxString::Format("Astrometry finished! Current location: RA %f, Dec %f\n Alt %f Az %f", startRa, startDec, startAlt, startAz);
-            wxMessageDialog * alert = new wxMessageDialog(pFrame, contents, wxString::Format("Goto"), wxOK|wxCENTRE, wxDefaultPosition);
-            calibrateSuccess = true;
-            //wxMessageDialog * alert = new wxMessageDialog(pFrame, contents, wxString::Format("Goto"), wxOK|wxCENTRE, wxDefaultPosition);
-            alert->ShowModal();
-            break;
+void GotoDialog::SlewToCalibrationLocation(size_t index) {
+    m_calIndex = index;
+    double alt = m_calLocations[index].first;
+    double az  = m_calLocations[index].second;
+    Debug.AddLine(wxString::Format("Goto: trying location %f %f", alt, az));
+    pMount->HexGoto(alt, az);
+    m_calMount.resize(m_calLocations.size());
+    pMount->GetLastGoto(&m_calMount[index].first, &m_calMount[index].second);
+
+    // Wait for the mount to finish the goto before taking a frame
+    m_calSlew.Start();
+    m_calState = CALIBRATION_SETTLING;
+}
+
+void GotoDialog::UpdateCalibration() {
+    switch (m_calState) {
+    case CALIBRATION_SETTLING: {
+        if (!m_calSlew.IsSettled()) {
+            if (m_calSlew.TimedOut()) {
+                Debug.AddLine("Goto: mount did not finish the calibration goto");
+                m_solver->CancelAll();
+                m_calSolves.clear();
+                if (m_surveying)
+                    FinishSurvey();
+                else
+                    FailCalibration();
+            }
+            return;
+        }
+
+        // Wait for a full frame that was started after the mount settled
+        FrameRef frame = GotoEngine::FrameTakenAfter(m_calSlew.SettledAt());
+        if (!frame)
+            return;
+
+        unsigned int id = m_solver->Submit(frame, GotoEngine::SolveHint(*frame, m_calLocations[m_calIndex].first,
+                                                                        m_calLocations[m_calIndex].second));
+        m_calSolves[id] = m_calIndex;
+
+        // Don't wait for the solver, move on to the next location now. If this
+        // frame solves we come back here.
+        if (m_calIndex + 1 < m_calLocations.size()) {
+            SlewToCalibrationLocation(m_calIndex + 1);
         } else {
-            Debug.AddLine(wxString::Format("Goto: failed to calibrate at %f %f", get<0>(calLocations[i]), get<1>(calLocations[i])));                                                          
+            m_calState = CALIBRATION_WAITING;
+        }
+        break;
+    }
+    case CALIBRATION_RETURNING:
+        if (m_calSlew.IsSettled() || m_calSlew.TimedOut())
+            FinishCalibration();
+        break;
+    default:
+        break;
+    }
+}
+
+void GotoDialog::OnSolveProgress(wxThreadEvent& event) {
+    if (m_gotoEngine->HandleSolveProgress(event.GetInt(), event.GetString()))
+        return;
+    if (m_calSolves.find(event.GetInt()) == m_calSolves.end())
+        return;
+    m_solveStatus = event.GetString();
+    UpdateStatusText();
+}
+
+void GotoDialog::OnSolveResult(wxThreadEvent& event) {
+    PlateSolveResult result = event.GetPayload<PlateSolveResult>();
+    if (m_gotoEngine->HandleSolveResult(result))
+        return;
+    std::map<unsigned int, size_t>::iterator it = m_calSolves.find(result.id);
+    if (it == m_calSolves.end())
+        return;
+    size_t index = it->second;
+    m_calSolves.erase(it);
+
+    if (m_calState != CALIBRATION_SETTLING && m_calState != CALIBRATION_WAITING)
+        return;
+
+    if (!result.success) {
+        Debug.AddLine(wxString::Format("Goto: failed to calibrate at %f %f (%s)", m_calLocations[index].first,
+                                       m_calLocations[index].second, result.error));
+        m_solveStatus = "Did not solve";
+        if (m_calState == CALIBRATION_WAITING && m_calSolves.empty()) {
+            if (m_surveying)
+                FinishSurvey();
+            else
+                FailCalibration();
         }
+        return;
+    }
+
+    Debug.AddLine(wxString::Format("Goto: solved location %u in %.1fs: ra %f dec %f rot %f", (unsigned int) index,
+                                   result.elapsed, result.ra, result.dec, result.rotation));
+    RecordSolve(index, result);
+
+    if (m_surveying) {
+        // Keep going; every location is wanted
+        m_solveStatus = "Solved";
+        if (m_calState == CALIBRATION_WAITING && m_calSolves.empty())
+            FinishSurvey();
+        return;
+    }
+
+    // Anything still queued is no longer needed
+    m_solver->CancelAll();
+    m_calSolves.clear();
+    m_calResult = result;
+    m_solveStatus = "Solved";
+
+    if (index == m_calIndex && m_calState == CALIBRATION_WAITING) {
+        // Still where the frame was taken
+        m_calSlew.MarkSettled();
+    } else {
+        m_calIndex = index;
+        pMount->HexGoto(m_calLocations[index].first, m_calLocations[index].second);
+        m_calSlew.Start();
     }
+    m_calState = CALIBRATION_RETURNING;
+}
+
+void GotoDialog::FailCalibration() {
+    m_calState = CALIBRATION_IDLE;
+    m_calibrateButton->Enable();
+    m_debugButton->Enable();
+    UpdateStatusText();
+
+    wxString contents = wxString("Unable to work out position with astrometry!\n"
+                                     "Please check that the image is in focus, lens cap is off, and no clouds are occluding stars.\n"
+                                     "Goto cannot proceed.");
+    wxMessageDialog * alert = new wxMessageDialog(pFrame, contents, wxString::Format("Goto"), wxOK|wxCENTRE, wxDefaultPosition);
+    alert->ShowModal(); 
+}
 
-    if (not calibrateSuccess) {
-        wxString contents = wxString("Unable to work out position with astrometry!\n"
-                                         "Please check that the image is in focus, lens cap is off, and no clouds are occluding stars.\n"
-                                         "Goto cannot proceed.");
-            wxMessageDialog * alert = new wxMessageDialog(pFrame, contents, wxString::Format("Goto"), wxOK|wxCENTRE, wxDefaultPosition);
-        alert->ShowModal(); 
-        return false;   
-    }       
+void GotoDialog::FinishCalibration() {
+    m_calState = CALIBRATION_IDLE;
+    m_calibrateButton->Enable();
+    m_debugButton->Enable();
+
+    // Convert for the time the solved frame was taken, not now
+    SkyObserver observer = SkyObserver::FromProfile();
+    double startRa  = m_calResult.ra;
+    double startDec = m_calResult.dec;
+    double startAlt = 0;
+    double startAz  = 0;
+    double astroRotationAngle = m_calResult.rotation;
+    SkyCalc::EquatorialToHorizontal(m_calResult.frameTime, observer, startRa, startDec, &startAlt, &startAz);
 
     // -- Center of rotation --
     // Determine rotation center of image
@@ -420,10 +564,10 @@ bool GotoDialog::Calibrate() {
 
     // Get rotation center's distance from center of image
     usImage *pImage = pFrame->pGuider->CurrentImage();
-    double height = pImage->Size.GetHeight();
-    double width  = pImage->Size.GetWidth();
-    rotationCenter.X -= pImage->Size.GetWidth() / 2;
-    rotationCenter.Y -= pImage->Size.GetHeight() / 2;
+    if (pImage) {
+        rotationCenter.X -= pImage->Size.GetWidth() / 2;
+        rotationCenter.Y -= pImage->Size.GetHeight() / 2;
+    }
     
     // Convert to degrees, using the known ratio of pixels to degrees of FOV for this camera
     // TODO - use the GetPixelScale method on the camera, rather than relying on knowing the StarShoot Autoguide's ratios
@@ -437,28 +581,25 @@ bool GotoDialog::Calibrate() {
     // -- North celestial pole alt az
     double northCelestialPoleAlt = 0;
     double northCelestialPoleAz  = 0;
-    Destination::EquatorialToHorizontal(0, 90, northCelestialPoleAlt, northCelestialPoleAz, true);
+    SkyCalc::EquatorialToHorizontal(m_calResult.frameTime, observer, 0, 90, &northCelestialPoleAlt, &northCelestialPoleAz);
     
     pMount->HexCalibrate(startAlt, startAz, calDetails.cameraAngle, rotationCenter, astroRotationAngle, northCelestialPoleAlt); // TODO - fill in missing angle
     Debug.AddLine("Goto: Ending onCalibrate");
     calibrated = true;
-    return true;
+    UpdateStatusText();
+
+    wxString contents = wxString::Format("Astrometry finished! Current location: RA %f, Dec %f\n Alt %f Az %f", startRa, startDec, startAlt, startAz);
+    wxMessageDialog * alert = new wxMessageDialog(pFrame, contents, wxString::Format("Goto"), wxOK|wxCENTRE, wxDefaultPosition);
+    alert->ShowModal();
 }
 
 void GotoDialog::OnDebug(wxCommandEvent&) {
-    // Line up some points to visit
-    for (int i = 90; i > 30; i -= 10) {
-        m_pointsToVisit.push_back(std::make_pair(i, 0));
-    }
-    Debug.AddLine(wxString::Format("Goto accMap: Goto 90, 0"));
-    pMount->HexGoto(90, 0);
-    m_solveTriesRemaining = 3;
-    m_doAccuracyMap = true;
+    StartSurvey();
 }
 
 void GotoDialog::OnCalibrate(wxCommandEvent& )
 {
-    Calibrate();   
+    StartCalibration();   
 }
 
 void GotoDialog::OnGoto(wxCommandEvent& )
@@ -486,79 +627,18 @@ void GotoDialog::OnGoto(wxCommandEvent& )
     //                                              wxOK|wxCENTRE, wxDefaultPosition);
     //alert->ShowModal(); 
 
-    gotoInProgress = true;
     Goto();
 }
 
 void GotoDialog::Goto() {
-    destination.CheckForUpdate();
-    pMount->HexGoto(destination.alt, destination.az);
-}
-
-bool GotoDialog::AstroSolveCurrentLocation(double &outRa, double &outDec, double &outAstroRotationAngle) {
-
-    // Run astrometry, identify where we are,
-    // and pipe the textual results from stdin into pos.ra and pos.dec.
-    
-    // The result is to call something like "/usr/local/astrometry/bin/solve-field --overwrite /dev/shm/phd2/goto/guide-image.fits"
-    char inputFilename[200];
-    strcpy(inputFilename, SOLVER_FILENAME);
-    // TODO: Detect arcsecperpix ratio from the first astrometry output, instead of hardcoding it here
-    strcat(inputFilename, " --overwrite --no-plots --scale-low=6 --scale-high=6.5 --scale-units=arcsecperpix --no-fits2fits --fits-image ");
-    strcat(inputFilename, IMAGE_FILENAME);
-    Debug.AddLine(wxString::Format("inputFilename %s", inputFilename));
-
-    // If simulator is being used as the camera, override with test input image
-    // TEMPORARILY DISABLED FOR DEBUGGING
-    //if (dynamic_cast<Camera_SimClass*>(pCamera)) {
-    //    pFrame->Alert(wxString::Format("Since the current camera is the simulator, will use fake test image to determine position."));
-    //    strcpy(inputFilename, "/usr/local/astrometry/bin/solve-field --overwrite --no-plots /usr/local/astrometry/examples/apod2.jpg");    
-    //}
-    
-    wxProgressDialog(wxString::Format("Solving current location..."), wxString::Format("Solving..."), 100, this, wxPD_AUTO_HIDE | wxPD_APP_MODAL | wxPD_ELAPSED_TIME); 
-    
-    string astOutput;
-    FILE *in;
-    char buff[512];
-
-    if(!(in = popen(inputFilename, "r"))){
-        return 1;
-    }
-    while(fgets(buff, sizeof(buff), in)!=NULL){
-        cout << buff;
-        astOutput += buff;
+    if (m_calState != CALIBRATION_IDLE) {
+        Debug.AddLine("Goto: calibration in progress, goto ignored");
+        return;
     }
-    pclose(in);
-
-    // FITS image is no longer needed, can be deleted.
-    //remove(IMAGE_FILENAME);
-
-    unsigned int strLocation = astOutput.find("(RA,Dec)");
-    if ( astOutput.find("(RA,Dec)") == string::npos) {
-        return false; // Astrometry failed to solve
+    if (m_gotoEngine->Start(destination)) {
+        m_calibrateButton->Disable();
+        m_debugButton->Disable();
     }
-    const string line = astOutput.substr(strLocation, strLocation+100);
-    // const string line = "Field center: (RA,Dec) = (104.757911, -3.500760) deg.";
-    
-    regex raReg("\\(-?[[:digit:]]+(\\.[[:digit:]]+)?");
-    regex decReg("-?[[:digit:]]+(\\.[[:digit:]]+)?\\)");
-    smatch raMatch;
-    smatch decMatch;
-    regex_search(line.begin(), line.end(), raMatch, raReg); 
-    regex_search(line.begin(), line.end(), decMatch, decReg);
-    string raResult = raMatch[0];
-    string decResult = decMatch[0];
-    outRa = stod(raResult.substr(1, raResult.size())); // Trim leading bracket
-    outDec = stod(decResult.substr(0, decResult.size()-1)); // Trim ending bracket
-    
-    strLocation = astOutput.find("Field rotation angle");
-    const string line2 = astOutput.substr(strLocation, strLocation+30);
-    regex angleReg("-?[[:digit:]]+\\.?[[:digit:]]+");
-    smatch angleMatch;
-    regex_search(line2.begin(), line2.end(), angleMatch, angleReg);
-    outAstroRotationAngle = stod(angleMatch[0]);
-
-    return true;
 }
 
 int GotoDialog::StringWidth(const wxString& string)
@@ -577,6 +657,7 @@ void GotoDialog::OnClose(wxCommandEvent& event) {
 GotoDialog::~GotoDialog(void)
 {
     m_timer->Stop();
-    pFrame->pGuider->InvalidateSavedImage();
+    delete m_gotoEngine;
+    delete m_solver;
 
 }
@@ -35,8 +35,12 @@
 
 #ifndef GotoDialog_h_included
 #define GotoDialog_h_included
+#include <map>
 #include <unordered_map>
 
+#include "plate_solver.h"
+#include "goto_engine.h"
+
 class GotoDialog :
     public wxDialog
 {
@@ -56,7 +60,6 @@ private:
     std::unordered_map<string,string> m_catalog;
     Destination destination;
 
-    bool gotoInProgress;
     bool calibrated;
 
     wxTimer *m_timer; 
@@ -67,15 +70,44 @@ private:
 
     int prevExposureDuration;
 
-    // Accuracy map
-    std::vector<std::pair<double,double>> m_pointsToVisit;
-    bool m_doAccuracyMap = false;
-    int m_solveTriesRemaining;
+    // Calibration visits each of m_calLocations in turn and solves a frame
+    // taken there. Solves run in the background while the mount moves on to
+    // the next location. A pointing survey does the same over a grid of
+    // locations, keeping every solve for the pointing model.
+    enum CalibrationState
+    {
+        CALIBRATION_IDLE,
+        CALIBRATION_SETTLING,    // slewing to m_calIndex, waiting for a frame taken there
+        CALIBRATION_WAITING,     // every location visited, waiting on the last solves
+        CALIBRATION_RETURNING,   // solved, moving back to where the solved frame was taken
+    };
+
+    PlateSolver *m_solver;
+    GotoEngine *m_gotoEngine;
+    wxString m_gotoStatus;
+    CalibrationState m_calState;
+    std::vector<std::pair<double,double>> m_calLocations;
+    std::vector<std::pair<double,double>> m_calMount;    // each location as sent to the mount
+    bool m_surveying;
+    size_t m_calIndex;
+    SlewMonitor m_calSlew;
+    std::map<unsigned int, size_t> m_calSolves;   // solve id -> location index
+    PlateSolveResult m_calResult;
+    wxString m_solveStatus;
 
     void SetDestination(double ra, double dec);
     int StringWidth(const wxString& string);
-    void AccuracyMap();
-    bool Calibrate();
+    void StartCalibration();
+    void StartSurvey();
+    void FinishSurvey();
+    void RecordSolve(size_t index, const PlateSolveResult& result);
+    void SlewToCalibrationLocation(size_t index);
+    void UpdateCalibration();
+    void FinishCalibration();
+    void FailCalibration();
+    void OnSolveProgress(wxThreadEvent& event);
+    void OnSolveResult(wxThreadEvent& event);
+    void OnGotoEvent(wxThreadEvent& event);
     void OnCalibrate(wxCommandEvent& event);
     void OnDebug(wxCommandEvent& event);
     void OnGoto(wxCommandEvent& event);
@@ -83,7 +115,6 @@ private:
     void OnTimer(wxTimerEvent& event);
     void Goto();
     void OnChangeDestination(wxCommandEvent& event);
-    bool AstroSolveCurrentLocation(double &outRa, double &outDec, double &outAstroRotationAngle);
     void UpdateStatusText(void);
     void UpdateDestinationText(void);
 
@@ -0,0 +1,388 @@
+/*
+ *  goto_engine.cpp
+ *  PHD Guiding
+ *
+ *  Created by Arran Dengate
+ *  Copyright (c) 2017 Arran Dengate
+ *  All rights reserved.
+ *
+ *  This source code is distributed under the following "BSD" license
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *    Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *    Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *    Neither the name of Bret McKee, Dad Dog Development,
+ *     Craig Stark, Stark Labs nor the names of its
+ *     contributors may be used to endorse or promote products derived from
+ *     this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "phd.h"
+#include "goto_engine.h"
+#include "cam_simulator.h"
+#include "snapshot_writer.h"
+
+#include <sys/stat.h>
+
+wxDEFINE_EVENT(GOTO_ENGINE_EVENT, wxThreadEvent);
+
+static const char MOVE_COMPLETE_FILENAME[] = "/dev/shm/phd2/goto/done";
+static const char GotoImageFileName[] = "/dev/shm/phd2/goto/guide-scope-image.fits";
+
+static const int DefaultSettleTimeMs = 15000;      // fixed wait when the mount can't tell us it is done
+static const int DefaultPostSlewSettleMs = 2000;   // after the mount reports the move complete
+static const int DefaultSlewTimeoutMs = 120000;
+static const int DefaultFrameTimeoutMs = 30000;
+static const int DefaultSimulatedSlewMs = 3000;
+static const double DefaultTolerance = 0.25;       // degrees
+static const int DefaultMaxCorrections = 3;
+static const int MaxSolveTries = 3;
+static const double DefaultPixelScale = 6.25;      // arcsec / pixel, StarShoot Autoguider on the hexapod
+static const double DefaultSolveRadius = 15.0;     // degrees, how far an uncalibrated goto may be off
+
+// Whether the legacy controller has touched the done file since t (UTC ms)
+static bool DoneFileTouchedSince(wxLongLong t)
+{
+    struct stat info;
+    if (stat(MOVE_COMPLETE_FILENAME, &info) != 0)
+        return false;
+    return (wxLongLong) info.st_mtime * 1000 >= t - 1000;   // st_mtime has only second resolution
+}
+
+// When the exposure of a frame started, UTC ms
+static wxLongLong FrameStartMs(const usImage& img)
+{
+    return (wxLongLong) img.ImgStartTime * 1000 + img.ImgStartMillis;
+}
+
+// Great circle distance between two alt/az positions, degrees
+static double Separation(double alt1, double az1, double alt2, double az2)
+{
+    double a = sin(radians(alt2 - alt1) / 2.0);
+    double b = sin(radians(az2 - az1) / 2.0);
+    double h = a * a + cos(radians(alt1)) * cos(radians(alt2)) * b * b;
+    return degrees(2.0 * asin(std::min(1.0, sqrt(h))));
+}
+
+SlewMonitor::SlewMonitor(void)
+    : m_start(0),
+      m_arrived(0),
+      m_settled(0)
+{
+}
+
+void SlewMonitor::Start(void)
+{
+    m_start = wxGetUTCTimeMillis();
+    m_arrived = 0;
+    m_settled = 0;
+}
+
+void SlewMonitor::MarkSettled(void)
+{
+    m_start = m_arrived = m_settled = wxGetUTCTimeMillis();
+}
+
+bool SlewMonitor::IsSettled(void)
+{
+    if (m_settled != 0)
+        return true;
+
+    wxLongLong now = wxGetUTCTimeMillis();
+
+    if (m_arrived == 0)
+    {
+        switch (pMount->LastGotoProgress())
+        {
+        case Mount::GOTO_COMPLETE:
+            m_arrived = now;
+            break;
+        case Mount::GOTO_MOVING:
+            return false;
+        case Mount::GOTO_UNTRACKED:
+            if (DoneFileTouchedSince(m_start))
+                m_arrived = now;
+            else if (now >= m_start + pConfig->Profile.GetInt("/goto/SettleTime", DefaultSettleTimeMs))
+                m_arrived = m_settled = now;    // the fixed wait allows for settling
+            break;
+        }
+        if (m_arrived == 0)
+            return false;
+        Debug.AddLine(wxString::Format("Goto: mount arrived after %lld ms", (now - m_start).GetValue()));
+    }
+
+    if (m_settled == 0 && now >= m_arrived + pConfig->Profile.GetInt("/goto/PostSlewSettle", DefaultPostSlewSettleMs))
+        m_settled = now;
+
+    return m_settled != 0;
+}
+
+bool SlewMonitor::TimedOut(void) const
+{
+    return m_settled == 0 &&
+        wxGetUTCTimeMillis() >= m_start + pConfig->Profile.GetInt("/goto/SlewTimeout", DefaultSlewTimeoutMs);
+}
+
+GotoEngine::GotoEngine(wxEvtHandler *owner, PlateSolver *solver)
+    : m_owner(owner),
+      m_solver(solver),
+      m_snapshots(new SnapshotWriter()),
+      m_state(GOTO_IDLE),
+      m_sentAlt(0.0),
+      m_sentAz(0.0),
+      m_solveId(0),
+      m_solveTries(0),
+      m_corrections(0),
+      m_residual(0.0)
+{
+    // Without a mount controller nothing would ever acknowledge a goto, so
+    // stand in for it when simulating
+    bool simulate = pConfig->Profile.GetBoolean("/goto/SimulateMount", false);
+#if defined(SIMULATOR)
+    if (dynamic_cast<Camera_SimClass *>(pCamera))
+        simulate = true;
+#endif
+    if (simulate && MountChannel.Connect() && !MountChannel.ConsumerAttached())
+        m_standIn.Start(pConfig->Profile.GetInt("/goto/SimulatedSlewTime", DefaultSimulatedSlewMs));
+
+    m_timer.SetOwner(this);
+    Bind(wxEVT_TIMER, &GotoEngine::OnTimer, this);
+    m_timer.Start(200);
+}
+
+GotoEngine::~GotoEngine(void)
+{
+    m_timer.Stop();
+    m_standIn.Stop();
+    delete m_snapshots;
+}
+
+bool GotoEngine::IsActive(void) const
+{
+    return m_state == GOTO_SLEWING || m_state == GOTO_EXPOSING || m_state == GOTO_SOLVING;
+}
+
+void GotoEngine::SetState(State state, const wxString& status)
+{
+    m_state = state;
+    Debug.AddLine(wxString::Format("Goto: state %d: %s", state, status));
+
+    wxThreadEvent *event = new wxThreadEvent(GOTO_ENGINE_EVENT);
+    event->SetInt(state);
+    event->SetString(status);
+    wxQueueEvent(m_owner, event);
+}
+
+bool GotoEngine::Start(const Destination& destination)
+{
+    if (IsActive() || !destination.initialised)
+        return false;
+
+    m_destination = destination;
+    m_destination.Update();
+    m_corrections = 0;
+    m_residual = 0.0;
+    m_started = wxGetUTCTimeMillis();
+
+    Debug.AddLine(wxString::Format("Goto: starting goto to %s, alt %f az %f", m_destination.name,
+                                   m_destination.alt, m_destination.az));
+    if (!pMount->HexGoto(m_destination.alt, m_destination.az))
+    {
+        Fail(_("Could not send the goto to the mount"));
+        return false;
+    }
+    pMount->GetLastGoto(&m_sentAlt, &m_sentAz);
+    m_slew.Start();
+    SetState(GOTO_SLEWING, _("Slewing"));
+    return true;
+}
+
+void GotoEngine::SlewTo(double mountAlt, double mountAz)
+{
+    if (!pMount->HexGotoMount(mountAlt, mountAz))
+    {
+        Fail(_("Could not send the goto to the mount"));
+        return;
+    }
+    m_sentAlt = mountAlt;
+    m_sentAz = mountAz;
+    m_slew.Start();
+    SetState(GOTO_SLEWING, wxString::Format(_("Correcting (%d)"), m_corrections));
+}
+
+void GotoEngine::Cancel(void)
+{
+    if (!IsActive())
+        return;
+    if (m_state == GOTO_SOLVING)
+        m_solver->CancelAll();
+    m_solveId = 0;
+    SetState(GOTO_IDLE, _("Goto canceled"));
+}
+
+void GotoEngine::Fail(const wxString& why)
+{
+    m_solveId = 0;
+    SetState(GOTO_FAILED, why);
+}
+
+void GotoEngine::SubmitFrame(void)
+{
+    FrameRef frame = FrameTakenAfter(m_frameAfter);
+    if (!frame)
+    {
+        if (wxGetUTCTimeMillis() >= m_frameAfter + pConfig->Profile.GetInt("/goto/FrameTimeout", DefaultFrameTimeoutMs))
+            Fail(_("No frame to solve, is the camera looping?"));
+        return;
+    }
+
+    m_solveId = m_solver->Submit(frame, SolveHint(*frame, m_sentAlt, m_sentAz));
+    // Publish the frame being solved so it can be checked or re-solved by hand
+    m_snapshots->Submit(frame, GotoImageFileName);
+    // A retry needs a later frame than this one
+    m_frameAfter = FrameStartMs(*frame) + 1;
+    SetState(GOTO_SOLVING, _("Solving"));
+}
+
+void GotoEngine::OnTimer(wxTimerEvent&)
+{
+    m_standIn.Poll();
+
+    switch (m_state)
+    {
+    case GOTO_SLEWING:
+        if (m_slew.IsSettled())
+        {
+            m_solveTries = 0;
+            m_frameAfter = m_slew.SettledAt();
+            SetState(GOTO_EXPOSING, _("Waiting for a frame"));
+        }
+        else if (m_slew.TimedOut())
+        {
+            Fail(_("The mount did not finish the goto"));
+        }
+        break;
+    case GOTO_EXPOSING:
+        SubmitFrame();
+        break;
+    default:
+        break;
+    }
+}
+
+bool GotoEngine::HandleSolveProgress(unsigned int id, const wxString& status)
+{
+    if (m_state != GOTO_SOLVING || id != m_solveId)
+        return false;
+    SetState(GOTO_SOLVING, status);
+    return true;
+}
+
+bool GotoEngine::HandleSolveResult(const PlateSolveResult& result)
+{
+    if (m_state != GOTO_SOLVING || result.id != m_solveId)
+        return false;
+    m_solveId = 0;
+
+    if (!result.success)
+    {
+        Debug.AddLine(wxString::Format("Goto: solve failed (%s)", result.error));
+        if (++m_solveTries < MaxSolveTries)
+            SetState(GOTO_EXPOSING, _("Did not solve, trying another frame"));
+        else
+            Fail(_("Unable to work out the position with astrometry"));
+        return true;
+    }
+
+    SkyObserver observer = SkyObserver::FromProfile();
+    double solvedAlt, solvedAz;
+    SkyCalc::EquatorialToHorizontal(result.frameTime, observer, result.ra, result.dec, &solvedAlt, &solvedAz);
+
+    PointingModel& model = pMount->GetPointingModel();
+    if (model.AddObservation(m_sentAlt, m_sentAz, solvedAlt, solvedAz))
+        model.Save();
+
+    // Compare with where the destination was when the frame was taken
+    double targetAlt, targetAz;
+    if (m_destination.ephemeral)
+    {
+        double ra, dec;
+        SkyCalc::BodyPosition(m_destination.name, result.frameTime, observer, &ra, &dec, &targetAlt, &targetAz);
+    }
+    else
+    {
+        SkyCalc::EquatorialToHorizontal(result.frameTime, observer, m_destination.ra, m_destination.dec,
+                                        &targetAlt, &targetAz);
+    }
+    m_residual = Separation(solvedAlt, solvedAz, targetAlt, targetAz);
+
+    double elapsed = (wxGetUTCTimeMillis() - m_started).ToDouble() / 1000.0;
+    Debug.AddLine(wxString::Format("Goto: solved alt %f az %f, destination alt %f az %f, off by %.3f deg after %.1fs",
+                                   solvedAlt, solvedAz, targetAlt, targetAz, m_residual, elapsed));
+
+    if (m_residual <= pConfig->Profile.GetDouble("/goto/Tolerance", DefaultTolerance))
+    {
+        SetState(GOTO_DONE, wxString::Format(_("Arrived, %.2f deg off, in %.0fs"), m_residual, elapsed));
+        return true;
+    }
+
+    if (m_corrections >= pConfig->Profile.GetInt("/goto/MaxCorrections", DefaultMaxCorrections))
+    {
+        SetState(GOTO_DONE, wxString::Format(_("Stopped after %d corrections, %.2f deg off"), m_corrections, m_residual));
+        return true;
+    }
+
+    // The mount holds alt/az, so it is off by solved - sent wherever it is
+    // sent next. Aim that much the other way from where the destination is now.
+    m_destination.Update();
+    double mountAlt = std::min(90.0, m_sentAlt + (m_destination.alt - solvedAlt));
+    double mountAz = norm(m_sentAz + norm(m_destination.az - solvedAz, -180.0, 180.0), 0.0, 360.0);
+    ++m_corrections;
+    SlewTo(mountAlt, mountAz);
+    return true;
+}
+
+PlateSolveHint GotoEngine::SolveHint(const usImage& img, double alt, double az)
+{
+    PlateSolveHint hint;
+
+    double scale = pFrame->GetCameraPixelScale();
+    if (scale == 1.0)
+        scale = pConfig->Profile.GetDouble("/goto/PixelScale", DefaultPixelScale);
+    hint.scaleLow = scale * 0.96;
+    hint.scaleHigh = scale * 1.04;
+
+    // Where the frame should be if the mount went where it was told
+    hint.hasPosition = true;
+    hint.radius = pConfig->Profile.GetDouble("/goto/SolveRadius", DefaultSolveRadius);
+    SkyCalc::HorizontalToEquatorial(PlateSolver::FrameTime(img), SkyObserver::FromProfile(), alt, az,
+                                    &hint.ra, &hint.dec);
+    return hint;
+}
+
+FrameRef GotoEngine::FrameTakenAfter(wxLongLong utcMs)
+{
+    FrameRef frame = pFrame->pGuider->CurrentFrame();
+    const usImage *pImage = frame.get();
+    if (!pImage || !pImage->ImageData || !pImage->Subframe.IsEmpty())
+        return FrameRef();
+    if (FrameStartMs(*pImage) < utcMs)
+        return FrameRef();
+    return frame;
+}
@@ -0,0 +1,140 @@
+/*
+ *  goto_engine.h
+ *  PHD Guiding
+ *
+ *  Created by Arran Dengate
+ *  Copyright (c) 2017 Arran Dengate
+ *  All rights reserved.
+ *
+ *  This source code is distributed under the following "BSD" license
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *    Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *    Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *    Neither the name of Bret McKee, Dad Dog Development,
+ *     Craig Stark, Stark Labs nor the names of its
+ *     contributors may be used to endorse or promote products derived from
+ *     this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef GOTO_ENGINE_H_INCLUDED
+#define GOTO_ENGINE_H_INCLUDED
+
+#include "plate_solver.h"
+#include "mount_channel.h"
+
+class SnapshotWriter;
+
+// Waits for the mount to finish a goto. Gotos that went through the command
+// ring are done when the controller acknowledges them, plus a short settle.
+// Gotos sent the legacy way are done when the controller touches the "done"
+// file, or failing that after a fixed wait.
+class SlewMonitor
+{
+    wxLongLong m_start;
+    wxLongLong m_arrived;   // 0 until the mount reported the move complete
+    wxLongLong m_settled;   // 0 until settled
+
+public:
+    SlewMonitor(void);
+
+    // Call right after sending the goto
+    void Start(void);
+    // The mount was not moved, so there is nothing to wait for
+    void MarkSettled(void);
+
+    bool IsSettled(void);
+    bool TimedOut(void) const;
+    // When the mount settled (UTC ms); frames started before this are unusable
+    wxLongLong SettledAt(void) const { return m_settled; }
+};
+
+// State changes and status lines of a goto are reported to the owner as
+// GOTO_ENGINE_EVENT, with the GotoEngine::State in GetInt() and the status
+// line in GetString().
+wxDECLARE_EVENT(GOTO_ENGINE_EVENT, wxThreadEvent);
+
+// Closed loop goto. Slews to the destination, waits for the mount to report
+// the move complete, solves a frame taken there and, if the solved position
+// is further from the destination than the tolerance, sends a correction and
+// goes round again. Every solve also feeds the pointing model.
+//
+// Solves go through the owner's plate solver; the owner passes its solver
+// events to HandleSolveProgress/HandleSolveResult.
+class GotoEngine : public wxEvtHandler
+{
+public:
+    enum State
+    {
+        GOTO_IDLE,
+        GOTO_SLEWING,    // waiting for the mount to arrive and settle
+        GOTO_EXPOSING,   // waiting for a frame started after the mount settled
+        GOTO_SOLVING,
+        GOTO_DONE,
+        GOTO_FAILED,
+    };
+
+private:
+    wxEvtHandler *m_owner;
+    PlateSolver *m_solver;
+    SnapshotWriter *m_snapshots;    // publishes each frame we solve
+    wxTimer m_timer;
+    MountControllerStandIn m_standIn;
+
+    State m_state;
+    Destination m_destination;
+    SlewMonitor m_slew;
+    wxLongLong m_frameAfter;    // only solve frames started at or after this (UTC ms)
+    double m_sentAlt;           // last goto as sent to the mount
+    double m_sentAz;
+    unsigned int m_solveId;
+    int m_solveTries;
+    int m_corrections;
+    double m_residual;          // degrees, from the last solve
+    wxLongLong m_started;
+
+    void SetState(State state, const wxString& status);
+    void SlewTo(double mountAlt, double mountAz);
+    void SubmitFrame(void);
+    void Fail(const wxString& why);
+    void OnTimer(wxTimerEvent& evt);
+
+public:
+    GotoEngine(wxEvtHandler *owner, PlateSolver *solver);
+    ~GotoEngine(void);
+
+    bool Start(const Destination& destination);
+    void Cancel(void);
+
+    State GetState(void) const { return m_state; }
+    bool IsActive(void) const;
+    // Distance from the destination found by the last solve, degrees
+    double Residual(void) const { return m_residual; }
+
+    // Return true if the solve was one of ours
+    bool HandleSolveProgress(unsigned int id, const wxString& status);
+    bool HandleSolveResult(const PlateSolveResult& result);
+
+    // Solver hint for a frame taken with the mount sent to alt/az
+    static PlateSolveHint SolveHint(const usImage& img, double alt, double az);
+    // The current frame, if it is a full frame started at or after utcMs
+    static FrameRef FrameTakenAfter(wxLongLong utcMs);
+};
+
+#endif // GOTO_ENGINE_H_INCLUDED
@@ -125,6 +125,7 @@ Guider::Guider(wxWindow *parent, int xSize, int ySize) :
     m_rotationGuideNeeded = 0;
     m_searchRegion = 0;
     m_pCurrentImage = new usImage(); // so we always have one
+    m_frames.Publish(m_pCurrentImage);
 
     SetOverlayMode(DefaultOverlayMode);
 
@@ -151,7 +152,6 @@ Guider::Guider(wxWindow *parent, int xSize, int ySize) :
 Guider::~Guider(void)
 {
     delete m_displayedImage;
-    delete m_pCurrentImage;
 
     s_deflectionLogger.Uninit();
 }
@@ -365,7 +365,8 @@ bool Guider::PaintHelper(wxAutoBufferedPaintDCBase& dc, wxMemoryDC& memDC)
         {
             int blevel = m_pCurrentImage->FiltMin;
             int wlevel = m_pCurrentImage->FiltMax;
-            m_pCurrentImage->CopyToImage(&m_displayedImage, blevel, wlevel, pFrame->Stretch_gamma);
+            m_displayStretch.Set(blevel, wlevel, pFrame->Stretch_gamma);
+            m_pCurrentImage->CopyToImage(&m_displayedImage, m_displayStretch);
         }
 
         int imageWidth   = m_displayedImage->GetWidth();
@@ -1045,43 +1046,14 @@ void Guider::Reset(bool fullReset)
     }
 }
 
-void Guider::RequestSaveImage() 
-{
-    requestSaveImage = true;
-    imageSaved       = false;
-}
-
-void Guider::InvalidateSavedImage()
-{
-    imageSaved       = false;
-    requestSaveImage = false;
-}
-
-bool Guider::IsImageSaved() {
-    return imageSaved;
-}
-
 /*************  A new image is ready ************************/
 
-void Guider::UpdateGuideState(usImage *pImage, bool bStopping)
+void Guider::UpdateGuideState(const FramePtr& frame, bool bStopping)
 {
     wxString statusMessage;
     bool someException = false;
-
-    // If asked, save the image so astrometry can have a look at it.
-
-    if ( requestSaveImage ) {
-        // Also store a timestamp with the image so we later know when it was taken.
-        int ret = system("/usr/local/skyfield/sky.py --store-time");
-        if (WEXITSTATUS(ret) != 0) {
-            Debug.AddLine("Guider: Skyfield threw an error while storing time");
-            throw 20;
-        }
-        wxString fname = "/dev/shm/phd2/goto/guide-scope-image.fits.temp";
-        m_pCurrentImage->Save(fname);
-        rename("/dev/shm/phd2/goto/guide-scope-image.fits.temp", "/dev/shm/phd2/goto/guide-scope-image.fits");
-        imageSaved = true;
-    }
+    bool const newFrame = (bool) frame;
+    usImage *pImage = frame.get();
 
     // If we're not guiding, the guider position initialisation needs to be reset
     if ( not ( GetState() == STATE_GUIDING ) and pFrame->pGuider->m_guidingPositionsInitialised ) {
@@ -1094,11 +1066,11 @@ void Guider::UpdateGuideState(usImage *pImage, bool bStopping)
 
         if (pImage)
         {
-            // switch in the new image
+            // switch in the new image; the previous one goes back to the
+            // frame pool once nothing else holds a reference to it
 
-            usImage *pPrevImage = m_pCurrentImage;
+            m_frames.Publish(frame);
             m_pCurrentImage = pImage;
-            delete pPrevImage;
         }
         else
         {
@@ -1112,7 +1084,8 @@ void Guider::UpdateGuideState(usImage *pImage, bool bStopping)
             throw THROW_INFO("Stopped Guiding");
         }
 
-        assert(!pMount || !pMount->IsBusy());
+        // with overlapping exposures the move from an earlier frame may still be underway
+        assert(!pMount || !pMount->IsBusy() || pFrame->PipelineActive());
 
         // shift lock position
         if (LockPosShiftEnabled() && IsGuiding())
@@ -1357,6 +1330,9 @@ void Guider::UpdateGuideState(usImage *pImage, bool bStopping)
 
     UpdateImageDisplay(pImage);
 
+    if (newFrame)
+        FrameStream.NotifyFrame(CurrentFrame(), pFrame->m_frameCounter, CurrentPosition());
+
     //Debug.AddLine("UpdateGuideState exits: " + statusMessage);
 }
 
@@ -144,6 +144,7 @@ class Guider : public wxWindow
     // Private member data.
 
     wxImage *m_displayedImage;
+    ImageStretch m_displayStretch;
     OVERLAY_MODE m_overlayMode;
     OverlaySlitCoords m_overlaySlitCoords;
     const DefectMap *m_defectMapPreview;
@@ -160,14 +161,13 @@ class Guider : public wxWindow
     double m_avgDistance;         // averaged distance for distance reporting
     bool m_avgDistanceNeedReset;
     GUIDER_STATE m_state;
-    usImage *m_pCurrentImage;
+    usImage *m_pCurrentImage;   // latest frame in m_frames
+    FrameRing m_frames;
     bool m_scaleImage;
     bool m_lockPosIsSticky;
     bool m_fastRecenterEnabled;
     LockPosShiftParams m_lockPosShift;
     bool m_measurementMode;
-    bool requestSaveImage;
-    bool imageSaved;
 
 protected:
     int m_searchRegion; // how far u/d/l/r do we do the initial search for a star
@@ -179,11 +179,7 @@ protected:
 
     // Things related to the Advanced Config Dialog
 public:
-    
-    bool IsImageSaved();
-    void RequestSaveImage();
-    void InvalidateSavedImage();
-    
+
     class GuiderConfigDialogPane : public ConfigDialogPane
     {
         Guider *m_pGuider;
@@ -218,10 +214,9 @@ protected:
 
 public:
     Star m_star; // Primary guiding star
-    std::vector<Star> m_starList; // Secondary stars
+    StarTracker m_starList; // Secondary stars
     bool m_guidingPositionsInitialised;
     double m_rotationGuideNeeded;
-    std::deque<double> m_previousRotationGuides;
 
     bool IsPaused(void) const;
     PauseType GetPauseType(void) const;
@@ -258,7 +253,7 @@ public:
 
     void StartGuiding(void);
     void StopGuiding(void);
-    void UpdateGuideState(usImage *pImage, bool bStopping=false);
+    void UpdateGuideState(const FramePtr& frame, bool bStopping=false);
 
     bool SetScaleImage(bool newScaleValue);
     bool GetScaleImage(void);
@@ -311,6 +306,7 @@ public:
     virtual int StarError(void) = 0;
 
     usImage *CurrentImage(void);
+    FrameRef CurrentFrame(void) const;
     virtual wxImage *DisplayedImage(void);
     virtual double ScaleFactor(void);
 
@@ -384,6 +380,11 @@ inline usImage *Guider::CurrentImage(void)
     return m_pCurrentImage;
 }
 
+inline FrameRef Guider::CurrentFrame(void) const
+{
+    return m_frames.Latest();
+}
+
 inline wxImage *Guider::DisplayedImage(void)
 {
     return m_displayedImage;
@@ -50,7 +50,6 @@
 #endif
 
 static const double DefaultMassChangeThreshold = 0.5;
-const int PREV_STAR_POSITIONS_LENGTH = 20;
 
 enum {
     MIN_SEARCH_REGION = 7,
@@ -99,6 +98,9 @@ void GuiderMultiStar::LoadProfileSettings(void)
 
     int searchRegion = pConfig->Profile.GetInt("/guider/multistar/SearchRegion", DEFAULT_SEARCH_REGION);
     SetSearchRegion(searchRegion);
+
+    m_fieldFit.SetTolerance(pConfig->Profile.GetDouble("/guider/multistar/FieldFitTolerance", m_fieldFit.GetTolerance()));
+    m_rotationFilter.SetDrift(pConfig->Profile.GetDouble("/guider/multistar/RotationDrift", m_rotationFilter.GetDrift()));
 }
 
 bool GuiderMultiStar::GetMassChangeThresholdEnabled(void)
@@ -356,8 +358,9 @@ bool GuiderMultiStar::AutoSelect(void)
         {
             throw ERROR_INFO("Unable to set Lock Position");
         }
-        m_starList.clear(); 
-        newStar.GetStarList(*pImage, edgeAllowance, m_searchRegion, m_starList);
+        std::vector<Star> secondaries;
+        newStar.GetStarList(*pImage, edgeAllowance, m_searchRegion, secondaries);
+        m_starList.Reset(secondaries);
 
         if (GetState() == STATE_SELECTING)
         {
@@ -366,7 +369,7 @@ bool GuiderMultiStar::AutoSelect(void)
             // try to start guiding after selecting the star, but guiding will fail
             // to start if state is still STATE_SELECTING
             Debug.Write(wxString::Format("AutoSelect: state = %d, call UpdateGuideState\n", GetState()));
-            UpdateGuideState(NULL, false);
+            UpdateGuideState(FramePtr(), false);
         }
 
         UpdateImageDisplay();
@@ -386,11 +389,7 @@ bool GuiderMultiStar::AutoSelect(void)
     }
     
     m_originalRotationAngle = RotationAngle();
-    m_previousRotationGuides.clear(); // When starting guiding, clear the array of previous rotation guides.
-    
-    // Have previously been adding some zeroes to the previous rotation guides array to prevent it from lurching suddenly
-    // as guiding begins. There's probably a better way to do this (eg, multiply by a small ramping up value).
-    // m_previousRotationGuides.push_back(0);
+    m_rotationFilter.Reset(); // When starting guiding, forget the previous rotation estimate.
     return bError;
 }
 
@@ -506,9 +505,6 @@ int GuiderMultiStar::StarError(void)
 void GuiderMultiStar::InvalidateCurrentPosition(bool fullReset)
 {
     m_star.Invalidate();
-    for ( Star s : m_starList ) {
-        s.Invalidate();
-    }
 
     if (fullReset)
     {
@@ -587,24 +583,9 @@ bool GuiderMultiStar::UpdateCurrentPosition(usImage *pImage, FrameDroppedInfo *e
     }
 
     // Also update positions for the secondary stars
+    // (all of them in one pass; lost ones are dropped once out of chances)
     if ( m_star.WasFound() ) {
-        std::vector<Star>::iterator s = m_starList.begin(); 
-        while (s != m_starList.end()) {
-            Star newStar(*s);
-            if (!newStar.Find(pImage, m_searchRegion, pFrame->GetStarFindMode())) {
-                s->massChecker.validationChances -= 1;
-                s->massChecker.currentlyValid = false;
-            } else {
-                UpdateStar(*s, newStar); // This will also reset the number of validation chances.
-            }
-
-            if (s->massChecker.validationChances <= 0) {
-                    Debug.Write(wxString::Format("Star: Failed to find secondary star at %f %f, removing from list\n", s->X, s->Y));
-                    m_starList.erase(s);
-            } else {
-                    s++;
-            }        
-        }
+        m_starList.Update(pImage, m_searchRegion, pFrame->GetStarFindMode());
     }
 
     // Star recovery! Keep track of where stars should be, based on initial position and the motion of the other secondaries.
@@ -612,14 +593,13 @@ bool GuiderMultiStar::UpdateCurrentPosition(usImage *pImage, FrameDroppedInfo *e
     if ( ! ( GetState() == STATE_GUIDING ) )  {    
         double calAngleSum   = 0;
         double calAngleCount = 0;
-        for (Star &s : m_starList ) {
-            if ( s.massChecker.currentlyValid and s != m_star) {
-                double currentAngle  = degrees(s.Angle(m_star));
-                double originalAngle = s.preCalAngle;
+        for (unsigned int i = 0; i < m_starList.Count(); i++) {
+            if ( m_starList.IsValid(i) && !IsPrimary(i) ) {
+                double currentAngle  = degrees(m_starList.Position(i).Angle(m_star));
+                double originalAngle = m_starList.preCalAngle[i];
                 double angleDiff     = currentAngle - originalAngle;
                 if (angleDiff >  180) angleDiff -= 360;
                 if (angleDiff < -180) angleDiff += 360;
-                double distance = s.Distance(PHD_Point(LockPosition().X, LockPosition().Y));
                 calAngleSum    += angleDiff;
                 calAngleCount ++;
             }
@@ -629,94 +609,67 @@ bool GuiderMultiStar::UpdateCurrentPosition(usImage *pImage, FrameDroppedInfo *e
         //Debug.AddLine(wxString::Format("Guider: cal avg %f", calAngleSum));
         
         // Now find the lost ones, using this info
-        for ( Star &s : m_starList ) {
-            if ( s != m_star && ! s.massChecker.currentlyValid ) {
-                double expectedAngle = s.preCalAngle + calAngleSum;
+        m_lostStars.clear();
+        m_lostExpected.clear();
+        for (unsigned int i = 0; i < m_starList.Count(); i++) {
+            if ( !IsPrimary(i) && !m_starList.IsValid(i) ) {
+                double expectedAngle = m_starList.preCalAngle[i] + calAngleSum;
                 if ( expectedAngle >  360 ) expectedAngle -= 360;
                 if ( expectedAngle < -360 ) expectedAngle += 360;
-                s.lastAngleDiff = expectedAngle;
-                double expectedX = m_star.X + (s.preCalDistance * cos(radians(expectedAngle)));
-                double expectedY = m_star.Y + (s.preCalDistance * sin(radians(expectedAngle)));
-                
-                Star newStar(s);
-                //Debug.AddLine(wxString::Format("Guider: lost star last seen %f %f, searching at %f %f.", s.X, s.Y, expectedX, expectedY));
-                s.lastExpectedPos.SetXY(expectedX, expectedY); 
-                if ( newStar.Find(pImage, m_searchRegion, expectedX, expectedY, pFrame->GetStarFindMode())) {
-                    //Debug.AddLine(wxString::Format("Guider: Recovered star at %f, %f", expectedX, expectedY));
-                    UpdateStar(s, newStar);
-                    //s.X = expectedX;
-                    //s.Y = expectedY;
-                }
-                //Debug.AddLine(wxString::Format("Guider: s.preCalDistance %f s.preCalAngle %f, expected X %f Y %f", s.preCalDistance, s.preCalAngle, expectedX, expectedY));
+                m_starList.lastAngleDiff[i] = expectedAngle;
+                double expectedX = m_star.X + (m_starList.preCalDistance[i] * cos(radians(expectedAngle)));
+                double expectedY = m_star.Y + (m_starList.preCalDistance[i] * sin(radians(expectedAngle)));
+                m_lostStars.push_back(i);
+                m_lostExpected.push_back(PHD_Point(expectedX, expectedY));
             }
         }
+        if ( !m_lostStars.empty() ) {
+            m_starList.Recover(pImage, m_searchRegion, pFrame->GetStarFindMode(), m_lostStars, m_lostExpected);
+        }
     }
 
+    // No rotation is sent unless this frame's field fit succeeds: with fewer
+    // than three usable stars the last estimate would otherwise go out with
+    // every move
+    m_rotationGuideNeeded = 0.0;
+
     if ( GetState() == STATE_GUIDING ) {
         if ( ! m_guidingPositionsInitialised ) {
-            for ( Star &s : m_starList ) {
-            s.guidingStartPos = PHD_Point(s.X, s.Y);
+            for (unsigned int i = 0; i < m_starList.Count(); i++) {
+                m_starList.guidingStartPos[i] = m_starList.Position(i);
             }
+            m_fieldFit.Reset();
+            m_rotationFilter.Reset();
         }
         m_guidingPositionsInitialised = true;    
         
-        // Calculate angle difference for tracking. Uses weighted average (stars further away from center have relatively less jitter.)
-        double angleSum   = 0;
-        double angleCount = 0;
-        for (Star &s : m_starList ) {
-            if ( s.massChecker.currentlyValid and s != m_star) {
-                double currentAngle  = degrees(s.Angle(m_star));
-                double originalAngle = degrees(s.guidingStartPos.Angle(PHD_Point(LockPosition().X, LockPosition().Y)));
-                double angleDiff     = currentAngle - originalAngle;
-                if (angleDiff >  180) angleDiff -= 360;
-                if (angleDiff < -180) angleDiff += 360;
-                double distance = s.Distance(PHD_Point(LockPosition().X, LockPosition().Y));
-                s.lastAngleDiff = angleDiff;
-                angleSum   += angleDiff;
-                angleCount ++;
+        // Fit the motion of the whole field since guiding started, rather than the angles of the
+        // stars about the primary, so jitter of the primary no longer shows up as rotation. Each
+        // star is weighted by SNR squared, as its centroid error goes as 1/SNR.
+        m_fieldFit.Clear();
+        for (unsigned int i = 0; i < m_starList.Count(); i++) {
+            if ( m_starList.IsValid(i) ) {
+                double snr = std::max(m_starList.SNR[i], 1.0);
+                m_fieldFit.Add(m_starList.guidingStartPos[i], m_starList.Position(i), snr * snr);
             }
         }
-        if ( angleCount > 0) {
-            angleSum /= angleCount;
-            m_previousRotationGuides.push_front(angleSum * -1);
-        }
-        double rotationSum = 0;
-        for (double d : m_previousRotationGuides) {
-            rotationSum += d;
-        }
-        double rotationAverage = rotationSum / m_previousRotationGuides.size();
 
-        // The array of previous rotation guides is maintained at a maximum size.
-        if (m_previousRotationGuides.size() > 300) m_previousRotationGuides.pop_back();
-        
-        // Currently trying a thing where raw input is used for the first few guides, to collect some data before
-        // we start using averages. This seems to speed up the settling process to ~30 seconds. 
-        if (m_previousRotationGuides.size() < 10) {
-            m_rotationGuideNeeded = angleSum * -1;
-        } else {
-            m_rotationGuideNeeded = rotationAverage;    
+        FieldTransform motion;
+        if ( m_fieldFit.Solve(&motion) ) {
+            m_rotationGuideNeeded = m_rotationFilter.Update(motion.rotation * -1, motion.cov[2][2]);
+
+            Debug.AddLine(wxString::Format("Guider: field dx %.3f dy %.3f rotation %.4f +/- %.4f scale %.5f rms %.3f, %u of %u stars",
+                motion.dx, motion.dy, motion.rotation, sqrt(motion.cov[2][2]), motion.scale, motion.rms,
+                motion.inliers, m_fieldFit.Count()));
+            Debug.AddLine(wxString::Format("Guider: Naive %f\t algo %f", motion.rotation * -1, m_rotationGuideNeeded));
         }
-        
-        Debug.AddLine(wxString::Format("Guider: Naive %f\t algo %f", angleSum * -1, m_rotationGuideNeeded));
-        Debug.AddLine(wxString::Format("Guider: Number of secondary stars %d", angleSum));
     }
     return bError;
 }
 
-void GuiderMultiStar::UpdateStar(Star &s, Star &newStar) {
-    s.prevPositions.push_front(PHD_Point(s.X, s.Y));
-    s.X       = newStar.X;
-    s.Y       = newStar.Y;
-    s.Mass    = newStar.Mass;
-    s.SNR     = newStar.SNR;
-    s.HFD     = newStar.HFD;
-    s.PeakVal = newStar.PeakVal;
-    s.massChecker.AppendData(newStar.Mass);
-    s.massChecker.validationChances = 14;
-    s.massChecker.currentlyValid = true;  
-    if (s.prevPositions.size() > PREV_STAR_POSITIONS_LENGTH) {
-        s.prevPositions.pop_back(); // Only keep the most recent
-    }
+bool GuiderMultiStar::IsPrimary(unsigned int i) const
+{
+    return m_starList.X[i] == m_star.X && m_starList.Y[i] == m_star.Y;
 }
 
 bool GuiderMultiStar::IsValidLockPosition(const PHD_Point& pt)
@@ -849,28 +802,7 @@ void GuiderMultiStar::OnPaint(wxPaintEvent& event)
         #endif
 
 
-        /* TODO: File streaming to web interface.
-         * Commented out because not currently using.
-         * File is repeatedly overwritten to create a video stream.
-         
-        const char TEMP_VIDEO_FILE_PATH[] = "/dev/shm/phd2/video_file_temp.jpg";
-        const char VIDEO_FILE_PATH[]      = "/dev/shm/phd2/video_file.jpg";
-        const char VIDEO_DIRECTORY[]      = "/dev/shm/phd2/";
-        mkdir(VIDEO_DIRECTORY, 0755);
-        wxString fname = TEMP_VIDEO_FILE_PATH;
-        //wxImage subImg = SubBmp.ConvertToImage();
-        wxImage* subImg = pFrame->pGuider->DisplayedImage();
-        // subImg.Rescale(120, 120);  zoom up (not now)
-        if (pFrame->GetLoggedImageFormat() == LIF_HI_Q_JPEG)
-        {
-            // set high(ish) JPEG quality
-            subImg->SetOption(wxIMAGE_OPTION_QUALITY, 100);
-        }
-
-        subImg->SaveFile(fname, wxBITMAP_TYPE_JPEG);
-        rename(TEMP_VIDEO_FILE_PATH, VIDEO_FILE_PATH);
-            
-        */
+        // Remote displays get frames from the frame stream server (frame_stream.h)
 
         GUIDER_STATE state = GetState();
         bool FoundStar = m_star.WasFound();
@@ -881,10 +813,11 @@ void GuiderMultiStar::OnPaint(wxPaintEvent& event)
             
             dc.SetPen(wxPen(wxColour(0,0,0), 1, wxSOLID));
             dc.DrawCircle(m_rotationCenter.X * m_scaleFactor, m_rotationCenter.Y *m_scaleFactor + m_yOffset, 5);
-            for (Star s : m_starList) 
+            for (unsigned int i = 0; i < m_starList.Count(); i++)
             {   
+                PHD_Point s = m_starList.Position(i);
                 if ( s.X > m_star.X + border || s.X < m_star.X - border || s.Y > m_star.Y + border || s.Y < m_star.Y - border) {
-                    if ( s.massChecker.currentlyValid ) {
+                    if ( m_starList.IsValid(i) ) {
                         // Draw light boxes if valid
                         dc.SetPen(wxPen(wxColour(200,40,40), 1, wxSOLID));    
                     } else {
@@ -900,7 +833,8 @@ void GuiderMultiStar::OnPaint(wxPaintEvent& event)
                 {
                     PHD_Point prevPoint(s.X, s.Y);
                     dc.SetPen(wxPen(wxColour(233,228,24), 1, wxSOLID));
-                    for (PHD_Point p : s.prevPositions) {
+                    for (unsigned int age = 0; age < m_starList.TrailLength(i); age++) {
+                        const PHD_Point& p = m_starList.TrailPoint(i, age);
                         dc.DrawLine(wxPoint(prevPoint.X * m_scaleFactor, prevPoint.Y * m_scaleFactor + m_yOffset), 
                                     wxPoint(p.X         * m_scaleFactor, p.Y         * m_scaleFactor + m_yOffset));
                         prevPoint = p;
@@ -908,20 +842,18 @@ void GuiderMultiStar::OnPaint(wxPaintEvent& event)
                 }
 
                 // Also show when star recovery is being attempted
-                if ( s != m_star and ! s.massChecker.currentlyValid and GetState() == STATE_CALIBRATING_PRIMARY ) {
+                if ( !IsPrimary(i) && !m_starList.IsValid(i) && GetState() == STATE_CALIBRATING_PRIMARY ) {
                     
                     // Boxes
-                    Star tempStar;
-                    tempStar.SetXY(s.lastExpectedPos.X, s.lastExpectedPos.Y);
                     dc.SetPen(wxPen(wxColour(250,127,227), 1, wxSOLID));    
-                    DrawBox(dc, tempStar, m_searchRegion, m_scaleFactor, 0, m_yOffset);    
+                    DrawBox(dc, m_starList.lastExpectedPos[i], m_searchRegion, m_scaleFactor, 0, m_yOffset);    
                 }
 
                 // Debugging info (text labels under stars showing angle diff)
                 /*
-                if ( GetState() == STATE_GUIDING and s != m_star ) {
+                if ( GetState() == STATE_GUIDING and !IsPrimary(i) ) {
                     //Place text near stars
-                    wxString strAngle = wxString::Format(wxT("%.3f"),s.lastAngleDiff);
+                    wxString strAngle = wxString::Format(wxT("%.3f"),m_starList.lastAngleDiff[i]);
                     wxColour original = dc.GetTextForeground();
                     dc.SetTextForeground(wxColour(255, 255, 255));
                     dc.DrawText(strAngle, s.X * m_scaleFactor + 10, s.Y * m_scaleFactor + m_yOffset + 10);
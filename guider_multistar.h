@@ -74,6 +74,14 @@ private:
     double m_originalRotationAngle;
     PHD_Point m_rotationCenter;
 
+    // secondary stars being searched for, reused each frame
+    std::vector<unsigned int> m_lostStars;
+    std::vector<PHD_Point> m_lostExpected;
+
+    // field rotation while guiding
+    FieldTransformEstimator m_fieldFit;
+    RotationFilter m_rotationFilter;
+
     wxImage m_arrowImg;
     wxImage m_arrowImgClicked;
     wxImage m_curveArrowImg;
@@ -148,7 +156,7 @@ private:
     void InvalidateCurrentPosition(bool fullReset = false);
     bool UpdateCurrentPosition(usImage *pImage, FrameDroppedInfo *errorInfo);
     bool SetCurrentPosition(usImage *pImage, const PHD_Point& position);
-    void UpdateStar(Star &s, Star &newStar);
+    bool IsPrimary(unsigned int i) const;
 
     void OnLeftMouseDown(wxMouseEvent& evt);
     void OnLeftMouseUp(wxMouseEvent& evt);
@@ -422,7 +422,7 @@ bool GuiderOneStar::AutoSelect(void)
             // try to start guiding after selecting the star, but guiding will fail
             // to start if state is still STATE_SELECTING
             Debug.Write(wxString::Format("AutoSelect: state = %d, call UpdateGuideState\n", GetState()));
-            UpdateGuideState(NULL, false);
+            UpdateGuideState(FramePtr(), false);
         }
 
         UpdateImageDisplay();
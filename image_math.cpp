@@ -38,8 +38,13 @@
 #include <wx/wfstream.h>
 #include <wx/txtstrm.h>
 #include <wx/tokenzr.h>
+#include <wx/filename.h>
 
 #include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
 
 int dbl_sort_func (double *first, double *second)
 {
@@ -76,10 +81,118 @@ double CalcSlope(const ArrayOfDbl& y)
     return (n * s_xy - (s_x * s_y)) / (n * s_xx - (s_x * s_x));
 }
 
+// Worker threads for ParallelRowBands. They are started on first use and kept
+// for the life of the process, so a frame does not pay for creating and
+// joining a thread per band. The pool is never destroyed: the workers are
+// detached and left waiting when the process exits.
+class RowBandPool
+{
+    std::mutex m_lock;
+    std::condition_variable m_wake;
+    std::condition_variable m_done;
+    std::atomic<bool> m_busy;
+    unsigned int m_generation;
+    const std::function<void(int, int)> *m_fn;
+    int m_rows;
+    int m_bands;
+    int m_next;
+    int m_pending;
+
+    // claim bands of the current job until none are left; called with m_lock held
+    void RunBands(std::unique_lock<std::mutex>& lock)
+    {
+        while (m_next < m_bands)
+        {
+            int band = m_next++;
+            const std::function<void(int, int)>& fn = *m_fn;
+            int begin = m_rows * band / m_bands;
+            int end = m_rows * (band + 1) / m_bands;
+
+            lock.unlock();
+            fn(begin, end);
+            lock.lock();
+
+            if (--m_pending == 0)
+                m_done.notify_one();
+        }
+    }
+
+    void Worker()
+    {
+        std::unique_lock<std::mutex> lock(m_lock);
+        unsigned int seen = m_generation;
+        for (;;)
+        {
+            while (m_generation == seen)
+                m_wake.wait(lock);
+            seen = m_generation;
+            RunBands(lock);
+        }
+    }
+
+public:
+
+    RowBandPool(int workers)
+        : m_busy(false), m_generation(0), m_fn(0), m_rows(0), m_bands(0), m_next(0), m_pending(0)
+    {
+        for (int i = 0; i < workers; i++)
+            std::thread(&RowBandPool::Worker, this).detach();
+    }
+
+    // Runs the bands on the workers and the calling thread. Returns true
+    // without running anything if the pool is already running a job, as
+    // when two threads process frames at once or fn itself uses the pool.
+    bool Run(int rows, int bands, const std::function<void(int, int)>& fn)
+    {
+        if (m_busy.exchange(true))
+            return true;
+
+        std::unique_lock<std::mutex> lock(m_lock);
+        m_fn = &fn;
+        m_rows = rows;
+        m_bands = bands;
+        m_next = 0;
+        m_pending = bands;
+        ++m_generation;
+        m_wake.notify_all();
+
+        RunBands(lock);
+        while (m_pending > 0)
+            m_done.wait(lock);
+        m_fn = 0;
+        lock.unlock();
+
+        m_busy = false;
+        return false;
+    }
+};
+
+void ParallelRowBands(int rows, int minBandRows, const std::function<void(int, int)>& fn)
+{
+    static const int cpus = std::max(1, (int) std::thread::hardware_concurrency());
+    int bands = std::max(1, std::min(cpus, rows / std::max(1, minBandRows)));
+
+    if (bands > 1)
+    {
+        static RowBandPool *pool = new RowBandPool(cpus - 1);
+        if (!pool->Run(rows, bands, fn))
+            return;
+    }
+
+    fn(0, rows);
+}
+
 bool QuickLRecon(usImage& img)
 {
-    // Does a simple debayer of luminance data only -- sliding 2x2 window
     usImage tmp;
+    return QuickLRecon(img, tmp);
+}
+
+// tmp receives the original pixels, so passing the same scratch image for
+// every frame lets the two buffers take turns without reallocating
+bool QuickLRecon(usImage& img, usImage& tmp)
+{
+    // Does a simple debayer of luminance data only -- sliding 2x2 window
     if (tmp.Init(img.Size))
     {
         pFrame->Alert(_("Memory allocation error"));
@@ -150,6 +263,11 @@ bool QuickLRecon(usImage& img)
 bool Median3(usImage& img)
 {
     usImage tmp;
+    return Median3(img, tmp);
+}
+
+bool Median3(usImage& img, usImage& tmp)
+{
     tmp.Init(img.Size);
 
     bool err;
@@ -316,7 +434,21 @@ inline static unsigned short median3(const unsigned short l[3])
     return l0;
 }
 
-bool Median3(unsigned short *dst, const unsigned short *src, const wxSize& size, const wxRect& rect)
+inline static unsigned short median(const unsigned short *l, int n)
+{
+    switch (n)
+    {
+    case 9: return median9(l);
+    case 6: return median6(l);
+    default: return median4(l);
+    }
+}
+
+// 3x3 median filter of rows [rowBegin, rowEnd) of rect. For each pixel the n
+// neighbours are passed to out(index, a, n), where index is the pixel's
+// offset in src; out decides whether it needs the median.
+template <class Out>
+static void Median3Filter(const unsigned short *src, const wxSize& size, const wxRect& rect, int rowBegin, int rowEnd, Out& out)
 {
     int const W = size.GetWidth();
     int const RX = rect.GetX();
@@ -325,42 +457,45 @@ bool Median3(unsigned short *dst, const unsigned short *src, const wxSize& size,
     int const RH = rect.GetHeight();
 
     unsigned short a[9];
-    unsigned short *d;
+    int d;
 
 #define IX(x_, y_) ((RY + (y_)) * W + RX + (x_))
 
-    // top row
-    d = &dst[IX(0, 0)];
+    if (rowBegin == 0)
+    {
+        // top row
+        d = IX(0, 0);
 
-    // top-left corner
-    a[0] = src[IX(0, 0)];
-    a[1] = src[IX(1, 0)];
-    a[2] = src[IX(0, 1)];
-    a[3] = src[IX(1, 1)];
-    *d++ = median4(a);
+        // top-left corner
+        a[0] = src[IX(0, 0)];
+        a[1] = src[IX(1, 0)];
+        a[2] = src[IX(0, 1)];
+        a[3] = src[IX(1, 1)];
+        out(d++, a, 4);
 
-    // top row middle pixels
-    for (int x = 1; x <= RW - 2; x++)
-    {
-        a[0] = src[IX(x - 1, 0)];
-        a[1] = src[IX(x,     0)];
-        a[2] = src[IX(x + 1, 0)];
-        a[3] = src[IX(x - 1, 1)];
-        a[4] = src[IX(x,     1)];
-        a[5] = src[IX(x + 1, 1)];
-        *d++ = median6(a);
-    }
+        // top row middle pixels
+        for (int x = 1; x <= RW - 2; x++)
+        {
+            a[0] = src[IX(x - 1, 0)];
+            a[1] = src[IX(x,     0)];
+            a[2] = src[IX(x + 1, 0)];
+            a[3] = src[IX(x - 1, 1)];
+            a[4] = src[IX(x,     1)];
+            a[5] = src[IX(x + 1, 1)];
+            out(d++, a, 6);
+        }
 
-    // top-right corner
-    a[0] = src[IX(RW - 2, 0)];
-    a[1] = src[IX(RW - 1, 0)];
-    a[2] = src[IX(RW - 2, 1)];
-    a[3] = src[IX(RW - 1, 1)];
-    *d = median4(a);
+        // top-right corner
+        a[0] = src[IX(RW - 2, 0)];
+        a[1] = src[IX(RW - 1, 0)];
+        a[2] = src[IX(RW - 2, 1)];
+        a[3] = src[IX(RW - 1, 1)];
+        out(d, a, 4);
+    }
 
-    for (int y = 1; y <= RH - 2; y++)
+    for (int y = std::max(1, rowBegin); y <= std::min(RH - 2, rowEnd - 1); y++)
     {
-        d = &dst[IX(0, y)];
+        d = IX(0, y);
 
         // leftmost pixel
         a[0] = src[IX(0, y - 1)];
@@ -369,7 +504,7 @@ bool Median3(unsigned short *dst, const unsigned short *src, const wxSize& size,
         a[3] = src[IX(1, y    )];
         a[4] = src[IX(0, y + 1)];
         a[5] = src[IX(1, y + 1)];
-        *d++ = median6(a);
+        out(d++, a, 6);
 
         for (int x = 1; x <= RW - 2; x++)
         {
@@ -382,7 +517,7 @@ bool Median3(unsigned short *dst, const unsigned short *src, const wxSize& size,
             a[6] = src[IX(x - 1, y + 1)];
             a[7] = src[IX(x    , y + 1)];
             a[8] = src[IX(x + 1, y + 1)];
-            *d++ = median9(a);
+            out(d++, a, 9);
         }
 
         // rightmost pixel
@@ -392,43 +527,123 @@ bool Median3(unsigned short *dst, const unsigned short *src, const wxSize& size,
         a[3] = src[IX(RW - 1, y    )];
         a[4] = src[IX(RW - 2, y + 1)];
         a[5] = src[IX(RW - 1, y + 1)];
-        *d++ = median6(a);
+        out(d++, a, 6);
     }
 
-    // bottom row
-    d = &dst[IX(0, RH - 1)];
+    if (rowEnd == RH)
+    {
+        // bottom row
+        d = IX(0, RH - 1);
 
-    // bottom-left corner
-    a[0] = src[IX(0, RH - 2)];
-    a[1] = src[IX(1, RH - 2)];
-    a[2] = src[IX(0, RH - 1)];
-    a[3] = src[IX(1, RH - 1)];
-    *d++ = median4(a);
+        // bottom-left corner
+        a[0] = src[IX(0, RH - 2)];
+        a[1] = src[IX(1, RH - 2)];
+        a[2] = src[IX(0, RH - 1)];
+        a[3] = src[IX(1, RH - 1)];
+        out(d++, a, 4);
 
-    // bottom row middle pixels
-    for (int x = 1; x <= RW - 2; x++)
-    {
-        a[0] = src[IX(x - 1, RH - 2)];
-        a[1] = src[IX(x    , RH - 2)];
-        a[2] = src[IX(x + 1, RH - 2)];
-        a[3] = src[IX(x - 1, RH - 1)];
-        a[4] = src[IX(x    , RH - 1)];
-        a[5] = src[IX(x + 1, RH - 1)];
-        *d++ = median6(a);
-    }
+        // bottom row middle pixels
+        for (int x = 1; x <= RW - 2; x++)
+        {
+            a[0] = src[IX(x - 1, RH - 2)];
+            a[1] = src[IX(x    , RH - 2)];
+            a[2] = src[IX(x + 1, RH - 2)];
+            a[3] = src[IX(x - 1, RH - 1)];
+            a[4] = src[IX(x    , RH - 1)];
+            a[5] = src[IX(x + 1, RH - 1)];
+            out(d++, a, 6);
+        }
 
-    // bottom-right corner
-    a[0] = src[IX(RW - 2, RH - 2)];
-    a[1] = src[IX(RW - 1, RH - 2)];
-    a[2] = src[IX(RW - 2, RH - 1)];
-    a[3] = src[IX(RW - 1, RH - 1)];
-    *d = median4(a);
+        // bottom-right corner
+        a[0] = src[IX(RW - 2, RH - 2)];
+        a[1] = src[IX(RW - 1, RH - 2)];
+        a[2] = src[IX(RW - 2, RH - 1)];
+        a[3] = src[IX(RW - 1, RH - 1)];
+        out(d, a, 4);
+    }
 
 #undef IX
+}
+
+struct Median3Writer
+{
+    unsigned short *dst;
+    void operator()(int index, const unsigned short *a, int n) { dst[index] = median(a, n); }
+};
 
+bool Median3(unsigned short *dst, const unsigned short *src, const wxSize& size, const wxRect& rect)
+{
+    Median3Writer out = { dst };
+    Median3Filter(src, size, rect, 0, rect.GetHeight(), out);
     return false;
 }
 
+struct MinMaxAccumulator
+{
+    unsigned short min;
+    unsigned short max;
+    MinMaxAccumulator() : min(65535), max(0) { }
+
+    // The median can only be outside [min, max] if at least half of the
+    // neighbours are, which is cheap to check and rarely true
+    void operator()(int, const unsigned short *a, int n)
+    {
+        int above = 0, below = 0;
+        for (int i = 0; i < n; i++)
+        {
+            above += a[i] > max;
+            below += a[i] < min;
+        }
+        if (2 * above >= n || 2 * below >= n)
+        {
+            unsigned short val = median(a, n);
+            min = std::min(min, val);
+            max = std::max(max, val);
+        }
+    }
+};
+
+void ImageMinMax(const usImage& img, const wxRect& rect, int *min, int *max, int *filtMin, int *filtMax)
+{
+    int const W = img.Size.GetWidth();
+    bool const filter = rect.GetWidth() >= 2 && rect.GetHeight() >= 2;
+    wxCriticalSection lock;
+    MinMaxAccumulator raw, filtered;
+
+    // One sweep over the rows; the median filter is only reduced, never stored
+    ParallelRowBands(rect.GetHeight(), 128, [&](int rowBegin, int rowEnd) {
+        MinMaxAccumulator bandRaw, bandFiltered;
+        for (int y = rowBegin; y < rowEnd; y++)
+        {
+            const unsigned short *p = img.ImageData + (rect.GetTop() + y) * W + rect.GetLeft();
+            unsigned short lo = bandRaw.min, hi = bandRaw.max;
+            for (int x = 0; x < rect.GetWidth(); x++)
+            {
+                lo = std::min(lo, p[x]);
+                hi = std::max(hi, p[x]);
+            }
+            bandRaw.min = lo;
+            bandRaw.max = hi;
+        }
+        if (filter)
+            Median3Filter(img.ImageData, img.Size, rect, rowBegin, rowEnd, bandFiltered);
+
+        wxCriticalSectionLocker lck(lock);
+        raw.min = std::min(raw.min, bandRaw.min);
+        raw.max = std::max(raw.max, bandRaw.max);
+        filtered.min = std::min(filtered.min, bandFiltered.min);
+        filtered.max = std::max(filtered.max, bandFiltered.max);
+    });
+
+    if (!filter)
+        filtered = raw;
+
+    *min = raw.min;
+    *max = raw.max;
+    *filtMin = filtered.min;
+    *filtMax = filtered.max;
+}
+
 static unsigned short MedianBorderingPixels(const usImage& img, int x, int y)
 {
     unsigned short array[8];
@@ -592,23 +807,25 @@ bool Subtract(usImage& light, const usImage& dark)
         height = light.Size.GetHeight();
     }
 
+    unsigned int const W = light.Size.GetWidth();
+    wxCriticalSection lock;
     int mindiff = 65535;
 
-    unsigned short *pl0 = &light.Pixel(left, top);
-    const unsigned short *pd0 = &dark.Pixel(left, top);
-    for (unsigned int r = 0; r < height;
-         r++, pl0 += light.Size.GetWidth(), pd0 += light.Size.GetWidth())
-    {
-        unsigned short *const endl = pl0 + width;
-        unsigned short *pl;
-        const unsigned short *pd;
-        for (pl = pl0, pd = pd0; pl < endl; pl++, pd++)
+    // The pedestal has to be known before anything is subtracted, so this
+    // takes two passes, each a straight loop over a band of rows that the
+    // compiler can vectorize
+    ParallelRowBands(height, 128, [&](int rowBegin, int rowEnd) {
+        int bandMin = 65535;
+        for (int r = rowBegin; r < rowEnd; r++)
         {
-            int diff = (int) *pl - (int) *pd;
-            if (diff < mindiff)
-                mindiff = diff;
+            const unsigned short *pl = &light.Pixel(left, top + r);
+            const unsigned short *pd = &dark.Pixel(left, top + r);
+            for (unsigned int x = 0; x < width; x++)
+                bandMin = std::min(bandMin, (int) pl[x] - (int) pd[x]);
         }
-    }
+        wxCriticalSectionLocker lck(lock);
+        mindiff = std::min(mindiff, bandMin);
+    });
 
     int offset = 0;
     if (mindiff < 0) // dark was lighter than light
@@ -617,173 +834,308 @@ bool Subtract(usImage& light, const usImage& dark)
         light.Pedestal = (unsigned short) offset;
     }
 
-    pl0 = &light.Pixel(left, top);
-    pd0 = &dark.Pixel(left, top);
-    for (unsigned int r = 0; r < height;
-         r++, pl0 += light.Size.GetWidth(), pd0 += light.Size.GetWidth())
+    ParallelRowBands(height, 128, [&](int rowBegin, int rowEnd) {
+        for (int r = rowBegin; r < rowEnd; r++)
+        {
+            unsigned short *pl = light.ImageData + (top + r) * W + left;
+            const unsigned short *pd = &dark.Pixel(left, top + r);
+            for (unsigned int x = 0; x < width; x++)
+            {
+                // never negative, as offset covers the largest negative difference
+                int newval = (int) pl[x] - (int) pd[x] + offset;
+                pl[x] = (unsigned short) std::min(newval, 65535);
+            }
+        }
+    });
+
+    return false;
+}
+
+DarkStacker::DarkStacker(bool rejectExtremes)
+    :
+    m_rejectExtremes(rejectExtremes),
+    m_count(0)
+{
+}
+
+bool DarkStacker::Add(const usImage& frame)
+{
+    if (!frame.ImageData)
+        return true;
+
+    if (m_count == 0)
     {
-        unsigned short *const endl = pl0 + width;
-        unsigned short *pl;
-        const unsigned short *pd;
-        for (pl = pl0, pd = pd0; pl < endl; pl++, pd++)
+        m_size = frame.Size;
+        m_sum.assign(frame.NPixels, 0);
+        if (m_rejectExtremes)
         {
-            int newval = (int) *pl - (int) *pd + offset;
-            if (newval < 0) newval = 0; // shouldn't hit this...
-            else if (newval > 65535) newval = 65535;
-            *pl = (unsigned short) newval;
+            m_min.assign(frame.NPixels, 65535);
+            m_max.assign(frame.NPixels, 0);
         }
     }
+    else if (frame.Size != m_size)
+    {
+        Debug.Write(wxString::Format("DarkStacker: frame size %dx%d does not match %dx%d\n",
+            frame.Size.GetWidth(), frame.Size.GetHeight(), m_size.GetWidth(), m_size.GetHeight()));
+        return true;
+    }
+
+    int const W = m_size.GetWidth();
+
+    ParallelRowBands(m_size.GetHeight(), 64, [&](int rowBegin, int rowEnd) {
+        size_t const begin = (size_t) rowBegin * W;
+        size_t const end = (size_t) rowEnd * W;
+        const unsigned short *src = frame.ImageData;
+        unsigned int *sum = &m_sum[0];
+        for (size_t i = begin; i < end; i++)
+            sum[i] += src[i];
+        if (m_rejectExtremes)
+        {
+            unsigned short *mn = &m_min[0];
+            unsigned short *mx = &m_max[0];
+            for (size_t i = begin; i < end; i++)
+            {
+                mn[i] = std::min(mn[i], src[i]);
+                mx[i] = std::max(mx[i], src[i]);
+            }
+        }
+    });
+
+    ++m_count;
+    return false;
+}
+
+bool DarkStacker::GetResult(usImage& dst) const
+{
+    if (m_count == 0 || !dst.ImageData || dst.Size != m_size)
+        return true;
+
+    // dropping the extremes only makes sense with at least one frame left over
+    bool const reject = m_rejectExtremes && m_count >= 3;
+    unsigned int const n = reject ? m_count - 2 : m_count;
+    int const W = m_size.GetWidth();
+
+    ParallelRowBands(m_size.GetHeight(), 64, [&](int rowBegin, int rowEnd) {
+        size_t const begin = (size_t) rowBegin * W;
+        size_t const end = (size_t) rowEnd * W;
+        unsigned short *out = dst.ImageData;
+        if (reject)
+        {
+            for (size_t i = begin; i < end; i++)
+                out[i] = (unsigned short)((m_sum[i] - m_min[i] - m_max[i]) / n);
+        }
+        else
+        {
+            for (size_t i = begin; i < end; i++)
+                out[i] = (unsigned short)(m_sum[i] / n);
+        }
+    });
 
     return false;
 }
 
-inline static unsigned short histo_median(unsigned short histo1[256], unsigned short histo2[65536], int n)
+// Two level histogram for running medians. histo1 counts values by their
+// high byte. Neighbouring windows have nearly the same median, so the last
+// one is kept along with the count of values below it and nudged up or down
+// from there; if that takes too long the median is looked up from scratch,
+// walking the 256 bins of histo1 and then 256 bins of histo2.
+struct MedianHisto
 {
-    n /= 2;
-    unsigned int i;
-    for (i = 0; i < 256; i++)
+    std::vector<unsigned short> histo1;
+    std::vector<unsigned short> histo2;
+    unsigned int n;
+    unsigned int med;      // the last median
+    unsigned int below;    // number of values < med
+
+    MedianHisto() : histo1(256), histo2(65536), n(0), med(0), below(0) { }
+
+    void Add(unsigned short v) { ++histo1[v >> 8]; ++histo2[v]; ++n; below += v < med; }
+    void Remove(unsigned short v) { --histo1[v >> 8]; --histo2[v]; --n; below -= v < med; }
+
+    unsigned short Median()
     {
-        if (histo1[i] > n)
-            break;
-        n -= histo1[i];
+        enum { MAX_STEPS = 256 };
+        unsigned int k = n / 2;
+        int steps = 0;
+        while (below > k && steps < MAX_STEPS)
+        {
+            --med;
+            below -= histo2[med];
+            ++steps;
+        }
+        while (below + histo2[med] <= k && steps < MAX_STEPS)
+        {
+            below += histo2[med];
+            ++med;
+            ++steps;
+        }
+        if (steps == MAX_STEPS)
+            Search();
+        return med;
     }
-    for (i <<= 8; i < 65536; i++)
+
+    void Search()
     {
-        if (histo2[i] > n)
-            break;
-        n -= histo2[i];
+        unsigned int k = n / 2;
+        unsigned int i;
+        below = 0;
+        for (i = 0; i < 256; i++)
+        {
+            if (histo1[i] > k)
+                break;
+            k -= histo1[i];
+            below += histo1[i];
+        }
+        for (i <<= 8; i < 65536; i++)
+        {
+            if (histo2[i] > k)
+                break;
+            k -= histo2[i];
+            below += histo2[i];
+        }
+        med = i;
     }
-    return i;
-}
+};
 
 static void MedianFilter(usImage& dst, const usImage& src, int halfWidth)
 {
     dst.Init(src.Size);
-    unsigned short *d = &dst.ImageData[0];
 
     int const width = src.Size.GetWidth();
     int const height = src.Size.GetHeight();
 
-    for (int y = 0; y < height; y++)
-    {
-        int top = std::max(0, y - halfWidth);
-        int bot = std::min(y + halfWidth, height - 1);
-        int left = 0;
-        int right = halfWidth;
+    // Each band of rows is scanned in a zig-zag: left to right, down one row,
+    // right to left, down one row, ... so the window only ever moves by one
+    // row or column and the histogram is filled just once per band.
+    ParallelRowBands(height, 4 * halfWidth, [&](int rowBegin, int rowEnd) {
+        MedianHisto h;
 
-        // TODO: we initialize the histogram at the start of each row, but we could make this faster
-        // if we scan left to right, move down, scan right to left, move down so we never need to
-        // reinitialize the histogram
-
-        // initialize 2-level histogram
-        unsigned short histo1[256];
-        unsigned short histo2[65536];
-        memset(&histo1[0], 0, sizeof(histo1));
-        memset(&histo2[0], 0, sizeof(histo2));
+        int x = 0;
+        int top = std::max(0, rowBegin - halfWidth);
+        int bot = std::min(rowBegin + halfWidth, height - 1);
+        int left = 0;
+        int right = std::min(halfWidth, width - 1);
 
         for (int j = top; j <= bot; j++)
-        {
-            const unsigned short *p = &src.Pixel(left, j);
-            for (int i = left; i <= right; i++, p++)
-            {
-                ++histo1[*p >> 8];
-                ++histo2[*p];
-            }
-        }
-        unsigned int n = (right - left + 1) * (bot - top + 1);
+            for (int i = left; i <= right; i++)
+                h.Add(src.Pixel(i, j));
 
-        // read off first value for this row
-        *d++ = histo_median(histo1, histo2, n);
-
-        // loop across remaining columns for this row
-        for (int i = 1; i < width; i++)
+        for (int y = rowBegin; y < rowEnd; y++)
         {
-            left = std::max(0, i - halfWidth);
-            right = std::min(i + halfWidth, width - 1);
-
-            // remove leftmost column
-            if (left > 0)
+            if (y > rowBegin)
             {
-                const unsigned short *p = &src.Pixel(left - 1, top);
-                for (int j = top; j <= bot; j++, p += width)
+                // move down a row
+                if (y - halfWidth - 1 >= 0)
                 {
-                    --histo1[*p >> 8];
-                    --histo2[*p];
+                    const unsigned short *p = &src.Pixel(left, y - halfWidth - 1);
+                    for (int i = left; i <= right; i++)
+                        h.Remove(*p++);
                 }
-                n -= (bot - top + 1);
+                if (y + halfWidth <= height - 1)
+                {
+                    const unsigned short *p = &src.Pixel(left, y + halfWidth);
+                    for (int i = left; i <= right; i++)
+                        h.Add(*p++);
+                }
+                top = std::max(0, y - halfWidth);
+                bot = std::min(y + halfWidth, height - 1);
             }
 
-            // add new column on right
-            if (i + halfWidth <= width - 1)
+            unsigned short *d = &dst.Pixel(0, y);
+            d[x] = h.Median();
+
+            int const step = (y - rowBegin) % 2 == 0 ? 1 : -1;
+            for (int n = 1; n < width; n++)
             {
-                const unsigned short *p = &src.Pixel(right, top);
-                for (int j = top; j <= bot; j++, p += width)
+                x += step;
+
+                // drop the column the window leaves, add the one it enters
+                int out = step > 0 ? x - halfWidth - 1 : x + halfWidth + 1;
+                int in = step > 0 ? x + halfWidth : x - halfWidth;
+                if (out >= 0 && out <= width - 1)
                 {
-                    ++histo1[*p >> 8];
-                    ++histo2[*p];
+                    const unsigned short *p = &src.Pixel(out, top);
+                    for (int j = top; j <= bot; j++, p += width)
+                        h.Remove(*p);
                 }
-                n += (bot - top + 1);
-            }
+                if (in >= 0 && in <= width - 1)
+                {
+                    const unsigned short *p = &src.Pixel(in, top);
+                    for (int j = top; j <= bot; j++, p += width)
+                        h.Add(*p);
+                }
+                left = std::max(0, x - halfWidth);
+                right = std::min(x + halfWidth, width - 1);
 
-            *d++ = histo_median(histo1, histo2, n);
+                d[x] = h.Median();
+            }
         }
-    }
+    });
 }
 
 struct ImageStatsWork
 {
     ImageStats stats;
-    usImage temp;
 };
 
 static void GetImageStats(ImageStatsWork& w, const usImage& img, const wxRect& win)
 {
-    w.temp.Init(img.Size);
-
-    // Determine the mean and standard deviation
-    double sum = 0.0;
-    double a = 0.0;
-    double q = 0.0;
-    double k = 1.0;
-    double km1 = 0.0;
-
-    const unsigned short *p0 = &img.Pixel(win.GetLeft(), win.GetTop());
-    unsigned short *dst = &w.temp.ImageData[0];
-    for (int y = 0; y < win.GetHeight(); y++)
-    {
-        const unsigned short *end = p0 + win.GetWidth();
-        for (const unsigned short *p = p0; p < end; p++)
+    // One pass over the window collects a histogram along with the sums; the
+    // median and the MAD are then read off the histogram, so nothing is
+    // copied or sorted
+    std::vector<unsigned int> histo(65536);
+    uint64_t sum = 0;
+    uint64_t sumsq = 0;
+    wxCriticalSection lock;
+
+    ParallelRowBands(win.GetHeight(), 64, [&](int rowBegin, int rowEnd) {
+        std::vector<unsigned int> bandHisto(65536);
+        uint64_t bandSum = 0;
+        uint64_t bandSumsq = 0;
+        for (int y = rowBegin; y < rowEnd; y++)
         {
-            *dst++ = *p;
-            double const x = (double) *p;
-            sum += x;
-            double const a0 = a;
-            a += (x - a) / k;
-            q += (x - a0) * (x - a);
-            km1 = k;
-            k += 1.0;
+            const unsigned short *p = &img.Pixel(win.GetLeft(), win.GetTop() + y);
+            for (int x = 0; x < win.GetWidth(); x++)
+            {
+                unsigned int const v = p[x];
+                ++bandHisto[v];
+                bandSum += v;
+                bandSumsq += v * v;
+            }
         }
-        p0 += img.Size.GetWidth();
-    }
-
-    w.stats.mean = sum / km1;
-    w.stats.stdev = sqrt(q / km1);
 
-    int winPixels = win.GetWidth() * win.GetHeight();
-    unsigned short *tmp = &w.temp.ImageData[0];
-    std::nth_element(tmp, tmp + winPixels / 2, tmp + winPixels);
-
-    w.stats.median = tmp[winPixels / 2];
-
-    // replace each pixel with the absolute deviation from the median
-    unsigned short *p = tmp;
-    for (int i = 0; i < winPixels; i++)
+        wxCriticalSectionLocker lck(lock);
+        for (unsigned int i = 0; i < 65536; i++)
+            histo[i] += bandHisto[i];
+        sum += bandSum;
+        sumsq += bandSumsq;
+    });
+
+    double const n = (double) win.GetWidth() * win.GetHeight();
+    w.stats.mean = (double) sum / n;
+    w.stats.stdev = sqrt(std::max(0.0, (double) sumsq / n - w.stats.mean * w.stats.mean));
+
+    // the middle element of the sorted window, as nth_element would find it
+    uint64_t const half = (uint64_t) win.GetWidth() * win.GetHeight() / 2;
+
+    uint64_t cnt = 0;
+    unsigned int median = 0;
+    while (median < 65535 && cnt + histo[median] <= half)
+        cnt += histo[median++];
+    w.stats.median = median;
+
+    // count absolute deviations from the median, nearest first
+    cnt = histo[median];
+    unsigned int mad = 0;
+    while (cnt <= half && mad < 65535)
     {
-        unsigned short ad = (unsigned short) std::abs((int) *p - (int) w.stats.median);
-        *p++ = ad;
+        ++mad;
+        if (median + mad <= 65535)
+            cnt += histo[median + mad];
+        if (mad <= median)
+            cnt += histo[median - mad];
     }
-    std::nth_element(tmp, tmp + winPixels / 2, tmp + winPixels);
-    w.stats.mad = tmp[winPixels / 2];
+    w.stats.mad = mad;
 }
 
 void DefectMapDarks::BuildFilteredDark()
@@ -976,7 +1328,7 @@ int DefectMapBuilder::GetHotPixelCnt() const
     return m_impl->hotPxSelected;
 }
 
-inline static unsigned int emit_defects(DefectMap& defectMap, BadPxSet::const_iterator p0, BadPxSet::const_iterator p1, double stdev, int sign, bool verbose)
+inline static unsigned int emit_defects(std::vector<wxPoint>& defects, BadPxSet::const_iterator p0, BadPxSet::const_iterator p1, double stdev, int sign, bool verbose)
 {
     unsigned int cnt = 0;
     for (BadPxSet::const_iterator it = p0; it != p1; ++it, ++cnt)
@@ -986,7 +1338,7 @@ inline static unsigned int emit_defects(DefectMap& defectMap, BadPxSet::const_it
             int v = sign * it->v;
             Debug.Write(wxString::Format("DefectMap: defect @ (%d, %d) val = %d (%+.1f sigma)\n", it->x, it->y, v, stdev > 0.1 ? (double)v / stdev : 0.0));
         }
-        defectMap.push_back(wxPoint(it->x, it->y));
+        defects.push_back(wxPoint(it->x, it->y));
     }
     return cnt;
 }
@@ -1023,9 +1375,10 @@ void DefectMapBuilder::BuildDefectMap(DefectMap& defectMap, bool verbose) const
 
     FindThresh(m_impl);
 
-    defectMap.clear();
-    unsigned int nr_cold = emit_defects(defectMap, m_impl->coldPxThresh, m_impl->coldPx.end(), stats.stdev, -1, verbose);
-    unsigned int nr_hot = emit_defects(defectMap, m_impl->hotPxThresh, m_impl->hotPx.end(), stats.stdev, +1, verbose);
+    std::vector<wxPoint> defects;
+    unsigned int nr_cold = emit_defects(defects, m_impl->coldPxThresh, m_impl->coldPx.end(), stats.stdev, -1, verbose);
+    unsigned int nr_hot = emit_defects(defects, m_impl->hotPxThresh, m_impl->hotPx.end(), stats.stdev, +1, verbose);
+    defectMap.Assign(defects);
 
     if (verbose) Debug.Write(wxString::Format("New defect map created, count=%d (cold=%d, hot=%d)\n", defectMap.size(), nr_cold, nr_hot));
 }
@@ -1041,33 +1394,19 @@ bool RemoveDefects(usImage& light, const DefectMap& defectMap)
     if (!light.ImageData)
         return true;
 
+    wxRect rect(light.Size);
     if (!light.Subframe.IsEmpty())
+        rect.Intersect(light.Subframe);
+
+    // Replace each defect inside the frame with the median of the
+    // surrounding pixels. Only the rows of the subframe are looked at.
+    for (int y = rect.GetTop(); y <= rect.GetBottom(); y++)
     {
-        // Step over each defect and replace the light value
-        // with the median of the surrounding pixels
-        for (DefectMap::const_iterator it = defectMap.begin(); it != defectMap.end(); ++it)
-        {
-            const wxPoint& pt = *it;
-            // Check to see if we are within the subframe before correcting the defect
-            if (light.Subframe.Contains(pt))
-            {
-                light.Pixel(pt.x, pt.y) = MedianBorderingPixels(light, pt.x, pt.y);
-            }
-        }
-    }
-    else
-    {
-        // Step over each defect and replace the light value
-        // with the median of the surrounding pixels
-        for (DefectMap::const_iterator it = defectMap.begin(); it != defectMap.end(); ++it)
+        DefectMap::const_iterator first, last;
+        defectMap.FindInRow(y, rect.GetLeft(), rect.GetRight() + 1, &first, &last);
+        for (DefectMap::const_iterator it = first; it != last; ++it)
         {
-            int const x = it->x;
-            int const y = it->y;
-
-            if (x >= 0 && x < light.Size.GetWidth() && y >= 0 && y < light.Size.GetHeight())
-            {
-                light.Pixel(x, y) = MedianBorderingPixels(light, x, y);
-            }
+            light.Pixel(it->x, y) = MedianBorderingPixels(light, it->x, y);
         }
     }
 
@@ -1081,6 +1420,61 @@ wxString DefectMap::DefectMapFileName(int profileId)
         wxString::Format("PHD2_defect_map%s_%d.txt", inst > 1 ? wxString::Format("_%d", inst) : "", profileId);
 }
 
+// The binary copy of the defect map lives next to the text file
+static wxString DefectMapIndexFileName(int profileId)
+{
+    wxString name = DefectMap::DefectMapFileName(profileId);
+    wxString base;
+    if (name.EndsWith(".txt", &base))
+        name = base;
+    return name + ".bpm";
+}
+
+// The binary file header. textSize and textHash identify the text file it
+// was made from; if the text file has changed since, the binary file is
+// stale and is rebuilt. Defects follow as (x, y) pairs of 16 bit integers,
+// in index order.
+struct DefectIndexHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t count;
+    uint64_t textSize;
+    uint64_t textHash;
+};
+
+static const char DefectIndexMagic[8] = { 'P', 'H', 'D', '2', 'B', 'P', 'M', 0 };
+enum { DEFECT_INDEX_VERSION = 2 };
+
+// Modification times only have a resolution of a second here, too coarse to
+// catch a file rewritten with the same size within the second it was
+// indexed, so files are identified by their contents.
+bool HashFile(const wxString& filename, uint64_t *hash)
+{
+    wxFile file(filename);
+    if (!file.IsOpened())
+        return false;
+
+    uint64_t h = 14695981039346656037ULL;
+    std::vector<unsigned char> buf(65536);
+    ssize_t n;
+    while ((n = file.Read(buf.data(), buf.size())) > 0)
+    {
+        for (ssize_t i = 0; i < n; i++)
+            h = (h ^ buf[i]) * 1099511628211ULL;
+    }
+    if (n < 0)
+        return false;
+
+    *hash = h;
+    return true;
+}
+
+static bool DefectOrder(const wxPoint& a, const wxPoint& b)
+{
+    return a.y < b.y || (a.y == b.y && a.x < b.x);
+}
+
 bool DefectMap::ImportFromProfile(int srcId, int destId)
 {
     wxString sourceName;
@@ -1095,6 +1489,9 @@ bool DefectMap::ImportFromProfile(int srcId, int destId)
         Debug.Write(wxString::Format("DefectMap::ImportFromProfile failed on defect map copy of %s to %s\n", sourceName, destName));
         return false;
     }
+    // rebuilt from the text file on the next load
+    if (wxFileExists(DefectMapIndexFileName(destId)))
+        wxRemoveFile(DefectMapIndexFileName(destId));
     sourceName = DefectMapMasterPath(srcId);
     destName = DefectMapMasterPath(destId);
     rslt = wxCopyFile(sourceName, destName, true);
@@ -1183,6 +1580,8 @@ void DefectMap::Save(const wxArrayString& info) const
 
     oStream.Close();
     Debug.AddLine(wxString::Format("Saved defect map to %s", filename));
+
+    SaveIndexFile();
 }
 
 DefectMap::DefectMap()
@@ -1195,15 +1594,73 @@ DefectMap::DefectMap(int profileId)
 {
 }
 
+void DefectMap::BuildIndex()
+{
+    if (!std::is_sorted(m_defects.begin(), m_defects.end(), DefectOrder))
+        std::sort(m_defects.begin(), m_defects.end(), DefectOrder);
+    m_defects.erase(std::unique(m_defects.begin(), m_defects.end()), m_defects.end());
+
+    // Defects off the top or left of the sensor can never be corrected
+    std::vector<wxPoint>::iterator firstValid = m_defects.begin();
+    while (firstValid != m_defects.end() && firstValid->y < 0)
+        ++firstValid;
+    m_defects.erase(m_defects.begin(), firstValid);
+    m_defects.erase(std::remove_if(m_defects.begin(), m_defects.end(), [](const wxPoint& pt) { return pt.x < 0; }),
+                    m_defects.end());
+
+    int rows = m_defects.empty() ? 0 : m_defects.back().y + 1;
+    m_rowStart.resize(rows + 1);
+    size_t i = 0;
+    for (int y = 0; y <= rows; y++)
+    {
+        while (i < m_defects.size() && m_defects[i].y < y)
+            ++i;
+        m_rowStart[y] = i;
+    }
+}
+
+void DefectMap::Assign(const std::vector<wxPoint>& defects)
+{
+    m_defects = defects;
+    BuildIndex();
+}
+
+void DefectMap::clear()
+{
+    m_defects.clear();
+    m_rowStart.clear();
+}
+
+void DefectMap::FindInRow(int y, int x0, int x1, const_iterator *first, const_iterator *last) const
+{
+    if (y < 0 || y + 1 >= (int) m_rowStart.size())
+    {
+        *first = *last = end();
+        return;
+    }
+
+    const_iterator rowBegin = begin() + m_rowStart[y];
+    const_iterator rowEnd = begin() + m_rowStart[y + 1];
+    *first = std::lower_bound(rowBegin, rowEnd, x0, [](const wxPoint& pt, int x) { return pt.x < x; });
+    *last = std::lower_bound(*first, rowEnd, x1, [](const wxPoint& pt, int x) { return pt.x < x; });
+}
+
 bool DefectMap::FindDefect(const wxPoint& pt) const
 {
-    return std::find(begin(), end(), pt) != end();
+    const_iterator first, last;
+    FindInRow(pt.y, pt.x, pt.x + 1, &first, &last);
+    return first != last;
 }
 
 void DefectMap::AddDefect(const wxPoint& pt)
 {
     // first add the point
-    push_back(pt);
+    std::vector<wxPoint>::iterator pos = std::lower_bound(m_defects.begin(), m_defects.end(), pt, DefectOrder);
+    if (pos == m_defects.end() || *pos != pt)
+    {
+        m_defects.insert(pos, pt);
+        BuildIndex();
+    }
 
     wxString filename = DefectMapFileName(m_profileId);
     wxFile file(filename, wxFile::write_append);
@@ -1220,6 +1677,87 @@ void DefectMap::AddDefect(const wxPoint& pt)
 
     oStream.Close();
     Debug.AddLine(wxString::Format("Saved defect map to %s", filename));
+
+    SaveIndexFile();
+}
+
+void DefectMap::SaveIndexFile() const
+{
+    wxString textName = DefectMapFileName(m_profileId);
+    wxString filename = DefectMapIndexFileName(m_profileId);
+
+    if (!m_defects.empty() && (m_defects.back().y > 0xffff ||
+        std::find_if(begin(), end(), [](const wxPoint& pt) { return pt.x > 0xffff; }) != end()))
+    {
+        Debug.AddLine("DefectMap: defects do not fit the binary format, not saving it");
+        return;
+    }
+
+    DefectIndexHeader hdr;
+    memcpy(hdr.magic, DefectIndexMagic, sizeof(hdr.magic));
+    hdr.version = DEFECT_INDEX_VERSION;
+    hdr.count = m_defects.size();
+    hdr.textSize = wxFileName::GetSize(textName).GetValue();
+    if (!HashFile(textName, &hdr.textHash))
+    {
+        Debug.AddLine(wxString::Format("DefectMap: cannot read %s, not saving %s", textName, filename));
+        return;
+    }
+
+    std::vector<uint16_t> buf(2 * m_defects.size());
+    for (size_t i = 0; i < m_defects.size(); i++)
+    {
+        buf[2 * i] = m_defects[i].x;
+        buf[2 * i + 1] = m_defects[i].y;
+    }
+
+    wxFile file(filename, wxFile::write);
+    if (!file.IsOpened() || file.Write(&hdr, sizeof(hdr)) != sizeof(hdr) ||
+        file.Write(buf.data(), buf.size() * sizeof(uint16_t)) != buf.size() * sizeof(uint16_t))
+    {
+        Debug.AddLine(wxString::Format("DefectMap: failed to write %s", filename));
+        file.Close();
+        wxRemoveFile(filename);
+    }
+}
+
+bool DefectMap::LoadIndexFile(const wxString& textName)
+{
+    wxString filename = DefectMapIndexFileName(m_profileId);
+    if (!wxFileExists(filename))
+        return false;
+
+    wxFile file(filename);
+    DefectIndexHeader hdr;
+    if (!file.IsOpened() || file.Read(&hdr, sizeof(hdr)) != sizeof(hdr))
+        return false;
+
+    if (memcmp(hdr.magic, DefectIndexMagic, sizeof(hdr.magic)) != 0 || hdr.version != DEFECT_INDEX_VERSION)
+    {
+        Debug.AddLine(wxString::Format("DefectMap: ignoring %s, unknown format", filename));
+        return false;
+    }
+    uint64_t textHash;
+    if (hdr.textSize != wxFileName::GetSize(textName).GetValue() || !HashFile(textName, &textHash) ||
+        hdr.textHash != textHash)
+    {
+        Debug.AddLine(wxString::Format("DefectMap: %s is out of date", filename));
+        return false;
+    }
+
+    std::vector<uint16_t> buf(2 * (size_t) hdr.count);
+    size_t bytes = buf.size() * sizeof(uint16_t);
+    if (file.Length() != (wxFileOffset) (sizeof(hdr) + bytes) || file.Read(buf.data(), bytes) != (ssize_t) bytes)
+    {
+        Debug.AddLine(wxString::Format("DefectMap: %s is truncated", filename));
+        return false;
+    }
+
+    m_defects.resize(hdr.count);
+    for (size_t i = 0; i < m_defects.size(); i++)
+        m_defects[i] = wxPoint(buf[2 * i], buf[2 * i + 1]);
+    BuildIndex();
+    return true;
 }
 
 DefectMap *DefectMap::LoadDefectMap(int profileId)
@@ -1233,6 +1771,14 @@ DefectMap *DefectMap::LoadDefectMap(int profileId)
         return 0;
     }
 
+    DefectMap *defectMap = new DefectMap(profileId);
+
+    if (defectMap->LoadIndexFile(filename))
+    {
+        Debug.AddLine(wxString::Format("Loaded %d defects from %s", defectMap->size(), DefectMapIndexFileName(profileId)));
+        return defectMap;
+    }
+
     wxFileInputStream iStream(filename);
     wxTextInputStream inText(iStream);
 
@@ -1240,11 +1786,11 @@ DefectMap *DefectMap::LoadDefectMap(int profileId)
     if (iStream.GetLastError() != wxSTREAM_NO_ERROR)
     {
         Debug.AddLine(wxString::Format("Unexpected eof on defect map file %s", filename));
+        delete defectMap;
         return 0;
     }
 
-    DefectMap *defectMap = new DefectMap(profileId);
-
+    std::vector<wxPoint> defects;
     int linenum = 0;
     while (!inText.GetInputStream().Eof())
     {
@@ -1262,7 +1808,7 @@ DefectMap *DefectMap::LoadDefectMap(int profileId)
         long x, y;
         if (s1.ToLong(&x) && s2.ToLong(&y))
         {
-            defectMap->push_back(wxPoint(x, y));
+            defects.push_back(wxPoint(x, y));
         }
         else
         {
@@ -1270,6 +1816,9 @@ DefectMap *DefectMap::LoadDefectMap(int profileId)
         }
     }
 
+    defectMap->Assign(defects);
+    defectMap->SaveIndexFile();
+
     Debug.AddLine(wxString::Format("Loaded %d defects", defectMap->size()));
     return defectMap;
 }
@@ -1282,6 +1831,9 @@ void DefectMap::DeleteDefectMap(int profileId)
         Debug.AddLine("Removing defect map file: " + filename);
         wxRemoveFile(filename);
     }
+    filename = DefectMapIndexFileName(profileId);
+    if (wxFileExists(filename))
+        wxRemoveFile(filename);
 }
 
 
@@ -36,10 +36,27 @@
 #ifndef IMAGE_MATH_INCLUDED
 #define IMAGE_MATH_INCLUDED
 
-class DefectMap : public std::vector<wxPoint>
+#include <functional>
+
+// Defects are kept sorted by row, then column, with the index of the first
+// defect of each row, so the defects inside a subframe can be found without
+// looking at the rest. Alongside the text file the map is saved in a binary
+// form that loads without parsing.
+class DefectMap
 {
+public:
+    typedef std::vector<wxPoint>::const_iterator const_iterator;
+
+private:
     int m_profileId;
+    std::vector<wxPoint> m_defects;
+    std::vector<unsigned int> m_rowStart;   // first defect of each row, plus one past the last row
+
     DefectMap(int profileId);
+    void BuildIndex();
+    bool LoadIndexFile(const wxString& filename);
+    void SaveIndexFile() const;
+
 public:
     static void DeleteDefectMap(int profileId);
     static bool DefectMapExists(int profileId, bool showAlert = true);
@@ -51,16 +68,62 @@ public:
     bool FindDefect(const wxPoint& pt) const;
     void AddDefect(const wxPoint& pt);
 
+    // Replace the defects, in any order
+    void Assign(const std::vector<wxPoint>& defects);
+    void clear();
+
+    size_t size() const { return m_defects.size(); }
+    bool empty() const { return m_defects.empty(); }
+    const_iterator begin() const { return m_defects.begin(); }
+    const_iterator end() const { return m_defects.end(); }
+
+    // The defects in row y with x0 <= x < x1
+    void FindInRow(int y, int x0, int x1, const_iterator *first, const_iterator *last) const;
 };
 
 extern bool QuickLRecon(usImage& img);
+extern bool QuickLRecon(usImage& img, usImage& scratch);
 extern bool Median3(unsigned short *dst, const unsigned short *src, const wxSize& size, const wxRect& rect);
 extern bool Median3(usImage& img);
+extern bool Median3(usImage& img, usImage& scratch);
+// Min and max of the pixels in rect, before and after a 3x3 median filter.
+// Nothing is allocated; the filtered pixels are never stored.
+extern void ImageMinMax(const usImage& img, const wxRect& rect, int *min, int *max, int *filtMin, int *filtMax);
 extern bool SquarePixels(usImage& img, float xsize, float ysize);
 extern int dbl_sort_func(double *first, double *second);
 extern bool Subtract(usImage& light, const usImage& dark);
 extern double CalcSlope(const ArrayOfDbl& y);
 extern bool RemoveDefects(usImage& light, const DefectMap& defectMap);
+// 64 bit FNV-1a hash of a file's contents, false if it cannot be read
+extern bool HashFile(const wxString& filename, uint64_t *hash);
+
+// Calls fn(rowBegin, rowEnd) for bands of rows covering [0, rows), one band per
+// CPU, and waits for all of them. Bands are at least minBandRows tall, so
+// small images are processed on the calling thread. The bands run on a pool
+// of threads that lives as long as the process; while the pool is busy with
+// another caller's bands, fn(0, rows) runs on the calling thread instead.
+extern void ParallelRowBands(int rows, int minBandRows, const std::function<void(int, int)>& fn);
+
+// Combines dark frames one at a time as they are captured. Memory does not
+// grow with the number of frames: a per-pixel running sum, plus the per-pixel
+// minimum and maximum when rejectExtremes is set so that a transient in any
+// one frame (cosmic ray hit, readout glitch) is left out of the result.
+class DarkStacker
+{
+    wxSize m_size;
+    bool m_rejectExtremes;
+    unsigned int m_count;
+    std::vector<unsigned int> m_sum;
+    std::vector<unsigned short> m_min;
+    std::vector<unsigned short> m_max;
+
+public:
+
+    DarkStacker(bool rejectExtremes);
+    bool Add(const usImage& frame);
+    unsigned int Count() const { return m_count; }
+    bool GetResult(usImage& dst) const;
+};
 
 struct DefectMapBuilderImpl;
 
@@ -0,0 +1,131 @@
+/*
+ *  image_stretch.cpp
+ *  PHD Guiding
+ *
+ *  Created by Arran Dengate
+ *  Copyright (c) 2017 Arran Dengate
+ *  All rights reserved.
+ *
+ *  This source code is distributed under the following "BSD" license
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *    Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *    Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *    Neither the name of Bret McKee, Dad Dog Development,
+ *     Craig Stark, Stark Labs nor the names of its
+ *     contributors may be used to endorse or promote products derived from
+ *     this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "phd.h"
+
+ImageStretch::ImageStretch(void)
+    : m_lut(65536),
+      m_blevel(-1),
+      m_wlevel(-1),
+      m_power(0.0)
+{
+}
+
+bool ImageStretch::Set(int blevel, int wlevel, double power)
+{
+    if (blevel == m_blevel && wlevel == m_wlevel && power == m_power)
+        return false;
+
+    m_blevel = blevel;
+    m_wlevel = wlevel;
+    m_power = power;
+
+    unsigned char *lut = &m_lut[0];
+
+    if (power == 1.0 || blevel >= wlevel)
+    {
+        // Go 0-max
+        float range = (float) std::max(1, wlevel);
+        int n = std::min(std::max(1, wlevel), 65536);
+        for (int i = 0; i < n; i++)
+            lut[i] = (unsigned char) (((float) i / range) * 255.0);
+        memset(lut + n, 255, 65536 - n);
+    }
+    else
+    {
+        int lo = std::max(0, std::min(blevel + 1, 65536));
+        int hi = std::max(lo, std::min(wlevel, 65536));
+        float range = (float) (wlevel - blevel);
+        memset(lut, 0, lo);
+        for (int i = lo; i < hi; i++)
+        {
+            float d = ((float) i - (float) blevel) / range;
+            lut[i] = (unsigned char) (pow(d, (float) power) * 255.0);
+        }
+        memset(lut + hi, 255, 65536 - hi);
+    }
+
+    return true;
+}
+
+void ImageStretch::ToRGB(unsigned char *dst, const unsigned short *src, int n) const
+{
+    const unsigned char *lut = &m_lut[0];
+    for (int i = 0; i < n; i++)
+    {
+        unsigned char d = lut[src[i]];
+        dst[0] = d;
+        dst[1] = d;
+        dst[2] = d;
+        dst += 3;
+    }
+}
+
+void ImageStretch::ToGray(unsigned char *dst, const unsigned short *src, int n) const
+{
+    const unsigned char *lut = &m_lut[0];
+    for (int i = 0; i < n; i++)
+        dst[i] = lut[src[i]];
+}
+
+void ImageStretch::BinnedToRGB(unsigned char *dst, const unsigned short *src, int width, int height) const
+{
+    const unsigned char *lut = &m_lut[0];
+    for (int y = 0; y + 1 < height; y += 2)
+    {
+        const unsigned short *r0 = src + y * width;
+        const unsigned short *r1 = r0 + width;
+        for (int x = 0; x + 1 < width; x += 2)
+        {
+            unsigned char d = lut[((unsigned int) r0[x] + r0[x + 1] + r1[x] + r1[x + 1]) / 4];
+            dst[0] = d;
+            dst[1] = d;
+            dst[2] = d;
+            dst += 3;
+        }
+    }
+}
+
+void ImageStretch::BinnedToGray(unsigned char *dst, const unsigned short *src, int width, int height) const
+{
+    const unsigned char *lut = &m_lut[0];
+    for (int y = 0; y + 1 < height; y += 2)
+    {
+        const unsigned short *r0 = src + y * width;
+        const unsigned short *r1 = r0 + width;
+        for (int x = 0; x + 1 < width; x += 2)
+            *dst++ = lut[((unsigned int) r0[x] + r0[x + 1] + r1[x] + r1[x + 1]) / 4];
+    }
+}
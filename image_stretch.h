@@ -0,0 +1,70 @@
+/*
+ *  image_stretch.h
+ *  PHD Guiding
+ *
+ *  Created by Arran Dengate
+ *  Copyright (c) 2017 Arran Dengate
+ *  All rights reserved.
+ *
+ *  This source code is distributed under the following "BSD" license
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *    Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *    Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *    Neither the name of Bret McKee, Dad Dog Development,
+ *     Craig Stark, Stark Labs nor the names of its
+ *     contributors may be used to endorse or promote products derived from
+ *     this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef IMAGE_STRETCH_H_INCLUDED
+#define IMAGE_STRETCH_H_INCLUDED
+
+// Maps 16 bit pixel values to 8 bit display values through a lookup table
+// built for the current black level, white level and gamma. The table is
+// only rebuilt when those change, and then only between the black and white
+// levels, so applying it costs one load per pixel.
+//
+// With gamma 1.0 (or white <= black) the stretch is linear from 0 to the
+// white level, as the display has always done.
+class ImageStretch
+{
+    std::vector<unsigned char> m_lut;
+    int m_blevel;
+    int m_wlevel;
+    double m_power;
+
+public:
+    ImageStretch(void);
+
+    // Returns true if the table was rebuilt
+    bool Set(int blevel, int wlevel, double power);
+
+    unsigned char operator[](unsigned short val) const { return m_lut[val]; }
+
+    // Stretch n pixels to packed RGB (3 bytes per pixel) or grayscale
+    void ToRGB(unsigned char *dst, const unsigned short *src, int n) const;
+    void ToGray(unsigned char *dst, const unsigned short *src, int n) const;
+
+    // Same, averaging 2x2 blocks; dst gets (width / 2) x (height / 2) pixels
+    void BinnedToRGB(unsigned char *dst, const unsigned short *src, int width, int height) const;
+    void BinnedToGray(unsigned char *dst, const unsigned short *src, int width, int height) const;
+};
+
+#endif // IMAGE_STRETCH_H_INCLUDED
@@ -70,6 +70,8 @@ private:
         block *next;
     };
 
+    enum { MAX_KEEP = 64 * 1024 };
+
     block *m_head;
     size_t m_blocksize;
 
@@ -86,7 +88,8 @@ public:
     // allocate memory
     void *malloc(size_t size);
 
-    // reset to empty state, keeping one allocated block
+    // reset to empty state, keeping one block big enough for everything
+    // allocated since the last reset (up to MAX_KEEP bytes)
     void reset();
 
     // free all allocated blocks
@@ -109,18 +112,33 @@ block_allocator::~block_allocator()
 
 void block_allocator::reset()
 {
-    if (m_head)
+    if (!m_head)
+        return;
+
+    if (!m_head->next)
     {
-        block *b = m_head->next;
-        m_head->next = 0;
-        while (b)
-        {
-            block *t = b->next;
-            ::free(b);
-            b = t;
-        }
         m_head->used = sizeof(block);
+        return;
     }
+
+    // The last input overflowed the first block. Replace the chain with a
+    // single block that holds it all, so that parsing a similar input again
+    // needs no allocation.
+    size_t total = sizeof(block);
+    while (m_head)
+    {
+        block *t = m_head->next;
+        total += m_head->used - sizeof(block);
+        ::free(m_head);
+        m_head = t;
+    }
+
+    size_t alloc_size = std::max(std::min(total, (size_t) MAX_KEEP), m_blocksize);
+    block *b = (block *)::malloc(alloc_size);
+    b->size = alloc_size;
+    b->used = sizeof(block);
+    b->next = 0;
+    m_head = b;
 }
 
 void block_allocator::swap(block_allocator& rhs)
@@ -36,6 +36,7 @@
 #include "phd.h"
 #include "backlash_comp.h"
 #include "guiding_assistant.h"
+#include "mount_channel.h"
 
 #include <fstream>
 #include <iostream>
@@ -55,11 +56,6 @@
 // enable dec compensation when calibration declination is less than this
 //const double Mount::DEC_COMP_LIMIT = M_PI / 2.0 * 2.0 / 3.0;
 
-const char GUIDE_DIRECTORY[]         = "/dev/shm/phd2/";
-const char GUIDE_OUTPUT_DIRECTORY [] = "/dev/shm/phd2/output/";
-const char TEMP_FILE_PATH[]          = "/dev/shm/phd2/output/temp_mount_command";
-const char OUTPUT_FILE_PATH[]        = "/dev/shm/phd2/output/mount_command";
-
 inline static PierSide OppositeSide(PierSide p)
 {
     switch (p) {
@@ -645,19 +641,80 @@ void Mount::TestTransforms(void)
 }
 #endif
 
+// Convert pixels to degrees
+// For Starshoot Autoguide, this is...
+// 2.1701 x 1.73582 degrees
+// 1280 x 1024 pixels
+static const double DegreesPerPixelX = 0.001695391;
+static const double DegreesPerPixelY = 0.001695137;
+
+const int MoveLatencyStats::BucketLimitMs[BUCKETS - 1] = { 10, 25, 50, 100, 250, 500, 1000 };
+
+static int latency_bucket(long ms)
+{
+    int i = 0;
+    while (i < MoveLatencyStats::BUCKETS - 1 && ms >= MoveLatencyStats::BucketLimitMs[i])
+        ++i;
+    return i;
+}
+
+void MoveLatencyStats::Reset(void)
+{
+    for (int i = 0; i < BUCKETS; i++)
+        queued[i] = execute[i] = 0;
+    moves = merged = late = 0;
+    maxQueuedMs = maxExecuteMs = 0;
+}
+
+void MoveLatencyStats::Add(long queuedMs, long executeMs, bool wasMerged, bool wasLate)
+{
+    ++queued[latency_bucket(queuedMs)];
+    if (queuedMs > maxQueuedMs)
+        maxQueuedMs = queuedMs;
+
+    if (wasMerged)
+    {
+        ++merged;
+        return;
+    }
+
+    ++moves;
+    ++execute[latency_bucket(executeMs)];
+    if (executeMs > maxExecuteMs)
+        maxExecuteMs = executeMs;
+    if (wasLate)
+        ++late;
+}
+
+wxString MoveLatencyStats::Summary(void) const
+{
+    wxString q, x;
+    for (int i = 0; i < BUCKETS; i++)
+    {
+        q += wxString::Format("%s%u", i ? "," : "", queued[i]);
+        x += wxString::Format("%s%u", i ? "," : "", execute[i]);
+    }
+    return wxString::Format("moves=%u merged=%u late=%u queued=[%s] max %ldms execute=[%s] max %ldms",
+        moves, merged, late, q, maxQueuedMs, x, maxExecuteMs);
+}
+
 Mount::Mount(void)
 {
     m_connected = false;
     m_requestCount = 0;
     m_errorCount = 0;
+    m_lastCorrectionId = 0;
 
     m_pYGuideAlgorithm = NULL;
     m_pXGuideAlgorithm = NULL;
     m_guidingEnabled = true;
 
     m_backlashComp = NULL;
-    m_lastStep.mount = this;
-    m_lastStep.frameNumber = -1; // invalidate
+
+    m_lastGotoAlt = m_lastGotoAz = 0.0;
+    m_lastGotoSeq = 0;
+    m_lastGotoTracked = false;
+    m_pointingModel.Load();
 
     ClearCalibration();
 
@@ -766,64 +823,52 @@ bool Mount::FlipCalibration(void)
     return bError;
 }
 
-void Mount::LogGuideStepInfo()
+void Mount::LogGuideStepInfo(const GuideStepInfo& step)
 {
-    if (m_lastStep.frameNumber < 0)
+    if (step.frameNumber < 0)
         return;
 
-    pFrame->UpdateGuiderInfo(m_lastStep);
-    GuideLog.GuideStep(m_lastStep);
-    EvtServer.NotifyGuideStep(m_lastStep);
+    pFrame->UpdateGuiderInfo(step);
+    GuideLog.GuideStep(step);
+    EvtServer.NotifyGuideStep(step);
 
-    if (m_lastStep.moveType != MOVETYPE_DIRECT)
+    if (step.moveType != MOVETYPE_DIRECT)
     {
-        pFrame->pGraphLog->AppendData(m_lastStep);
-        pFrame->pTarget->AppendData(m_lastStep);
-        GuidingAssistant::NotifyGuideStep(m_lastStep);
+        pFrame->pGraphLog->AppendData(step);
+        pFrame->pTarget->AppendData(step);
+        GuidingAssistant::NotifyGuideStep(step);
     }
+}
 
-    m_lastStep.frameNumber = -1; // invalidate
+void Mount::RecordMoveLatency(long queuedMs, long executeMs, bool merged, bool late)
+{
+    m_moveStats.Add(queuedMs, executeMs, merged, late);
 }
 
 bool Mount::HexGuide(const PHD_Point& xyVector, double rotationVector) {
+    return HexGuide(xyVector, rotationVector, pFrame->RequestedExposureDuration());
+}
+
+bool Mount::HexGuide(const PHD_Point& xyVector, double rotationVector, int moveLengthMs) {
     
-    // Send a guide command (in degrees) to the mount, via an atomic file shuffle.
-    // File format for guide commands is: guide,<pitch>,<roll>,<yaw>
-    //                       For example: guide,0.00000000,-0.0003000,0.0000000
+    // Send a guide command (in degrees) to the mount over the command channel.
+    // Legacy file format for guide commands is: guide,<pitch>,<roll>,<yaw>,<duration>
+    //                              For example: guide,0.00000000,-0.0003000,0.0000000,1.00
 
     if (std::isnan(rotationVector)) { 
         rotationVector = 0;
         Debug.AddLine("Mount: rotationvector was NAN, set to 0");
     } 
 
-    Debug.AddLine(wxString::Format("rotationVector %f", rotationVector));
-
-    char commandType[]    = "guide";
     double xVector        = xyVector.X;
     double yVector        = xyVector.Y;
-    char format[]         = "%s,%.10f,%.10f,%.10f,%1.2f";
+    double moveLength     = (double)moveLengthMs / 1000.0;
     char message[200]     = {0};
 
-    // Create directory if does not exist
-    struct stat info;
-    if( stat( GUIDE_OUTPUT_DIRECTORY, &info ) != 0 ) {
-        mkdir(GUIDE_DIRECTORY, 0755);
-        mkdir(GUIDE_OUTPUT_DIRECTORY, 0755);
-    }    
-
-    double moveLength = (double)pFrame->RequestedExposureDuration() / 1000.0;
-    sprintf(message, format, commandType, yVector, xVector, rotationVector, moveLength);
-    Debug.AddLine(wxString::Format("Mount: Sent guide command %s", message));
-    ofstream pulse_output;
-    pulse_output.open (TEMP_FILE_PATH, ios::out | ios::trunc);
-    if (pulse_output.fail()) {
-        Debug.Write(wxString::Format("Could not open %s", TEMP_FILE_PATH));
-        throw 20;
-    } else {
-        pulse_output << message;
-        pulse_output.close();
-    }
-    rename(TEMP_FILE_PATH, OUTPUT_FILE_PATH);
+    snprintf(message, sizeof(message), "%s,%.10f,%.10f,%.10f,%1.2f", "guide", yVector, xVector, rotationVector, moveLength);
+    double args[] = { yVector, xVector, rotationVector, moveLength };
+    uint32_t seq = MountChannel.Send(MOUNT_COMMAND_GUIDE, args, WXSIZEOF(args), message);
+    Debug.AddLine(wxString::Format("Mount: Sent guide command %u %s", seq, message));
 
     if (dynamic_cast<Camera_SimClass*>(pCamera)) {
         // If we're using the simulator, move sim camera
@@ -831,82 +876,80 @@ bool Mount::HexGuide(const PHD_Point& xyVector, double rotationVector) {
 
     }
 
-    return true; // TODO: Implement error checking code
+    return seq != 0;
 
 }
 
-bool Mount::HexGoto(double alt, double az) {
+uint32_t Mount::HexGoto(double alt, double az) {
+
+    // Correct for the known pointing errors, so the mount ends up at alt/az
+    // rather than wherever alt/az takes it
+    double mountAlt, mountAz;
+    m_pointingModel.ToMount(alt, az, &mountAlt, &mountAz);
+    if (m_pointingModel.IsUsable())
+        Debug.AddLine(wxString::Format("Mount: pointing model moves goto %f %f to %f %f", alt, az, mountAlt, mountAz));
+
+    return HexGotoMount(mountAlt, mountAz);
+}
+
+uint32_t Mount::HexGotoMount(double mountAlt, double mountAz) {
     
-    // Send a goto command (in alt/az) to the mount, via an atomic file shuffle.
-    // File format for goto commands is: goto,<alt>,<az>
-    //                      For example: goto,0.0000,-0.0003
+    // Send a goto command (in alt/az) to the mount over the command channel.
+    // Legacy file format for goto commands is: goto,<alt>,<az>,1
+    //                             For example: goto,0.0000,-0.0003,1
 
-    char commandType[]    = "goto";
-    char format[]         = "%s,%.10g,%.10g,1";
     char message[100]     = {0};
 
-    // Create directory if does not exist
-    struct stat info;
-    if( stat( GUIDE_OUTPUT_DIRECTORY, &info ) != 0 ) {
-        mkdir(GUIDE_DIRECTORY, 0755);
-        mkdir(GUIDE_OUTPUT_DIRECTORY, 0755);
-    }    
-
-    Debug.Write(wxString::Format("Sent %s,%.10f,%.10f,1\n", commandType, alt, az));
-    sprintf(message, format, commandType, alt, az);
-    ofstream pulse_output;
-    pulse_output.open (TEMP_FILE_PATH, ios::out | ios::trunc);
-    if (pulse_output.fail()) {
-        Debug.Write(wxString::Format("Could not open %s", TEMP_FILE_PATH));
-        throw 20;
-    } else {
-        pulse_output << message;
-        pulse_output.close();
-    }
-    rename(TEMP_FILE_PATH, OUTPUT_FILE_PATH);
+    snprintf(message, sizeof(message), "%s,%.10g,%.10g,1", "goto", mountAlt, mountAz);
+    double args[] = { mountAlt, mountAz, 1.0 };
+    uint32_t seq = MountChannel.Send(MOUNT_COMMAND_GOTO, args, WXSIZEOF(args), message, &m_lastGotoTracked);
+    Debug.AddLine(wxString::Format("Mount: Sent goto command %u %s", seq, message));
 
-    return true; // Change when error checking code implemented
+    m_lastGotoAlt = mountAlt;
+    m_lastGotoAz  = mountAz;
+    m_lastGotoSeq = seq;
 
+    return seq;
+
+}
+
+void Mount::GetLastGoto(double *mountAlt, double *mountAz) const {
+    *mountAlt = m_lastGotoAlt;
+    *mountAz  = m_lastGotoAz;
+}
+
+Mount::GotoProgress Mount::LastGotoProgress(void) const {
+    if (!m_lastGotoTracked)
+        return GOTO_UNTRACKED;
+    return MountChannel.IsAcked(m_lastGotoSeq) ? GOTO_COMPLETE : GOTO_MOVING;
 }
 
 bool Mount::HexCalibrate(double alt, double az, double camAngle, const PHD_Point &camRotationCenter, double astroAngle, double northCelestialPoleAlt) {
     
-    // Send a goto command (in alt/az) to the mount, via an atomic file shuffle.
-    // File format is: calibrate,<alt>,<az>,<cam rotation angle>,<cam rotation center x>,<cam rotation center y>,<astrometry sky rotation angle>
+    // Send a calibrate command to the mount over the command channel.
+    // Legacy file format is: calibrate,<alt>,<az>,<cam rotation angle>,<cam rotation center x>,<cam rotation center y>,<astrometry sky rotation angle>,<ncp alt>
     // Eveything is in radians. Including the center x and y - that's expressed in radians from the center.
 
-    char commandType[]    = "calibrate";
-    char format[]         = "%s,%.10g,%.10g,%.10g,%.10g,%.10g,%.10g,%.10g";
     char message[200]     = {0};
 
-    // Create directory if does not exist
-    struct stat info;
-    if( stat( GUIDE_OUTPUT_DIRECTORY, &info ) != 0 ) {
-        mkdir(GUIDE_DIRECTORY, 0755);
-        mkdir(GUIDE_OUTPUT_DIRECTORY, 0755);
-    }    
-
-    sprintf(message, format, commandType, alt, az, camAngle, camRotationCenter.X, camRotationCenter.Y, astroAngle, northCelestialPoleAlt);
-    ofstream pulse_output;
-    pulse_output.open (TEMP_FILE_PATH, ios::out | ios::trunc);
-    if (pulse_output.fail()) {
-        Debug.Write(wxString::Format("Could not open %s", TEMP_FILE_PATH));
-        throw 20;
-    } else {
-        pulse_output << message;
-        pulse_output.close();
-    }
-    rename(TEMP_FILE_PATH, OUTPUT_FILE_PATH);
+    snprintf(message, sizeof(message), "%s,%.10g,%.10g,%.10g,%.10g,%.10g,%.10g,%.10g", "calibrate",
+             alt, az, camAngle, camRotationCenter.X, camRotationCenter.Y, astroAngle, northCelestialPoleAlt);
+    double args[] = { alt, az, camAngle, camRotationCenter.X, camRotationCenter.Y, astroAngle, northCelestialPoleAlt };
+    uint32_t seq = MountChannel.Send(MOUNT_COMMAND_CALIBRATE, args, WXSIZEOF(args), message);
+    Debug.AddLine(wxString::Format("Mount: Sent calibrate command %u %s", seq, message));
 
-    return true; // Change when error checking code implemented
+    return seq != 0;
 
 }
 
-Mount::MOVE_RESULT Mount::Move(const PHD_Point& cameraVectorEndpoint, MountMoveType moveType, double rotationAngleDeg)
+Mount::MOVE_RESULT Mount::PrepareMove(const PHD_Point& cameraVectorEndpoint, MountMoveType moveType, double rotationAngleDeg,
+                                      GuideCorrection *correction)
 {
     // This method is only triggered by guiding - note the vector endpoint rather than a N/S/E/W direction and duration.
     MOVE_RESULT result = MOVE_OK;
 
+    *correction = GuideCorrection();
+
     try
     {
         double xDistance, yDistance;
@@ -928,22 +971,36 @@ Mount::MOVE_RESULT Mount::Move(const PHD_Point& cameraVectorEndpoint, MountMoveT
         }
         else
         {
-            if (TransformCameraCoordinatesToMountCoordinates(cameraVectorEndpoint, mountVectorEndpoint))
+            PHD_Point cameraVector(cameraVectorEndpoint);
+
+            if (moveType == MOVETYPE_ALGO)
+            {
+                // leave out what earlier moves will correct once the frame catches up with them
+                PHD_Point unseen;
+                double unseenRotation;
+                UnseenCorrection(pFrame->pGuider->CurrentImage(), &unseen, &unseenRotation);
+                if (unseen.X != 0.0 || unseen.Y != 0.0 || unseenRotation != 0.0)
+                {
+                    Debug.AddLine(wxString::Format("Mount: %u moves not yet seen, offset (%.2f, %.2f) rotation %f",
+                        (unsigned int) m_pendingCorrections.size(), unseen.X, unseen.Y, unseenRotation));
+                    cameraVector -= unseen;
+                    rotationAngleDeg -= unseenRotation;
+                }
+            }
+
+            if (TransformCameraCoordinatesToMountCoordinates(cameraVector, mountVectorEndpoint))
             {
                 throw ERROR_INFO("Unable to transform camera coordinates");
             }
 
             // The camera -> mount transform has been broken ever since we changed calibration process.
             // So we're bypassing it (by skipping the transform and just using the camera vector).
-            xDistance = cameraVectorEndpoint.X;
-            yDistance = cameraVectorEndpoint.Y;
+            xDistance = cameraVector.X;
+            yDistance = cameraVector.Y;
 
             // Convert pixels to degrees
-            // For Starshoot Autoguide, this is...
-            // 2.1701 x 1.73582 degrees
-            // 1280 x 1024 pixels
-            xVector = xDistance * 0.001695391; 
-            yVector = yDistance * 0.001695137;  
+            xVector = xDistance * DegreesPerPixelX;
+            yVector = yDistance * DegreesPerPixelY;
 
             // Scale movements by this value.
             //const double MOVE_SCALE_FACTOR = 0.5; 
@@ -998,11 +1055,22 @@ Mount::MOVE_RESULT Mount::Move(const PHD_Point& cameraVectorEndpoint, MountMoveT
         
             Debug.AddLine(wxString::Format("Mount: algo guide distances %f, %f", xVector, yVector));
             
-            // Make the mount move.
-            PHD_Point moveVector(xVector, yVector);
-            HexGuide(moveVector, rotationAngleDeg);
-            
-            
+            // The mount is moved by SendMove.
+            correction->send = true;
+            correction->moveVector.SetXY(xVector, yVector);
+            correction->rotationDeg = rotationAngleDeg;
+            correction->moveLengthMs = pFrame->RequestedExposureDuration();
+
+            if (++m_lastCorrectionId == 0)
+                ++m_lastCorrectionId;
+            correction->id = m_lastCorrectionId;
+
+            PendingCorrection pending;
+            pending.id = correction->id;
+            pending.camera.SetXY(xVector / DegreesPerPixelX, yVector / DegreesPerPixelY);
+            pending.rotationDeg = rotationAngleDeg;
+            pending.sentTime = 0;
+            m_pendingCorrections.push_back(pending);
         }
             
 
@@ -1027,12 +1095,12 @@ Mount::MOVE_RESULT Mount::Move(const PHD_Point& cameraVectorEndpoint, MountMoveT
             result = Move(yDirection, requestedYAmount, 0, moveType, &yMoveResult);
         }
 
-        // Record the info about the guide step. The info will be picked up back in the main UI thread.
-        // We don't want to do anything with the info here in the worker thread since UI operations are
-        // not allowed outside the main UI thread.
         */
-        GuideStepInfo& info = m_lastStep;
+        // Record the info about the guide step. It travels with the move and is
+        // logged when the move completes.
+        GuideStepInfo& info = correction->step;
 
+        info.mount = this;
         info.moveType = moveType;
         info.frameNumber = pFrame->m_frameCounter;
         info.time = pFrame->TimeSinceGuidingStarted();
@@ -1062,6 +1130,122 @@ Mount::MOVE_RESULT Mount::Move(const PHD_Point& cameraVectorEndpoint, MountMoveT
     return result;
 }
 
+// Treat each correction as taking effect when the worker reports it sent. A
+// frame whose exposure started after that has seen it all; one that started
+// earlier saw it for the part of the exposure after the move, since the
+// centroid averages the star position over the exposure. Moves still queued
+// have not been seen at all. The mount's own spreading of a move over its
+// move length is not modeled, so with one exposure at a time every move is
+// sent before the next exposure starts and nothing is subtracted.
+void Mount::UnseenCorrection(const usImage *frame, PHD_Point *offset, double *rotationDeg)
+{
+    offset->SetXY(0.0, 0.0);
+    *rotationDeg = 0.0;
+
+    if (!frame || !frame->ImgStartTime)
+        return;
+
+    wxLongLong start = wxLongLong(frame->ImgStartTime) * 1000 + frame->ImgStartMillis;
+
+    std::deque<PendingCorrection>::iterator it = m_pendingCorrections.begin();
+    while (it != m_pendingCorrections.end())
+    {
+        if (it->sentTime != 0 && it->sentTime <= start)
+        {
+            // seen by this frame, and so by every later one
+            it = m_pendingCorrections.erase(it);
+            continue;
+        }
+
+        double unseen = 1.0;
+        if (it->sentTime != 0 && frame->ImgExpDur > 0)
+            unseen = wxMin(1.0, (it->sentTime - start).ToDouble() / frame->ImgExpDur);
+
+        offset->X += unseen * it->camera.X;
+        offset->Y += unseen * it->camera.Y;
+        *rotationDeg += unseen * it->rotationDeg;
+        ++it;
+    }
+}
+
+void Mount::CorrectionSent(unsigned int id, const wxLongLong& sentTime)
+{
+    for (std::deque<PendingCorrection>::iterator it = m_pendingCorrections.begin(); it != m_pendingCorrections.end(); ++it)
+    {
+        if (it->id == id)
+        {
+            it->sentTime = sentTime;
+            break;
+        }
+    }
+}
+
+void Mount::CorrectionMerged(unsigned int id, unsigned int intoId)
+{
+    std::deque<PendingCorrection>::iterator from = m_pendingCorrections.end(), into = m_pendingCorrections.end();
+    for (std::deque<PendingCorrection>::iterator it = m_pendingCorrections.begin(); it != m_pendingCorrections.end(); ++it)
+    {
+        if (it->id == id)
+            from = it;
+        else if (it->id == intoId)
+            into = it;
+    }
+
+    if (from == m_pendingCorrections.end())
+        return;
+
+    // the pulse goes out with the newer move, and is seen when that one is
+    if (into != m_pendingCorrections.end())
+    {
+        into->camera += from->camera;
+        into->rotationDeg += from->rotationDeg;
+    }
+
+    m_pendingCorrections.erase(from);
+}
+
+void Mount::CorrectionDropped(unsigned int id)
+{
+    for (std::deque<PendingCorrection>::iterator it = m_pendingCorrections.begin(); it != m_pendingCorrections.end(); ++it)
+    {
+        if (it->id == id)
+        {
+            m_pendingCorrections.erase(it);
+            break;
+        }
+    }
+}
+
+Mount::MOVE_RESULT Mount::SendMove(const GuideCorrection& correction)
+{
+    // Make the mount move.
+    if (correction.send)
+        HexGuide(correction.moveVector, correction.rotationDeg, correction.moveLengthMs);
+
+    return MOVE_OK;
+}
+
+Mount::MOVE_RESULT Mount::Move(const PHD_Point& cameraVectorEndpoint, MountMoveType moveType, double rotationDeg)
+{
+    GuideCorrection correction;
+
+    MOVE_RESULT result = PrepareMove(cameraVectorEndpoint, moveType, rotationDeg, &correction);
+    if (result == MOVE_OK)
+        result = SendMove(correction);
+
+    // no MOVE_COMPLETE event settles a move sent from here, so settle its
+    // pending correction now
+    if (correction.id)
+    {
+        if (result == MOVE_OK)
+            CorrectionSent(correction.id, wxGetUTCTimeMillis());
+        else
+            CorrectionDropped(correction.id);
+    }
+
+    return result;
+}
+
 /*
  * The transform code has proven really tricky to get right.  For future generations
  * (and for me the next time I try to work on it), I'm going to put some notes here.
@@ -1524,6 +1708,9 @@ inline static GuideParity guide_parity(int val)
 void Mount::NotifyGuidingStopped(void)
 {
     Debug.Write("Mount: notify guiding stopped\n");
+    Debug.Write(wxString::Format("Mount: %s move latency %s\n", GetMountClassName(), m_moveStats.Summary()));
+
+    m_pendingCorrections.clear();
 
     if (m_pXGuideAlgorithm)
         m_pXGuideAlgorithm->GuidingStopped();
@@ -1663,6 +1850,7 @@ bool Mount::Connect(void)
 {
     m_connected = true;
     ResetErrorCount();
+    m_moveStats.Reset();
 
     if (pFrame)
     {
@@ -132,6 +132,56 @@ struct MoveResultInfo
     MoveResultInfo() : amountMoved(0), limited(false) { }
 };
 
+// latency of guide moves, from the time a move is queued to the time it
+// completes, reported by get_move_stats
+struct MoveLatencyStats
+{
+    enum { BUCKETS = 8 };
+    static const int BucketLimitMs[BUCKETS - 1]; // upper bound of each bucket but the last
+
+    unsigned int queued[BUCKETS];   // waiting for the mount thread
+    unsigned int execute[BUCKETS];  // moving
+    unsigned int moves;
+    unsigned int merged;            // sent as part of a newer correction
+    unsigned int late;              // started after the next frame was due
+    long maxQueuedMs;
+    long maxExecuteMs;
+
+    MoveLatencyStats() { Reset(); }
+    void Reset(void);
+    void Add(long queuedMs, long executeMs, bool wasMerged, bool wasLate);
+    wxString Summary(void) const;
+};
+
+// A guide move as worked out on the main thread. The guide algorithms run and
+// the step record is filled in when the move is scheduled, so the thread that
+// sends it to the mount touches nothing else.
+struct GuideCorrection
+{
+    unsigned int  id;               // key into Mount's pending corrections, 0 if not tracked
+    bool          send;             // false when there is nothing to send, e.g. dead reckoning
+    PHD_Point     moveVector;       // degrees, after the guide algorithms
+    double        rotationDeg;
+    int           moveLengthMs;     // time the mount spreads the move over
+    GuideStepInfo step;             // step.frameNumber < 0 when there is nothing to log
+
+    GuideCorrection() : id(0), send(false), rotationDeg(0.0), moveLengthMs(0)
+    {
+        step.mount = 0;
+        step.frameNumber = -1;
+    }
+};
+
+// A correction that has been scheduled but may not show in the frames taken
+// since, see Mount::UnseenCorrection
+struct PendingCorrection
+{
+    unsigned int id;
+    PHD_Point    camera;            // expected star displacement, pixels
+    double       rotationDeg;
+    wxLongLong   sentTime;          // UTC ms, 0 while the move is still queued
+};
+
 class MountConfigDialogCtrlSet : public ConfigDialogCtrlSet
 {
     Mount* m_pMount;
@@ -150,12 +200,21 @@ class Mount : public wxMessageBoxProxy
     bool m_connected;
     int m_requestCount;
     int m_errorCount;
+    MoveLatencyStats m_moveStats;
+    std::deque<PendingCorrection> m_pendingCorrections;
+    unsigned int m_lastCorrectionId;
 
     bool m_calibrated;
     Calibration m_cal;
     double m_xRate;         // rate adjusted for declination
     double m_yAngleError;
 
+    PointingModel m_pointingModel;
+    double m_lastGotoAlt;   // last goto as sent to the mount, after the pointing model
+    double m_lastGotoAz;
+    uint32_t m_lastGotoSeq;
+    bool m_lastGotoTracked; // went through the command ring, so will be acknowledged
+
 protected:
     bool m_guidingEnabled;
 
@@ -164,7 +223,6 @@ protected:
 
     wxString m_Name;
     BacklashComp *m_backlashComp;
-    GuideStepInfo m_lastStep;
 
     // Things related to the Advanced Config Dialog
 public:
@@ -241,9 +299,44 @@ public:
     void SetGuidingEnabled(bool guidingEnabled);
 
     bool HexGuide(const PHD_Point& xyVector, double rotationVector);
-    bool HexGoto(double alt, double az);
+    bool HexGuide(const PHD_Point& xyVector, double rotationVector, int moveLengthMs);
+    // Progress of the last goto. Gotos sent by the legacy command file are
+    // never acknowledged, so their progress is unknown.
+    enum GotoProgress
+    {
+        GOTO_MOVING,
+        GOTO_COMPLETE,
+        GOTO_UNTRACKED,
+    };
+
+    // Gotos return the command's sequence number, or 0 if it was not sent.
+    // HexGoto corrects alt/az with the pointing model, HexGotoMount sends
+    // them as they are.
+    uint32_t HexGoto(double alt, double az);
+    uint32_t HexGotoMount(double mountAlt, double mountAz);
+    void GetLastGoto(double *mountAlt, double *mountAz) const;
+    GotoProgress LastGotoProgress(void) const;
+    PointingModel& GetPointingModel(void) { return m_pointingModel; }
     bool HexCalibrate(double alt, double az, double camAngle, const PHD_Point &camRotationCenter, double astroAngle, double northCelestialPoleAlt);
     
+    // A guide move is made in two steps: PrepareMove runs the guide algorithms
+    // and must be called on the main thread, SendMove sends the result to the
+    // mount and may run on a worker thread. Move does both.
+    MOVE_RESULT PrepareMove(const PHD_Point& cameraVectorEndpoint, MountMoveType moveType, double rotationDeg,
+                            GuideCorrection *correction);
+    MOVE_RESULT SendMove(const GuideCorrection& correction);
+
+    // With overlapping exposures a frame can be taken before the moves
+    // computed from earlier frames have been made, so its offset still holds
+    // the error those moves correct. PrepareMove subtracts the part of each
+    // pending correction that the frame did not see; the worker (or Move, for
+    // a move sent synchronously) reports when each move went out with
+    // CorrectionSent, CorrectionMerged if it was sent as part of a newer move,
+    // or CorrectionDropped if it failed.
+    void UnseenCorrection(const usImage *frame, PHD_Point *offset, double *rotationDeg);
+    void CorrectionSent(unsigned int id, const wxLongLong& sentTime);
+    void CorrectionMerged(unsigned int id, unsigned int intoId);
+    void CorrectionDropped(unsigned int id);
     virtual MOVE_RESULT Move(const PHD_Point& cameraVectorEndpoint, MountMoveType moveType, double rotationDeg);
 
     bool TransformCameraCoordinatesToMountCoordinates(const PHD_Point& cameraVectorEndpoint,
@@ -252,7 +345,7 @@ public:
     bool TransformMountCoordinatesToCameraCoordinates(const PHD_Point& mountVectorEndpoint,
                                                      PHD_Point& cameraVectorEndpoint);
 
-    void LogGuideStepInfo(void);
+    void LogGuideStepInfo(const GuideStepInfo& step);
 
     GraphControlPane *GetXGuideAlgorithmControlPane(wxWindow *pParent);
     GraphControlPane *GetYGuideAlgorithmControlPane(wxWindow *pParent);
@@ -272,6 +365,9 @@ public:
     void IncrementErrorCount(void);
     void ResetErrorCount(void);
 
+    const MoveLatencyStats& GetMoveStats(void) const { return m_moveStats; }
+    void RecordMoveLatency(long queuedMs, long executeMs, bool merged, bool late);
+
     // pure virtual functions -- these MUST be overridden by a subclass
 public:
     // move the requested direction, return the actual amount of the move
@@ -0,0 +1,447 @@
+/*
+ *  mount_channel.cpp
+ *  PHD Guiding
+ *
+ *  Created by Arran Dengate
+ *  Copyright (c) 2017 Arran Dengate
+ *  All rights reserved.
+ *
+ *  This source code is distributed under the following "BSD" license
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *    Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *    Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *    Neither the name of Bret McKee, Dad Dog Development,
+ *     Craig Stark, Stark Labs nor the names of its
+ *     contributors may be used to endorse or promote products derived from
+ *     this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "phd.h"
+#include "mount_channel.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+static const char CHANNEL_DIRECTORY[]   = "/dev/shm/phd2/";
+static const char OUTPUT_DIRECTORY[]    = "/dev/shm/phd2/output/";
+static const char CHANNEL_FILE_PATH[]   = "/dev/shm/phd2/output/mount_channel";
+static const char TEMP_FILE_PATH[]      = "/dev/shm/phd2/output/temp_mount_command";
+static const char OUTPUT_FILE_PATH[]    = "/dev/shm/phd2/output/mount_command";
+
+static_assert(ATOMIC_INT_LOCK_FREE == 2, "mount channel needs lock-free 32 bit atomics");
+
+// how long a consumer found alive is trusted before it is checked again
+enum { CONSUMER_PROBE_MS = 1000 };
+
+MountCommandChannel MountChannel;
+
+static size_t ChannelSize(void)
+{
+    return sizeof(MountChannelHeader) + MOUNT_CHANNEL_CAPACITY * sizeof(MountCommandRecord);
+}
+
+static int64_t TimestampNow(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return (int64_t) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static int64_t MonotonicMs(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+static void CreateOutputDirectory(void)
+{
+    mkdir(CHANNEL_DIRECTORY, 0755);
+    mkdir(OUTPUT_DIRECTORY, 0755);
+}
+
+static void *MapChannel(bool create, size_t size)
+{
+    int fd = open(CHANNEL_FILE_PATH, create ? O_RDWR | O_CREAT : O_RDWR, 0666);
+    if (fd < 0)
+        return 0;
+
+    if (create && ftruncate(fd, size) != 0)
+    {
+        close(fd);
+        return 0;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < size)
+    {
+        close(fd);
+        return 0;
+    }
+
+    void *p = mmap(0, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+
+    return p == MAP_FAILED ? 0 : p;
+}
+
+MountCommandChannel::MountCommandChannel(void)
+    : m_header(0),
+      m_records(0),
+      m_mapSize(0),
+      m_openFailed(false),
+      m_directoryCreated(false),
+      m_sequence(0),
+      m_probedPid(0),
+      m_probedAt(0),
+      m_consumerAlive(false)
+{
+}
+
+MountCommandChannel::~MountCommandChannel(void)
+{
+    Close();
+}
+
+bool MountCommandChannel::Open(void)
+{
+    if (m_header)
+        return true;
+    if (m_openFailed)
+        return false;
+
+    if (!m_directoryCreated)
+    {
+        CreateOutputDirectory();
+        m_directoryCreated = true;
+    }
+
+    size_t size = ChannelSize();
+    void *p = MapChannel(true, size);
+    if (!p)
+    {
+        Debug.AddLine(wxString::Format("MountChannel: cannot map %s (errno %d), using command file only", CHANNEL_FILE_PATH, errno));
+        m_openFailed = true;
+        return false;
+    }
+
+    m_header = static_cast<MountChannelHeader *>(p);
+    m_records = reinterpret_cast<MountCommandRecord *>(static_cast<char *>(p) + sizeof(MountChannelHeader));
+    m_mapSize = size;
+
+    if (m_header->magic != MOUNT_CHANNEL_MAGIC || m_header->version != MOUNT_CHANNEL_VERSION ||
+        m_header->capacity != MOUNT_CHANNEL_CAPACITY || m_header->recordSize != sizeof(MountCommandRecord))
+    {
+        // New or stale segment, start over. The magic goes in last so a
+        // consumer never sees a half initialised header.
+        m_header->magic = 0;
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        m_header->version = MOUNT_CHANNEL_VERSION;
+        m_header->capacity = MOUNT_CHANNEL_CAPACITY;
+        m_header->recordSize = sizeof(MountCommandRecord);
+        m_header->consumerPid.store(0);
+        m_header->head.store(1);
+        m_header->tail.store(1);
+        m_header->acked.store(0);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        m_header->magic = MOUNT_CHANNEL_MAGIC;
+    }
+
+    m_header->producerPid = getpid();
+
+    // carry on from the last command in a segment left by an earlier run, so
+    // the consumer's acknowledgement does not cover new commands
+    uint32_t head = m_header->head.load(std::memory_order_relaxed);
+    if (head != 1)
+    {
+        uint32_t last = m_records[(head - 1) % MOUNT_CHANNEL_CAPACITY].sequence;
+        if ((int32_t) (last - m_sequence) > 0)
+            m_sequence = last;
+    }
+
+    Debug.AddLine(wxString::Format("MountChannel: opened %s, head %u tail %u", CHANNEL_FILE_PATH,
+        m_header->head.load(), m_header->tail.load()));
+
+    return true;
+}
+
+bool MountCommandChannel::Connect(void)
+{
+    wxCriticalSectionLocker lock(m_lock);
+    return Open();
+}
+
+void MountCommandChannel::Close(void)
+{
+    if (m_header)
+    {
+        munmap(m_header, m_mapSize);
+        m_header = 0;
+        m_records = 0;
+        m_mapSize = 0;
+    }
+}
+
+bool MountCommandChannel::ConsumerAttached(void)
+{
+    wxCriticalSectionLocker lock(m_lock);
+    return ProbeConsumer();
+}
+
+// kill() is a system call, too slow to make for every guide command, so a
+// consumer found alive is only checked again after CONSUMER_PROBE_MS, or
+// straight away when a different one attaches. Called with m_lock held.
+bool MountCommandChannel::ProbeConsumer(void)
+{
+    if (!m_header)
+        return false;
+    int32_t pid = m_header->consumerPid.load(std::memory_order_acquire);
+    if (pid <= 0)
+        return false;
+
+    int64_t now = MonotonicMs();
+    if (pid != m_probedPid || now - m_probedAt >= CONSUMER_PROBE_MS)
+    {
+        m_probedPid = pid;
+        m_probedAt = now;
+        m_consumerAlive = kill(pid, 0) == 0 || errno == EPERM;
+    }
+    return m_consumerAlive;
+}
+
+// 0 is never handed out, Send returns it for a command that failed
+uint32_t MountCommandChannel::NextSequence(void)
+{
+    if (++m_sequence == 0)
+        ++m_sequence;
+    return m_sequence;
+}
+
+// Replaces any command the controller has not picked up yet: the file
+// protocol has room for one
+bool MountCommandChannel::WriteFallbackFile(const char *text)
+{
+    if (!m_directoryCreated)
+    {
+        CreateOutputDirectory();
+        m_directoryCreated = true;
+    }
+
+    FILE *fp = fopen(TEMP_FILE_PATH, "w");
+    if (!fp)
+    {
+        Debug.AddLine(wxString::Format("MountChannel: could not open %s", TEMP_FILE_PATH));
+        return false;
+    }
+    fputs(text, fp);
+    fclose(fp);
+
+    if (rename(TEMP_FILE_PATH, OUTPUT_FILE_PATH) != 0)
+    {
+        Debug.AddLine(wxString::Format("MountChannel: could not rename %s", TEMP_FILE_PATH));
+        return false;
+    }
+
+    return true;
+}
+
+uint32_t MountCommandChannel::Send(MountCommandType type, const double *args, unsigned int argCount, const char *text,
+                                   bool *acknowledged)
+{
+    wxCriticalSectionLocker lock(m_lock);
+
+    if (acknowledged)
+        *acknowledged = false;
+
+    if (Open() && ProbeConsumer())
+    {
+        uint32_t head = m_header->head.load(std::memory_order_relaxed);
+        uint32_t tail = m_header->tail.load(std::memory_order_acquire);
+
+        if (head - tail < MOUNT_CHANNEL_CAPACITY)
+        {
+            uint32_t sequence = NextSequence();
+            MountCommandRecord& rec = m_records[head % MOUNT_CHANNEL_CAPACITY];
+            rec.sequence = sequence;
+            rec.type = type;
+            rec.timestamp = TimestampNow();
+            rec.argCount = std::min(argCount, (unsigned int) MOUNT_COMMAND_MAX_ARGS);
+            rec.reserved = 0;
+            memcpy(rec.args, args, rec.argCount * sizeof(double));
+
+            m_header->head.store(head + 1, std::memory_order_release);
+            if (acknowledged)
+                *acknowledged = true;
+            return sequence;
+        }
+
+        // The controller has stopped reading. Don't overwrite commands it has
+        // not seen yet; fall through to the file so the newest one still gets
+        // out.
+        Debug.AddLine(wxString::Format("MountChannel: ring full (head %u tail %u), using command file", head, tail));
+    }
+
+    if (!WriteFallbackFile(text))
+        return 0;
+
+    return NextSequence();
+}
+
+uint32_t MountCommandChannel::LastAcked(void) const
+{
+    return m_header ? m_header->acked.load(std::memory_order_acquire) : 0;
+}
+
+bool MountCommandChannel::IsAcked(uint32_t sequence) const
+{
+    return m_header && (int32_t) (LastAcked() - sequence) >= 0;
+}
+
+MountCommandReader::MountCommandReader(void)
+    : m_header(0),
+      m_records(0),
+      m_mapSize(0)
+{
+}
+
+MountCommandReader::~MountCommandReader(void)
+{
+    Detach();
+}
+
+bool MountCommandReader::Attach(void)
+{
+    if (m_header)
+        return true;
+
+    size_t size = ChannelSize();
+    void *p = MapChannel(false, size);
+    if (!p)
+        return false;
+
+    MountChannelHeader *header = static_cast<MountChannelHeader *>(p);
+    if (header->magic != MOUNT_CHANNEL_MAGIC || header->version != MOUNT_CHANNEL_VERSION)
+    {
+        munmap(p, size);
+        return false;
+    }
+
+    m_header = header;
+    m_records = reinterpret_cast<MountCommandRecord *>(static_cast<char *>(p) + sizeof(MountChannelHeader));
+    m_mapSize = size;
+    m_header->consumerPid.store(getpid(), std::memory_order_release);
+
+    return true;
+}
+
+void MountCommandReader::Detach(void)
+{
+    if (m_header)
+    {
+        int32_t pid = getpid();
+        m_header->consumerPid.compare_exchange_strong(pid, 0);
+        munmap(m_header, m_mapSize);
+        m_header = 0;
+        m_records = 0;
+    }
+}
+
+bool MountCommandReader::Read(MountCommandRecord *record)
+{
+    if (!m_header)
+        return false;
+
+    uint32_t tail = m_header->tail.load(std::memory_order_relaxed);
+    uint32_t head = m_header->head.load(std::memory_order_acquire);
+    if (tail == head)
+        return false;
+
+    *record = m_records[tail % MOUNT_CHANNEL_CAPACITY];
+    m_header->tail.store(tail + 1, std::memory_order_release);
+    return true;
+}
+
+void MountCommandReader::Acknowledge(uint32_t sequence)
+{
+    if (m_header)
+        m_header->acked.store(sequence, std::memory_order_release);
+}
+
+MountControllerStandIn::MountControllerStandIn(void)
+    : m_slewMs(0),
+      m_lastRead(0),
+      m_slewing(false)
+{
+}
+
+bool MountControllerStandIn::Start(int slewMs)
+{
+    m_slewMs = slewMs;
+    m_lastRead = 0;
+    m_slewing = false;
+
+    if (!MountChannel.Connect() || !m_reader.Attach())
+    {
+        Debug.AddLine("MountChannel: could not start the controller stand-in");
+        return false;
+    }
+
+    Debug.AddLine(wxString::Format("MountChannel: controller stand-in attached, slews take %d ms", slewMs));
+    return true;
+}
+
+void MountControllerStandIn::Stop(void)
+{
+    m_reader.Detach();
+}
+
+void MountControllerStandIn::Poll(void)
+{
+    if (!m_reader.IsAttached())
+        return;
+
+    wxLongLong now = wxGetUTCTimeMillis();
+
+    MountCommandRecord rec;
+    while (m_reader.Read(&rec))
+    {
+        m_lastRead = rec.sequence;
+        if (rec.type == MOUNT_COMMAND_GOTO)
+        {
+            m_slewing = true;
+            m_slewDone = now + m_slewMs;
+        }
+    }
+
+    if (m_slewing && now >= m_slewDone)
+        m_slewing = false;
+
+    // Acknowledgements are cumulative, so nothing after a goto can be
+    // acknowledged until the slew is over
+    if (!m_slewing && m_lastRead != 0)
+        m_reader.Acknowledge(m_lastRead);
+}
@@ -0,0 +1,188 @@
+/*
+ *  mount_channel.h
+ *  PHD Guiding
+ *
+ *  Created by Arran Dengate
+ *  Copyright (c) 2017 Arran Dengate
+ *  All rights reserved.
+ *
+ *  This source code is distributed under the following "BSD" license
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *    Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *    Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *    Neither the name of Bret McKee, Dad Dog Development,
+ *     Craig Stark, Stark Labs nor the names of its
+ *     contributors may be used to endorse or promote products derived from
+ *     this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef MOUNT_CHANNEL_H_INCLUDED
+#define MOUNT_CHANNEL_H_INCLUDED
+
+#include <atomic>
+#include <stdint.h>
+
+// Commands for the hexapod controller go through a single-producer,
+// single-consumer ring buffer in a memory-mapped file under /dev/shm. The
+// layout below is shared with the controller process, so any change to it
+// must bump MOUNT_CHANNEL_VERSION.
+//
+//   head      - number of the next slot the producer will write
+//   tail      - number of the next slot the consumer will read
+//   acked     - sequence number of the last command the mount has finished
+//
+// Slot numbers are free-running 32 bit counters; a record lives in slot
+// (number % capacity). The producer publishes a record by storing head with
+// release semantics, the consumer frees it by storing tail the same way.
+//
+// When no consumer has attached to the segment, or the ring is full, the old
+// text file protocol (an atomic rename over /dev/shm/phd2/output/mount_command)
+// is used instead, so controllers that have not been updated keep working.
+// The file holds a single command: one the controller has not picked up yet
+// is replaced by the next, and commands sent this way are never acknowledged.
+//
+// Every command takes the next number from one sequence, whichever way it is
+// sent, so a record's sequence can skip the numbers of commands that went
+// through the file and is not its slot number.
+
+enum { MOUNT_CHANNEL_MAGIC = 0x48584d43 };  // "HXMC"
+enum { MOUNT_CHANNEL_VERSION = 2 };
+enum { MOUNT_CHANNEL_CAPACITY = 64 };
+enum { MOUNT_COMMAND_MAX_ARGS = 8 };
+
+enum MountCommandType
+{
+    MOUNT_COMMAND_GUIDE = 1,
+    MOUNT_COMMAND_GOTO = 2,
+    MOUNT_COMMAND_CALIBRATE = 3,
+};
+
+struct MountCommandRecord
+{
+    uint32_t sequence;             // command sequence number, see above
+    uint32_t type;                 // MountCommandType
+    int64_t  timestamp;            // CLOCK_REALTIME, nanoseconds
+    uint32_t argCount;
+    uint32_t reserved;
+    double   args[MOUNT_COMMAND_MAX_ARGS];
+};
+
+struct MountChannelHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t capacity;
+    uint32_t recordSize;
+    int32_t  producerPid;
+    std::atomic<int32_t> consumerPid;
+
+    alignas(64) std::atomic<uint32_t> head;
+    alignas(64) std::atomic<uint32_t> tail;
+    std::atomic<uint32_t> acked;
+};
+
+class MountCommandChannel
+{
+    wxCriticalSection m_lock;      // Mount::Move and the UI can both send
+    MountChannelHeader *m_header;
+    MountCommandRecord *m_records;
+    size_t m_mapSize;
+    bool m_openFailed;
+    bool m_directoryCreated;
+    uint32_t m_sequence;           // last sequence number handed out
+    int32_t m_probedPid;           // consumer last checked for, and when
+    int64_t m_probedAt;
+    bool m_consumerAlive;
+
+    bool Open(void);
+    bool ProbeConsumer(void);
+    uint32_t NextSequence(void);
+    bool WriteFallbackFile(const char *text);
+
+public:
+    MountCommandChannel(void);
+    ~MountCommandChannel(void);
+
+    // Create the shared segment ahead of the first command, so that a
+    // consumer can attach before anything is sent
+    bool Connect(void);
+    void Close(void);
+
+    bool ConsumerAttached(void);
+
+    // Queue a command. text is the legacy one-line representation, used when
+    // no consumer is attached. Returns the command's sequence number, or 0 if
+    // it could not be delivered. If acknowledged is given it is set to whether
+    // the command went through the ring, i.e. whether IsAcked will report it;
+    // a command sent through the file only counts as acknowledged once a
+    // later one that went through the ring is.
+    uint32_t Send(MountCommandType type, const double *args, unsigned int argCount, const char *text,
+                  bool *acknowledged = 0);
+
+    // Sequence number of the last command the mount reported as complete
+    uint32_t LastAcked(void) const;
+    bool IsAcked(uint32_t sequence) const;
+};
+
+// The controller side of the channel. The real consumer lives in the hexapod
+// controller; this one is used by the simulator and for testing.
+class MountCommandReader
+{
+    MountChannelHeader *m_header;
+    MountCommandRecord *m_records;
+    size_t m_mapSize;
+
+public:
+    MountCommandReader(void);
+    ~MountCommandReader(void);
+
+    bool Attach(void);
+    void Detach(void);
+    bool IsAttached(void) const { return m_header != 0; }
+
+    // Pop the oldest unread command, returns false if the ring is empty
+    bool Read(MountCommandRecord *record);
+    void Acknowledge(uint32_t sequence);
+};
+
+// Stands in for the hexapod controller when there is none, e.g. with the
+// camera simulator. It drains the channel and acknowledges each goto once a
+// simulated slew time has passed, so goto logic can be exercised without a
+// mount. Runs on the main thread, driven by Poll().
+class MountControllerStandIn
+{
+    MountCommandReader m_reader;
+    int m_slewMs;
+    uint32_t m_lastRead;
+    bool m_slewing;
+    wxLongLong m_slewDone;
+
+public:
+    MountControllerStandIn(void);
+
+    bool Start(int slewMs);
+    void Stop(void);
+    bool IsRunning(void) const { return m_reader.IsAttached(); }
+    void Poll(void);
+};
+
+extern MountCommandChannel MountChannel;
+
+#endif // MOUNT_CHANNEL_H_INCLUDED
@@ -58,6 +58,8 @@ static const DitherMode DefaultDitherMode = DITHER_RANDOM;
 static const bool DefaultServerMode = true;
 static const bool DefaultLoggingMode = false;
 static const int DefaultTimelapse = 0;
+static const int DefaultPipelineDepth = 1;
+static const int MaxPipelineDepth = 3;
 static const int DefaultFocalLength = 0;
 static const int DefaultAutoExpMin = 1000;
 static const int DefaultAutoExpMax = 5000;
@@ -188,6 +190,8 @@ MyFrame::MyFrame(int instanceNumber, wxLocale *locale)
     StartWorkerThread(m_pPrimaryWorkerThread);
     m_pSecondaryWorkerThread = NULL;
     StartWorkerThread(m_pSecondaryWorkerThread);
+    m_pMountWorkerThread = NULL;
+    StartWorkerThread(m_pMountWorkerThread);
 
     //m_statusbarTimer.SetOwner(this, STATUSBAR_TIMER_EVENT);
 
@@ -389,7 +393,7 @@ MyFrame::MyFrame(int instanceNumber, wxLocale *locale)
 
     m_continueCapturing = false;
     CaptureActive     = false;
-    m_exposurePending = false;
+    m_exposuresPending = 0;
 
     m_mgr.GetArtProvider()->SetColour(wxAUI_DOCKART_BACKGROUND_COLOUR, *wxBLACK);
     m_mgr.GetArtProvider()->SetMetric(wxAUI_DOCKART_GRADIENT_TYPE, wxAUI_GRADIENT_VERTICAL);
@@ -824,6 +828,9 @@ void MyFrame::LoadProfileSettings(void)
     int timeLapse = pConfig->Profile.GetInt("/frame/timeLapse", DefaultTimelapse);
     SetTimeLapse(timeLapse);
 
+    int pipelineDepth = pConfig->Profile.GetInt("/frame/pipelineDepth", DefaultPipelineDepth);
+    SetPipelineDepth(pipelineDepth);
+
     SetAutoLoadCalibration(pConfig->Profile.GetBoolean("/AutoLoadCalibration", false));
 
     int focalLength = pConfig->Profile.GetInt("/frame/focalLength", DefaultFocalLength);
@@ -1230,7 +1237,7 @@ void MyFrame::DoTryReconnect()
     {
         Debug.Write(wxString::Format("More than %d camera reconnect attempts in less than %d seconds, "
             "return without reconnect.\n", MAX_ATTEMPTS, TIME_WINDOW));
-        OnExposeComplete(0, true);
+        OnExposeComplete(FramePtr(), true);
         return;
     }
     m_cameraReconnectAttempts.push_back(now);
@@ -1240,14 +1247,15 @@ void MyFrame::DoTryReconnect()
     {
         Debug.Write("Camera Re-connect failed\n");
         // complete the pending exposure notification
-        OnExposeComplete(0, true);
+        OnExposeComplete(FramePtr(), true);
     }
     else
     {
         Debug.Write("Camera Re-connect succeeded, resume exposures\n");
         UpdateStateLabels();
-        m_exposurePending = false; // exposure no longer pending
-        ScheduleExposure();
+        --m_exposuresPending; // exposure no longer pending
+        if (!m_exposuresPending)
+            ScheduleExposure();
     }
 }
 
@@ -1472,7 +1480,7 @@ bool MyFrame::StopWorkerThread(WorkerThread*& pWorkerThread)
 void MyFrame::OnRequestExposure(wxCommandEvent& evt)
 {
     EXPOSE_REQUEST *req = (EXPOSE_REQUEST *) evt.GetClientData();
-    bool error = GuideCamera::Capture(pCamera, req->exposureDuration, *req->pImage, req->options, req->subframe);
+    bool error = GuideCamera::Capture(pCamera, req->exposureDuration, *req->image, req->options, req->subframe);
     req->error = error;
     req->pSemaphore->Post();
 }
@@ -1489,7 +1497,7 @@ void MyFrame::OnRequestMountMove(wxCommandEvent& evt)
     }
     else
     {
-        pRequest->moveResult = pRequest->pMount->Move(pRequest->vectorEndpoint, pRequest->moveType, 0);
+        pRequest->moveResult = pRequest->pMount->SendMove(pRequest->correction);
     }
 
     pRequest->pSemaphore->Post();
@@ -1513,30 +1521,63 @@ void MyFrame::ScheduleExposure(void)
     const wxRect& subframe = pGuider->GetBoundingBox();
 
     //Debug.Write(wxString::Format("ScheduleExposure(%d,%x,%d) exposurePending=%d\n",
-    //    exposureDuration, exposureOptions, !subframe.IsEmpty(), m_exposurePending));
+    //    exposureDuration, exposureOptions, !subframe.IsEmpty(), m_exposuresPending));
 
-    assert(wxThread::IsMain()); // m_exposurePending only updated in main thread
-    assert(!m_exposurePending);
+    assert(wxThread::IsMain()); // m_exposuresPending only updated in main thread
+    assert(m_exposuresPending < m_pipelineDepth);
 
-    m_exposurePending = true;
+    ++m_exposuresPending;
 
-    usImage *img = new usImage();
+    FramePtr img = m_framePool.Acquire();
 
     wxCriticalSectionLocker lock(m_CSpWorkerThread);
     assert(m_pPrimaryWorkerThread);
     m_pPrimaryWorkerThread->EnqueueWorkerThreadExposeRequest(img, exposureDuration, exposureOptions, subframe);
 }
 
+// True when the next exposure may start before the last frame has been
+// processed. Calibration and star selection need each move to finish before
+// the next frame is taken, so frames only overlap while guiding.
+bool MyFrame::PipelineActive(void) const
+{
+    return m_pipelineDepth > 1 && pCamera && pCamera->HasNonGuiCapture() &&
+        pGuider->IsGuiding() && pGuider->GetPauseType() == PAUSE_NONE;
+}
+
 void MyFrame::SchedulePrimaryMove(Mount *mount, const PHD_Point& vectorEndpoint, MountMoveType moveType, double rotationDeg)
 {
     //Debug.Write(wxString::Format("SchedulePrimaryMove(%p, x=%.2f, y=%.2f, type=%d)\n", mount, vectorEndpoint.X, vectorEndpoint.Y, moveType));
     wxCriticalSectionLocker lock(m_CSpWorkerThread);
 
     assert(mount);
+    assert(wxThread::IsMain()); // the guide algorithms run here
+
+    GuideCorrection correction;
+    if (mount->PrepareMove(vectorEndpoint, moveType, rotationDeg, &correction) != Mount::MOVE_OK)
+    {
+        Debug.Write("SchedulePrimaryMove: PrepareMove failed\n");
+        mount->IncrementErrorCount();
+        return;
+    }
+
     mount->IncrementRequestCount();
 
+    // the correction from the next frame replaces this one, so the move is
+    // late if it has not started by then
+    int deadlineMs = RequestedExposureDuration();
+
+    if (PipelineActive() && !mount->SynchronousOnly())
+    {
+        // the primary thread is busy taking the next exposure, do not hold
+        // the correction back until it completes. Moves get their own thread
+        // so they do not queue behind the secondary mount's bumps.
+        assert(m_pMountWorkerThread);
+        m_pMountWorkerThread->EnqueueWorkerThreadMoveRequest(mount, vectorEndpoint, moveType, correction, deadlineMs);
+        return;
+    }
+
     assert(m_pPrimaryWorkerThread);
-    m_pPrimaryWorkerThread->EnqueueWorkerThreadMoveRequest(mount, vectorEndpoint, moveType, rotationDeg);
+    m_pPrimaryWorkerThread->EnqueueWorkerThreadMoveRequest(mount, vectorEndpoint, moveType, correction, deadlineMs);
 }
 
 void MyFrame::ScheduleSecondaryMove(Mount *mount, const PHD_Point& vectorEndpoint, MountMoveType moveType)
@@ -1554,10 +1595,18 @@ void MyFrame::ScheduleSecondaryMove(Mount *mount, const PHD_Point& vectorEndpoin
     }
     else
     {
+        GuideCorrection correction;
+        if (mount->PrepareMove(vectorEndpoint, moveType, 0, &correction) != Mount::MOVE_OK)
+        {
+            Debug.Write("ScheduleSecondaryMove: PrepareMove failed\n");
+            mount->IncrementErrorCount();
+            return;
+        }
+
         mount->IncrementRequestCount();
 
         assert(m_pSecondaryWorkerThread);
-        m_pSecondaryWorkerThread->EnqueueWorkerThreadMoveRequest(mount, vectorEndpoint, moveType, 0);
+        m_pSecondaryWorkerThread->EnqueueWorkerThreadMoveRequest(mount, vectorEndpoint, moveType, correction, 0);
     }
 }
 
@@ -1591,7 +1640,7 @@ void MyFrame::ScheduleCalibrationMove(Mount *mount, const GUIDE_DIRECTION direct
 
 void MyFrame::StartCapturing()
 {
-    Debug.Write(wxString::Format("StartCapturing CaptureActive=%d continueCapturing=%d exposurePending=%d\n", CaptureActive, m_continueCapturing, m_exposurePending));
+    Debug.Write(wxString::Format("StartCapturing CaptureActive=%d continueCapturing=%d exposuresPending=%d\n", CaptureActive, m_continueCapturing, m_exposuresPending));
 
     if (!CaptureActive)
     {
@@ -1603,10 +1652,10 @@ void MyFrame::StartCapturing()
         CheckDarkFrameGeometry();
         UpdateButtonsStatus();
 
-        // m_exposurePending should always be false here since CaptureActive is cleared on exposure
+        // m_exposuresPending should always be zero here since CaptureActive is cleared on exposure
         // completion, but be paranoid and check it anyway
 
-        if (!m_exposurePending)
+        if (!m_exposuresPending)
         {
             pCamera->InitCapture();
             ScheduleExposure();
@@ -1616,16 +1665,17 @@ void MyFrame::StartCapturing()
 
 void MyFrame::StopCapturing(void)
 {
-    Debug.Write(wxString::Format("StopCapturing CaptureActive=%d continueCapturing=%d exposurePending=%d\n", CaptureActive, m_continueCapturing, m_exposurePending));
+    Debug.Write(wxString::Format("StopCapturing CaptureActive=%d continueCapturing=%d exposuresPending=%d\n", CaptureActive, m_continueCapturing, m_exposuresPending));
 
     if (m_continueCapturing)
     {
         StatusMsgNoTimeout(_("Waiting for devices..."));
         m_continueCapturing = false;
 
-        if (m_exposurePending)
+        if (m_exposuresPending)
         {
             m_pPrimaryWorkerThread->RequestStop();
+            m_pMountWorkerThread->RequestStop();
         }
         else
         {
@@ -1644,7 +1694,7 @@ void MyFrame::SetPaused(PauseType pause)
 {
     bool const isPaused = pGuider->IsPaused();
 
-    Debug.Write(wxString::Format("SetPaused type=%d isPaused=%d exposurePending=%d\n", pause, isPaused, m_exposurePending));
+    Debug.Write(wxString::Format("SetPaused type=%d isPaused=%d exposuresPending=%d\n", pause, isPaused, m_exposuresPending));
 
     if (pause != PAUSE_NONE && !isPaused)
     {
@@ -1661,7 +1711,7 @@ void MyFrame::SetPaused(PauseType pause)
             Debug.Write("un-pause: clearing mount guide algorithm history\n");
             pMount->NotifyGuidingResumed();
         }
-        if (m_continueCapturing && !m_exposurePending)
+        if (m_continueCapturing && !m_exposuresPending)
             ScheduleExposure();
         StatusMsg(_("Resumed"));
         GuideLog.ServerCommand(pGuider, "RESUME");
@@ -1897,6 +1947,8 @@ void MyFrame::OnClose(wxCloseEvent& event)
     bool killed = StopWorkerThread(m_pPrimaryWorkerThread);
     if (StopWorkerThread(m_pSecondaryWorkerThread))
         killed = true;
+    if (StopWorkerThread(m_pMountWorkerThread))
+        killed = true;
 
     // disconnect all gear
     pGearDialog->Shutdown(killed);
@@ -2125,6 +2177,7 @@ static bool load_multi_darks(GuideCamera *camera, const wxString& fname)
     fitsfile *fptr = 0;
     int status = 0;  // CFITSIO status value MUST be initialized to zero!
     long last_frame_size [] = { -1L, -1L };
+    ExposureImgMap loaded;
 
     try
     {
@@ -2133,6 +2186,9 @@ static bool load_multi_darks(GuideCamera *camera, const wxString& fname)
             throw ERROR_INFO("File does not exist");
         }
 
+        if (DarkLibraryCache::Load(camera, fname))
+            return false;
+
         if (PHD_fits_open_diskfile(&fptr, fname, READONLY, &status) == 0)
         {
             int nhdus = 0;
@@ -2195,6 +2251,7 @@ static bool load_multi_darks(GuideCamera *camera, const wxString& fname)
                 img->ImgExpDur = (int)(exposure * 1000.0);
 
                 Debug.Write(wxString::Format("loaded dark frame exposure = %d\n", img->ImgExpDur));
+                loaded[img->ImgExpDur] = img.get();
                 camera->AddDark(img.release());
 
                 // if this is the last hdu, we are done
@@ -2224,6 +2281,14 @@ static bool load_multi_darks(GuideCamera *camera, const wxString& fname)
         PHD_fits_close_file(fptr);
     }
 
+    // next time the darks are mapped from the cache instead of parsed, and
+    // reloading them now swaps the copies just read for mapped ones
+    if (!bError)
+    {
+        DarkLibraryCache::Save(loaded, fname);
+        DarkLibraryCache::Load(camera, fname);
+    }
+
     return bError;
 }
 
@@ -2378,6 +2443,12 @@ void MyFrame::SaveDarkLibrary(const wxString& note)
     if (save_multi_darks(pCamera->Darks, filename, note))
     {
         Alert(_("Error saving darks FITS file ") + filename);
+        DarkLibraryCache::Remove(filename);
+    }
+    else
+    {
+        DarkLibraryCache::Save(pCamera->Darks, filename);
+        DarkLibraryCache::Load(pCamera, filename);
     }
 }
 
@@ -2391,6 +2462,7 @@ void MyFrame::DeleteDarkLibraryFiles(int profileId)
         Debug.Write(wxString::Format("Removing dark library file: %s\n", filename));
         wxRemoveFile(filename);
     }
+    DarkLibraryCache::Remove(filename);
 
     DefectMap::DeleteDefectMap(profileId);
 }
@@ -2441,6 +2513,36 @@ bool MyFrame::SetTimeLapse(int timeLapse)
     return bError;
 }
 
+int MyFrame::GetPipelineDepth(void)
+{
+    return m_pipelineDepth;
+}
+
+bool MyFrame::SetPipelineDepth(int depth)
+{
+    bool bError = false;
+
+    try
+    {
+        if (depth < 1 || depth > MaxPipelineDepth)
+        {
+            throw ERROR_INFO("invalid pipeline depth");
+        }
+
+        m_pipelineDepth = depth;
+    }
+    catch (const wxString& Msg)
+    {
+        POSSIBLY_UNUSED(Msg);
+        bError = true;
+        m_pipelineDepth = DefaultPipelineDepth;
+    }
+
+    pConfig->Profile.SetInt("/frame/pipelineDepth", m_pipelineDepth);
+
+    return bError;
+}
+
 int MyFrame::GetFocalLength(void)
 {
     return m_focalLength;
@@ -2629,6 +2731,16 @@ MyFrameConfigDialogCtrlSet::MyFrameConfigDialogCtrlSet(MyFrame *pFrame, Advanced
     AddLabeledCtrl(CtrlMap, AD_szTimeLapse, _("Time Lapse (ms)"), m_pTimeLapse,
         _("How long should PHD wait between guide frames? Default = 0ms, useful when using very short exposures (e.g., using a video camera) but wanting to send guide commands less frequently"));
 
+    parent = GetParentWindow(AD_szPipelineDepth);
+    m_pPipelineDepth = new wxSpinCtrl(parent, wxID_ANY, wxEmptyString, wxPoint(-1, -1),
+        wxSize(width + 30, -1), wxSP_ARROW_KEYS, 1, MaxPipelineDepth, DefaultPipelineDepth, _T("PipelineDepth"));
+    AddLabeledCtrl(CtrlMap, AD_szPipelineDepth, _("Pipeline depth"), m_pPipelineDepth,
+        _("How many guide frames can be in flight at once? Default = 1, each frame is measured before the next exposure starts. "
+        "Higher values start the next exposure while the last frame is measured, so the frame rate approaches the exposure rate, "
+        "but each frame is taken before the moves from the frames ahead of it have been made. PHD subtracts those pending moves "
+        "from the measured offset, so the guide algorithms work from staler data but errors are not corrected twice. "
+        "Only used while guiding with a camera that captures in the background."));
+
     parent = GetParentWindow(AD_szFocalLength);
     m_pFocalLength = new wxTextCtrl(parent, wxID_ANY, _T("    "), wxDefaultPosition, wxSize(width + 30, -1));
     AddLabeledCtrl(CtrlMap, AD_szFocalLength, _("Focal length (mm)"), m_pFocalLength,
@@ -2760,6 +2872,7 @@ void MyFrameConfigDialogCtrlSet::LoadValues()
     m_ditherRaOnly->SetValue(m_pFrame->GetDitherRaOnly());
     m_ditherScaleFactor->SetValue(m_pFrame->GetDitherScaleFactor());
     m_pTimeLapse->SetValue(m_pFrame->GetTimeLapse());
+    m_pPipelineDepth->SetValue(m_pFrame->GetPipelineDepth());
     SetFocalLength(m_pFrame->GetFocalLength());
     m_pFocalLength->Enable(!pFrame->CaptureActive);
 
@@ -2814,6 +2927,7 @@ void MyFrameConfigDialogCtrlSet::UnloadValues()
         m_pFrame->SetDitherRaOnly(m_ditherRaOnly->GetValue());
         m_pFrame->SetDitherScaleFactor(m_ditherScaleFactor->GetValue());
         m_pFrame->SetTimeLapse(m_pTimeLapse->GetValue());
+        m_pFrame->SetPipelineDepth(m_pPipelineDepth->GetValue());
         m_pFrame->SetFocalLength(GetFocalLength());
 
         int language = m_pLanguage->GetSelection();
@@ -125,6 +125,7 @@ class MyFrameConfigDialogCtrlSet : public ConfigDialogCtrlSet
     wxCheckBox *m_ditherRaOnly;
     wxChoice *m_pNoiseReduction;
     wxSpinCtrl *m_pTimeLapse;
+    wxSpinCtrl *m_pPipelineDepth;
     wxTextCtrl *m_pFocalLength;
     wxChoice* m_pLanguage;
     wxArrayInt m_LanguageIDs;
@@ -159,6 +160,9 @@ protected:
     bool SetTimeLapse(int timeLapse);
     int GetTimeLapse(void);
 
+    bool SetPipelineDepth(int depth);
+    int GetPipelineDepth(void);
+
     bool SetFocalLength(int focalLength);
 
     bool SetLanguage(int language);
@@ -182,6 +186,8 @@ private:
     DitherSpiral m_ditherSpiral;
     bool m_serverMode;
     int  m_timeLapse;       // Delay between frames (useful for vid cameras)
+    int  m_pipelineDepth;   // Frames in flight while guiding, 1 = capture and process in turn
+    FramePool m_framePool;  // images for ScheduleExposure to capture into
     int  m_focalLength;
     double m_sampling;
     bool m_autoLoadCalibration;
@@ -236,7 +242,7 @@ public:
     wxDialog *pCalSanityCheckDlg;
     wxDialog *pCalReviewDlg;
     bool CaptureActive; // Is camera looping captures?
-    bool m_exposurePending; // exposure scheduled and not completed
+    int m_exposuresPending; // exposures scheduled and not completed
     double Stretch_gamma;
     int gammaValue;
     wxLocale *m_pLocale;
@@ -321,7 +327,7 @@ public:
     void OnImportCamCal(wxCommandEvent& evt);
 
     void OnExposeComplete(wxThreadEvent& evt);
-    void OnExposeComplete(usImage *image, bool err);
+    void OnExposeComplete(const FramePtr& image, bool err);
     void OnMoveComplete(wxThreadEvent& evt);
     void LoadProfileSettings(void);
     void UpdateTitle(void);
@@ -382,6 +388,7 @@ public:
     void OnRequestMountMove(wxCommandEvent& evt);
 
     void ScheduleExposure(void);
+    bool PipelineActive(void) const;
 
     void SchedulePrimaryMove(Mount *pMount, const PHD_Point& vectorEndpoint, MountMoveType moveType, double rotationDeg);
     void ScheduleSecondaryMove(Mount *pMount, const PHD_Point& vectorEndpoint, MountMoveType moveType);
@@ -424,6 +431,7 @@ private:
     wxCriticalSection m_CSpWorkerThread;
     WorkerThread *m_pPrimaryWorkerThread;
     WorkerThread *m_pSecondaryWorkerThread;
+    WorkerThread *m_pMountWorkerThread;     // primary mount moves while exposures overlap
 
     wxSocketServer *SocketServer;
     wxTimer m_statusbarTimer;
@@ -633,6 +641,10 @@ enum {
     SOCK_SERVER_CLIENT_ID,
     EVENT_SERVER_ID,
     EVENT_SERVER_CLIENT_ID,
+    EVENT_SERVER_OVERFLOW_ID,
+    FRAME_STREAM_ID,
+    FRAME_STREAM_CLIENT_ID,
+    FRAME_STREAM_ENCODED_ID,
 };
 
 wxDECLARE_EVENT(APPSTATE_NOTIFY_EVENT, wxCommandEvent);
@@ -332,18 +332,29 @@ static void WarnRawImageMode(void)
  * - updates button state based on appropriate state variables
  * - schedules another exposure if CaptureActive is stil true
  *
+ * When the capture pipeline is active (see PipelineActive), the next exposures
+ * are scheduled before the guider state is updated so the camera is exposing
+ * while this frame is measured and the correction computed.
+ *
  */
-void MyFrame::OnExposeComplete(usImage *pNewFrame, bool err)
+void MyFrame::OnExposeComplete(const FramePtr& pNewFrame, bool err)
 {
     try
     {
         //Debug.Write("OnExposeComplete: enter\n");
 
-        m_exposurePending = false;
+        --m_exposuresPending;
+
+        if (m_exposuresPending && !m_continueCapturing)
+        {
+            // stopping with more exposures in flight, the last one to
+            // complete finishes the stop
+            Debug.Write(wxString::Format("capture stopping, dropping frame, %d exposures pending\n", m_exposuresPending));
+            return;
+        }
 
         if (pGuider->GetPauseType() == PAUSE_FULL)
         {
-            delete pNewFrame;
             Debug.Write("guider is paused, ignoring frame, not scheduling exposure\n");
             return;
         }
@@ -352,7 +363,12 @@ void MyFrame::OnExposeComplete(usImage *pNewFrame, bool err)
         {
             Debug.Write("OnExposeComplete: Capture Error reported\n");
 
-            delete pNewFrame;
+            if (m_exposuresPending)
+            {
+                // let the exposures still in flight drain before reporting
+                StopCapturing();
+                throw ERROR_INFO("Error reported capturing image");
+            }
 
             bool stopping = !m_continueCapturing;
             StopCapturing();
@@ -388,8 +404,13 @@ void MyFrame::OnExposeComplete(usImage *pNewFrame, bool err)
             CheckDarkFrameGeometry();
         }
 
+        if (m_continueCapturing && PipelineActive())
+        {
+            while (m_exposuresPending < m_pipelineDepth - 1)
+                ScheduleExposure();
+        }
+
         pGuider->UpdateGuideState(pNewFrame, !m_continueCapturing);
-        pNewFrame = NULL; // the guider owns it now
 
         PhdController::UpdateControllerState();
 
@@ -400,7 +421,14 @@ void MyFrame::OnExposeComplete(usImage *pNewFrame, bool err)
 
         if (CaptureActive)
         {
-            ScheduleExposure();
+            if (!m_exposuresPending)
+                ScheduleExposure();
+        }
+        else if (m_exposuresPending)
+        {
+            // guiding or looping was stopped while frames were in flight
+            m_pPrimaryWorkerThread->RequestStop();
+            m_pMountWorkerThread->RequestStop();
         }
         else
         {
@@ -416,7 +444,7 @@ void MyFrame::OnExposeComplete(usImage *pNewFrame, bool err)
 
 void MyFrame::OnExposeComplete(wxThreadEvent& event)
 {
-    usImage *image = event.GetPayload<usImage *>();
+    FramePtr image = event.GetPayload<FramePtr>();
     bool err = event.GetInt() != 0;
     OnExposeComplete(image, err);
 }
@@ -425,13 +453,28 @@ void MyFrame::OnMoveComplete(wxThreadEvent& event)
 {
     try
     {
-        Mount *mount = event.GetPayload<Mount *>();
+        MOVE_COMPLETE done = event.GetPayload<MOVE_COMPLETE>();
+        Mount *mount = done.pMount;
         assert(mount->IsBusy());
         mount->DecrementRequestCount();
 
-        Mount::MOVE_RESULT moveResult = static_cast<Mount::MOVE_RESULT>(event.GetInt());
+        Mount::MOVE_RESULT moveResult = done.moveResult;
+
+        mount->RecordMoveLatency(done.queuedMs, done.executeMs, done.merged, done.late);
+
+        if (done.correctionId)
+        {
+            if (done.merged)
+                mount->CorrectionMerged(done.correctionId, done.mergedInto);
+            else if (moveResult == Mount::MOVE_OK)
+                mount->CorrectionSent(done.correctionId, done.sentTime);
+            else
+                mount->CorrectionDropped(done.correctionId);
+        }
 
-        mount->LogGuideStepInfo();
+        // a merged move was sent as part of a newer one, but its guide step
+        // was still taken and is logged like any other
+        mount->LogGuideStepInfo(done.step);
 
         // deliver the outstanding GuidingStopped notification if this is a late-arriving
         // move completion event
@@ -63,7 +63,9 @@
 #include <wx/thread.h>
 #include <wx/utils.h>
 
+#include <deque>
 #include <map>
+#include <memory>
 #include <math.h>
 #include <stdarg.h>
 
@@ -145,9 +147,13 @@ WX_DEFINE_ARRAY_DOUBLE(double, ArrayOfDbl);
 #include "phdconfig.h"
 #include "configdialog.h"
 #include "optionsbutton.h"
+#include "image_stretch.h"
 #include "usImage.h"
+#include "frame_ring.h"
 #include "point.h"
 #include "star.h"
+#include "star_tracker.h"
+#include "field_transform.h"
 #include "circbuf.h"
 #include "guidinglog.h"
 #include "graph.h"
@@ -160,12 +166,15 @@ WX_DEFINE_ARRAY_DOUBLE(double, ArrayOfDbl);
 #include "masschecker.h"
 #include "custom_button.h"
 #include "destination.h"
+#include "sky_calc.h"
 #include "messagebox_proxy.h"
 #include "serialports.h"
 #include "parallelports.h"
 #include "onboard_st4.h"
 #include "cameras.h"
 #include "camera.h"
+#include "dark_library.h"
+#include "pointing_model.h"
 #include "mount.h"
 #include "scopes.h"
 #include "stepguiders.h"
@@ -178,6 +187,7 @@ WX_DEFINE_ARRAY_DOUBLE(double, ArrayOfDbl);
 #include "debuglog.h"
 #include "worker_thread.h"
 #include "event_server.h"
+#include "frame_stream.h"
 #include "confirm_dialog.h"
 #include "phdcontrol.h"
 #include "runinbg.h"
@@ -0,0 +1,564 @@
+/*
+ *  plate_solver.cpp
+ *  PHD Guiding
+ *
+ *  Created by Arran Dengate
+ *  Copyright (c) 2017 Arran Dengate
+ *  All rights reserved.
+ *
+ *  This source code is distributed under the following "BSD" license
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *    Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *    Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *    Neither the name of Bret McKee, Dad Dog Development,
+ *     Craig Stark, Stark Labs nor the names of its
+ *     contributors may be used to endorse or promote products derived from
+ *     this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef _GNU_SOURCE
+# define _GNU_SOURCE    // pipe2, must come before any system header
+#endif
+
+#include "phd.h"
+#include "plate_solver.h"
+
+#include <algorithm>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+#include <wx/filename.h>
+
+static const char SOLVER_FILENAME[]     = "/usr/local/astrometry/bin/solve-field";
+static const char SOLVE_DIRECTORY[]     = "/dev/shm/phd2/goto";
+static const char SOLVE_PARENT_DIRECTORY[] = "/dev/shm/phd2";
+static const int DefaultSolveTimeoutMs  = 60000;
+static const int ChildKillDelayMs       = 3000;    // after SIGTERM, before SIGKILL
+static const char DefaultStarIndex[]    = "goto/star_index.bin";
+static const double DefaultMagLimit     = 9.0;
+static const double DefaultFieldSize    = 1.5;     // degrees, used when the pixel scale is unknown
+static const int NativeSearchRegion     = 15;
+static const int NativeMaxStars         = 30;
+
+// Catalogs the star index can be built from, in order of preference. The
+// full HYG database (see goto/data/hygdata_v3.csv.notes) has enough stars
+// for triangles at guide camera fields; the bundled subset is too sparse for
+// that, so with only the subset installed frames go to solve-field.
+static const char *StarCatalogs[] = {
+    "goto/data/hygdata_v3.csv",
+    "goto/data/HYGSubset.csv",
+};
+
+// Relative paths are taken from the PHD2 data directory
+static std::string DataPath(const wxString& path)
+{
+    if (wxFileName(path).IsAbsolute())
+        return path.ToStdString();
+    return PHD2_FILE_PATH + path.ToStdString();
+}
+
+static wxString DefaultStarCatalog(void)
+{
+    for (unsigned int i = 0; i < WXSIZEOF(StarCatalogs); i++)
+    {
+        if (wxFileExists(DataPath(StarCatalogs[i])))
+            return StarCatalogs[i];
+    }
+    return StarCatalogs[WXSIZEOF(StarCatalogs) - 1];
+}
+
+wxDEFINE_EVENT(PLATESOLVE_PROGRESS_EVENT, wxThreadEvent);
+wxDEFINE_EVENT(PLATESOLVE_RESULT_EVENT, wxThreadEvent);
+
+PlateSolver::PlateSolver(wxEvtHandler *owner)
+    : m_owner(owner),
+      m_childPid(0),
+      m_childStopping(false),
+      m_generation(0),
+      m_pending(0),
+      m_nextId(1),
+      m_timeoutMs(DefaultSolveTimeoutMs),
+      m_indexFieldSize(0.0),
+      m_catalogWarned(false)
+{
+    m_catalogFile = DataPath(pConfig->Profile.GetString("/goto/StarCatalog", DefaultStarCatalog()));
+    m_indexFile = DataPath(pConfig->Profile.GetString("/goto/StarIndex", DefaultStarIndex));
+    m_magLimit = pConfig->Profile.GetDouble("/goto/StarCatalogMagLimit", DefaultMagLimit);
+
+    if (!wxFileExists(m_catalogFile))
+    {
+        Debug.AddLine(wxString::Format("PlateSolver: star catalog %s not found", m_catalogFile.c_str()));
+        m_catalogWarned = true;
+        pFrame->Alert(wxString::Format(_("Star catalog %s not found. Gotos will be solved with solve-field "
+            "until /goto/StarCatalog names a catalog such as hygdata_v3.csv."), m_catalogFile.c_str()));
+    }
+
+    Bind(PLATESOLVE_PROGRESS_EVENT, &PlateSolver::OnProgress, this);
+    Bind(PLATESOLVE_RESULT_EVENT, &PlateSolver::OnResult, this);
+
+    if (CreateThread() != wxTHREAD_NO_ERROR || GetThread()->Run() != wxTHREAD_NO_ERROR)
+    {
+        Debug.AddLine("PlateSolver: could not start solver thread");
+    }
+}
+
+PlateSolver::~PlateSolver(void)
+{
+    CancelAll();
+    if (GetThread())
+    {
+        m_queue.Post(0);   // tells the thread to exit
+        GetThread()->Wait();
+    }
+}
+
+double PlateSolver::FrameTime(const usImage& img)
+{
+    if (!img.ImgStartTime)
+        return SkyCalc::JulianDateNow();
+    return SkyCalc::JulianDate(img.ImgStartTime, img.ImgStartMillis / 1000.0 + img.ImgExpDur / 2000.0);
+}
+
+unsigned int PlateSolver::Submit(const FrameRef& frame, const PlateSolveHint& hint)
+{
+    Job *job = new Job();
+    job->id = m_nextId++;
+    job->generation = m_generation;
+    job->frameTime = FrameTime(*frame);
+    job->hint = hint;
+    job->image = frame;
+
+    ++m_pending;
+    unsigned int id = job->id;
+    m_queue.Post(job);
+
+    Debug.AddLine(wxString::Format("PlateSolver: queued solve %u", id));
+    return id;
+}
+
+void PlateSolver::CancelAll(void)
+{
+    // Jobs remember the generation they were queued in; bumping it makes the
+    // worker drop everything older, including the one it is running.
+    ++m_generation;
+    StopChild();
+}
+
+// Asks the running solver to exit. Only the first request sends SIGTERM;
+// the solver thread follows up with KillChild if it is ignored.
+void PlateSolver::StopChild(void)
+{
+    wxCriticalSectionLocker lock(m_lock);
+    if (m_childPid > 0 && !m_childStopping)
+    {
+        m_childStopping = true;
+        kill(-m_childPid, SIGTERM);
+    }
+}
+
+void PlateSolver::KillChild(void)
+{
+    wxCriticalSectionLocker lock(m_lock);
+    if (m_childPid > 0)
+    {
+        kill(-m_childPid, SIGKILL);
+    }
+}
+
+void PlateSolver::PostProgress(unsigned int id, const wxString& msg)
+{
+    wxThreadEvent *evt = new wxThreadEvent(PLATESOLVE_PROGRESS_EVENT);
+    evt->SetInt(id);
+    evt->SetString(msg.c_str());   // deep copy, the string crosses threads
+    wxQueueEvent(this, evt);
+}
+
+void PlateSolver::PostResult(const PlateSolveResult& result)
+{
+    wxThreadEvent *evt = new wxThreadEvent(PLATESOLVE_RESULT_EVENT);
+    evt->SetInt(result.id);
+    PlateSolveResult copy(result);
+    copy.solver = result.solver.c_str();
+    copy.error = result.error.c_str();
+    evt->SetPayload(copy);
+    wxQueueEvent(this, evt);
+}
+
+void PlateSolver::OnProgress(wxThreadEvent& evt)
+{
+    if (m_owner)
+        m_owner->ProcessEvent(evt);
+}
+
+void PlateSolver::OnResult(wxThreadEvent& evt)
+{
+    if (m_pending > 0)
+        --m_pending;
+
+    PlateSolveResult result = evt.GetPayload<PlateSolveResult>();
+    EvtServer.NotifyPlateSolve(result);
+
+    if (m_owner)
+        m_owner->ProcessEvent(evt);
+}
+
+wxThread::ExitCode PlateSolver::Entry()
+{
+    while (true)
+    {
+        Job *job = 0;
+        if (m_queue.Receive(job) != wxMSGQUEUE_NO_ERROR || !job)
+            break;
+
+        PlateSolveResult result;
+        result.id = job->id;
+        result.frameTime = job->frameTime;
+
+        if (job->generation != m_generation)
+        {
+            result.canceled = true;
+            result.error = "canceled";
+        }
+        else
+        {
+            wxStopWatch swatch;
+            Solve(job, &result);
+            result.elapsed = swatch.Time() / 1000.0;
+        }
+
+        PostResult(result);
+        delete job;
+    }
+
+    return 0;
+}
+
+static bool WriteSolverImage(const usImage& img, const wxString& fileName)
+{
+    // A bare image is all the solver needs. usImage::Save would also query
+    // the camera and pointing source, which is not safe from this thread.
+    long fsize[] = { (long) img.Size.GetWidth(), (long) img.Size.GetHeight() };
+    long fpixel[] = { 1, 1 };
+    fitsfile *fptr;
+    int status = 0;
+
+    PHD_fits_create_file(&fptr, fileName, true, &status);
+    if (status)
+        return false;
+    fits_create_img(fptr, USHORT_IMG, 2, fsize, &status);
+    fits_write_pix(fptr, TUSHORT, fpixel, img.NPixels, img.ImageData, &status);
+    PHD_fits_close_file(fptr);
+
+    return status == 0;
+}
+
+bool PlateSolver::SolveNative(Job *job, PlateSolveResult *result)
+{
+    const usImage& img = *job->image;
+
+    // The index only needs triangles that fit in the frame. Round the field
+    // size up so small changes in the scale hint do not force a rebuild.
+    double fieldSize = DefaultFieldSize;
+    if (job->hint.scaleHigh > 0.0)
+        fieldSize = ceil(hypot(img.Size.GetWidth(), img.Size.GetHeight()) * job->hint.scaleHigh / 360.0) / 10.0;
+
+    if (fieldSize != m_indexFieldSize)
+    {
+        m_indexFieldSize = fieldSize;
+        m_index.Load(m_catalogFile, m_indexFile, fieldSize, m_magLimit);
+        if (m_index.IsLoaded() && m_index.TriangleCount() == 0)
+        {
+            Debug.AddLine(wxString::Format("PlateSolver: %s has no star patterns for a %.1f degree field",
+                                           m_catalogFile.c_str(), fieldSize));
+            if (!m_catalogWarned)
+            {
+                m_catalogWarned = true;
+                pFrame->Alert(wxString::Format(_("Star catalog %s is too sparse to solve guide camera frames. "
+                    "Gotos will be solved with solve-field until /goto/StarCatalog names a denser catalog "
+                    "such as hygdata_v3.csv."), m_catalogFile.c_str()));
+            }
+        }
+    }
+    if (!m_index.IsLoaded() || m_index.TriangleCount() == 0)
+        return false;
+
+    Star finder;
+    std::vector<Star> found;
+    if (!finder.GetStarList(img, 0, NativeSearchRegion, found, NativeMaxStars))
+        return false;
+
+    std::vector<SolverStar> stars;
+    stars.reserve(found.size());
+    for (unsigned int i = 0; i < found.size(); i++)
+    {
+        SolverStar s = { found[i].X, found[i].Y, found[i].Mass };
+        stars.push_back(s);
+    }
+
+    StarSolution solution;
+    StarPatternSolver solver(m_index);
+    if (!solver.Solve(stars, img.Size.GetWidth(), img.Size.GetHeight(), job->hint, &solution))
+        return false;
+
+    result->ra = solution.ra;
+    result->dec = solution.dec;
+    result->rotation = solution.rotation;
+    result->pixelScale = solution.pixelScale;
+    result->solver = "native";
+    result->success = true;
+    return true;
+}
+
+void PlateSolver::Solve(Job *job, PlateSolveResult *result)
+{
+    PostProgress(job->id, _("Matching stars"));
+    if (SolveNative(job, result))
+    {
+        Debug.AddLine(wxString::Format("PlateSolver: solve %u matched the star index ra %f dec %f rot %f scale %f",
+            job->id, result->ra, result->dec, result->rotation, result->pixelScale));
+        PostProgress(job->id, _("Solved"));
+        return;
+    }
+
+    mkdir(SOLVE_PARENT_DIRECTORY, 0755);
+    mkdir(SOLVE_DIRECTORY, 0755);
+
+    wxString fileName = wxString::Format("%s/solve-%u.fits", SOLVE_DIRECTORY, job->id);
+
+    PostProgress(job->id, _("Writing image"));
+    if (!WriteSolverImage(*job->image, fileName))
+    {
+        result->error = "could not write solver image";
+        return;
+    }
+
+    PostProgress(job->id, _("Solving"));
+    RunSolver(job, fileName, result);
+
+    // solve-field leaves its outputs next to the input
+    wxString base = fileName.BeforeLast('.');
+    const char *exts[] = { ".fits", ".axy", ".corr", ".match", ".rdls", ".solved", ".wcs", "-indx.xyls", ".new" };
+    for (unsigned int i = 0; i < WXSIZEOF(exts); i++)
+        unlink((base + exts[i]).fn_str());
+}
+
+static bool ParseSolverLine(const char *line, PlateSolveResult *result)
+{
+    // Field center: (RA,Dec) = (104.757911, -3.500760) deg.
+    // Field rotation angle: up is 12.3456 degrees E of N
+    // ... pixel scale 6.23 arcsec/pix.
+
+    const char *p;
+    if ((p = strstr(line, "(RA,Dec) = (")) != 0)
+    {
+        double ra, dec;
+        if (sscanf(p, "(RA,Dec) = (%lf, %lf)", &ra, &dec) == 2)
+        {
+            result->ra = ra;
+            result->dec = dec;
+            return true;
+        }
+    }
+    else if ((p = strstr(line, "Field rotation angle: up is ")) != 0)
+    {
+        sscanf(p, "Field rotation angle: up is %lf", &result->rotation);
+    }
+    else if ((p = strstr(line, "pixel scale ")) != 0)
+    {
+        sscanf(p, "pixel scale %lf", &result->pixelScale);
+    }
+    return false;
+}
+
+bool PlateSolver::RunSolver(Job *job, const wxString& fileName, PlateSolveResult *result)
+{
+    int cpuLimit = std::max(1, m_timeoutMs / 1000);
+
+    // Build the argument list before forking; the child may only make
+    // async-signal-safe calls.
+    char cpuArg[32];
+    snprintf(cpuArg, sizeof(cpuArg), "--cpulimit=%d", cpuLimit);
+    wxCharBuffer fileArg(fileName.fn_str());
+    char scaleLowArg[32], scaleHighArg[32], raArg[32], decArg[32], radiusArg[32];
+
+    std::vector<const char *> argv;
+    argv.push_back(SOLVER_FILENAME);
+    argv.push_back("--overwrite");
+    argv.push_back("--no-plots");
+    argv.push_back("--no-fits2fits");
+    argv.push_back(cpuArg);
+
+    const PlateSolveHint& hint = job->hint;
+    if (hint.scaleLow > 0.0 && hint.scaleHigh >= hint.scaleLow)
+    {
+        snprintf(scaleLowArg, sizeof(scaleLowArg), "--scale-low=%.3f", hint.scaleLow);
+        snprintf(scaleHighArg, sizeof(scaleHighArg), "--scale-high=%.3f", hint.scaleHigh);
+        argv.push_back(scaleLowArg);
+        argv.push_back(scaleHighArg);
+        argv.push_back("--scale-units=arcsecperpix");
+    }
+    if (hint.hasPosition)
+    {
+        snprintf(raArg, sizeof(raArg), "--ra=%.6f", hint.ra);
+        snprintf(decArg, sizeof(decArg), "--dec=%.6f", hint.dec);
+        snprintf(radiusArg, sizeof(radiusArg), "--radius=%.3f", hint.radius);
+        argv.push_back(raArg);
+        argv.push_back(decArg);
+        argv.push_back(radiusArg);
+    }
+
+    argv.push_back("--fits-image");
+    argv.push_back(fileArg.data());
+    argv.push_back(0);
+
+    // Close-on-exec, so a solver started by another thread cannot inherit
+    // this pipe and hold it open; dup2 clears the flag on the child's copies
+    int fds[2];
+    if (pipe2(fds, O_CLOEXEC) != 0)
+    {
+        result->error = "pipe failed";
+        return false;
+    }
+
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        close(fds[0]);
+        close(fds[1]);
+        result->error = "fork failed";
+        return false;
+    }
+
+    if (pid == 0)
+    {
+        // Own process group, so cancel can take down the solver's children too
+        setpgid(0, 0);
+        dup2(fds[1], STDOUT_FILENO);
+        dup2(fds[1], STDERR_FILENO);
+        close(fds[0]);
+        close(fds[1]);
+        execv(argv[0], const_cast<char * const *>(&argv[0]));
+        _exit(127);
+    }
+
+    // Also set the group here: until the child's own setpgid has run, a
+    // kill of the group would miss it
+    setpgid(pid, pid);
+
+    close(fds[1]);
+    {
+        wxCriticalSectionLocker lock(m_lock);
+        m_childPid = pid;
+        m_childStopping = false;
+    }
+
+    Debug.AddLine(wxString::Format("PlateSolver: solve %u started, pid %d", job->id, (int) pid));
+
+    wxStopWatch swatch;
+    bool solved = false;
+    bool timedOut = false;
+    long stopTime = -1;     // when the solver was asked to stop
+    bool killed = false;
+    std::string pending;
+    char buf[512];
+
+    while (true)
+    {
+        if (job->generation != m_generation)
+            result->canceled = true;
+        else if (swatch.Time() > m_timeoutMs)
+            timedOut = true;
+
+        if (result->canceled || timedOut)
+        {
+            if (stopTime < 0)
+            {
+                StopChild();
+                stopTime = swatch.Time();
+            }
+            else if (!killed && swatch.Time() - stopTime > ChildKillDelayMs)
+            {
+                Debug.AddLine(wxString::Format("PlateSolver: solve %u ignored SIGTERM, killing pid %d", job->id, (int) pid));
+                KillChild();
+                killed = true;
+            }
+        }
+
+        struct pollfd pfd = { fds[0], POLLIN, 0 };
+        int ret = poll(&pfd, 1, 250);
+        if (ret < 0 && errno != EINTR)
+            break;
+        if (ret <= 0)
+            continue;
+
+        ssize_t n = read(fds[0], buf, sizeof(buf));
+        if (n <= 0)
+            break;   // EOF, the solver has exited
+
+        pending.append(buf, n);
+        size_t eol;
+        while ((eol = pending.find('\n')) != std::string::npos)
+        {
+            std::string line = pending.substr(0, eol);
+            pending.erase(0, eol + 1);
+            if (ParseSolverLine(line.c_str(), result))
+            {
+                solved = true;
+                PostProgress(job->id, _("Solved"));
+            }
+            else if (line.find("did not solve") != std::string::npos)
+            {
+                PostProgress(job->id, _("Field did not solve"));
+            }
+        }
+    }
+    close(fds[0]);
+
+    int status;
+    while (waitpid(pid, &status, 0) < 0 && errno == EINTR)
+        ;
+    {
+        wxCriticalSectionLocker lock(m_lock);
+        m_childPid = 0;
+    }
+
+    if (result->canceled)
+        result->error = "canceled";
+    else if (timedOut)
+        result->error = "timed out";
+    else if (!solved)
+        result->error = "did not solve";
+
+    result->success = solved && !result->canceled && !timedOut;
+    if (result->success)
+        result->solver = "astrometry.net";
+
+    Debug.AddLine(wxString::Format("PlateSolver: solve %u %s ra %f dec %f rot %f scale %f",
+        job->id, result->success ? "succeeded" : result->error, result->ra, result->dec,
+        result->rotation, result->pixelScale));
+
+    return result->success;
+}
@@ -0,0 +1,135 @@
+/*
+ *  plate_solver.h
+ *  PHD Guiding
+ *
+ *  Created by Arran Dengate
+ *  Copyright (c) 2017 Arran Dengate
+ *  All rights reserved.
+ *
+ *  This source code is distributed under the following "BSD" license
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *    Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *    Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *    Neither the name of Bret McKee, Dad Dog Development,
+ *     Craig Stark, Stark Labs nor the names of its
+ *     contributors may be used to endorse or promote products derived from
+ *     this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef PLATE_SOLVER_H_INCLUDED
+#define PLATE_SOLVER_H_INCLUDED
+
+#include "star_solver.h"
+
+#include <atomic>
+
+struct PlateSolveResult
+{
+    unsigned int id;
+    bool success;
+    bool canceled;
+    double ra;              // field center, J2000 degrees
+    double dec;
+    double rotation;        // field rotation, degrees E of N
+    double pixelScale;      // arcsec / pixel
+    double frameTime;       // julian date (UTC) of the middle of the exposure
+    double elapsed;         // seconds spent solving
+    wxString solver;        // "native" or "astrometry.net"
+    wxString error;
+
+    PlateSolveResult()
+        : id(0), success(false), canceled(false), ra(0.0), dec(0.0), rotation(0.0),
+          pixelScale(0.0), frameTime(0.0), elapsed(0.0)
+    {
+    }
+};
+
+// Progress events carry the solve id in GetInt() and a status line in
+// GetString(). Result events carry a PlateSolveResult payload.
+wxDECLARE_EVENT(PLATESOLVE_PROGRESS_EVENT, wxThreadEvent);
+wxDECLARE_EVENT(PLATESOLVE_RESULT_EVENT, wxThreadEvent);
+
+// Solves guide frames on a background thread so the UI and the guide loop
+// never wait on the solver. Frames are queued and solved in order; a job
+// holds a reference to the published frame, so nothing is copied.
+// Results are reported to the owner as PLATESOLVE_RESULT_EVENT and published
+// to event server clients.
+//
+// Each frame is first matched against the built-in star pattern index; only
+// frames that fail to match are handed to astrometry.net.
+class PlateSolver : public wxEvtHandler, public wxThreadHelper
+{
+    struct Job
+    {
+        unsigned int id;
+        unsigned int generation;
+        double frameTime;
+        PlateSolveHint hint;
+        FrameRef image;
+    };
+
+    wxEvtHandler *m_owner;
+    wxMessageQueue<Job *> m_queue;
+    wxCriticalSection m_lock;   // protects m_childPid and m_childStopping
+    int m_childPid;
+    bool m_childStopping;       // SIGTERM already sent to the child
+    std::atomic<unsigned int> m_generation;
+    unsigned int m_pending;     // main thread only
+    unsigned int m_nextId;
+    int m_timeoutMs;
+    std::string m_catalogFile;
+    std::string m_indexFile;
+    double m_magLimit;          // faintest catalog star indexed
+    StarIndex m_index;          // solver thread only
+    double m_indexFieldSize;
+    bool m_catalogWarned;       // solver thread only
+
+    void PostProgress(unsigned int id, const wxString& msg);
+    void PostResult(const PlateSolveResult& result);
+    void Solve(Job *job, PlateSolveResult *result);
+    bool SolveNative(Job *job, PlateSolveResult *result);
+    bool RunSolver(Job *job, const wxString& fileName, PlateSolveResult *result);
+    void StopChild(void);
+    void KillChild(void);
+
+    void OnProgress(wxThreadEvent& evt);
+    void OnResult(wxThreadEvent& evt);
+
+protected:
+    wxThread::ExitCode Entry();
+
+public:
+    PlateSolver(wxEvtHandler *owner);
+    ~PlateSolver(void);
+
+    // Queue a frame for solving. Returns the id that will be reported in the
+    // progress and result events.
+    unsigned int Submit(const FrameRef& frame, const PlateSolveHint& hint = PlateSolveHint());
+
+    // Abandon the solve in progress (if any) and everything queued
+    void CancelAll(void);
+
+    bool IsBusy(void) const { return m_pending > 0; }
+    void SetTimeout(int timeoutMs) { m_timeoutMs = timeoutMs; }
+
+    static double FrameTime(const usImage& img);
+};
+
+#endif // PLATE_SOLVER_H_INCLUDED
@@ -0,0 +1,281 @@
+/*
+ *  pointing_model.cpp
+ *  PHD Guiding
+ *
+ *  Created by Arran Dengate
+ *  Copyright (c) 2017 Arran Dengate
+ *  All rights reserved.
+ *
+ *  This source code is distributed under the following "BSD" license
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *    Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *    Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *    Neither the name of Bret McKee, Dad Dog Development,
+ *     Craig Stark, Stark Labs nor the names of its
+ *     contributors may be used to endorse or promote products derived from
+ *     this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "phd.h"
+
+static const char *ProfileKey = "/goto/PointingModel/Observations";
+
+static const unsigned int MaxObservations = 100;
+static const unsigned int MinObservations = 3;
+static const double MaxPlausibleError = 10.0;   // degrees; anything worse is a bad solve
+// Terms are kept small until the observations say otherwise: the ratio of a
+// typical solve error (0.05 deg) to a typical term (1 deg), squared
+static const double Prior = 0.0025;
+
+static double WrapDegrees(double d)
+{
+    return norm(d, -180.0, 180.0);
+}
+
+// Effect of each term on the pointing at alt/az: x is the azimuth error
+// times cos(alt), i.e. measured on the sky, y is the elevation error
+static void Basis(double alt, double az, double x[PointingModel::TERM_COUNT], double y[PointingModel::TERM_COUNT])
+{
+    double se = sin(radians(alt)), ce = cos(radians(alt));
+    double sa = sin(radians(az)), ca = cos(radians(az));
+
+    x[PointingModel::IA] = -ce;         y[PointingModel::IA] = 0.0;
+    x[PointingModel::IE] = 0.0;         y[PointingModel::IE] = 1.0;
+    x[PointingModel::CA] = -1.0;        y[PointingModel::CA] = 0.0;
+    x[PointingModel::NPAE] = -se;       y[PointingModel::NPAE] = 0.0;
+    x[PointingModel::AN] = -sa * se;    y[PointingModel::AN] = -ca;
+    x[PointingModel::AW] = -ca * se;    y[PointingModel::AW] = sa;
+    x[PointingModel::TF] = 0.0;         y[PointingModel::TF] = -ce;
+}
+
+// cos(alt), kept away from zero so azimuth stays finite at the zenith
+static double AzScale(double alt)
+{
+    return std::max(cos(radians(alt)), 1e-3);
+}
+
+PointingModel::PointingModel(void)
+{
+    Clear();
+}
+
+const char *PointingModel::TermName(Term term)
+{
+    static const char *names[TERM_COUNT] = { "IA", "IE", "CA", "NPAE", "AN", "AW", "TF" };
+    return names[term];
+}
+
+void PointingModel::Clear(void)
+{
+    m_observations.clear();
+    for (int i = 0; i < TERM_COUNT; i++)
+    {
+        for (int j = 0; j < TERM_COUNT; j++)
+            m_normal[i][j] = 0.0;
+        m_rhs[i] = 0.0;
+        m_terms[i] = 0.0;
+    }
+}
+
+void PointingModel::Load(void)
+{
+    Clear();
+
+    wxString str = pConfig->Profile.GetString(ProfileKey, wxEmptyString);
+    std::string s(str.mb_str());
+    const char *p = s.c_str();
+    Observation obs;
+    int used;
+
+    while ((p = strchr(p, '{')) != NULL)
+    {
+        if (sscanf(p, "{%lf %lf %lf %lf}%n", &obs.mountAlt, &obs.mountAz, &obs.skyAlt, &obs.skyAz, &used) != 4)
+            break;
+        m_observations.push_back(obs);
+        Accumulate(obs, 1.0);
+        p += used;
+    }
+
+    Fit();
+
+    Debug.AddLine(wxString::Format("PointingModel: loaded %u observations", Count()));
+}
+
+void PointingModel::Save(void) const
+{
+    wxString str;
+    for (std::deque<Observation>::const_iterator it = m_observations.begin(); it != m_observations.end(); ++it)
+    {
+        if (!str.IsEmpty())
+            str += ", ";
+        str += wxString::Format("{%.5f %.5f %.5f %.5f}", it->mountAlt, it->mountAz, it->skyAlt, it->skyAz);
+    }
+    pConfig->Profile.SetString(ProfileKey, str);
+}
+
+void PointingModel::Accumulate(const Observation& obs, double sign)
+{
+    double x[TERM_COUNT], y[TERM_COUNT];
+    Basis(obs.mountAlt, obs.mountAz, x, y);
+
+    double rx = WrapDegrees(obs.skyAz - obs.mountAz) * cos(radians(obs.mountAlt));
+    double ry = obs.skyAlt - obs.mountAlt;
+
+    for (int i = 0; i < TERM_COUNT; i++)
+    {
+        for (int j = 0; j < TERM_COUNT; j++)
+            m_normal[i][j] += sign * (x[i] * x[j] + y[i] * y[j]);
+        m_rhs[i] += sign * (x[i] * rx + y[i] * ry);
+    }
+}
+
+// Solves the (regularized) normal equations by Cholesky decomposition
+void PointingModel::Fit(void)
+{
+    double L[TERM_COUNT][TERM_COUNT];
+    double z[TERM_COUNT];
+
+    for (int i = 0; i < TERM_COUNT; i++)
+    {
+        for (int j = 0; j <= i; j++)
+        {
+            double sum = m_normal[i][j] + (i == j ? Prior : 0.0);
+            for (int k = 0; k < j; k++)
+                sum -= L[i][k] * L[j][k];
+            if (i == j)
+                L[i][i] = sqrt(std::max(sum, 1e-12));
+            else
+                L[i][j] = sum / L[j][j];
+        }
+    }
+
+    for (int i = 0; i < TERM_COUNT; i++)
+    {
+        double sum = m_rhs[i];
+        for (int k = 0; k < i; k++)
+            sum -= L[i][k] * z[k];
+        z[i] = sum / L[i][i];
+    }
+
+    for (int i = TERM_COUNT - 1; i >= 0; i--)
+    {
+        double sum = z[i];
+        for (int k = i + 1; k < TERM_COUNT; k++)
+            sum -= L[k][i] * m_terms[k];
+        m_terms[i] = sum / L[i][i];
+    }
+}
+
+bool PointingModel::AddObservation(double mountAlt, double mountAz, double skyAlt, double skyAz)
+{
+    Observation obs;
+    obs.mountAlt = mountAlt;
+    obs.mountAz = mountAz;
+    obs.skyAlt = skyAlt;
+    obs.skyAz = skyAz;
+
+    double error = hypot(WrapDegrees(skyAz - mountAz) * cos(radians(mountAlt)), skyAlt - mountAlt);
+    if (error > MaxPlausibleError)
+    {
+        Debug.AddLine(wxString::Format("PointingModel: rejected observation at %.3f %.3f, error %.2f deg",
+                                       mountAlt, mountAz, error));
+        return false;
+    }
+
+    m_observations.push_back(obs);
+    Accumulate(obs, 1.0);
+
+    if (m_observations.size() > MaxObservations)
+    {
+        Accumulate(m_observations.front(), -1.0);
+        m_observations.pop_front();
+    }
+
+    Fit();
+
+    wxString terms;
+    for (int i = 0; i < TERM_COUNT; i++)
+        terms += wxString::Format(" %s=%.4f", TermName((Term) i), m_terms[i]);
+    Debug.AddLine(wxString::Format("PointingModel: %u observations, error here %.3f deg,%s", Count(), error, terms));
+
+    return true;
+}
+
+bool PointingModel::IsUsable(void) const
+{
+    return m_observations.size() >= MinObservations;
+}
+
+void PointingModel::ToSky(double mountAlt, double mountAz, double *alt, double *az) const
+{
+    double x[TERM_COUNT], y[TERM_COUNT];
+    Basis(mountAlt, mountAz, x, y);
+
+    double dx = 0.0, dy = 0.0;
+    for (int i = 0; i < TERM_COUNT; i++)
+    {
+        dx += x[i] * m_terms[i];
+        dy += y[i] * m_terms[i];
+    }
+
+    *alt = mountAlt + dy;
+    *az = norm(mountAz + dx / AzScale(mountAlt), 0.0, 360.0);
+}
+
+void PointingModel::ToMount(double alt, double az, double *mountAlt, double *mountAz) const
+{
+    *mountAlt = alt;
+    *mountAz = az;
+
+    if (!IsUsable())
+        return;
+
+    // The corrections vary slowly with position, so a few fixed-point steps converge
+    for (int iter = 0; iter < 3; iter++)
+    {
+        double skyAlt, skyAz;
+        ToSky(*mountAlt, *mountAz, &skyAlt, &skyAz);
+        *mountAlt += alt - skyAlt;
+        *mountAz = norm(*mountAz + WrapDegrees(az - skyAz), 0.0, 360.0);
+    }
+}
+
+void PointingModel::Residuals(double *rawRms, double *modelRms) const
+{
+    double raw = 0.0, model = 0.0;
+
+    for (std::deque<Observation>::const_iterator it = m_observations.begin(); it != m_observations.end(); ++it)
+    {
+        double scale = cos(radians(it->skyAlt));
+        double dx = WrapDegrees(it->skyAz - it->mountAz) * scale;
+        double dy = it->skyAlt - it->mountAlt;
+        raw += dx * dx + dy * dy;
+
+        double alt, az;
+        ToSky(it->mountAlt, it->mountAz, &alt, &az);
+        dx = WrapDegrees(it->skyAz - az) * scale;
+        dy = it->skyAlt - alt;
+        model += dx * dx + dy * dy;
+    }
+
+    unsigned int n = std::max(Count(), 1U);
+    *rawRms = sqrt(raw / n);
+    *modelRms = sqrt(model / n);
+}
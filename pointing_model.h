@@ -0,0 +1,105 @@
+/*
+ *  pointing_model.h
+ *  PHD Guiding
+ *
+ *  Created by Arran Dengate
+ *  Copyright (c) 2017 Arran Dengate
+ *  All rights reserved.
+ *
+ *  This source code is distributed under the following "BSD" license
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *    Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *    Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *    Neither the name of Bret McKee, Dad Dog Development,
+ *     Craig Stark, Stark Labs nor the names of its
+ *     contributors may be used to endorse or promote products derived from
+ *     this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef POINTING_MODEL_H_INCLUDED
+#define POINTING_MODEL_H_INCLUDED
+
+#include <deque>
+
+// Alt/az pointing model for the hexapod, in the style of TPOINT. It predicts
+// where the mount actually points when it is sent to a given alt/az, using
+// the terms
+//
+//   IA, IE  azimuth and elevation index errors
+//   CA      collimation (optical axis not square to the elevation axis)
+//   NPAE    elevation axis not square to the azimuth axis
+//   AN, AW  tilt of the azimuth axis to the north and west (hexapod tilt)
+//   TF      tube flexure
+//
+// The model is fitted by least squares to observations (where the mount was
+// sent, where a plate solve says it went). Each observation updates the
+// normal equations in place, so adding one costs the same however many
+// there are. The most recent observations are stored in the profile, and
+// the model is rebuilt from them on load.
+//
+// All angles are in degrees.
+class PointingModel
+{
+public:
+    enum Term { IA, IE, CA, NPAE, AN, AW, TF, TERM_COUNT };
+
+    struct Observation
+    {
+        double mountAlt;    // where the mount was sent
+        double mountAz;
+        double skyAlt;      // where it went, from the solve
+        double skyAz;
+    };
+
+private:
+    std::deque<Observation> m_observations;
+    double m_normal[TERM_COUNT][TERM_COUNT];
+    double m_rhs[TERM_COUNT];
+    double m_terms[TERM_COUNT];
+
+    void Accumulate(const Observation& obs, double sign);
+    void Fit(void);
+
+public:
+    PointingModel(void);
+
+    void Clear(void);
+    void Load(void);
+    void Save(void) const;
+
+    // Returns false if the observation was rejected as implausible
+    bool AddObservation(double mountAlt, double mountAz, double skyAlt, double skyAz);
+    unsigned int Count(void) const { return m_observations.size(); }
+    bool IsUsable(void) const;
+
+    double GetTerm(Term term) const { return m_terms[term]; }
+    static const char *TermName(Term term);
+
+    // Where the mount should be sent for it to point at alt/az
+    void ToMount(double alt, double az, double *mountAlt, double *mountAz) const;
+    // Where the mount points when sent to mountAlt/mountAz
+    void ToSky(double mountAlt, double mountAz, double *alt, double *az) const;
+
+    // rms pointing error of the stored observations, in degrees on the sky,
+    // without and with the model applied
+    void Residuals(double *rawRms, double *modelRms) const;
+};
+
+#endif // POINTING_MODEL_H_INCLUDED
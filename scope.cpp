@@ -1082,9 +1082,10 @@ bool Scope::UpdateCalibrationState(const PHD_Point& currentLocation)
             m_calibrationStartingLocation = currentLocation;
             GetRADecCoordinates(&m_calibrationStartingCoords);
 
-            for ( Star &s : pFrame->pGuider->m_starList ) {
-                s.preCalAngle    = degrees(s.Angle(PHD_Point(pFrame->pGuider->LockPosition().X, pFrame->pGuider->LockPosition().Y)));
-                s.preCalDistance = s.Distance(PHD_Point(pFrame->pGuider->LockPosition().X, pFrame->pGuider->LockPosition().Y));
+            StarTracker& stars = pFrame->pGuider->m_starList;
+            for (unsigned int i = 0; i < stars.Count(); i++) {
+                stars.preCalAngle[i]    = degrees(stars.Position(i).Angle(PHD_Point(pFrame->pGuider->LockPosition().X, pFrame->pGuider->LockPosition().Y)));
+                stars.preCalDistance[i] = stars.Position(i).Distance(PHD_Point(pFrame->pGuider->LockPosition().X, pFrame->pGuider->LockPosition().Y));
             }
 
             Debug.Write(wxString::Format("Scope::UpdateCalibrationstate: starting location = %.2f,%.2f coords = %s\n",
@@ -1183,8 +1184,9 @@ bool Scope::UpdateCalibrationState(const PHD_Point& currentLocation)
                 if (m_calibrationStepsRemaining > 0) {
 
                     if (m_calibrationStepsRemaining == M_INITIAL_CALIBRATION_STEPS) {
-                        for (Star &s : pFrame->pGuider->m_starList) {
-                            s.calStartPos = PHD_Point(s.X, s.Y);
+                        StarTracker& stars = pFrame->pGuider->m_starList;
+                        for (unsigned int i = 0; i < stars.Count(); i++) {
+                            stars.calStartPos[i] = stars.Position(i);
                         }
                     }
 
@@ -1194,27 +1196,28 @@ bool Scope::UpdateCalibrationState(const PHD_Point& currentLocation)
                     break;
                 }
 
-                for (Star &s : pFrame->pGuider->m_starList) {
-                    s.calEndPos = PHD_Point(s.X, s.Y);
-                    Debug.AddLine(wxString::Format("Scope: calibration start x %f y %f end x %f y %f",
-                                                   s.calStartPos.X, s.calStartPos.Y,
-                                                   s.calEndPos.X, s.calEndPos.Y));
+                {
+                    StarTracker& stars = pFrame->pGuider->m_starList;
+                    for (unsigned int i = 0; i < stars.Count(); i++) {
+                        stars.calEndPos[i] = stars.Position(i);
+                        Debug.AddLine(wxString::Format("Scope: calibration start x %f y %f end x %f y %f",
+                                                       stars.calStartPos[i].X, stars.calStartPos[i].Y,
+                                                       stars.calEndPos[i].X, stars.calEndPos[i].Y));
                     
-                    //Debug.AddLine(wxString::Format("Scope: estimated center %f, %f", Get))
-                }
+                        //Debug.AddLine(wxString::Format("Scope: estimated center %f, %f", Get))
+                    }
 
-                {
                     double xSum = 0;
                     double ySum = 0;
                     double pointCount = 0;
-                    for (Star &i : pFrame->pGuider->m_starList) 
+                    for (unsigned int i = 0; i < stars.Count(); i++) 
                     {
-                        for (Star &j : pFrame->pGuider->m_starList) 
+                        for (unsigned int j = 0; j < stars.Count(); j++) 
                         {
                             if ( i != j ) 
                             {
-                                Line perpAB = GetPerpendicularLine(PHD_Point(i.calStartPos.X, i.calStartPos.Y), PHD_Point(i.calEndPos.X, i.calEndPos.Y));
-                                Line perpCD = GetPerpendicularLine(PHD_Point(j.calStartPos.X, j.calStartPos.Y), PHD_Point(j.calEndPos.X, j.calEndPos.Y));
+                                Line perpAB = GetPerpendicularLine(stars.calStartPos[i], stars.calEndPos[i]);
+                                Line perpCD = GetPerpendicularLine(stars.calStartPos[j], stars.calEndPos[j]);
                                 PHD_Point intersection(0,0);
                                 if ( GetIntersectionPoint(perpAB, perpCD, intersection)) 
                                 {
@@ -1225,7 +1228,7 @@ bool Scope::UpdateCalibrationState(const PHD_Point& currentLocation)
                                 }
                             }
                         }
-                     }
+                    }
                     PHD_Point averageCenter(xSum / pointCount, ySum / pointCount);
                     pFrame->pGuider->SetRotationCenter(averageCenter);
                     Debug.AddLine(wxString::Format("Scope: average center was %.2f, %.2f", averageCenter.X, averageCenter.Y));
@@ -1237,7 +1240,6 @@ bool Scope::UpdateCalibrationState(const PHD_Point& currentLocation)
 
             case CALIBRATION_STATE_COMPLETE:
 
-                pFrame->pGuider->m_star.calEndPos = PHD_Point(pFrame->pGuider->m_star.X, pFrame->pGuider->m_star.Y);
                 pFrame->pGuider->m_guidingPositionsInitialised = false;
 
                 // Work out camera correction angle 
@@ -0,0 +1,732 @@
+/*
+ *  sky_calc.cpp
+ *  PHD Guiding
+ *
+ *  Created by Arran Dengate
+ *  Copyright (c) 2017 Arran Dengate
+ *  All rights reserved.
+ *
+ *  This source code is distributed under the following "BSD" license
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *    Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *    Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *    Neither the name of Bret McKee, Dad Dog Development,
+ *     Craig Stark, Stark Labs nor the names of its
+ *     contributors may be used to endorse or promote products derived from
+ *     this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "phd.h"
+#include "sky_calc.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cmath>
+#include <sys/time.h>
+
+// The algorithms are the low precision ones from Meeus, "Astronomical
+// Algorithms" (2nd ed.) and the Keplerian elements from Standish, "Keplerian
+// Elements for Approximate Positions of the Major Planets" (JPL, 1800-2050).
+// Catalog stars come out at the arcsecond level, planets at a few arcseconds
+// and the Moon at around ten - far below what the hexapod can resolve.
+
+static const double DEG = M_PI / 180.0;
+static const double ARCSEC = DEG / 3600.0;
+static const double J2000 = 2451545.0;
+static const double DAYS_PER_CENTURY = 36525.0;
+static const double TT_MINUS_UTC = 69.184;                     // seconds; TAI-UTC (37s) + 32.184s
+static const double AU_KM = 149597870.7;
+static const double C_AU_PER_DAY = 173.1446327;
+static const double EARTH_RADIUS_KM = 6378.137;
+static const double EARTH_FLATTENING = 1.0 / 298.257223563;
+static const double EARTH_MOON_MASS_RATIO = 81.30056;
+static const double OBLIQUITY_J2000 = 23.43927944 * DEG;
+
+struct Vec3
+{
+    double x, y, z;
+
+    Vec3() : x(0.0), y(0.0), z(0.0) { }
+    Vec3(double x_, double y_, double z_) : x(x_), y(y_), z(z_) { }
+
+    Vec3 operator+(const Vec3& v) const { return Vec3(x + v.x, y + v.y, z + v.z); }
+    Vec3 operator-(const Vec3& v) const { return Vec3(x - v.x, y - v.y, z - v.z); }
+    Vec3 operator*(double s) const { return Vec3(x * s, y * s, z * s); }
+    double Dot(const Vec3& v) const { return x * v.x + y * v.y + z * v.z; }
+    double Length() const { return sqrt(Dot(*this)); }
+    Vec3 Unit() const { return *this * (1.0 / Length()); }
+};
+
+struct Mat3
+{
+    double m[3][3];
+
+    Vec3 operator*(const Vec3& v) const
+    {
+        return Vec3(m[0][0] * v.x + m[0][1] * v.y + m[0][2] * v.z,
+                    m[1][0] * v.x + m[1][1] * v.y + m[1][2] * v.z,
+                    m[2][0] * v.x + m[2][1] * v.y + m[2][2] * v.z);
+    }
+
+    Mat3 operator*(const Mat3& b) const
+    {
+        Mat3 r;
+        for (int i = 0; i < 3; i++)
+            for (int j = 0; j < 3; j++)
+                r.m[i][j] = m[i][0] * b.m[0][j] + m[i][1] * b.m[1][j] + m[i][2] * b.m[2][j];
+        return r;
+    }
+
+    Mat3 Transpose() const
+    {
+        Mat3 r;
+        for (int i = 0; i < 3; i++)
+            for (int j = 0; j < 3; j++)
+                r.m[i][j] = m[j][i];
+        return r;
+    }
+};
+
+static double NormDegrees(double d)
+{
+    d = fmod(d, 360.0);
+    return d < 0.0 ? d + 360.0 : d;
+}
+
+static Vec3 FromSpherical(double ra, double dec, double r = 1.0)
+{
+    double const cd = cos(dec * DEG);
+    return Vec3(r * cd * cos(ra * DEG), r * cd * sin(ra * DEG), r * sin(dec * DEG));
+}
+
+static void ToSpherical(const Vec3& v, double *ra, double *dec)
+{
+    *ra = NormDegrees(atan2(v.y, v.x) / DEG);
+    *dec = atan2(v.z, sqrt(v.x * v.x + v.y * v.y)) / DEG;
+}
+
+static double TtCenturies(double jd)
+{
+    return (jd + TT_MINUS_UTC / 86400.0 - J2000) / DAYS_PER_CENTURY;
+}
+
+// ----------------------------------------------------------------------------
+// Precession and nutation
+// ----------------------------------------------------------------------------
+
+// IAU 1976 precession, J2000 mean equator/equinox to mean of date.
+static Mat3 PrecessionMatrix(double T)
+{
+    double const zeta  = (2306.2181 * T + 0.30188 * T * T + 0.017998 * T * T * T) * ARCSEC;
+    double const z     = (2306.2181 * T + 1.09468 * T * T + 0.018203 * T * T * T) * ARCSEC;
+    double const theta = (2004.3109 * T - 0.42665 * T * T - 0.041833 * T * T * T) * ARCSEC;
+
+    double const cz = cos(zeta), sz = sin(zeta);
+    double const cZ = cos(z), sZ = sin(z);
+    double const ct = cos(theta), st = sin(theta);
+
+    Mat3 p;
+    p.m[0][0] =  cz * cZ * ct - sz * sZ;
+    p.m[0][1] = -sz * cZ * ct - cz * sZ;
+    p.m[0][2] = -cZ * st;
+    p.m[1][0] =  cz * sZ * ct + sz * cZ;
+    p.m[1][1] = -sz * sZ * ct + cz * cZ;
+    p.m[1][2] = -sZ * st;
+    p.m[2][0] =  cz * st;
+    p.m[2][1] = -sz * st;
+    p.m[2][2] =  ct;
+    return p;
+}
+
+// Largest terms of the IAU 1980 nutation series (Meeus table 22.A). Multiples
+// of D, M, M', F, Omega; then the longitude and obliquity coefficients in
+// units of 0.0001 arcsecond with their time derivatives.
+struct NutationTerm
+{
+    signed char d, m, mp, f, om;
+    double psi, psiT, eps, epsT;
+};
+
+static const NutationTerm NUTATION_TERMS[] =
+{
+    {  0,  0,  0,  0,  1, -171996, -174.2, 92025,  8.9 },
+    { -2,  0,  0,  2,  2,  -13187,   -1.6,  5736, -3.1 },
+    {  0,  0,  0,  2,  2,   -2274,   -0.2,   977, -0.5 },
+    {  0,  0,  0,  0,  2,    2062,    0.2,  -895,  0.5 },
+    {  0,  1,  0,  0,  0,    1426,   -3.4,    54, -0.1 },
+    {  0,  0,  1,  0,  0,     712,    0.1,    -7,  0.0 },
+    { -2,  1,  0,  2,  2,    -517,    1.2,   224, -0.6 },
+    {  0,  0,  0,  2,  1,    -386,   -0.4,   200,  0.0 },
+    {  0,  0,  1,  2,  2,    -301,    0.0,   129, -0.1 },
+    { -2, -1,  0,  2,  2,     217,   -0.5,   -95,  0.3 },
+    { -2,  0,  1,  0,  0,    -158,    0.0,     0,  0.0 },
+    { -2,  0,  0,  2,  1,     129,    0.1,   -70,  0.0 },
+    {  0,  0, -1,  2,  2,     123,    0.0,   -53,  0.0 },
+    {  2,  0,  0,  0,  0,      63,    0.0,     0,  0.0 },
+    {  0,  0,  1,  0,  1,      63,    0.1,   -33,  0.0 },
+    {  2,  0, -1,  2,  2,     -59,    0.0,    26,  0.0 },
+    {  0,  0, -1,  0,  1,     -58,   -0.1,    32,  0.0 },
+    {  0,  0,  1,  2,  1,     -51,    0.0,    27,  0.0 },
+    { -2,  0,  2,  0,  0,      48,    0.0,     0,  0.0 },
+    {  0,  0, -2,  2,  1,      46,    0.0,   -24,  0.0 },
+    {  2,  0,  0,  2,  2,     -38,    0.0,    16,  0.0 },
+    {  0,  0,  2,  2,  2,     -31,    0.0,    13,  0.0 },
+    {  0,  0,  2,  0,  0,      29,    0.0,     0,  0.0 },
+    { -2,  0,  1,  2,  2,      29,    0.0,   -12,  0.0 },
+    {  0,  0,  0,  2,  0,      26,    0.0,     0,  0.0 },
+    { -2,  0,  0,  2,  0,     -22,    0.0,     0,  0.0 },
+    {  0,  0, -1,  2,  1,      21,    0.0,   -10,  0.0 },
+    {  0,  2,  0,  0,  0,      17,   -0.1,     0,  0.0 },
+    {  2,  0, -1,  0,  1,      16,    0.0,    -8,  0.0 },
+    { -2,  2,  0,  2,  2,     -16,    0.1,     7,  0.0 },
+    {  0,  1,  0,  0,  1,     -15,    0.0,     9,  0.0 },
+    { -2,  0,  1,  0,  1,     -13,    0.0,     7,  0.0 },
+    {  0, -1,  0,  0,  1,     -12,    0.0,     6,  0.0 },
+    {  0,  0,  2, -2,  0,      11,    0.0,     0,  0.0 },
+};
+
+static void NutationAngles(double T, double *dPsi, double *dEps, double *eps0)
+{
+    double const D  = (297.85036 + 445267.111480 * T - 0.0019142 * T * T + T * T * T / 189474.0) * DEG;
+    double const M  = (357.52772 + 35999.050340 * T - 0.0001603 * T * T - T * T * T / 300000.0) * DEG;
+    double const Mp = (134.96298 + 477198.867398 * T + 0.0086972 * T * T + T * T * T / 56250.0) * DEG;
+    double const F  = (93.27191 + 483202.017538 * T - 0.0036825 * T * T + T * T * T / 327270.0) * DEG;
+    double const Om = (125.04452 - 1934.136261 * T + 0.0020708 * T * T + T * T * T / 450000.0) * DEG;
+
+    double psi = 0.0, eps = 0.0;
+    for (const NutationTerm& t : NUTATION_TERMS)
+    {
+        double const arg = t.d * D + t.m * M + t.mp * Mp + t.f * F + t.om * Om;
+        psi += (t.psi + t.psiT * T) * sin(arg);
+        eps += (t.eps + t.epsT * T) * cos(arg);
+    }
+
+    *dPsi = psi * 1e-4;   // arcseconds
+    *dEps = eps * 1e-4;
+    *eps0 = (84381.448 - 46.8150 * T - 0.00059 * T * T + 0.001813 * T * T * T) / 3600.0;
+}
+
+static Mat3 NutationMatrix(double dPsi, double dEps, double eps0)
+{
+    double const e0 = eps0 * DEG;
+    double const e = e0 + dEps * ARCSEC;
+    double const p = dPsi * ARCSEC;
+
+    double const cp = cos(p), sp = sin(p);
+    double const ce0 = cos(e0), se0 = sin(e0);
+    double const ce = cos(e), se = sin(e);
+
+    Mat3 n;
+    n.m[0][0] =  cp;
+    n.m[0][1] = -sp * ce0;
+    n.m[0][2] = -sp * se0;
+    n.m[1][0] =  sp * ce;
+    n.m[1][1] =  cp * ce * ce0 + se * se0;
+    n.m[1][2] =  cp * ce * se0 - se * ce0;
+    n.m[2][0] =  sp * se;
+    n.m[2][1] =  cp * se * ce0 - ce * se0;
+    n.m[2][2] =  cp * se * se0 + ce * ce0;
+    return n;
+}
+
+// J2000 to true equator and equinox of date
+static Mat3 PrecessionNutationMatrix(double T)
+{
+    double dPsi, dEps, eps0;
+    NutationAngles(T, &dPsi, &dEps, &eps0);
+    return NutationMatrix(dPsi, dEps, eps0) * PrecessionMatrix(T);
+}
+
+// ----------------------------------------------------------------------------
+// Planetary ephemeris
+// ----------------------------------------------------------------------------
+
+// Standish's elements and rates per Julian century: semi-major axis (AU),
+// eccentricity, inclination, mean longitude, longitude of perihelion and
+// longitude of the ascending node (degrees), J2000 ecliptic and equinox.
+struct KeplerElements
+{
+    const char *name;
+    double a, e, i, L, peri, node;
+    double da, de, di, dL, dperi, dnode;
+};
+
+static const KeplerElements PLANETS[] =
+{
+    { "mercury",  0.38709927, 0.20563593,  7.00497902, 252.25032350,  77.45779628,  48.33076593,
+                  0.00000037, 0.00001906, -0.00594749, 149472.67411175, 0.16047689, -0.12534081 },
+    { "venus",    0.72333566, 0.00677672,  3.39467605, 181.97909950, 131.60246718,  76.67984255,
+                  0.00000390, -0.00004107, -0.00078890, 58517.81538729, 0.00268329, -0.27769418 },
+    { "earth",    1.00000261, 0.01671123, -0.00001531, 100.46457166, 102.93768193,   0.0,
+                  0.00000562, -0.00004392, -0.01294668, 35999.37244981, 0.32327364,  0.0 },
+    { "mars",     1.52371034, 0.09339410,  1.84969142,  -4.55343205, -23.94362959,  49.55953891,
+                  0.00001847, 0.00007882, -0.00813131, 19140.30268499, 0.44441088, -0.29257343 },
+    { "jupiter",  5.20288700, 0.04838624,  1.30439695,  34.39644051,  14.72847983, 100.47390909,
+                 -0.00011607, -0.00013253, -0.00183714, 3034.74612775, 0.21252668,  0.20469106 },
+    { "saturn",   9.53667594, 0.05386179,  2.48599187,  49.95424423,  92.59887831, 113.66242448,
+                 -0.00125060, -0.00050991, 0.00193609, 1222.49362201, -0.41897216, -0.28867794 },
+    { "uranus",  19.18916464, 0.04725744,  0.77263783, 313.23810451, 170.95427630,  74.01692503,
+                 -0.00196176, -0.00004397, -0.00242939, 428.48202785, 0.40805281,  0.04240589 },
+    { "neptune", 30.06992276, 0.00859048,  1.77004347, -55.12002969,  44.96476227, 131.78422574,
+                  0.00026291, 0.00005105, 0.00035372, 218.45945325, -0.32241464, -0.00508664 },
+    { "pluto",   39.48211675, 0.24882730, 17.14001206, 238.92903833, 224.06891629, 110.30393684,
+                 -0.00031596, 0.00005170, 0.00004818, 145.20780515, -0.04062942, -0.01183482 },
+};
+
+enum { EARTH_INDEX = 2 };
+
+static const KeplerElements *FindPlanet(const std::string& name)
+{
+    for (const KeplerElements& p : PLANETS)
+        if (name == p.name)
+            return &p;
+    return 0;
+}
+
+// Heliocentric position (AU), J2000 mean equator and equinox
+static Vec3 HeliocentricPosition(const KeplerElements& el, double T)
+{
+    double const a = el.a + el.da * T;
+    double const e = el.e + el.de * T;
+    double const i = (el.i + el.di * T) * DEG;
+    double const L = el.L + el.dL * T;
+    double const peri = el.peri + el.dperi * T;
+    double const node = (el.node + el.dnode * T) * DEG;
+
+    double const w = peri * DEG - node;
+    double M = NormDegrees(L - peri) * DEG;
+    if (M > M_PI)
+        M -= 2.0 * M_PI;
+
+    // Kepler's equation by Newton iteration
+    double E = M + e * sin(M);
+    for (int n = 0; n < 10; n++)
+    {
+        double const dE = (E - e * sin(E) - M) / (1.0 - e * cos(E));
+        E -= dE;
+        if (fabs(dE) < 1e-12)
+            break;
+    }
+
+    double const xp = a * (cos(E) - e);
+    double const yp = a * sqrt(1.0 - e * e) * sin(E);
+
+    double const cw = cos(w), sw = sin(w);
+    double const cn = cos(node), sn = sin(node);
+    double const ci = cos(i), si = sin(i);
+
+    double const x = (cw * cn - sw * sn * ci) * xp + (-sw * cn - cw * sn * ci) * yp;
+    double const y = (cw * sn + sw * cn * ci) * xp + (-sw * sn + cw * cn * ci) * yp;
+    double const z = (sw * si) * xp + (cw * si) * yp;
+
+    double const ce = cos(OBLIQUITY_J2000), se = sin(OBLIQUITY_J2000);
+    return Vec3(x, y * ce - z * se, y * se + z * ce);
+}
+
+// Geocentric Moon (AU), mean equator and equinox of date. Truncated ELP-2000
+// series from Meeus chapter 47.
+struct MoonTerm
+{
+    signed char d, m, mp, f;
+    double l, r;
+};
+
+static const MoonTerm MOON_LR_TERMS[] =
+{
+    { 0,  0,  1,  0, 6288774, -20905355 },
+    { 2,  0, -1,  0, 1274027,  -3699111 },
+    { 2,  0,  0,  0,  658314,  -2955968 },
+    { 0,  0,  2,  0,  213618,   -569925 },
+    { 0,  1,  0,  0, -185116,     48888 },
+    { 0,  0,  0,  2, -114332,     -3149 },
+    { 2,  0, -2,  0,   58793,    246158 },
+    { 2, -1, -1,  0,   57066,   -152138 },
+    { 2,  0,  1,  0,   53322,   -170733 },
+    { 2, -1,  0,  0,   45758,   -204586 },
+    { 0,  1, -1,  0,  -40923,   -129620 },
+    { 1,  0,  0,  0,  -34720,    108743 },
+    { 0,  1,  1,  0,  -30383,    104755 },
+    { 2,  0,  0, -2,   15327,     10321 },
+    { 0,  0,  1,  2,  -12528,         0 },
+    { 0,  0,  1, -2,   10980,     79661 },
+    { 4,  0, -1,  0,   10675,    -34782 },
+    { 0,  0,  3,  0,   10034,    -23210 },
+    { 4,  0, -2,  0,    8548,    -21636 },
+    { 2,  1, -1,  0,   -7888,     24208 },
+    { 2,  1,  0,  0,   -6766,     30824 },
+    { 1,  0, -1,  0,   -5163,     -8379 },
+    { 1,  1,  0,  0,    4987,    -16675 },
+    { 2, -1,  1,  0,    4036,    -12831 },
+    { 2,  0,  2,  0,    3994,    -10445 },
+    { 4,  0,  0,  0,    3861,    -11650 },
+    { 2,  0, -3,  0,    3665,     14403 },
+    { 0,  1, -2,  0,   -2689,     -7003 },
+    { 2,  0, -1,  2,   -2602,         0 },
+    { 2, -1, -2,  0,    2390,     10056 },
+    { 1,  0,  1,  0,   -2348,      6322 },
+    { 2, -2,  0,  0,    2236,     -9884 },
+};
+
+static const MoonTerm MOON_B_TERMS[] =
+{
+    { 0,  0,  0,  1, 5128122, 0 },
+    { 0,  0,  1,  1,  280602, 0 },
+    { 0,  0,  1, -1,  277693, 0 },
+    { 2,  0,  0, -1,  173237, 0 },
+    { 2,  0, -1,  1,   55413, 0 },
+    { 2,  0, -1, -1,   46271, 0 },
+    { 2,  0,  0,  1,   32573, 0 },
+    { 0,  0,  2,  1,   17198, 0 },
+    { 2,  0,  1, -1,    9266, 0 },
+    { 0,  0,  2, -1,    8822, 0 },
+    { 2, -1,  0, -1,    8216, 0 },
+    { 2,  0, -2, -1,    4324, 0 },
+    { 2,  0,  1,  1,    4200, 0 },
+    { 2,  1,  0, -1,   -3359, 0 },
+    { 2, -1, -1,  1,    2463, 0 },
+    { 2, -1,  0,  1,    2211, 0 },
+    { 2, -1, -1, -1,    2065, 0 },
+    { 0,  1, -1, -1,   -1870, 0 },
+    { 4,  0, -1, -1,    1828, 0 },
+    { 0,  1,  0,  1,   -1794, 0 },
+    { 0,  0,  0,  3,   -1749, 0 },
+    { 0,  1, -1,  1,   -1565, 0 },
+    { 1,  0,  0,  1,   -1491, 0 },
+    { 0,  1,  1,  1,   -1475, 0 },
+    { 0,  1,  1, -1,   -1410, 0 },
+    { 0,  1,  0, -1,   -1344, 0 },
+    { 1,  0,  0, -1,   -1335, 0 },
+};
+
+static Vec3 GeocentricMoon(double T)
+{
+    double const T2 = T * T, T3 = T2 * T, T4 = T3 * T;
+    double const Lp = (218.3164477 + 481267.88123421 * T - 0.0015786 * T2 + T3 / 538841.0 - T4 / 65194000.0) * DEG;
+    double const D  = (297.8501921 + 445267.1114034 * T - 0.0018819 * T2 + T3 / 545868.0 - T4 / 113065000.0) * DEG;
+    double const M  = (357.5291092 + 35999.0502909 * T - 0.0001536 * T2 + T3 / 24490000.0) * DEG;
+    double const Mp = (134.9633964 + 477198.8675055 * T + 0.0087414 * T2 + T3 / 69699.0 - T4 / 14712000.0) * DEG;
+    double const F  = (93.2720950 + 483202.0175233 * T - 0.0036539 * T2 - T3 / 3526000.0 + T4 / 863310000.0) * DEG;
+    double const A1 = (119.75 + 131.849 * T) * DEG;
+    double const A2 = (53.09 + 479264.290 * T) * DEG;
+    double const A3 = (313.45 + 481266.484 * T) * DEG;
+    double const E  = 1.0 - 0.002516 * T - 0.0000074 * T2;
+
+    double sl = 0.0, sr = 0.0, sb = 0.0;
+    for (const MoonTerm& t : MOON_LR_TERMS)
+    {
+        double const arg = t.d * D + t.m * M + t.mp * Mp + t.f * F;
+        double const ecc = t.m == 0 ? 1.0 : (abs(t.m) == 1 ? E : E * E);
+        sl += t.l * ecc * sin(arg);
+        sr += t.r * ecc * cos(arg);
+    }
+    for (const MoonTerm& t : MOON_B_TERMS)
+    {
+        double const arg = t.d * D + t.m * M + t.mp * Mp + t.f * F;
+        double const ecc = t.m == 0 ? 1.0 : (abs(t.m) == 1 ? E : E * E);
+        sb += t.l * ecc * sin(arg);
+    }
+
+    sl += 3958.0 * sin(A1) + 1962.0 * sin(Lp - F) + 318.0 * sin(A2);
+    sb += -2235.0 * sin(Lp) + 382.0 * sin(A3) + 175.0 * sin(A1 - F) + 175.0 * sin(A1 + F)
+        + 127.0 * sin(Lp - Mp) - 115.0 * sin(Lp + Mp);
+
+    double const lambda = Lp + sl * 1e-6 * DEG;
+    double const beta = sb * 1e-6 * DEG;
+    double const dist = (385000.56 + sr / 1000.0) / AU_KM;
+
+    double dPsi, dEps, eps0;
+    NutationAngles(T, &dPsi, &dEps, &eps0);
+    double const ce = cos(eps0 * DEG), se = sin(eps0 * DEG);
+
+    double const x = dist * cos(beta) * cos(lambda);
+    double const y = dist * cos(beta) * sin(lambda);
+    double const z = dist * sin(beta);
+    return Vec3(x, y * ce - z * se, y * se + z * ce);
+}
+
+// Heliocentric Earth (not the Earth-Moon barycenter), J2000 equatorial
+static Vec3 HeliocentricEarth(double T)
+{
+    Vec3 const emb = HeliocentricPosition(PLANETS[EARTH_INDEX], T);
+    Vec3 const moon = PrecessionMatrix(T).Transpose() * GeocentricMoon(T);
+    return emb - moon * (1.0 / (1.0 + EARTH_MOON_MASS_RATIO));
+}
+
+// Heliocentric Earth velocity in AU/day, J2000 equatorial
+static Vec3 EarthVelocity(double T)
+{
+    double const dt = 0.5 / DAYS_PER_CENTURY;
+    return (HeliocentricPosition(PLANETS[EARTH_INDEX], T + dt) -
+            HeliocentricPosition(PLANETS[EARTH_INDEX], T - dt)) * (1.0 / (2.0 * dt * DAYS_PER_CENTURY));
+}
+
+// Annual aberration of a unit vector, first order in v/c
+static Vec3 Aberrate(const Vec3& u, const Vec3& earthVelocity)
+{
+    Vec3 const beta = earthVelocity * (1.0 / C_AU_PER_DAY);
+    return (u + beta - u * u.Dot(beta)).Unit();
+}
+
+// Observer position in AU, true equator of date
+static Vec3 ObserverPosition(double jd, const SkyObserver& obs)
+{
+    double const lat = obs.latitude * DEG;
+    double const u = atan((1.0 - EARTH_FLATTENING) * tan(lat));
+    double const h = obs.elevation / 1000.0 / EARTH_RADIUS_KM;
+    double const rhoSin = (1.0 - EARTH_FLATTENING) * sin(u) + h * sin(lat);
+    double const rhoCos = cos(u) + h * cos(lat);
+    double const last = SkyCalc::LocalApparentSiderealTime(jd, obs) * DEG;
+    double const r = EARTH_RADIUS_KM / AU_KM;
+    return Vec3(r * rhoCos * cos(last), r * rhoCos * sin(last), r * rhoSin);
+}
+
+static std::string ToLower(const std::string& s)
+{
+    std::string r(s);
+    std::transform(r.begin(), r.end(), r.begin(), [](unsigned char c) { return (char) tolower(c); });
+    return r;
+}
+
+// ----------------------------------------------------------------------------
+// SkyObserver
+// ----------------------------------------------------------------------------
+
+// Defaults are the observatory the goto dialog was written for
+static const double DefaultLatitude = -35.2809;
+static const double DefaultLongitude = 149.1300;
+static const double DefaultElevation = 580.0;
+static const double DefaultTemperature = 10.0;
+static const double DefaultPressure = 1010.0;
+
+SkyObserver::SkyObserver()
+    : latitude(DefaultLatitude),
+      longitude(DefaultLongitude),
+      elevation(DefaultElevation),
+      temperature(DefaultTemperature),
+      pressure(DefaultPressure)
+{
+}
+
+SkyObserver::SkyObserver(double lat, double lon, double elev)
+    : latitude(lat),
+      longitude(lon),
+      elevation(elev),
+      temperature(DefaultTemperature),
+      pressure(DefaultPressure)
+{
+}
+
+SkyObserver SkyObserver::FromProfile(void)
+{
+    SkyObserver obs;
+    obs.latitude = pConfig->Profile.GetDouble("/goto/Latitude", DefaultLatitude);
+    obs.longitude = pConfig->Profile.GetDouble("/goto/Longitude", DefaultLongitude);
+    obs.elevation = pConfig->Profile.GetDouble("/goto/Elevation", DefaultElevation);
+    obs.temperature = pConfig->Profile.GetDouble("/goto/Temperature", DefaultTemperature);
+    obs.pressure = pConfig->Profile.GetDouble("/goto/Pressure", DefaultPressure);
+    return obs;
+}
+
+// ----------------------------------------------------------------------------
+// SkyCalc
+// ----------------------------------------------------------------------------
+
+double SkyCalc::JulianDate(time_t t, double fractionalSeconds)
+{
+    return ((double) t + fractionalSeconds) / 86400.0 + 2440587.5;
+}
+
+double SkyCalc::JulianDateNow(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, 0);
+    return JulianDate(tv.tv_sec, tv.tv_usec * 1e-6);
+}
+
+double SkyCalc::GreenwichMeanSiderealTime(double jd)
+{
+    double const d = jd - J2000;
+    double const T = d / DAYS_PER_CENTURY;
+    return NormDegrees(280.46061837 + 360.98564736629 * d + 0.000387933 * T * T - T * T * T / 38710000.0);
+}
+
+double SkyCalc::GreenwichApparentSiderealTime(double jd)
+{
+    double dPsi, dEps, meanEps, trueEps;
+    Nutation(jd, &dPsi, &dEps, &meanEps, &trueEps);
+    return NormDegrees(GreenwichMeanSiderealTime(jd) + dPsi / 3600.0 * cos(trueEps * DEG));
+}
+
+double SkyCalc::LocalApparentSiderealTime(double jd, const SkyObserver& obs)
+{
+    return NormDegrees(GreenwichApparentSiderealTime(jd) + obs.longitude);
+}
+
+void SkyCalc::Nutation(double jd, double *dPsi, double *dEps, double *meanEps, double *trueEps)
+{
+    NutationAngles(TtCenturies(jd), dPsi, dEps, meanEps);
+    *trueEps = *meanEps + *dEps / 3600.0;
+}
+
+void SkyCalc::J2000ToApparent(double jd, double ra, double dec, double *outRa, double *outDec)
+{
+    double const T = TtCenturies(jd);
+    Vec3 const u = Aberrate(FromSpherical(ra, dec), EarthVelocity(T));
+    ToSpherical(PrecessionNutationMatrix(T) * u, outRa, outDec);
+}
+
+void SkyCalc::ApparentToJ2000(double jd, double ra, double dec, double *outRa, double *outDec)
+{
+    double const T = TtCenturies(jd);
+    Vec3 const v = EarthVelocity(T);
+    Vec3 const target = PrecessionNutationMatrix(T).Transpose() * FromSpherical(ra, dec);
+
+    // Aberration has no closed-form inverse; two fixed point steps are plenty
+    Vec3 u = target;
+    for (int i = 0; i < 2; i++)
+        u = (u + (target - Aberrate(u, v))).Unit();
+
+    ToSpherical(u, outRa, outDec);
+}
+
+double SkyCalc::Refraction(double trueAlt, const SkyObserver& obs)
+{
+    if (trueAlt < -1.0)
+        return 0.0;
+
+    // Saemundsson's formula, scaled for local pressure and temperature
+    double const r = 1.02 / tan((trueAlt + 10.3 / (trueAlt + 5.11)) * DEG);
+    return r / 60.0 * (obs.pressure / 1010.0) * (283.0 / (273.0 + obs.temperature));
+}
+
+// Refraction to subtract from an observed altitude. Starts from Bennett's
+// formula and refines against Saemundsson's so the two directions agree.
+static double ObservedRefraction(double observedAlt, const SkyObserver& obs)
+{
+    if (observedAlt < -1.0)
+        return 0.0;
+
+    double r = 1.0 / tan((observedAlt + 7.31 / (observedAlt + 4.4)) * DEG) / 60.0 *
+        (obs.pressure / 1010.0) * (283.0 / (273.0 + obs.temperature));
+    for (int i = 0; i < 3; i++)
+        r = SkyCalc::Refraction(observedAlt - r, obs);
+    return r;
+}
+
+void SkyCalc::ApparentToHorizontal(double jd, const SkyObserver& obs, double ra, double dec,
+                                   double *alt, double *az, bool refract)
+{
+    double const H = (LocalApparentSiderealTime(jd, obs) - ra) * DEG;
+    double const lat = obs.latitude * DEG;
+    double const d = dec * DEG;
+
+    double const sinAlt = sin(lat) * sin(d) + cos(lat) * cos(d) * cos(H);
+    double const a = asin(std::max(-1.0, std::min(1.0, sinAlt))) / DEG;
+
+    *az = NormDegrees(atan2(-cos(d) * sin(H), sin(d) * cos(lat) - cos(d) * cos(H) * sin(lat)) / DEG);
+    *alt = refract ? a + Refraction(a, obs) : a;
+}
+
+void SkyCalc::HorizontalToApparent(double jd, const SkyObserver& obs, double alt, double az,
+                                   double *ra, double *dec, bool refracted)
+{
+    if (refracted)
+        alt -= ObservedRefraction(alt, obs);
+
+    double const lat = obs.latitude * DEG;
+    double const h = alt * DEG;
+    double const A = az * DEG;
+
+    double const sinDec = sin(lat) * sin(h) + cos(lat) * cos(h) * cos(A);
+    double const H = atan2(-cos(h) * sin(A), sin(h) * cos(lat) - cos(h) * cos(A) * sin(lat)) / DEG;
+
+    *dec = asin(std::max(-1.0, std::min(1.0, sinDec))) / DEG;
+    *ra = NormDegrees(LocalApparentSiderealTime(jd, obs) - H);
+}
+
+void SkyCalc::EquatorialToHorizontal(double jd, const SkyObserver& obs, double ra, double dec,
+                                     double *alt, double *az, bool refract)
+{
+    double appRa, appDec;
+    J2000ToApparent(jd, ra, dec, &appRa, &appDec);
+    ApparentToHorizontal(jd, obs, appRa, appDec, alt, az, refract);
+}
+
+void SkyCalc::HorizontalToEquatorial(double jd, const SkyObserver& obs, double alt, double az,
+                                     double *ra, double *dec, bool refracted)
+{
+    double appRa, appDec;
+    HorizontalToApparent(jd, obs, alt, az, &appRa, &appDec, refracted);
+    ApparentToJ2000(jd, appRa, appDec, ra, dec);
+}
+
+bool SkyCalc::IsSolarSystemBody(const std::string& name)
+{
+    std::string const body = ToLower(name);
+    return body == "sun" || body == "moon" || (FindPlanet(body) && body != "earth");
+}
+
+bool SkyCalc::BodyPosition(const std::string& name, double jd, const SkyObserver& obs,
+                           double *raJ2000, double *decJ2000, double *alt, double *az)
+{
+    std::string const body = ToLower(name);
+    if (!IsSolarSystemBody(body))
+        return false;
+
+    double const T = TtCenturies(jd);
+    Mat3 const NP = PrecessionNutationMatrix(T);
+    Vec3 geo;   // geocentric astrometric position, AU, J2000
+
+    if (body == "moon")
+    {
+        geo = PrecessionMatrix(T).Transpose() * GeocentricMoon(T);
+    }
+    else
+    {
+        Vec3 const earth = HeliocentricEarth(T);
+        const KeplerElements *planet = FindPlanet(body);
+
+        // Iterate on light travel time
+        double tau = 0.0;
+        for (int i = 0; i < 3; i++)
+        {
+            Vec3 const helio = planet ? HeliocentricPosition(*planet, T - tau / DAYS_PER_CENTURY) : Vec3();
+            geo = helio - earth;
+            tau = geo.Length() / C_AU_PER_DAY;
+        }
+    }
+
+    // Parallax: shift the origin from the geocenter to the observer. Only
+    // matters for the Moon, but is cheap enough to do for everything.
+    Vec3 const topo = geo - NP.Transpose() * ObserverPosition(jd, obs);
+    ToSpherical(topo, raJ2000, decJ2000);
+
+    // The Moon series already gives apparent longitudes less nutation, so
+    // only the planets get aberration
+    Vec3 u = topo.Unit();
+    if (body != "moon")
+        u = Aberrate(u, EarthVelocity(T));
+
+    double appRa, appDec;
+    ToSpherical(NP * u, &appRa, &appDec);
+    ApparentToHorizontal(jd, obs, appRa, appDec, alt, az, true);
+
+    return true;
+}
@@ -0,0 +1,121 @@
+/*
+ *  sky_calc.h
+ *  PHD Guiding
+ *
+ *  Created by Arran Dengate
+ *  Copyright (c) 2017 Arran Dengate
+ *  All rights reserved.
+ *
+ *  This source code is distributed under the following "BSD" license
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *    Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *    Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *    Neither the name of Bret McKee, Dad Dog Development,
+ *     Craig Stark, Stark Labs nor the names of its
+ *     contributors may be used to endorse or promote products derived from
+ *     this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef SKY_CALC_H_INCLUDED
+#define SKY_CALC_H_INCLUDED
+
+#include <string>
+#include <ctime>
+
+// Where the telescope is. Latitude and longitude are in degrees (east and
+// north positive), elevation in metres, temperature in Celsius and pressure
+// in hPa. The last two are only used by the refraction model.
+struct SkyObserver
+{
+    double latitude;
+    double longitude;
+    double elevation;
+    double temperature;
+    double pressure;
+
+    SkyObserver();
+    SkyObserver(double lat, double lon, double elev = 0.0);
+
+    // The observer configured in the current profile.
+    static SkyObserver FromProfile(void);
+};
+
+// Native replacement for the skyfield helper script. Computes apparent
+// positions and horizontal coordinates for catalog stars and solar system
+// bodies. Everything is synchronous and allocation free; a full star
+// conversion takes a few microseconds.
+//
+// Unless noted otherwise, angles are in degrees, right ascension included,
+// and catalog coordinates are J2000 (ICRS is close enough at this precision).
+// Times are Julian dates on the UTC scale.
+class SkyCalc
+{
+public:
+
+    static double JulianDate(time_t t, double fractionalSeconds = 0.0);
+    static double JulianDateNow(void);
+
+    static double GreenwichMeanSiderealTime(double jd);
+    static double GreenwichApparentSiderealTime(double jd);
+    static double LocalApparentSiderealTime(double jd, const SkyObserver& obs);
+
+    // Nutation in longitude and obliquity (arcseconds) and the mean and true
+    // obliquity of the ecliptic (degrees) for the given date.
+    static void Nutation(double jd, double *dPsi, double *dEps, double *meanEps, double *trueEps);
+
+    // J2000 mean place to apparent place of date: annual aberration,
+    // precession and nutation.
+    static void J2000ToApparent(double jd, double ra, double dec, double *outRa, double *outDec);
+
+    // Apparent place of date back to J2000 (the inverse of the above).
+    static void ApparentToJ2000(double jd, double ra, double dec, double *outRa, double *outDec);
+
+    // Apparent equatorial to horizontal. Azimuth is measured from north
+    // through east. If refract is set the returned altitude is the observed
+    // one, ie. it includes atmospheric refraction.
+    static void ApparentToHorizontal(double jd, const SkyObserver& obs, double ra, double dec,
+                                     double *alt, double *az, bool refract = true);
+
+    // Inverse of ApparentToHorizontal.
+    static void HorizontalToApparent(double jd, const SkyObserver& obs, double alt, double az,
+                                     double *ra, double *dec, bool refracted = true);
+
+    // Convenience wrappers going straight from/to J2000.
+    static void EquatorialToHorizontal(double jd, const SkyObserver& obs, double ra, double dec,
+                                       double *alt, double *az, bool refract = true);
+    static void HorizontalToEquatorial(double jd, const SkyObserver& obs, double alt, double az,
+                                       double *ra, double *dec, bool refracted = true);
+
+    // Refraction correction (degrees) to add to a true altitude to get the
+    // observed one.
+    static double Refraction(double trueAlt, const SkyObserver& obs);
+
+    // True if the name is one of the bodies the ephemeris knows about
+    // (Sun, Moon, Mercury ... Pluto, case insensitive).
+    static bool IsSolarSystemBody(const std::string& name);
+
+    // Topocentric position of a solar system body. raJ2000/decJ2000 are the
+    // astrometric coordinates, alt/az the observed horizontal ones. Returns
+    // false if the body is unknown.
+    static bool BodyPosition(const std::string& name, double jd, const SkyObserver& obs,
+                             double *raJ2000, double *decJ2000, double *alt, double *az);
+};
+
+#endif // SKY_CALC_H_INCLUDED
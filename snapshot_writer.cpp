@@ -0,0 +1,154 @@
+/*
+ *  snapshot_writer.cpp
+ *  PHD Guiding
+ *
+ *  Created by Arran Dengate
+ *  Copyright (c) 2017 Arran Dengate
+ *  All rights reserved.
+ *
+ *  This source code is distributed under the following "BSD" license
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *    Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *    Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *    Neither the name of Bret McKee, Dad Dog Development,
+ *     Craig Stark, Stark Labs nor the names of its
+ *     contributors may be used to endorse or promote products derived from
+ *     this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "phd.h"
+#include "snapshot_writer.h"
+#include "plate_solver.h"
+
+#include <stdio.h>
+#include <wx/filename.h>
+
+SnapshotWriter::SnapshotWriter(void)
+    : m_nextId(1)
+{
+    if (CreateThread() != wxTHREAD_NO_ERROR || GetThread()->Run() != wxTHREAD_NO_ERROR)
+    {
+        Debug.AddLine("SnapshotWriter: could not start writer thread");
+    }
+}
+
+SnapshotWriter::~SnapshotWriter(void)
+{
+    if (GetThread())
+    {
+        m_queue.Post(0);   // tells the thread to exit
+        GetThread()->Wait();
+    }
+}
+
+unsigned int SnapshotWriter::Submit(const FrameRef& frame, const wxString& fileName)
+{
+    Job *job = new Job();
+    job->id = m_nextId++;
+    job->frameTime = PlateSolver::FrameTime(*frame);
+    job->image = frame;
+    job->fileName = fileName.c_str();   // deep copy, the string crosses threads
+
+    unsigned int id = job->id;
+    m_queue.Post(job);
+    return id;
+}
+
+bool SnapshotWriter::Write(const Job& job)
+{
+    // Only the pixels and what was recorded with them; usImage::Save would
+    // also query the camera and pointing source, which is not safe from this
+    // thread.
+    const usImage& img = *job.image;
+    long fsize[] = { (long) img.Size.GetWidth(), (long) img.Size.GetHeight() };
+    long fpixel[] = { 1, 1 };
+    fitsfile *fptr;
+    int status = 0;
+
+    wxString dir = wxFileName(job.fileName).GetPath();
+    if (!wxDirExists(dir) && !wxFileName::Mkdir(dir, 0755, wxPATH_MKDIR_FULL))
+        return false;
+
+    wxString tmpName = job.fileName + ".temp";
+
+    PHD_fits_create_file(&fptr, tmpName, true, &status);
+    if (status)
+        return false;
+
+    fits_create_img(fptr, USHORT_IMG, 2, fsize, &status);
+
+    float exposure = (float) img.ImgExpDur / 1000.0;
+    fits_write_key(fptr, TFLOAT, const_cast<char *>("EXPOSURE"), &exposure, const_cast<char *>("Exposure time in seconds"), &status);
+    wxString dateObs = img.GetImgStartTime();
+    fits_write_key(fptr, TSTRING, const_cast<char *>("DATE-OBS"), const_cast<char *>((const char *) dateObs.c_str()),
+        const_cast<char *>("Time image was captured"), &status);
+    double jd = job.frameTime;
+    fits_write_key(fptr, TDOUBLE, const_cast<char *>("JD-MID"), &jd, const_cast<char *>("Julian date (UTC) of mid exposure"), &status);
+
+    fits_write_pix(fptr, TUSHORT, fpixel, img.NPixels, img.ImageData, &status);
+    PHD_fits_close_file(fptr);
+
+    if (status)
+    {
+        remove(tmpName.fn_str());
+        return false;
+    }
+
+    return rename(tmpName.fn_str(), job.fileName.fn_str()) == 0;
+}
+
+wxThread::ExitCode SnapshotWriter::Entry()
+{
+    while (true)
+    {
+        Job *job = 0;
+        if (m_queue.Receive(job) != wxMSGQUEUE_NO_ERROR || !job)
+            break;
+
+        // skip to the newest frame, the ones before it are already stale
+        bool exiting = false;
+        Job *next;
+        while (m_queue.ReceiveTimeout(0, next) == wxMSGQUEUE_NO_ERROR)
+        {
+            if (!next)
+            {
+                exiting = true;
+                break;
+            }
+            Debug.AddLine(wxString::Format("SnapshotWriter: skipping snapshot %u", job->id));
+            delete job;
+            job = next;
+        }
+
+        wxStopWatch swatch;
+
+        bool ok = Write(*job);
+
+        Debug.AddLine(wxString::Format("SnapshotWriter: snapshot %u %s %s in %ld ms", job->id,
+            ok ? "written to" : "failed for", job->fileName, swatch.Time()));
+
+        delete job;
+
+        if (exiting)
+            break;
+    }
+
+    return 0;
+}
@@ -0,0 +1,72 @@
+/*
+ *  snapshot_writer.h
+ *  PHD Guiding
+ *
+ *  Created by Arran Dengate
+ *  Copyright (c) 2017 Arran Dengate
+ *  All rights reserved.
+ *
+ *  This source code is distributed under the following "BSD" license
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *    Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *    Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *    Neither the name of Bret McKee, Dad Dog Development,
+ *     Craig Stark, Stark Labs nor the names of its
+ *     contributors may be used to endorse or promote products derived from
+ *     this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef SNAPSHOT_WRITER_H_INCLUDED
+#define SNAPSHOT_WRITER_H_INCLUDED
+
+// Writes guide frames to disk on a background thread, so a pending snapshot
+// costs the guide loop no more than queueing a frame reference. Only the
+// newest frame is written: if frames are submitted faster than they can be
+// saved, the older ones are skipped. Each file is written next to its final
+// name and renamed into place, so readers never see a partial image, and
+// it carries its own DATE-OBS and JD-MID, so the time matches the pixels.
+class SnapshotWriter : public wxThreadHelper
+{
+    struct Job
+    {
+        unsigned int id;
+        double frameTime;
+        FrameRef image;
+        wxString fileName;
+    };
+
+    wxMessageQueue<Job *> m_queue;
+    unsigned int m_nextId;      // main thread only
+
+    bool Write(const Job& job);
+
+protected:
+    wxThread::ExitCode Entry();
+
+public:
+    SnapshotWriter(void);
+    ~SnapshotWriter(void);
+
+    // Queue a frame to be written to fileName, creating its directory if
+    // needed. Returns the id the writer logs the snapshot under.
+    unsigned int Submit(const FrameRef& frame, const wxString& fileName);
+};
+
+#endif // SNAPSHOT_WRITER_H_INCLUDED
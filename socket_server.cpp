@@ -118,6 +118,9 @@ bool MyFrame::StartServer(bool state)
             return true;
         }
 
+        // remote displays can do without the frame stream, so carry on if it fails
+        FrameStream.Start(m_instanceNumber);
+
         Debug.AddLine(wxString::Format("Server started, listening on port %u", port));
         StatusMsg(_("Server started"));
     }
@@ -132,6 +135,7 @@ bool MyFrame::StartServer(bool state)
         std::for_each(s_clients.begin(), s_clients.end(), std::mem_fun(&wxSocketBase::Destroy));
         s_clients.empty();
         EvtServer.EventServerStop();
+        FrameStream.Stop();
         delete SocketServer;
         SocketServer = NULL;
         StatusMsg(_("Server stopped"));
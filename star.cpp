@@ -39,6 +39,7 @@
 #include <algorithm>
 #include <iostream>
 #include <fstream>
+#include <memory>
 #include <vector>
 
 Star::Star(void)
@@ -86,7 +87,6 @@ void Star::Invalidate(void)
     HFD = 0.0;
     m_lastFindResult = STAR_ERROR;
     PHD_Point::Invalidate();
-    prevPositions.clear();
 }
 
 void Star::SetError(FindResult error)
@@ -105,25 +105,27 @@ struct R2M
     bool operator<(const R2M& rhs) const { return r2 < rhs.r2; }
 };
 
-static double hfr(std::vector<R2M>& vec, double cx, double cy, double mass)
+static double hfr(R2M *vec, unsigned int count, double cx, double cy, double mass)
 {
-    if (vec.size() == 1) // hot pixel?
+    if (count == 1) // hot pixel?
         return 0.25;
 
+    R2M *end = vec + count;
+
     // compute Half Flux Radius (HFR)
-    for (auto it = vec.begin(); it != vec.end(); ++it)
+    for (R2M *it = vec; it != end; ++it)
     {
         double dx = (double) it->p.x - cx;
         double dy = (double) it->p.y - cy;
         it->r2 = dx * dx + dy * dy;
     }
-    std::sort(vec.begin(), vec.end()); // sort by ascending radius^2
+    std::sort(vec, end); // sort by ascending radius^2
 
     // find radius of half-mass
     double r20, r21, m0, m1;
     r20 = r21 = m0 = m1 = 0.0;
     double halfm = 0.5 * mass;
-    for (auto it = vec.begin(); it != vec.end(); ++it)
+    for (R2M *it = vec; it != end; ++it)
     {
         const R2M& rm = *it;
         r20 = r21;
@@ -148,7 +150,7 @@ static double hfr(std::vector<R2M>& vec, double cx, double cy, double mass)
     return hfr;
 }
 
-bool Star::Find(const usImage *pImg, int searchRegion, int base_x, int base_y, FindMode mode)
+Star::FindResult Star::Measure(const usImage *pImg, int searchRegion, int base_x, int base_y, FindMode mode, Measurement *m)
 {
     FindResult Result = STAR_OK;
     double newX = base_x;
@@ -210,7 +212,7 @@ bool Star::Find(const usImage *pImg, int searchRegion, int base_x, int base_y, F
                 }
             }
 
-            PeakVal = peak_val;
+            m->PeakVal = peak_val;
         }
         else
         {
@@ -249,7 +251,7 @@ bool Star::Find(const usImage *pImg, int searchRegion, int base_x, int base_y, F
                 }
             }
 
-            PeakVal = max3[0];   // raw peak val
+            m->PeakVal = max3[0];   // raw peak val
             peak_val /= 16; // smoothed peak value
         }
 
@@ -306,7 +308,8 @@ bool Star::Find(const usImage *pImg, int searchRegion, int base_x, int base_y, F
         double mass = 0.0;
         unsigned int n;
 
-        std::vector<R2M> hfrvec;
+        // pixels in the aperture, for the HFD; the aperture is at most (2A+1)^2
+        R2M hfrvec[(2 * A + 1) * (2 * A + 1)];
 
         if (mode == FIND_PEAK)
         {
@@ -355,38 +358,38 @@ bool Star::Find(const usImage *pImg, int searchRegion, int base_x, int base_y, F
                     mass += d;
                     ++n;
 
-                    hfrvec.push_back(R2M(x, y, d));
+                    hfrvec[n - 1] = R2M(x, y, d);
                 }
             }
         }
 
-        Mass = mass;
+        m->Mass = mass;
 
         // SNR estimate from: Measuring the Signal-to-Noise Ratio S/N of the CCD Image of a Star or Nebula, J.H.Simonetti, 2004 January 8
         //     http://www.phys.vt.edu/~jhs/phys3154/snr20040108.pdf
         double const gain = .5; // electrons per ADU, nominal
-        SNR = n > 0 ? mass / sqrt(mass / gain + sigma2_bg * (double) n * (1.0 + 1.0 / (double) nbg)) : 0.0;
+        m->SNR = n > 0 ? mass / sqrt(mass / gain + sigma2_bg * (double) n * (1.0 + 1.0 / (double) nbg)) : 0.0;
 
         double const LOW_SNR = 3.0;
 
         // a few scattered pixels over threshold can give a false positive
         // avoid this by requiring the smoothed peak value to be above the threshold
-        if (peak_val <= thresh && SNR >= LOW_SNR)
+        if (peak_val <= thresh && m->SNR >= LOW_SNR)
         {
             //Debug.Write(wxString::Format("Star::Find false star n=%u nbg=%u bg=%.1f sigma=%.1f thresh=%u peak=%u\n", n, nbg, mean_bg, sigma_bg, thresh, peak_val));
-            SNR = LOW_SNR - 0.1;
+            m->SNR = LOW_SNR - 0.1;
         }
 
         if (mass < 10.0)
             Result = STAR_LOWMASS;
-        else if (SNR < LOW_SNR)
+        else if (m->SNR < LOW_SNR)
             Result = STAR_LOWSNR;
         else
         {
             newX = peak_x + cx / mass;
             newY = peak_y + cy / mass;
 
-            HFD = 2.0 * hfr(hfrvec, newX, newY, mass);
+            m->HFD = 2.0 * hfr(hfrvec, n, newX, newY, mass);
 
             // even at saturation, the max values may vary a bit due to noise
             // Call it saturated if the the top three values are within 32 parts per 65535 of max for 16-bit cameras,
@@ -422,8 +425,29 @@ bool Star::Find(const usImage *pImg, int searchRegion, int base_x, int base_y, F
         }
     }
 
+    m->X = newX;
+    m->Y = newY;
+    m->result = Result;
+
+    return Result;
+}
+
+bool Star::Find(const usImage *pImg, int searchRegion, int base_x, int base_y, FindMode mode)
+{
+    Measurement m;
+    m.Mass = Mass;
+    m.SNR = SNR;
+    m.HFD = HFD;
+    m.PeakVal = PeakVal;
+
+    FindResult Result = Measure(pImg, searchRegion, base_x, base_y, mode, &m);
+
     // update state
-    SetXY(newX, newY);
+    SetXY(m.X, m.Y);
+    Mass = m.Mass;
+    SNR = m.SNR;
+    HFD = m.HFD;
+    PeakVal = m.PeakVal;
     m_lastFindResult = Result;
 
     bool wasFound = WasFound(Result);
@@ -436,7 +460,7 @@ bool Star::Find(const usImage *pImg, int searchRegion, int base_x, int base_y, F
     }
 
     //Debug.Write(wxString::Format("Star::Find returns %d (%d), X=%.2f, Y=%.2f, Mass=%.f, SNR=%.1f, Peak=%hu HFD=%.1f\n",
-    //    wasFound, Result, newX, newY, Mass, SNR, PeakVal, HFD));
+    //    wasFound, Result, X, Y, Mass, SNR, PeakVal, HFD));
 
     return wasFound;
 }
@@ -495,6 +519,24 @@ static void GetStats(double *mean, double *stdev, const FloatImg& img, const wxR
     *stdev = sqrt(q / km1);
 }
 
+// Same mean as GetStats, without the cost of the running variance
+static double GetMean(const FloatImg& img, const wxRect& win)
+{
+    double sum = 0.0;
+
+    const int width = img.Size.GetWidth();
+    const float *p0 = &img.px[win.GetTop() * width + win.GetLeft()];
+    for (int y = 0; y < win.GetHeight(); y++)
+    {
+        const float *end = p0 + win.GetWidth();
+        for (const float *p = p0; p < end; p++)
+            sum += (double) *p;
+        p0 += width;
+    }
+
+    return sum / (win.GetWidth() * win.GetHeight());
+}
+
 // un-comment to save the intermediate autofind image
 //#define SAVE_AUTOFIND_IMG
 
@@ -552,58 +594,59 @@ static void psf_conv(FloatImg& dst, const FloatImg& src)
     44 * D3
     */
 
+    /* The class sums are built from vertical pairs of pixels k rows above
+       and below the center row (Vk), so each output pixel is a few dozen
+       adds over contiguous rows instead of 81 scattered reads, and the inner
+       loop vectorizes. D3 is whatever is left of the 9x9 box (T is the
+       vertical 9-pixel sum). Bands of rows are filtered in parallel. */
+
     int psf_size = 4;
 
-    for (int y = psf_size; y < height - psf_size; y++)
+    ParallelRowBands(height - 2 * psf_size, 32, [&](int band0, int band1)
     {
-        for (int x = psf_size; x < width - psf_size; x++)
+        std::vector<float> buf(4 * width);
+        float *V1 = &buf[0];
+        float *V2 = V1 + width;
+        float *V3 = V2 + width;
+        float *T = V3 + width;
+
+        for (int y = band0 + psf_size; y < band1 + psf_size; y++)
         {
-            float A, B1, B2, C1, C2, C3, D1, D2, D3;
-
-#define PX(dx, dy) *(src.px + width * (y + (dy)) + x + (dx))
-            A =  PX(+0, +0);
-            B1 = PX(+0, -1) + PX(+0, +1) + PX(+1, +0) + PX(-1, +0);
-            B2 = PX(-1, -1) + PX(+1, -1) + PX(-1, +1) + PX(+1, +1);
-            C1 = PX(+0, -2) + PX(-2, +0) + PX(+2, +0) + PX(+0, +2);
-            C2 = PX(-1, -2) + PX(+1, -2) + PX(-2, -1) + PX(+2, -1) + PX(-2, +1) + PX(+2, +1) + PX(-1, +2) + PX(+1, +2);
-            C3 = PX(-2, -2) + PX(+2, -2) + PX(-2, +2) + PX(+2, +2);
-            D1 = PX(+0, -3) + PX(-3, +0) + PX(+3, +0) + PX(+0, +3);
-            D2 = PX(-1, -3) + PX(+1, -3) + PX(-3, -1) + PX(+3, -1) + PX(-3, +1) + PX(+3, +1) + PX(-1, +3) + PX(+1, +3);
-            D3 = PX(-4, -2) + PX(-3, -2) + PX(+3, -2) + PX(+4, -2) + PX(-4, -1) + PX(+4, -1) + PX(-4, +0) + PX(+4, +0) + PX(-4, +1) + PX(+4, +1) + PX(-4, +2) + PX(-3, +2) + PX(+3, +2) + PX(+4, +2);
-#undef PX
-            int i;
-            const float *uptr;
-
-            uptr = src.px + width * (y - 4) + (x - 4);
-            for (i = 0; i < 9; i++)
-                D3 += *uptr++;
-
-            uptr = src.px + width * (y - 3) + (x - 4);
-            for (i = 0; i < 3; i++)
-                D3 += *uptr++;
-            uptr += 3;
-            for (i = 0; i < 3; i++)
-                D3 += *uptr++;
-
-            uptr = src.px + width * (y + 3) + (x - 4);
-            for (i = 0; i < 3; i++)
-                D3 += *uptr++;
-            uptr += 3;
-            for (i = 0; i < 3; i++)
-                D3 += *uptr++;
-
-            uptr = src.px + width * (y + 4) + (x - 4);
-            for (i = 0; i < 9; i++)
-                D3 += *uptr++;
-
-            double mean = (A + B1 + B2 + C1 + C2 + C3 + D1 + D2 + D3) / 81.0;
-            double PSF_fit = PSF[0] * (A - mean) + PSF[1] * (B1 - 4.0 * mean) + PSF[2] * (B2 - 4.0 * mean) +
-                PSF[3] * (C1 - 4.0 * mean) + PSF[4] * (C2 - 8.0 * mean) + PSF[5] * (C3 - 4.0 * mean) +
-                PSF[6] * (D1 - 4.0 * mean) + PSF[7] * (D2 - 8.0 * mean) + PSF[8] * (D3 - 44.0 * mean);
-
-            dst.px[width * y + x] = (float) PSF_fit;
+            const float *row = src.px + width * y;
+
+            for (int x = 0; x < width; x++)
+            {
+                const float *p = row + x;
+                V1[x] = p[-width] + p[width];
+                V2[x] = p[-2 * width] + p[2 * width];
+                V3[x] = p[-3 * width] + p[3 * width];
+                T[x] = p[0] + V1[x] + V2[x] + V3[x] + p[-4 * width] + p[4 * width];
+            }
+
+            float *out = dst.px + width * y;
+
+            for (int x = psf_size; x < width - psf_size; x++)
+            {
+                float A = row[x];
+                float B1 = V1[x] + row[x - 1] + row[x + 1];
+                float B2 = V1[x - 1] + V1[x + 1];
+                float C1 = V2[x] + row[x - 2] + row[x + 2];
+                float C2 = V2[x - 1] + V2[x + 1] + V1[x - 2] + V1[x + 2];
+                float C3 = V2[x - 2] + V2[x + 2];
+                float D1 = V3[x] + row[x - 3] + row[x + 3];
+                float D2 = V3[x - 1] + V3[x + 1] + V1[x - 3] + V1[x + 3];
+                float box = T[x - 4] + T[x - 3] + T[x - 2] + T[x - 1] + T[x] + T[x + 1] + T[x + 2] + T[x + 3] + T[x + 4];
+                float D3 = box - (A + B1 + B2 + C1 + C2 + C3 + D1 + D2);
+
+                double mean = box / 81.0;
+                double PSF_fit = PSF[0] * (A - mean) + PSF[1] * (B1 - 4.0 * mean) + PSF[2] * (B2 - 4.0 * mean) +
+                    PSF[3] * (C1 - 4.0 * mean) + PSF[4] * (C2 - 8.0 * mean) + PSF[5] * (C3 - 4.0 * mean) +
+                    PSF[6] * (D1 - 4.0 * mean) + PSF[7] * (D2 - 8.0 * mean) + PSF[8] * (D3 - 44.0 * mean);
+
+                out[x] = (float) PSF_fit;
+            }
         }
-    }
+    });
 }
 
 static void Downsample(FloatImg& dst, const FloatImg& src, int downsample)
@@ -639,6 +682,143 @@ struct Peak
     bool operator<(const Peak& rhs) const { return val < rhs.val; }
 };
 
+// Keeps the n brightest peaks with distinct values, the first one seen
+// winning ties -- the same set as inserting into a std::set<Peak> and trimming
+// the dimmest, but without a tree node per candidate.
+class TopPeaks
+{
+    std::vector<Peak> m_heap;   // min-heap on val
+    size_t m_max;
+
+    static bool Brighter(const Peak& a, const Peak& b) { return b < a; }
+
+public:
+    TopPeaks(size_t n) : m_max(n) { m_heap.reserve(n + 1); }
+
+    void Add(const Peak& peak)
+    {
+        if (m_heap.size() == m_max && !(m_heap.front() < peak))
+            return;
+        for (size_t i = 0; i < m_heap.size(); i++)
+            if (m_heap[i].val == peak.val)
+                return;
+        m_heap.push_back(peak);
+        std::push_heap(m_heap.begin(), m_heap.end(), Brighter);
+        if (m_heap.size() > m_max)
+        {
+            std::pop_heap(m_heap.begin(), m_heap.end(), Brighter);
+            m_heap.pop_back();
+        }
+    }
+
+    const std::vector<Peak>& Peaks() const { return m_heap; }
+};
+
+// dst = maximum of the (2 * r + 1)^2 box around each pixel of src. Only rows
+// and columns at least r from the edge are filled in.
+static void BoxMax(FloatImg& dst, const FloatImg& src, int r)
+{
+    dst.Init(src.Size);
+
+    int const width = src.Size.GetWidth();
+    int const height = src.Size.GetHeight();
+
+    ParallelRowBands(height - 2 * r, 32, [&](int band0, int band1)
+    {
+        std::vector<float> colMax(width);
+
+        for (int y = band0 + r; y < band1 + r; y++)
+        {
+            const float *p = src.px + width * (y - r);
+            std::copy(p, p + width, colMax.begin());
+            for (int j = 1; j <= 2 * r; j++)
+            {
+                p += width;
+                for (int x = 0; x < width; x++)
+                    colMax[x] = std::max(colMax[x], p[x]);
+            }
+
+            float *out = dst.px + width * y;
+            for (int x = r; x < width - r; x++)
+            {
+                float m = colMax[x - r];
+                for (int i = -r + 1; i <= r; i++)
+                    m = std::max(m, colMax[x + i]);
+                out[x] = m;
+            }
+        }
+    });
+}
+
+// Finds the local maxima of the convolved image and keeps the brightest topN,
+// measured against the mean of their surroundings
+static void FindPeaks(std::set<Peak>& stars, const FloatImg& conv, const wxRect& convRect, double global_stdev,
+                      double threshold, int downsample, int topN)
+{
+    // a pixel is a local maximum when nothing in the box around it is brighter
+    int srch = 4;
+    FloatImg boxMax;
+    BoxMax(boxMax, conv, srch);
+
+    int dw = conv.Size.GetWidth();
+    int y0 = convRect.GetTop() + srch;
+    int y1 = convRect.GetBottom() - srch + 1;
+    if (y1 <= y0)
+        return;
+
+    // each band keeps its own candidates, keyed by its first row
+    std::map<int, std::vector<Peak> > bands;
+    wxCriticalSection lock;
+
+    ParallelRowBands(y1 - y0, 32, [&](int band0, int band1)
+    {
+        TopPeaks top(topN);
+
+        for (int y = y0 + band0; y < y0 + band1; y++)
+        {
+            for (int x = convRect.GetLeft() + srch; x <= convRect.GetRight() - srch; x++)
+            {
+                float val = conv.px[dw * y + x];
+                if (!(val > 0.0) || val < boxMax.px[dw * y + x])
+                    continue;
+
+                // compare local maximum to mean value of surrounding pixels
+                const int local = 7;
+                wxRect localRect(x - local, y - local, 2 * local + 1, 2 * local + 1);
+                localRect.Intersect(convRect);
+                double local_mean = GetMean(conv, localRect);
+
+                // this is our measure of star intensity
+                double h = (val - local_mean) / global_stdev;
+
+                if (h < threshold)
+                {
+                    //  Debug.Write(wxString::Format("AG: local max REJECT [%d, %d] PSF %.1f SNR %.1f\n", imgx, imgy, val, SNR));
+                    continue;
+                }
+
+                // coordinates on the original image
+                int imgx = x * downsample + downsample / 2;
+                int imgy = y * downsample + downsample / 2;
+
+                top.Add(Peak(imgx, imgy, h));
+            }
+        }
+
+        wxCriticalSectionLocker lck(lock);
+        bands[band0] = top.Peaks();
+    });
+
+    // Merge in raster order, so a tie goes to the same peak it would have
+    // gone to with a single pass over the image
+    TopPeaks top(topN);
+    for (std::map<int, std::vector<Peak> >::const_iterator it = bands.begin(); it != bands.end(); ++it)
+        for (size_t i = 0; i < it->second.size(); i++)
+            top.Add(it->second[i]);
+
+    stars.insert(top.Peaks().begin(), top.Peaks().end());
+}
+
 static void RemoveItems(std::set<Peak>& stars, const std::set<int>& to_erase)
 {
     int n = 0;
@@ -656,7 +836,7 @@ static void RemoveItems(std::set<Peak>& stars, const std::set<int>& to_erase)
     }
 }
 
-bool Star::GetStarList(const usImage& image, int extraEdgeAllowance, int searchRegion, std::vector<Star>& outStars)
+bool Star::GetStarList(const usImage& image, int extraEdgeAllowance, int searchRegion, std::vector<Star>& outStars, int maxStars)
 {
     if (!image.Subframe.IsEmpty())
     {
@@ -664,7 +844,10 @@ bool Star::GetStarList(const usImage& image, int extraEdgeAllowance, int searchR
         return false; // not found
     }
 
-    wxBusyCursor busy;
+    // the plate solver calls this from its own thread
+    std::unique_ptr<wxBusyCursor> busy;
+    if (wxThread::IsMain())
+        busy.reset(new wxBusyCursor());
 
     Debug.Write(wxString::Format("Star::AutoFind called with edgeAllowance = %d searchRegion = %d\n", extraEdgeAllowance, searchRegion));
 
@@ -710,59 +893,7 @@ bool Star::GetStarList(const usImage& image, int extraEdgeAllowance, int searchR
     const double threshold = 0.1;
     Debug.Write(wxString::Format("AutoFind: using threshold = %.1f\n", threshold));
 
-    // find each local maximum
-    int srch = 4;
-    for (int y = convRect.GetTop() + srch; y <= convRect.GetBottom() - srch; y++)
-    {
-        for (int x = convRect.GetLeft() + srch; x <= convRect.GetRight() - srch; x++)
-        {
-            float val = conv.px[dw * y + x];
-            bool ismax = false;
-            if (val > 0.0)
-            {
-                ismax = true;
-                for (int j = -srch; j <= srch; j++)
-                {
-                    for (int i = -srch; i <= srch; i++)
-                    {
-                        if (i == 0 && j == 0)
-                            continue;
-                        if (conv.px[dw * (y + j) + (x + i)] > val)
-                        {
-                            ismax = false;
-                            break;
-                        }
-                    }
-                }
-            }
-            if (!ismax)
-                continue;
-
-            // compare local maximum to mean value of surrounding pixels
-            const int local = 7;
-            double local_mean, local_stdev;
-            wxRect localRect(x - local, y - local, 2 * local + 1, 2 * local + 1);
-            localRect.Intersect(convRect);
-            GetStats(&local_mean, &local_stdev, conv, localRect);
-
-            // this is our measure of star intensity
-            double h = (val - local_mean) / global_stdev;
-
-            if (h < threshold)
-            {
-                //  Debug.Write(wxString::Format("AG: local max REJECT [%d, %d] PSF %.1f SNR %.1f\n", imgx, imgy, val, SNR));
-                continue;
-            }
-
-            // coordinates on the original image
-            int imgx = x * downsample + downsample / 2;
-            int imgy = y * downsample + downsample / 2;
-
-            stars.insert(Peak(imgx, imgy, h));
-            if (stars.size() > TOP_N)
-                stars.erase(stars.begin());
-        }
-    }
+    FindPeaks(stars, conv, convRect, global_stdev, threshold, downsample, TOP_N);
 
     for (std::set<Peak>::const_reverse_iterator it = stars.rbegin(); it != stars.rend(); ++it)
         Debug.Write(wxString::Format("AutoFind: local max [%d, %d] %.1f\n", it->x, it->y, it->val));
@@ -910,12 +1041,11 @@ bool Star::GetStarList(const usImage& image, int extraEdgeAllowance, int searchR
     // Set a limit on the maximum number of stars since the Pi can't handle too many.
     // TODO: make sure this chooses the best ones, not just the first ones!
 
-    int MAX_STARS = 8;
     int num_stars = 0;
 
     for (std::set<Peak>::reverse_iterator it = stars.rbegin(); it != stars.rend(); ++it)
     {
-        if (num_stars < MAX_STARS) {
+        if (num_stars < maxStars) {
             Star tmp;
             tmp.Find(&image, searchRegion, it->x, it->y, FIND_CENTROID);
             if (tmp.WasFound()) {
@@ -924,6 +1054,8 @@ bool Star::GetStarList(const usImage& image, int extraEdgeAllowance, int searchR
         }
         num_stars += 1;
     }
+
+    return !outStars.empty();
 }
 
 bool Star::AutoFind(const usImage& image, int extraEdgeAllowance, int searchRegion)
@@ -980,59 +1112,7 @@ bool Star::AutoFind(const usImage& image, int extraEdgeAllowance, int searchRegi
     const double threshold = 0.1;
     Debug.Write(wxString::Format("AutoFind: using threshold = %.1f\n", threshold));
 
-    // find each local maximum
-    int srch = 4;
-    for (int y = convRect.GetTop() + srch; y <= convRect.GetBottom() - srch; y++)
-    {
-        for (int x = convRect.GetLeft() + srch; x <= convRect.GetRight() - srch; x++)
-        {
-            float val = conv.px[dw * y + x];
-            bool ismax = false;
-            if (val > 0.0)
-            {
-                ismax = true;
-                for (int j = -srch; j <= srch; j++)
-                {
-                    for (int i = -srch; i <= srch; i++)
-                    {
-                        if (i == 0 && j == 0)
-                            continue;
-                        if (conv.px[dw * (y + j) + (x + i)] > val)
-                        {
-                            ismax = false;
-                            break;
-                        }
-                    }
-                }
-            }
-            if (!ismax)
-                continue;
-
-            // compare local maximum to mean value of surrounding pixels
-            const int local = 7;
-            double local_mean, local_stdev;
-            wxRect localRect(x - local, y - local, 2 * local + 1, 2 * local + 1);
-            localRect.Intersect(convRect);
-            GetStats(&local_mean, &local_stdev, conv, localRect);
-
-            // this is our measure of star intensity
-            double h = (val - local_mean) / global_stdev;
-
-            if (h < threshold)
-            {
-                //  Debug.Write(wxString::Format("AG: local max REJECT [%d, %d] PSF %.1f SNR %.1f\n", imgx, imgy, val, SNR));
-                continue;
-            }
-
-            // coordinates on the original image
-            int imgx = x * downsample + downsample / 2;
-            int imgy = y * downsample + downsample / 2;
-
-            stars.insert(Peak(imgx, imgy, h));
-            if (stars.size() > TOP_N)
-                stars.erase(stars.begin());
-        }
-    }
+    FindPeaks(stars, conv, convRect, global_stdev, threshold, downsample, TOP_N);
 
     for (std::set<Peak>::const_reverse_iterator it = stars.rbegin(); it != stars.rend(); ++it)
         Debug.Write(wxString::Format("AutoFind: local max [%d, %d] %.1f\n", it->x, it->y, it->val));
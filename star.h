@@ -63,19 +63,25 @@ public:
         STAR_ERROR,
     };
    
+    // The result of centroiding a star, without the state a Star carries
+    // between frames. Fields a failed search does not produce are left as
+    // they were.
+    struct Measurement
+    {
+        double X;
+        double Y;
+        double Mass;
+        double SNR;
+        double HFD;
+        unsigned short PeakVal;
+        FindResult result;
+    };
+
     MassChecker massChecker;
     double Mass;
     double SNR;
     double HFD;
     unsigned short PeakVal;
-    std::deque<PHD_Point> prevPositions;
-    PHD_Point calStartPos;
-    PHD_Point calEndPos;
-    PHD_Point guidingStartPos; 
-    double preCalAngle;
-    double preCalDistance;
-    double lastAngleDiff; // Only needed for debugging
-    PHD_Point lastExpectedPos; // Only needed for debugging
 
     Star(void);
     ~Star();
@@ -87,8 +93,9 @@ public:
      */
     bool Find(const usImage *pImg, int searchRegion, FindMode mode);
     bool Find(const usImage *pImg, int searchRegion, int X, int Y, FindMode mode);
+    static FindResult Measure(const usImage *pImg, int searchRegion, int X, int Y, FindMode mode, Measurement *m);
     bool AutoFind(const usImage& image, int edgeAllowance, int searchRegion);
-    bool GetStarList(const usImage& image, int extraEdgeAllowance, int searchRegion, std::vector<Star>& outStars);
+    bool GetStarList(const usImage& image, int extraEdgeAllowance, int searchRegion, std::vector<Star>& outStars, int maxStars = 8);
  
     bool WasFound(FindResult result);
     bool WasFound(void);
@@ -0,0 +1,828 @@
+/*
+ *  star_solver.cpp
+ *  PHD Guiding
+ *
+ *  Created by Arran Dengate
+ *  Copyright (c) 2017 Arran Dengate
+ *  All rights reserved.
+ *
+ *  This source code is distributed under the following "BSD" license
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *    Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *    Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *    Neither the name of Bret McKee, Dad Dog Development,
+ *     Craig Stark, Stark Labs nor the names of its
+ *     contributors may be used to endorse or promote products derived from
+ *     this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "phd.h"
+#include "star_solver.h"
+
+#include <algorithm>
+#include <complex>
+#include <errno.h>
+#include <fcntl.h>
+#include <fstream>
+#include <sstream>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+typedef std::complex<double> Complex;
+
+static const double DegToRad = M_PI / 180.0;
+static const double ArcsecToRad = M_PI / (180.0 * 3600.0);
+
+enum { NeighborCount = 8 };         // neighbors per catalog star used to form triangles
+enum { MaxPatternStars = 12 };       // brightest image stars used to form triangles
+enum { MinMatches = 4 };             // matched stars needed to accept a solution
+static const double MaxFalseMatch = 1e-5;   // chance the confirming stars matched at random
+enum { MaxHypotheses = 50000 };      // bound on the work done for one frame
+
+static const double MinSideRatio = 0.1;     // reject long, thin triangles
+static const double MinSideGap = 0.02;      // reject triangles with nearly equal sides
+static const double RatioTolerance = 0.015;
+static const double MinImageSide = 20.0;    // pixels
+static const double MinScale = 0.5;         // arcsec / pixel, when there is no hint
+static const double MaxScale = 200.0;
+
+// ---------------------------------------------------------------------------
+// Vector helpers
+
+static void ToVector(double ra, double dec, double v[3])
+{
+    ra *= DegToRad;
+    dec *= DegToRad;
+    v[0] = cos(dec) * cos(ra);
+    v[1] = cos(dec) * sin(ra);
+    v[2] = sin(dec);
+}
+
+static void ToRaDec(const double v[3], double *ra, double *dec)
+{
+    double r = atan2(v[1], v[0]) / DegToRad;
+    if (r < 0.0)
+        r += 360.0;
+    *ra = r;
+    *dec = atan2(v[2], sqrt(v[0] * v[0] + v[1] * v[1])) / DegToRad;
+}
+
+static void ToVector(const StarIndexStar& s, double v[3])
+{
+    v[0] = s.x;
+    v[1] = s.y;
+    v[2] = s.z;
+}
+
+static double Dot(const double a[3], const double b[3])
+{
+    return a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+}
+
+static double Separation(const double a[3], const double b[3])
+{
+    double c[3] = { a[1] * b[2] - a[2] * b[1], a[2] * b[0] - a[0] * b[2], a[0] * b[1] - a[1] * b[0] };
+    return atan2(sqrt(Dot(c, c)), Dot(a, b));
+}
+
+static double Separation(const StarIndexStar& a, const StarIndexStar& b)
+{
+    double va[3], vb[3];
+    ToVector(a, va);
+    ToVector(b, vb);
+    return Separation(va, vb);
+}
+
+// Gnomonic projection onto the plane tangent to the sky at a point. xi points
+// east and eta north, both in radians.
+struct TangentPlane
+{
+    double t[3], e[3], n[3];
+
+    TangentPlane(const double v[3])
+    {
+        double ra, dec;
+        ToRaDec(v, &ra, &dec);
+        ToVector(ra, dec, t);
+        ra *= DegToRad;
+        dec *= DegToRad;
+        e[0] = -sin(ra);
+        e[1] = cos(ra);
+        e[2] = 0.0;
+        n[0] = -sin(dec) * cos(ra);
+        n[1] = -sin(dec) * sin(ra);
+        n[2] = cos(dec);
+    }
+
+    bool Project(const double v[3], Complex *w) const
+    {
+        double d = Dot(v, t);
+        if (d <= 0.0)
+            return false;
+        *w = Complex(Dot(v, e) / d, Dot(v, n) / d);
+        return true;
+    }
+
+    void Deproject(const Complex& w, double v[3]) const
+    {
+        double len = 0.0;
+        for (int i = 0; i < 3; i++)
+        {
+            v[i] = t[i] + w.real() * e[i] + w.imag() * n[i];
+            len += v[i] * v[i];
+        }
+        len = sqrt(len);
+        for (int i = 0; i < 3; i++)
+            v[i] /= len;
+    }
+};
+
+// Stars sorted by z; returns the stars within radius of v
+static void FindStarsInCone(const StarIndexStar *stars, unsigned int count, const double v[3], double radius,
+                       std::vector<unsigned int> *result)
+{
+    result->clear();
+
+    double dec = asin(std::max(-1.0, std::min(1.0, v[2])));
+    float zlo = (float) sin(std::max(-M_PI / 2.0, dec - radius));
+    float zhi = (float) sin(std::min(M_PI / 2.0, dec + radius));
+    double minDot = cos(radius);
+
+    struct ByZ
+    {
+        bool operator()(const StarIndexStar& s, float z) const { return s.z < z; }
+    };
+    const StarIndexStar *p = std::lower_bound(stars, stars + count, zlo, ByZ());
+
+    for (; p < stars + count && p->z <= zhi; ++p)
+    {
+        if (p->x * v[0] + p->y * v[1] + p->z * v[2] >= minDot)
+            result->push_back((unsigned int)(p - stars));
+    }
+}
+
+// Orders the vertices of a triangle by the length of the opposite side, and
+// returns false for shapes that do not hash reliably
+static bool LabelTriangle(const double side[3], int order[3], double ratio[2])
+{
+    // side[i] is opposite vertex i
+    order[0] = 0;
+    order[1] = 1;
+    order[2] = 2;
+    std::sort(order, order + 3, [side](int a, int b) { return side[a] < side[b]; });
+
+    double s0 = side[order[0]], s1 = side[order[1]], s2 = side[order[2]];
+    if (s2 <= 0.0)
+        return false;
+    ratio[0] = s0 / s2;
+    ratio[1] = s1 / s2;
+
+    return ratio[0] >= MinSideRatio && ratio[1] - ratio[0] >= MinSideGap && 1.0 - ratio[1] >= MinSideGap;
+}
+
+// Least-squares similarity transform w = a z + b
+static void FitSimilarity(const Complex *z, const Complex *w, unsigned int count, Complex *a, Complex *b)
+{
+    Complex zbar(0.0), wbar(0.0);
+    for (unsigned int i = 0; i < count; i++)
+    {
+        zbar += z[i];
+        wbar += w[i];
+    }
+    zbar /= (double) count;
+    wbar /= (double) count;
+
+    Complex num(0.0);
+    double den = 0.0;
+    for (unsigned int i = 0; i < count; i++)
+    {
+        num += (w[i] - wbar) * std::conj(z[i] - zbar);
+        den += std::norm(z[i] - zbar);
+    }
+
+    *a = den > 0.0 ? num / den : Complex(0.0);
+    *b = wbar - *a * zbar;
+}
+
+// ---------------------------------------------------------------------------
+// Catalog and index
+
+static void SplitLine(const std::string& line, char delim, std::vector<std::string> *out)
+{
+    out->clear();
+    std::stringstream ss(line);
+    std::string item;
+    while (std::getline(ss, item, delim))
+    {
+        size_t b = item.find_first_not_of(" \t\r\"");
+        size_t e = item.find_last_not_of(" \t\r\"");
+        out->push_back(b == std::string::npos ? std::string() : item.substr(b, e - b + 1));
+    }
+}
+
+static bool ParseNumber(const std::vector<std::string>& cols, int index, double *val)
+{
+    if (index < 0 || index >= (int) cols.size() || cols[index].empty())
+        return false;
+    char *end;
+    *val = strtod(cols[index].c_str(), &end);
+    return *end == 0;
+}
+
+// Reads the goto catalog (tab separated, "ra degrees" and "dec" columns) or a
+// HYG database export (comma separated, "ra" in hours, "dec" and "mag").
+// Stars fainter than maxMag are skipped; catalogs without magnitudes are
+// read in full.
+static bool ReadCatalog(const std::string& fileName, double maxMag, std::vector<StarIndexStar> *stars)
+{
+    std::ifstream in(fileName.c_str());
+    std::string line;
+    if (!in || !std::getline(in, line))
+    {
+        Debug.AddLine(wxString::Format("StarIndex: cannot read catalog %s", fileName.c_str()));
+        return false;
+    }
+
+    char delim = line.find('\t') != std::string::npos ? '\t' : ',';
+    std::vector<std::string> cols;
+    SplitLine(line, delim, &cols);
+
+    int raCol = -1, decCol = -1, magCol = -1;
+    double raFactor = 1.0;
+    for (unsigned int i = 0; i < cols.size(); i++)
+    {
+        std::string name(cols[i]);
+        std::transform(name.begin(), name.end(), name.begin(), ::tolower);
+        if (name == "ra degrees")
+        {
+            raCol = i;
+            raFactor = 1.0;
+        }
+        else if (name == "ra" && raCol < 0)
+        {
+            raCol = i;
+            raFactor = 15.0;
+        }
+        else if (name == "dec")
+            decCol = i;
+        else if (name == "mag")
+            magCol = i;
+    }
+
+    if (raCol < 0 || decCol < 0)
+    {
+        Debug.AddLine(wxString::Format("StarIndex: catalog %s has no ra/dec columns", fileName.c_str()));
+        return false;
+    }
+
+    while (std::getline(in, line))
+    {
+        SplitLine(line, delim, &cols);
+        double ra, dec, mag;
+        if (!ParseNumber(cols, raCol, &ra) || !ParseNumber(cols, decCol, &dec))
+            continue;
+        if (!ParseNumber(cols, magCol, &mag))
+            mag = 0.0;
+        else if (mag > maxMag)
+            continue;
+
+        double v[3];
+        ToVector(ra * raFactor, dec, v);
+        StarIndexStar s = { (float) v[0], (float) v[1], (float) v[2], (float) mag };
+        stars->push_back(s);
+    }
+
+    return !stars->empty();
+}
+
+uint32_t StarIndex::TriangleKey(double r0, double r1)
+{
+    int q0 = std::min(STAR_INDEX_BINS - 1, std::max(0, (int)(r0 * STAR_INDEX_BINS)));
+    int q1 = std::min(STAR_INDEX_BINS - 1, std::max(0, (int)(r1 * STAR_INDEX_BINS)));
+    return (uint32_t)(q0 * STAR_INDEX_BINS + q1);
+}
+
+bool StarIndex::Build(const std::string& catalogFile, double maxSide, double maxMag, std::vector<char> *out)
+{
+    std::vector<StarIndexStar> stars;
+    if (!ReadCatalog(catalogFile, maxMag, &stars))
+        return false;
+
+    std::sort(stars.begin(), stars.end(), [](const StarIndexStar& a, const StarIndexStar& b) { return a.z < b.z; });
+
+    double maxSideRad = maxSide * DegToRad;
+
+    // Triangles are formed from each star and pairs of its brightest
+    // neighbors. The neighbors come from within half the field size, so they
+    // are about as bright as the stars that stand out in a frame; going out to
+    // the full field picks stars that are mostly outside it. The same
+    // triangle is found from each of its vertices, so collect vertex triples
+    // first and drop the duplicates.
+    struct Triple
+    {
+        uint32_t s[3];
+        bool operator<(const Triple& o) const
+        {
+            return s[0] != o.s[0] ? s[0] < o.s[0] : s[1] != o.s[1] ? s[1] < o.s[1] : s[2] < o.s[2];
+        }
+        bool operator==(const Triple& o) const { return s[0] == o.s[0] && s[1] == o.s[1] && s[2] == o.s[2]; }
+    };
+    std::vector<Triple> triples;
+    std::vector<unsigned int> nearby;
+
+    for (unsigned int i = 0; i < stars.size(); i++)
+    {
+        double v[3];
+        ToVector(stars[i], v);
+        FindStarsInCone(&stars[0], stars.size(), v, maxSideRad / 2.0, &nearby);
+        nearby.erase(std::remove(nearby.begin(), nearby.end(), i), nearby.end());
+
+        std::sort(nearby.begin(), nearby.end(), [&stars](unsigned int a, unsigned int b) { return stars[a].mag < stars[b].mag; });
+        if (nearby.size() > NeighborCount)
+            nearby.resize(NeighborCount);
+
+        for (unsigned int j = 0; j < nearby.size(); j++)
+        {
+            for (unsigned int k = j + 1; k < nearby.size(); k++)
+            {
+                if (Separation(stars[nearby[j]], stars[nearby[k]]) > maxSideRad)
+                    continue;
+                Triple t = { { i, nearby[j], nearby[k] } };
+                std::sort(t.s, t.s + 3);
+                triples.push_back(t);
+            }
+        }
+    }
+
+    std::sort(triples.begin(), triples.end());
+    triples.erase(std::unique(triples.begin(), triples.end()), triples.end());
+
+    std::vector<StarIndexTriangle> triangles;
+    triangles.reserve(triples.size());
+
+    for (unsigned int i = 0; i < triples.size(); i++)
+    {
+        const uint32_t *s = triples[i].s;
+        double side[3] = {
+            Separation(stars[s[1]], stars[s[2]]),
+            Separation(stars[s[0]], stars[s[2]]),
+            Separation(stars[s[0]], stars[s[1]]),
+        };
+        int order[3];
+        double ratio[2];
+        if (!LabelTriangle(side, order, ratio))
+            continue;
+
+        StarIndexTriangle t;
+        t.key = TriangleKey(ratio[0], ratio[1]);
+        for (int k = 0; k < 3; k++)
+            t.star[k] = s[order[k]];
+        t.ratio[0] = (float) ratio[0];
+        t.ratio[1] = (float) ratio[1];
+        t.side = (float) side[order[2]];
+        triangles.push_back(t);
+    }
+
+    std::sort(triangles.begin(), triangles.end(),
+              [](const StarIndexTriangle& a, const StarIndexTriangle& b) { return a.key < b.key; });
+
+    StarIndexHeader hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = STAR_INDEX_MAGIC;
+    hdr.version = STAR_INDEX_VERSION;
+    hdr.starCount = stars.size();
+    hdr.triangleCount = triangles.size();
+    hdr.bins = STAR_INDEX_BINS;
+    hdr.maxSide = maxSideRad;
+    hdr.maxMag = maxMag;
+
+    struct stat st;
+    if (stat(catalogFile.c_str(), &st) == 0)
+        hdr.catalogTime = st.st_mtime;
+
+    size_t starBytes = stars.size() * sizeof(StarIndexStar);
+    size_t triangleBytes = triangles.size() * sizeof(StarIndexTriangle);
+    out->resize(sizeof(hdr) + starBytes + triangleBytes);
+    memcpy(&(*out)[0], &hdr, sizeof(hdr));
+    memcpy(&(*out)[sizeof(hdr)], &stars[0], starBytes);
+    if (triangleBytes)
+        memcpy(&(*out)[sizeof(hdr) + starBytes], &triangles[0], triangleBytes);
+
+    Debug.AddLine(wxString::Format("StarIndex: built %u stars, %u triangles from %s", hdr.starCount,
+                                   hdr.triangleCount, catalogFile.c_str()));
+    return true;
+}
+
+StarIndex::StarIndex(void)
+    : m_map(0),
+      m_mapSize(0),
+      m_header(0),
+      m_stars(0),
+      m_triangles(0)
+{
+}
+
+StarIndex::~StarIndex(void)
+{
+    Unload();
+}
+
+void StarIndex::Unload(void)
+{
+    if (m_map)
+        munmap(m_map, m_mapSize);
+    m_map = 0;
+    m_mapSize = 0;
+    std::vector<char>().swap(m_owned);
+    m_header = 0;
+    m_stars = 0;
+    m_triangles = 0;
+}
+
+bool StarIndex::Attach(const char *data, size_t size)
+{
+    if (size < sizeof(StarIndexHeader))
+        return false;
+
+    const StarIndexHeader *hdr = reinterpret_cast<const StarIndexHeader *>(data);
+    if (hdr->magic != STAR_INDEX_MAGIC || hdr->version != STAR_INDEX_VERSION || hdr->bins != STAR_INDEX_BINS)
+        return false;
+    if (size != sizeof(StarIndexHeader) + hdr->starCount * sizeof(StarIndexStar) +
+                hdr->triangleCount * sizeof(StarIndexTriangle))
+        return false;
+
+    m_header = hdr;
+    m_stars = reinterpret_cast<const StarIndexStar *>(data + sizeof(StarIndexHeader));
+    m_triangles = reinterpret_cast<const StarIndexTriangle *>(m_stars + hdr->starCount);
+    return true;
+}
+
+static void *MapIndex(const std::string& fileName, size_t *size)
+{
+    int fd = open(fileName.c_str(), O_RDONLY);
+    if (fd < 0)
+        return 0;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0)
+    {
+        close(fd);
+        return 0;
+    }
+
+    void *p = mmap(0, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED)
+        return 0;
+
+    *size = st.st_size;
+    return p;
+}
+
+static bool WriteIndex(const std::string& fileName, const std::vector<char>& data)
+{
+    std::string tmpName = fileName + ".tmp";
+    FILE *fp = fopen(tmpName.c_str(), "wb");
+    if (!fp)
+        return false;
+    bool ok = fwrite(&data[0], 1, data.size(), fp) == data.size();
+    ok = fclose(fp) == 0 && ok;
+    if (ok)
+        ok = rename(tmpName.c_str(), fileName.c_str()) == 0;
+    if (!ok)
+        unlink(tmpName.c_str());
+    return ok;
+}
+
+bool StarIndex::Load(const std::string& catalogFile, const std::string& indexFile, double maxSide, double maxMag)
+{
+    Unload();
+
+    struct stat st;
+    bool haveCatalog = stat(catalogFile.c_str(), &st) == 0;
+    double maxSideRad = maxSide * DegToRad;
+
+    void *p = MapIndex(indexFile, &m_mapSize);
+    if (p)
+    {
+        m_map = p;
+        if (Attach(static_cast<const char *>(p), m_mapSize) && fabs(m_header->maxSide - maxSideRad) < 1e-9 &&
+            m_header->maxMag == maxMag &&
+            (!haveCatalog || m_header->catalogTime == (int64_t) st.st_mtime))
+        {
+            Debug.AddLine(wxString::Format("StarIndex: mapped %s, %u stars, %u triangles", indexFile.c_str(),
+                                           StarCount(), TriangleCount()));
+            return true;
+        }
+        Debug.AddLine(wxString::Format("StarIndex: %s is stale, rebuilding", indexFile.c_str()));
+        Unload();
+    }
+
+    std::vector<char> data;
+    if (!Build(catalogFile, maxSide, maxMag, &data))
+        return false;
+
+    if (WriteIndex(indexFile, data) && (p = MapIndex(indexFile, &m_mapSize)) != 0)
+    {
+        m_map = p;
+        if (Attach(static_cast<const char *>(p), m_mapSize))
+            return true;
+        Unload();
+    }
+
+    // Could not write the index out, keep it in memory for this session
+    Debug.AddLine(wxString::Format("StarIndex: cannot write %s (errno %d), index kept in memory", indexFile.c_str(), errno));
+    m_owned.swap(data);
+    return Attach(&m_owned[0], m_owned.size());
+}
+
+void StarIndex::FindTriangles(uint32_t key, const StarIndexTriangle **first, const StarIndexTriangle **last) const
+{
+    struct ByKey
+    {
+        bool operator()(const StarIndexTriangle& t, uint32_t k) const { return t.key < k; }
+        bool operator()(uint32_t k, const StarIndexTriangle& t) const { return k < t.key; }
+    };
+    const StarIndexTriangle *end = m_triangles + TriangleCount();
+    std::pair<const StarIndexTriangle *, const StarIndexTriangle *> range =
+        std::equal_range(m_triangles, end, key, ByKey());
+    *first = range.first;
+    *last = range.second;
+}
+
+void StarIndex::ConeSearch(const double v[3], double radius, std::vector<unsigned int> *result) const
+{
+    if (!m_header)
+    {
+        result->clear();
+        return;
+    }
+    FindStarsInCone(m_stars, m_header->starCount, v, radius, result);
+}
+
+// ---------------------------------------------------------------------------
+// Solver
+
+StarPatternSolver::StarPatternSolver(const StarIndex& index)
+    : m_index(index)
+{
+}
+
+static Complex ImagePoint(const SolverStar& s, bool flip)
+{
+    return Complex(s.x, flip ? -s.y : s.y);
+}
+
+// Probability of at least k events from a Poisson distribution with mean
+// lambda
+static double PoissonTail(double lambda, unsigned int k)
+{
+    double term = exp(-lambda);
+    for (unsigned int i = 1; i <= k; i++)
+        term *= lambda / i;
+    double sum = 0.0;
+    for (unsigned int i = k; i < k + 30 && term > 1e-300; i++)
+    {
+        sum += term;
+        term *= lambda / (i + 1);
+    }
+    return sum;
+}
+
+// Checks a candidate transform from image to tangent plane coordinates against
+// every catalog star in the field and refines it from the stars that match
+static bool Verify(const StarIndex& index, const std::vector<SolverStar>& stars, int width, int height,
+                   const TangentPlane& plane, bool flip, Complex a, Complex b, double matchRadius,
+                   StarSolution *solution)
+{
+    double center[3];
+    plane.Deproject(a * Complex(width / 2.0, flip ? -height / 2.0 : height / 2.0) + b, center);
+    double fieldRadius = 0.6 * hypot((double) width, (double) height) * std::abs(a);
+
+    std::vector<unsigned int> nearby;
+    index.ConeSearch(center, fieldRadius, &nearby);
+
+    std::vector<Complex> zs, ws;
+    std::vector<bool> used(stars.size(), false);
+    double matchRadius2 = matchRadius * matchRadius;
+    unsigned int predicted = 0;
+
+    for (unsigned int i = 0; i < nearby.size(); i++)
+    {
+        double v[3];
+        ToVector(index.GetStar(nearby[i]), v);
+        Complex w;
+        if (!plane.Project(v, &w))
+            continue;
+        Complex z = (w - b) / a;
+        double x = z.real(), y = flip ? -z.imag() : z.imag();
+        if (x < -matchRadius || y < -matchRadius || x > width + matchRadius || y > height + matchRadius)
+            continue;
+        ++predicted;
+
+        int best = -1;
+        double bestDist = matchRadius2;
+        for (unsigned int k = 0; k < stars.size(); k++)
+        {
+            double dx = stars[k].x - x, dy = stars[k].y - y;
+            double d2 = dx * dx + dy * dy;
+            if (d2 < bestDist && !used[k])
+            {
+                best = k;
+                bestDist = d2;
+            }
+        }
+        if (best < 0)
+            continue;
+
+        used[best] = true;
+        zs.push_back(ImagePoint(stars[best], flip));
+        ws.push_back(w);
+    }
+
+    if (zs.size() < MinMatches)
+        return false;
+
+    // The three stars of the seed triangle match by construction. The rest
+    // have to be more than coincidence: compare with the number of catalog
+    // stars expected to land on some image star at random.
+    double hitFraction = stars.size() * M_PI * matchRadius2 / ((double) width * height);
+    double lambda = (predicted > 3 ? predicted - 3 : 0) * std::min(1.0, hitFraction);
+    if (PoissonTail(lambda, zs.size() - 3) > MaxFalseMatch)
+        return false;
+
+    FitSimilarity(&zs[0], &ws[0], zs.size(), &a, &b);
+    if (std::abs(a) == 0.0)
+        return false;
+
+    double sumsq = 0.0;
+    for (unsigned int i = 0; i < zs.size(); i++)
+        sumsq += std::norm((ws[i] - b) / a - zs[i]);
+
+    plane.Deproject(a * Complex(width / 2.0, flip ? -height / 2.0 : height / 2.0) + b, center);
+    ToRaDec(center, &solution->ra, &solution->dec);
+
+    // Direction of image up (+y) on the sky, measured from north through east
+    Complex up = a * Complex(0.0, flip ? -1.0 : 1.0);
+    solution->rotation = atan2(up.real(), up.imag()) / DegToRad;
+    solution->pixelScale = std::abs(a) / ArcsecToRad;
+    solution->flipped = flip;
+    solution->matched = zs.size();
+    solution->rmsError = sqrt(sumsq / zs.size());
+    return true;
+}
+
+bool StarPatternSolver::Solve(const std::vector<SolverStar>& inStars, int width, int height,
+                              const PlateSolveHint& hint, StarSolution *solution) const
+{
+    solution->hypotheses = 0;
+
+    if (!m_index.IsLoaded() || inStars.size() < MinMatches)
+        return false;
+
+    std::vector<SolverStar> stars(inStars);
+    std::sort(stars.begin(), stars.end(),
+              [](const SolverStar& a, const SolverStar& b) { return a.brightness > b.brightness; });
+    unsigned int count = std::min((unsigned int) stars.size(), (unsigned int) MaxPatternStars);
+
+    double scaleLow = MinScale * ArcsecToRad;
+    double scaleHigh = MaxScale * ArcsecToRad;
+    if (hint.scaleLow > 0.0 && hint.scaleHigh >= hint.scaleLow)
+    {
+        scaleLow = hint.scaleLow * ArcsecToRad;
+        scaleHigh = hint.scaleHigh * ArcsecToRad;
+    }
+
+    double hintVec[3] = { 0.0, 0.0, 1.0 };
+    double hintMinDot = -1.0;
+    if (hint.hasPosition)
+    {
+        ToVector(hint.ra, hint.dec, hintVec);
+        double r = hint.radius * DegToRad + m_index.MaxSide();
+        if (r < M_PI)
+            hintMinDot = cos(r);
+    }
+
+    double matchRadius = std::max(3.0, 0.005 * std::max(width, height));
+
+    // Go through the triangles of the brightest stars first
+    for (unsigned int k = 2; k < count; k++)
+    {
+        for (unsigned int j = 1; j < k; j++)
+        {
+            for (unsigned int i = 0; i < j; i++)
+            {
+                const SolverStar *v[3] = { &stars[i], &stars[j], &stars[k] };
+                double side[3] = {
+                    hypot(v[1]->x - v[2]->x, v[1]->y - v[2]->y),
+                    hypot(v[0]->x - v[2]->x, v[0]->y - v[2]->y),
+                    hypot(v[0]->x - v[1]->x, v[0]->y - v[1]->y),
+                };
+                int order[3];
+                double ratio[2];
+                if (!LabelTriangle(side, order, ratio))
+                    continue;
+                double longest = side[order[2]];
+                if (longest < MinImageSide)
+                    continue;
+
+                int q0 = (int)(ratio[0] * STAR_INDEX_BINS);
+                int q1 = (int)(ratio[1] * STAR_INDEX_BINS);
+
+                for (int b0 = std::max(0, q0 - 1); b0 <= std::min(STAR_INDEX_BINS - 1, q0 + 1); b0++)
+                {
+                    for (int b1 = std::max(0, q1 - 1); b1 <= std::min(STAR_INDEX_BINS - 1, q1 + 1); b1++)
+                    {
+                        const StarIndexTriangle *t, *end;
+                        m_index.FindTriangles(b0 * STAR_INDEX_BINS + b1, &t, &end);
+
+                        for (; t < end; ++t)
+                        {
+                            if (fabs(t->ratio[0] - ratio[0]) > RatioTolerance || fabs(t->ratio[1] - ratio[1]) > RatioTolerance)
+                                continue;
+                            double scale = t->side / longest;
+                            if (scale < scaleLow || scale > scaleHigh)
+                                continue;
+
+                            double cat[3][3];
+                            for (int n = 0; n < 3; n++)
+                                ToVector(m_index.GetStar(t->star[n]), cat[n]);
+                            if (Dot(cat[0], hintVec) < hintMinDot)
+                                continue;
+
+                            if (++solution->hypotheses > MaxHypotheses)
+                            {
+                                Debug.AddLine("StarPatternSolver: giving up, too many candidates");
+                                return false;
+                            }
+
+                            double mid[3] = {
+                                cat[0][0] + cat[1][0] + cat[2][0],
+                                cat[0][1] + cat[1][1] + cat[2][1],
+                                cat[0][2] + cat[1][2] + cat[2][2],
+                            };
+                            TangentPlane plane(mid);
+                            Complex w[3];
+                            for (int n = 0; n < 3; n++)
+                                plane.Project(cat[n], &w[n]);
+
+                            // Try both parities, only one can fit a scalene triangle
+                            for (int flip = 0; flip < 2; flip++)
+                            {
+                                Complex z[3];
+                                for (int n = 0; n < 3; n++)
+                                    z[n] = ImagePoint(*v[order[n]], flip != 0);
+
+                                Complex a, b;
+                                FitSimilarity(z, w, 3, &a, &b);
+                                if (std::abs(a) == 0.0)
+                                    continue;
+
+                                double maxErr = 0.0;
+                                for (int n = 0; n < 3; n++)
+                                    maxErr = std::max(maxErr, std::abs((w[n] - b) / a - z[n]));
+                                if (maxErr > matchRadius)
+                                    continue;
+
+                                if (Verify(m_index, stars, width, height, plane, flip != 0, a, b, matchRadius, solution))
+                                {
+                                    Debug.AddLine(wxString::Format("StarPatternSolver: solved ra %.5f dec %.5f rot %.2f scale %.3f, "
+                                                                   "%u stars matched, rms %.2f px, %u candidates",
+                                                                   solution->ra, solution->dec, solution->rotation,
+                                                                   solution->pixelScale, solution->matched,
+                                                                   solution->rmsError, solution->hypotheses));
+                                    return true;
+                                }
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    Debug.AddLine(wxString::Format("StarPatternSolver: no match in %u candidates", solution->hypotheses));
+    return false;
+}
@@ -0,0 +1,172 @@
+/*
+ *  star_solver.h
+ *  PHD Guiding
+ *
+ *  Created by Arran Dengate
+ *  Copyright (c) 2017 Arran Dengate
+ *  All rights reserved.
+ *
+ *  This source code is distributed under the following "BSD" license
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *    Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *    Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *    Neither the name of Bret McKee, Dad Dog Development,
+ *     Craig Stark, Stark Labs nor the names of its
+ *     contributors may be used to endorse or promote products derived from
+ *     this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef STAR_SOLVER_H_INCLUDED
+#define STAR_SOLVER_H_INCLUDED
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// What is known about a frame before it is solved. Anything left at zero is
+// treated as unknown.
+struct PlateSolveHint
+{
+    bool hasPosition;
+    double ra;              // expected field center, J2000 degrees
+    double dec;
+    double radius;          // how far off the expected center may be, degrees
+    double scaleLow;        // arcsec / pixel
+    double scaleHigh;
+
+    PlateSolveHint()
+        : hasPosition(false), ra(0.0), dec(0.0), radius(0.0), scaleLow(0.0), scaleHigh(0.0)
+    {
+    }
+};
+
+// The index is a flat file that is memory-mapped read-only. Changing any of
+// the structures below must bump STAR_INDEX_VERSION; stale files are rebuilt
+// from the catalog automatically.
+//
+// Stars are stored as unit vectors sorted by z (sin dec), so a cone search is
+// a binary search on z followed by a dot product test. Triangles are stored
+// with their vertices ordered by the opposite side (shortest, middle,
+// longest) and sorted by a hash of the two side ratios, which are invariant
+// to scale, rotation and translation.
+
+enum { STAR_INDEX_MAGIC = 0x49534850 };  // "PHSI"
+enum { STAR_INDEX_VERSION = 2 };
+enum { STAR_INDEX_BINS = 50 };           // hash bins per side ratio
+
+struct StarIndexHeader
+{
+    uint32_t magic;
+    uint32_t version;
+    uint32_t starCount;
+    uint32_t triangleCount;
+    uint32_t bins;
+    uint32_t reserved;
+    double   maxSide;        // longest triangle side, radians
+    double   maxMag;         // faintest catalog star included
+    int64_t  catalogTime;    // modification time of the source catalog
+};
+
+struct StarIndexStar
+{
+    float x, y, z;
+    float mag;
+};
+
+struct StarIndexTriangle
+{
+    uint32_t key;
+    uint32_t star[3];
+    float    ratio[2];       // shortest / longest, middle / longest
+    float    side;           // longest side, radians
+};
+
+class StarIndex
+{
+    void *m_map;
+    size_t m_mapSize;
+    std::vector<char> m_owned;   // used when the index could not be written out
+    const StarIndexHeader *m_header;
+    const StarIndexStar *m_stars;
+    const StarIndexTriangle *m_triangles;
+
+    bool Attach(const char *data, size_t size);
+
+public:
+    StarIndex(void);
+    ~StarIndex(void);
+
+    // Map indexFile, rebuilding it from catalogFile first if it is missing,
+    // older than the catalog or was built for a different maxSide (degrees)
+    // or magnitude limit. Catalog stars fainter than maxMag are left out.
+    bool Load(const std::string& catalogFile, const std::string& indexFile, double maxSide, double maxMag);
+    void Unload(void);
+
+    bool IsLoaded(void) const { return m_header != 0; }
+    unsigned int StarCount(void) const { return m_header ? m_header->starCount : 0; }
+    unsigned int TriangleCount(void) const { return m_header ? m_header->triangleCount : 0; }
+    double MaxSide(void) const { return m_header ? m_header->maxSide : 0.0; }
+    const StarIndexStar& GetStar(unsigned int i) const { return m_stars[i]; }
+
+    // Triangles whose hash key is key, as a [first, last) range
+    void FindTriangles(uint32_t key, const StarIndexTriangle **first, const StarIndexTriangle **last) const;
+
+    // Indexes of the stars within radius (radians) of the unit vector v
+    void ConeSearch(const double v[3], double radius, std::vector<unsigned int> *result) const;
+
+    static uint32_t TriangleKey(double r0, double r1);
+    static bool Build(const std::string& catalogFile, double maxSide, double maxMag, std::vector<char> *out);
+};
+
+struct SolverStar
+{
+    double x;
+    double y;
+    double brightness;
+};
+
+struct StarSolution
+{
+    double ra;              // field center, J2000 degrees
+    double dec;
+    double rotation;        // image up (+y), degrees E of N
+    double pixelScale;      // arcsec / pixel
+    bool flipped;           // image is mirrored
+    unsigned int matched;   // image stars matched to the catalog
+    double rmsError;        // pixels
+    unsigned int hypotheses;
+};
+
+// Matches triangles of image stars against a StarIndex. With a position hint
+// only catalog triangles nearby the hint are considered, which keeps the search
+// to a few milliseconds; without one every triangle of the right shape and
+// size is tried.
+class StarPatternSolver
+{
+    const StarIndex& m_index;
+
+public:
+    StarPatternSolver(const StarIndex& index);
+
+    bool Solve(const std::vector<SolverStar>& stars, int width, int height, const PlateSolveHint& hint,
+               StarSolution *solution) const;
+};
+
+#endif // STAR_SOLVER_H_INCLUDED
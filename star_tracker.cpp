@@ -0,0 +1,237 @@
+/*
+ *  star_tracker.cpp
+ *  PHD Guiding
+ *
+ *  Created by Arran Dengate
+ *  Copyright (c) 2017 Arran Dengate
+ *  All rights reserved.
+ *
+ *  This source code is distributed under the following "BSD" license
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *    Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *    Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *    Neither the name of Bret McKee, Dad Dog Development,
+ *     Craig Stark, Stark Labs nor the names of its
+ *     contributors may be used to endorse or promote products derived from
+ *     this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "phd.h"
+
+// stars per thread; fewer than this and the pass runs on the calling thread
+static const int MinStarsPerThread = 8;
+
+StarTracker::StarTracker(void)
+{
+}
+
+void StarTracker::Clear(void)
+{
+    Reset(std::vector<Star>());
+}
+
+void StarTracker::Reset(const std::vector<Star>& stars)
+{
+    unsigned int n = stars.size();
+
+    X.resize(n);
+    Y.resize(n);
+    Mass.resize(n);
+    SNR.resize(n);
+    HFD.resize(n);
+    PeakVal.resize(n);
+    valid.assign(n, 1);
+    chances.assign(n, INITIAL_CHANCES);
+    calStartPos.assign(n, PHD_Point());
+    calEndPos.assign(n, PHD_Point());
+    guidingStartPos.assign(n, PHD_Point());
+    preCalAngle.assign(n, 0.0);
+    preCalDistance.assign(n, 0.0);
+    lastAngleDiff.assign(n, 0.0);
+    lastExpectedPos.assign(n, PHD_Point());
+    m_trail.resize(n * TRAIL_LENGTH);
+    m_trailHead.assign(n, 0);
+    m_trailCount.assign(n, 0);
+
+    for (unsigned int i = 0; i < n; i++)
+    {
+        X[i] = stars[i].X;
+        Y[i] = stars[i].Y;
+        Mass[i] = stars[i].Mass;
+        SNR[i] = stars[i].SNR;
+        HFD[i] = stars[i].HFD;
+        PeakVal[i] = stars[i].PeakVal;
+    }
+}
+
+const PHD_Point& StarTracker::TrailPoint(unsigned int i, unsigned int age) const
+{
+    unsigned int slot = (m_trailHead[i] + TRAIL_LENGTH - age) % TRAIL_LENGTH;
+    return m_trail[i * TRAIL_LENGTH + slot];
+}
+
+// Measures each star in m_which at the matching position in m_at, results
+// going to m_found
+void StarTracker::Locate(const usImage *pImg, int searchRegion, Star::FindMode mode)
+{
+    m_found.resize(m_which.size());
+
+    for (unsigned int k = 0; k < m_which.size(); k++)
+    {
+        unsigned int i = m_which[k];
+        Star::Measurement& m = m_found[k];
+        m.Mass = Mass[i];
+        m.SNR = SNR[i];
+        m.HFD = HFD[i];
+        m.PeakVal = PeakVal[i];
+    }
+
+    ParallelRowBands(m_which.size(), MinStarsPerThread, [&](int begin, int end)
+    {
+        for (int k = begin; k < end; k++)
+            Star::Measure(pImg, searchRegion, m_at[k].X, m_at[k].Y, mode, &m_found[k]);
+    });
+}
+
+void StarTracker::Accept(unsigned int i, const Star::Measurement& m)
+{
+    unsigned int head = (m_trailHead[i] + 1) % TRAIL_LENGTH;
+    m_trail[i * TRAIL_LENGTH + head] = PHD_Point(X[i], Y[i]);
+    m_trailHead[i] = head;
+    if (m_trailCount[i] < TRAIL_LENGTH)
+        ++m_trailCount[i];
+
+    X[i] = m.X;
+    Y[i] = m.Y;
+    Mass[i] = m.Mass;
+    SNR[i] = m.SNR;
+    HFD[i] = m.HFD;
+    PeakVal[i] = m.PeakVal;
+    chances[i] = VALIDATION_CHANCES;
+    valid[i] = 1;
+}
+
+template <typename T>
+static void KeepOnly(std::vector<T>& v, const std::vector<unsigned int>& keep)
+{
+    for (unsigned int j = 0; j < keep.size(); j++)
+        v[j] = v[keep[j]];
+    v.resize(keep.size());
+}
+
+void StarTracker::RemoveLost(void)
+{
+    m_keep.clear();
+    for (unsigned int i = 0; i < Count(); i++)
+    {
+        if (chances[i] > 0)
+            m_keep.push_back(i);
+        else
+            Debug.Write(wxString::Format("Star: Failed to find secondary star at %f %f, removing from list\n", X[i], Y[i]));
+    }
+
+    if (m_keep.size() == Count())
+        return;
+
+    for (unsigned int j = 0; j < m_keep.size(); j++)
+    {
+        if (m_keep[j] != j)
+        {
+            std::copy(m_trail.begin() + m_keep[j] * TRAIL_LENGTH, m_trail.begin() + (m_keep[j] + 1) * TRAIL_LENGTH,
+                      m_trail.begin() + j * TRAIL_LENGTH);
+        }
+    }
+    m_trail.resize(m_keep.size() * TRAIL_LENGTH);
+
+    KeepOnly(X, m_keep);
+    KeepOnly(Y, m_keep);
+    KeepOnly(Mass, m_keep);
+    KeepOnly(SNR, m_keep);
+    KeepOnly(HFD, m_keep);
+    KeepOnly(PeakVal, m_keep);
+    KeepOnly(valid, m_keep);
+    KeepOnly(chances, m_keep);
+    KeepOnly(calStartPos, m_keep);
+    KeepOnly(calEndPos, m_keep);
+    KeepOnly(guidingStartPos, m_keep);
+    KeepOnly(preCalAngle, m_keep);
+    KeepOnly(preCalDistance, m_keep);
+    KeepOnly(lastAngleDiff, m_keep);
+    KeepOnly(lastExpectedPos, m_keep);
+    KeepOnly(m_trailHead, m_keep);
+    KeepOnly(m_trailCount, m_keep);
+}
+
+unsigned int StarTracker::Update(const usImage *pImg, int searchRegion, Star::FindMode mode)
+{
+    m_which.resize(Count());
+    m_at.resize(Count());
+    for (unsigned int i = 0; i < Count(); i++)
+    {
+        m_which[i] = i;
+        m_at[i] = PHD_Point(X[i], Y[i]);
+    }
+
+    Locate(pImg, searchRegion, mode);
+
+    unsigned int found = 0;
+    for (unsigned int i = 0; i < Count(); i++)
+    {
+        const Star::Measurement& m = m_found[i];
+        if (m.result == Star::STAR_OK || m.result == Star::STAR_SATURATED)
+        {
+            Accept(i, m);
+            ++found;
+        }
+        else
+        {
+            chances[i] -= 1;
+            valid[i] = 0;
+        }
+    }
+
+    RemoveLost();
+
+    return found;
+}
+
+unsigned int StarTracker::Recover(const usImage *pImg, int searchRegion, Star::FindMode mode,
+                                  const std::vector<unsigned int>& stars, const std::vector<PHD_Point>& expected)
+{
+    m_which = stars;
+    m_at = expected;
+    for (unsigned int k = 0; k < stars.size(); k++)
+        lastExpectedPos[stars[k]] = expected[k];
+
+    Locate(pImg, searchRegion, mode);
+
+    unsigned int found = 0;
+    for (unsigned int k = 0; k < stars.size(); k++)
+    {
+        const Star::Measurement& m = m_found[k];
+        if (m.result == Star::STAR_OK || m.result == Star::STAR_SATURATED)
+        {
+            Accept(stars[k], m);
+            ++found;
+        }
+    }
+
+    return found;
+}
@@ -0,0 +1,106 @@
+/*
+ *  star_tracker.h
+ *  PHD Guiding
+ *
+ *  Created by Arran Dengate
+ *  Copyright (c) 2017 Arran Dengate
+ *  All rights reserved.
+ *
+ *  This source code is distributed under the following "BSD" license
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *    Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *    Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *    Neither the name of Bret McKee, Dad Dog Development,
+ *     Craig Stark, Stark Labs nor the names of its
+ *     contributors may be used to endorse or promote products derived from
+ *     this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#ifndef STAR_TRACKER_H_INCLUDED
+#define STAR_TRACKER_H_INCLUDED
+
+// The secondary stars, kept as one array per property rather than one Star
+// per star. A frame is processed in a single pass that centroids every star,
+// split across the CPUs, and all per-frame storage is reused, so tracking
+// many reference stars costs no allocations.
+class StarTracker
+{
+public:
+    enum { TRAIL_LENGTH = 20 };         // previous positions kept for the star trails overlay
+    enum { INITIAL_CHANCES = 3 };       // frames a new star may be missing before it is dropped
+    enum { VALIDATION_CHANCES = 14 };   // ... once it has been found again
+
+    std::vector<double> X;
+    std::vector<double> Y;
+    std::vector<double> Mass;
+    std::vector<double> SNR;
+    std::vector<double> HFD;
+    std::vector<unsigned short> PeakVal;
+    std::vector<char> valid;            // found on the latest frame
+    std::vector<int> chances;
+    std::vector<PHD_Point> calStartPos;
+    std::vector<PHD_Point> calEndPos;
+    std::vector<PHD_Point> guidingStartPos;
+    std::vector<double> preCalAngle;
+    std::vector<double> preCalDistance;
+    std::vector<double> lastAngleDiff;      // Only needed for debugging
+    std::vector<PHD_Point> lastExpectedPos; // Only needed for debugging
+
+private:
+    std::vector<PHD_Point> m_trail;         // TRAIL_LENGTH slots per star
+    std::vector<unsigned char> m_trailHead; // slot of the newest position
+    std::vector<unsigned char> m_trailCount;
+
+    // scratch for a pass over the frame
+    std::vector<unsigned int> m_which;
+    std::vector<PHD_Point> m_at;
+    std::vector<Star::Measurement> m_found;
+    std::vector<unsigned int> m_keep;
+
+    void Locate(const usImage *pImg, int searchRegion, Star::FindMode mode);
+    void Accept(unsigned int i, const Star::Measurement& m);
+    void RemoveLost(void);
+
+public:
+    StarTracker(void);
+
+    void Clear(void);
+    void Reset(const std::vector<Star>& stars);
+
+    unsigned int Count(void) const { return X.size(); }
+    PHD_Point Position(unsigned int i) const { return PHD_Point(X[i], Y[i]); }
+    bool IsValid(unsigned int i) const { return valid[i] != 0; }
+
+    // Previous positions of star i, age 0 being the most recent
+    unsigned int TrailLength(unsigned int i) const { return m_trailCount[i]; }
+    const PHD_Point& TrailPoint(unsigned int i, unsigned int age) const;
+
+    // Centroid every star around its last position. A star that is not found
+    // uses up one of its chances, and is dropped when it has none left.
+    // Returns the number of stars found.
+    unsigned int Update(const usImage *pImg, int searchRegion, Star::FindMode mode);
+
+    // Look for the given lost stars at the positions they are expected at.
+    // Returns the number recovered.
+    unsigned int Recover(const usImage *pImg, int searchRegion, Star::FindMode mode,
+                         const std::vector<unsigned int>& stars, const std::vector<PHD_Point>& expected);
+};
+
+#endif // STAR_TRACKER_H_INCLUDED
@@ -0,0 +1,290 @@
+/*
+ *  defect_map_test.cpp
+ *  PHD Guiding
+ *
+ *  Created by Arran Dengate
+ *  Copyright (c) 2017 Arran Dengate
+ *  All rights reserved.
+ *
+ *  This source code is distributed under the following "BSD" license
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *    Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *    Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *    Neither the name of Bret McKee, Dad Dog Development,
+ *     Craig Stark, Stark Labs nor the names of its
+ *     contributors may be used to endorse or promote products derived from
+ *     this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "phd.h"
+
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <stdlib.h>
+
+// The defect map median filter and dark statistics compared with the
+// implementations they replaced, on guide camera frame sizes. The DISABLED_
+// benchmark prints timings of both; run it with
+// --gtest_also_run_disabled_tests.
+
+enum { HalfWidth = 15 };    // DefectMapDarks::BuildFilteredDark uses a 31x31 window
+
+// The previous median filter: the two-level histogram is rebuilt at the
+// start of each row and searched from scratch for every pixel
+static unsigned short HistoMedian(const unsigned short *histo1, const unsigned short *histo2, unsigned int n)
+{
+    n /= 2;
+    unsigned int i;
+    for (i = 0; i < 256; i++)
+    {
+        if (histo1[i] > n)
+            break;
+        n -= histo1[i];
+    }
+    for (i <<= 8; i < 65536; i++)
+    {
+        if (histo2[i] > n)
+            break;
+        n -= histo2[i];
+    }
+    return i;
+}
+
+static void OldMedianFilter(usImage& dst, const usImage& src, int halfWidth)
+{
+    dst.Init(src.Size);
+    unsigned short *d = &dst.ImageData[0];
+
+    int const width = src.Size.GetWidth();
+    int const height = src.Size.GetHeight();
+    std::vector<unsigned short> histo1(256);
+    std::vector<unsigned short> histo2(65536);
+
+    for (int y = 0; y < height; y++)
+    {
+        int top = std::max(0, y - halfWidth);
+        int bot = std::min(y + halfWidth, height - 1);
+        int left = 0;
+        int right = std::min(halfWidth, width - 1);
+
+        std::fill(histo1.begin(), histo1.end(), 0);
+        std::fill(histo2.begin(), histo2.end(), 0);
+        for (int j = top; j <= bot; j++)
+        {
+            const unsigned short *p = &src.Pixel(left, j);
+            for (int i = left; i <= right; i++, p++)
+            {
+                ++histo1[*p >> 8];
+                ++histo2[*p];
+            }
+        }
+        unsigned int n = (right - left + 1) * (bot - top + 1);
+        *d++ = HistoMedian(&histo1[0], &histo2[0], n);
+
+        for (int i = 1; i < width; i++)
+        {
+            left = std::max(0, i - halfWidth);
+            right = std::min(i + halfWidth, width - 1);
+            if (left > 0)
+            {
+                const unsigned short *p = &src.Pixel(left - 1, top);
+                for (int j = top; j <= bot; j++, p += width)
+                {
+                    --histo1[*p >> 8];
+                    --histo2[*p];
+                }
+                n -= (bot - top + 1);
+            }
+            if (i + halfWidth <= width - 1)
+            {
+                const unsigned short *p = &src.Pixel(right, top);
+                for (int j = top; j <= bot; j++, p += width)
+                {
+                    ++histo1[*p >> 8];
+                    ++histo2[*p];
+                }
+                n += (bot - top + 1);
+            }
+            *d++ = HistoMedian(&histo1[0], &histo2[0], n);
+        }
+    }
+}
+
+// The previous statistics: a running mean and variance, then the median and
+// MAD of a sorted copy
+static ImageStats OldImageStats(const usImage& img)
+{
+    std::vector<unsigned short> tmp(img.ImageData, img.ImageData + img.NPixels);
+    double sum = 0.0, a = 0.0, q = 0.0, k = 1.0, km1 = 0.0;
+    for (unsigned int i = 0; i < tmp.size(); i++)
+    {
+        double const x = (double) tmp[i];
+        sum += x;
+        double const a0 = a;
+        a += (x - a) / k;
+        q += (x - a0) * (x - a);
+        km1 = k;
+        k += 1.0;
+    }
+
+    ImageStats stats;
+    stats.mean = sum / km1;
+    stats.stdev = sqrt(q / km1);
+    std::nth_element(tmp.begin(), tmp.begin() + tmp.size() / 2, tmp.end());
+    stats.median = tmp[tmp.size() / 2];
+    for (unsigned int i = 0; i < tmp.size(); i++)
+        tmp[i] = (unsigned short) std::abs((int) tmp[i] - (int) stats.median);
+    std::nth_element(tmp.begin(), tmp.begin() + tmp.size() / 2, tmp.end());
+    stats.mad = tmp[tmp.size() / 2];
+    return stats;
+}
+
+// A dark: read noise about a bias level with a gradient, plus hot and cold
+// pixels
+static void MakeDark(usImage& img, int width, int height, unsigned int seed)
+{
+    srand(seed);
+    img.Init(wxSize(width, height));
+    for (int y = 0; y < height; y++)
+    {
+        for (int x = 0; x < width; x++)
+        {
+            int v = 1000 + x / 16 + y / 32 + rand() % 40 - 20;
+            int r = rand() % 1000;
+            if (r == 0)
+                v = 20000 + rand() % 40000;
+            else if (r == 1)
+                v = rand() % 100;
+            img.Pixel(x, y) = (unsigned short) v;
+        }
+    }
+}
+
+static double Millis(const std::chrono::steady_clock::time_point& start)
+{
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+struct FrameSize
+{
+    int width;
+    int height;
+};
+
+class DefectMapTest : public ::testing::TestWithParam<FrameSize>
+{
+};
+
+TEST_P(DefectMapTest, MedianFilterMatchesPrevious)
+{
+    FrameSize const fs = GetParam();
+    DefectMapDarks darks;
+    MakeDark(darks.masterDark, fs.width, fs.height, fs.width * 7 + fs.height);
+
+    usImage expected;
+    OldMedianFilter(expected, darks.masterDark, HalfWidth);
+    darks.BuildFilteredDark();
+
+    ASSERT_EQ(expected.Size, darks.filteredDark.Size);
+    int mismatches = 0;
+    for (int i = 0; i < expected.NPixels; i++)
+        if (expected.ImageData[i] != darks.filteredDark.ImageData[i])
+            mismatches++;
+    EXPECT_EQ(0, mismatches);
+
+    // spot check against a sort of the window
+    for (int k = 0; k < 50; k++)
+    {
+        int x = rand() % fs.width, y = rand() % fs.height;
+        std::vector<unsigned short> win;
+        for (int j = std::max(0, y - HalfWidth); j <= std::min(fs.height - 1, y + HalfWidth); j++)
+            for (int i = std::max(0, x - HalfWidth); i <= std::min(fs.width - 1, x + HalfWidth); i++)
+                win.push_back(darks.masterDark.Pixel(i, j));
+        std::nth_element(win.begin(), win.begin() + win.size() / 2, win.end());
+        EXPECT_EQ(win[win.size() / 2], darks.filteredDark.Pixel(x, y)) << "at " << x << "," << y;
+    }
+}
+
+TEST_P(DefectMapTest, StatisticsMatchPrevious)
+{
+    FrameSize const fs = GetParam();
+    DefectMapDarks darks;
+    MakeDark(darks.masterDark, fs.width, fs.height, fs.width + fs.height * 3);
+    darks.BuildFilteredDark();
+
+    ImageStats expected = OldImageStats(darks.masterDark);
+
+    DefectMapBuilder builder;
+    builder.Init(darks);
+    const ImageStats& stats = builder.GetImageStats();
+
+    EXPECT_NEAR(expected.mean, stats.mean, 1e-6 * expected.mean);
+    EXPECT_NEAR(expected.stdev, stats.stdev, 1e-6 * expected.stdev);
+    EXPECT_EQ(expected.median, stats.median);
+    EXPECT_EQ(expected.mad, stats.mad);
+}
+
+TEST_P(DefectMapTest, DISABLED_Benchmark)
+{
+    FrameSize const fs = GetParam();
+    DefectMapDarks darks;
+    MakeDark(darks.masterDark, fs.width, fs.height, fs.width * 7 + fs.height);
+
+    usImage expected;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    OldMedianFilter(expected, darks.masterDark, HalfWidth);
+    double oldMs = Millis(start);
+
+    start = std::chrono::steady_clock::now();
+    darks.BuildFilteredDark();
+    double newMs = Millis(start);
+
+    printf("median filter %dx%d: previous %.1f ms, now %.1f ms\n", fs.width, fs.height, oldMs, newMs);
+
+    start = std::chrono::steady_clock::now();
+    OldImageStats(darks.masterDark);
+    oldMs = Millis(start);
+
+    DefectMapBuilder builder;
+    start = std::chrono::steady_clock::now();
+    builder.Init(darks);
+    newMs = Millis(start);
+
+    printf("dark statistics %dx%d: previous %.1f ms, now (with defect scan) %.1f ms\n", fs.width, fs.height, oldMs,
+           newMs);
+}
+
+static const FrameSize FrameSizes[] = {
+    { 752, 480 },       // QHY5L-II, Lodestar class
+    { 1280, 960 },      // ASI120
+    { 1936, 1216 },     // ASI174
+    { 37, 23 },         // smaller than the window
+    { 16, 40 },
+    { 500, 3 },
+};
+
+INSTANTIATE_TEST_CASE_P(FrameSizes, DefectMapTest, ::testing::ValuesIn(FrameSizes));
+
+int main(int argc, char **argv)
+{
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,222 @@
+/*
+ *  field_transform_test.cpp
+ *  PHD Guiding
+ *
+ *  Created by Arran Dengate
+ *  Copyright (c) 2017 Arran Dengate
+ *  All rights reserved.
+ *
+ *  This source code is distributed under the following "BSD" license
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *    Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *    Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *    Neither the name of Bret McKee, Dad Dog Development,
+ *     Craig Stark, Stark Labs nor the names of its
+ *     contributors may be used to endorse or promote products derived from
+ *     this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "phd.h"
+
+#include <gtest/gtest.h>
+
+#include <stdlib.h>
+
+// Moves stars by a rotation about the origin, a change of scale and a shift,
+// plus gaussian noise
+struct FieldMotion
+{
+    double rotation;    // degrees
+    double scale;
+    double dx;
+    double dy;
+    double noise;       // pixels, 1 sigma
+
+    PHD_Point Apply(const PHD_Point& p) const
+    {
+        double th = rotation * M_PI / 180.0;
+        double x = scale * (cos(th) * p.X - sin(th) * p.Y) + dx;
+        double y = scale * (sin(th) * p.X + cos(th) * p.Y) + dy;
+        return PHD_Point(x + Gauss() * noise, y + Gauss() * noise);
+    }
+
+    static double Gauss()
+    {
+        double u = (rand() + 1.0) / (RAND_MAX + 2.0);
+        double v = (rand() + 1.0) / (RAND_MAX + 2.0);
+        return sqrt(-2.0 * log(u)) * cos(2.0 * M_PI * v);
+    }
+};
+
+static PHD_Point RandomStar()
+{
+    return PHD_Point(rand() % 640, rand() % 480);
+}
+
+TEST(FieldTransformTest, RecoversRotationAndShift)
+{
+    srand(1);
+    FieldMotion m = { 0.3, 1.0, 2.5, -1.5, 0.15 };
+    FieldTransformEstimator fit;
+    double sx = 0.0, sy = 0.0;
+    for (int i = 0; i < 50; i++)
+    {
+        PHD_Point p = RandomStar();
+        PHD_Point q = m.Apply(p);
+        fit.Add(p, q, 1.0);
+        sx += q.X - p.X;
+        sy += q.Y - p.Y;
+    }
+
+    FieldTransform t;
+    ASSERT_TRUE(fit.Solve(&t));
+    EXPECT_NEAR(0.3, t.rotation, 0.01);
+    EXPECT_NEAR(1.0, t.scale, 5e-4);
+    EXPECT_NEAR(sx / 50.0, t.dx, 0.01);
+    EXPECT_NEAR(sy / 50.0, t.dy, 0.01);
+    EXPECT_EQ(50u, t.inliers);
+    EXPECT_LT(t.rms, 0.3);
+    EXPECT_GT(t.cov[2][2], 0.0);
+    EXPECT_LT(sqrt(t.cov[2][2]), 0.01);
+}
+
+TEST(FieldTransformTest, RotationHasTheSenseOfPointAngle)
+{
+    FieldMotion m = { 1.0, 1.0, 0.0, 0.0, 0.0 };
+    PHD_Point stars[] = { PHD_Point(100, 0), PHD_Point(0, 100), PHD_Point(-100, 0), PHD_Point(0, -100) };
+    FieldTransformEstimator fit;
+    for (unsigned int i = 0; i < WXSIZEOF(stars); i++)
+        fit.Add(stars[i], m.Apply(stars[i]), 1.0);
+
+    FieldTransform t;
+    ASSERT_TRUE(fit.Solve(&t));
+    double angleChange = (m.Apply(stars[0]).Angle() - stars[0].Angle()) * 180.0 / M_PI;
+    EXPECT_NEAR(angleChange, t.rotation, 1e-6);
+}
+
+TEST(FieldTransformTest, RejectsOutliers)
+{
+    srand(2);
+    FieldMotion m = { -0.2, 1.0, 0.5, 0.5, 0.15 };
+    FieldTransformEstimator fit;
+    for (int i = 0; i < 50; i++)
+    {
+        PHD_Point p = RandomStar();
+        PHD_Point q = m.Apply(p);
+        if (i % 10 == 0)
+            q = PHD_Point(q.X + 8.0, q.Y - 6.0);    // swapped for a neighbour
+        fit.Add(p, q, 1.0);
+    }
+
+    FieldTransform t;
+    ASSERT_TRUE(fit.Solve(&t));
+    EXPECT_NEAR(-0.2, t.rotation, 0.01);
+    EXPECT_EQ(45u, t.inliers);
+}
+
+TEST(FieldTransformTest, WeightsFavourBrightStars)
+{
+    srand(3);
+    FieldMotion good = { 0.1, 1.0, 0.0, 0.0, 0.05 };
+    FieldMotion poor = { 0.1, 1.0, 0.0, 0.0, 1.0 };
+    FieldTransformEstimator fit;
+    fit.SetTolerance(5.0);
+    for (int i = 0; i < 40; i++)
+    {
+        PHD_Point p = RandomStar();
+        if (i % 2)
+            fit.Add(p, good.Apply(p), 400.0);
+        else
+            fit.Add(p, poor.Apply(p), 1.0);
+    }
+
+    FieldTransform t;
+    ASSERT_TRUE(fit.Solve(&t));
+    EXPECT_NEAR(0.1, t.rotation, 0.01);
+}
+
+TEST(FieldTransformTest, UnderdeterminedFitFails)
+{
+    // The guider sends no rotation when this fails, so it must fail rather
+    // than return a guess from one or two stars
+    FieldMotion m = { 0.5, 1.0, 1.0, 1.0, 0.0 };
+    FieldTransformEstimator fit;
+    FieldTransform t;
+
+    fit.Clear();
+    EXPECT_FALSE(fit.Solve(&t));
+
+    PHD_Point a(100, 100), b(300, 200), c(200, 400);
+    fit.Add(a, m.Apply(a), 1.0);
+    EXPECT_FALSE(fit.Solve(&t));
+
+    fit.Add(b, m.Apply(b), 1.0);
+    EXPECT_EQ(2u, fit.Count());
+    EXPECT_FALSE(fit.Solve(&t));
+
+    fit.Add(c, m.Apply(c), 1.0);
+    ASSERT_TRUE(fit.Solve(&t));
+    EXPECT_NEAR(0.5, t.rotation, 1e-6);
+
+    // a later frame with too few stars fails again, even with the previous
+    // solution remembered
+    fit.Clear();
+    fit.Add(a, m.Apply(a), 1.0);
+    fit.Add(b, m.Apply(b), 1.0);
+    EXPECT_FALSE(fit.Solve(&t));
+}
+
+TEST(FieldTransformTest, NoConsensusFails)
+{
+    // three stars that moved in unrelated directions
+    FieldTransformEstimator fit;
+    fit.SetTolerance(0.5);
+    fit.Add(PHD_Point(100, 100), PHD_Point(110, 100), 1.0);
+    fit.Add(PHD_Point(300, 200), PHD_Point(300, 180), 1.0);
+    fit.Add(PHD_Point(200, 400), PHD_Point(185, 415), 1.0);
+
+    FieldTransform t;
+    EXPECT_FALSE(fit.Solve(&t));
+}
+
+TEST(RotationFilterTest, WeightsByVariance)
+{
+    RotationFilter filter;
+    filter.SetDrift(1e-6);
+    EXPECT_FALSE(filter.IsStarted());
+
+    EXPECT_DOUBLE_EQ(1.0, filter.Update(1.0, 0.01));
+    EXPECT_TRUE(filter.IsStarted());
+
+    // an equally good measurement moves the estimate half way, a much
+    // noisier one hardly at all
+    EXPECT_NEAR(1.5, filter.Update(2.0, 0.01), 1e-3);
+    EXPECT_NEAR(1.5, filter.Update(10.0, 1e4), 1e-3);
+
+    filter.Reset();
+    EXPECT_FALSE(filter.IsStarted());
+    EXPECT_DOUBLE_EQ(0.0, filter.Value());
+}
+
+int main(int argc, char **argv)
+{
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
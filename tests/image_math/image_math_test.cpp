@@ -0,0 +1,202 @@
+/*
+ *  image_math_test.cpp
+ *  PHD Guiding
+ *
+ *  Created by Arran Dengate
+ *  Copyright (c) 2017 Arran Dengate
+ *  All rights reserved.
+ *
+ *  This source code is distributed under the following "BSD" license
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *    Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *    Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *    Neither the name of Bret McKee, Dad Dog Development,
+ *     Craig Stark, Stark Labs nor the names of its
+ *     contributors may be used to endorse or promote products derived from
+ *     this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "phd.h"
+
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <stdlib.h>
+#include <thread>
+
+// Frame statistics from ImageMinMax compared with the way usImage::CalcStats
+// used to find them: copy the subframe, median filter it into a new image
+// and scan that. The DISABLED_ benchmark prints timings of both; run it with
+// --gtest_also_run_disabled_tests.
+
+static double Millis(const std::chrono::steady_clock::time_point& start)
+{
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+struct MinMax
+{
+    int min;
+    int max;
+    int filtMin;
+    int filtMax;
+};
+
+static MinMax OldMinMax(const usImage& img, const wxRect& rect)
+{
+    usImage sub;
+    sub.Init(rect.GetSize());
+    for (int y = 0; y < rect.GetHeight(); y++)
+        for (int x = 0; x < rect.GetWidth(); x++)
+            sub.Pixel(x, y) = img.Pixel(rect.GetLeft() + x, rect.GetTop() + y);
+
+    MinMax mm = { 65535, 0, 65535, 0 };
+    for (int i = 0; i < sub.NPixels; i++)
+    {
+        mm.min = std::min(mm.min, (int) sub.ImageData[i]);
+        mm.max = std::max(mm.max, (int) sub.ImageData[i]);
+    }
+
+    if (rect.GetWidth() < 2 || rect.GetHeight() < 2)
+    {
+        mm.filtMin = mm.min;
+        mm.filtMax = mm.max;
+        return mm;
+    }
+
+    usImage filtered;
+    filtered.Init(sub.Size);
+    Median3(filtered.ImageData, sub.ImageData, sub.Size, wxRect(sub.Size));
+    for (int i = 0; i < filtered.NPixels; i++)
+    {
+        mm.filtMin = std::min(mm.filtMin, (int) filtered.ImageData[i]);
+        mm.filtMax = std::max(mm.filtMax, (int) filtered.ImageData[i]);
+    }
+    return mm;
+}
+
+// sky with read noise, a gradient, hot and cold pixels and a saturated star
+static void MakeFrame(usImage& img, int width, int height)
+{
+    srand(width * 3 + height);
+    img.Init(wxSize(width, height));
+    for (int y = 0; y < height; y++)
+    {
+        for (int x = 0; x < width; x++)
+        {
+            int v = 1000 + x / 8 + y / 16 + rand() % 60;
+            int r = rand() % 2000;
+            if (r == 0)
+                v = 65535;
+            else if (r == 1)
+                v = 0;
+            img.Pixel(x, y) = (unsigned short) v;
+        }
+    }
+    img.Pixel(width / 2, height / 4) = 0;
+    img.Pixel(width / 2, height * 3 / 4) = 65535;
+    for (int y = height / 2 - 2; y <= height / 2 + 2; y++)
+        for (int x = width / 3 - 2; x <= width / 3 + 2; x++)
+            if (x >= 0 && y >= 0 && x < width && y < height)
+                img.Pixel(x, y) = 60000;
+}
+
+struct FrameSize
+{
+    int width;
+    int height;
+};
+
+class ImageMinMaxTest : public ::testing::TestWithParam<FrameSize>
+{
+};
+
+TEST_P(ImageMinMaxTest, MatchesFilteredCopy)
+{
+    FrameSize const fs = GetParam();
+    usImage img;
+    MakeFrame(img, fs.width, fs.height);
+
+    const wxRect rects[] = {
+        wxRect(img.Size),
+        wxRect(fs.width / 4, fs.height / 4, fs.width / 2, fs.height / 2),
+        wxRect(fs.width / 3 - 10, fs.height / 2 - 10, 20, 20),
+        wxRect(0, 0, fs.width, 1),
+        wxRect(fs.width - 1, 0, 1, fs.height),
+        wxRect(fs.width - 2, fs.height - 2, 2, 2),
+    };
+
+    for (size_t i = 0; i < WXSIZEOF(rects); i++)
+    {
+        wxRect const& rect = rects[i];
+        MinMax expected = OldMinMax(img, rect);
+        MinMax mm;
+        ImageMinMax(img, rect, &mm.min, &mm.max, &mm.filtMin, &mm.filtMax);
+        EXPECT_EQ(expected.min, mm.min) << "rect " << i;
+        EXPECT_EQ(expected.max, mm.max) << "rect " << i;
+        EXPECT_EQ(expected.filtMin, mm.filtMin) << "rect " << i;
+        EXPECT_EQ(expected.filtMax, mm.filtMax) << "rect " << i;
+    }
+
+    // the saturated star survives the median filter, the hot pixels do not
+    MinMax mm;
+    ImageMinMax(img, wxRect(img.Size), &mm.min, &mm.max, &mm.filtMin, &mm.filtMax);
+    EXPECT_EQ(65535, mm.max);
+    EXPECT_EQ(60000, mm.filtMax);
+    EXPECT_EQ(0, mm.min);
+    EXPECT_GT(mm.filtMin, 0);
+}
+
+TEST_P(ImageMinMaxTest, DISABLED_Benchmark)
+{
+    FrameSize const fs = GetParam();
+    usImage img;
+    MakeFrame(img, fs.width, fs.height);
+    enum { Runs = 20 };
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (int i = 0; i < Runs; i++)
+        OldMinMax(img, wxRect(img.Size));
+    double oldMs = Millis(start) / Runs;
+
+    MinMax mm;
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < Runs; i++)
+        ImageMinMax(img, wxRect(img.Size), &mm.min, &mm.max, &mm.filtMin, &mm.filtMax);
+    double newMs = Millis(start) / Runs;
+
+    printf("frame statistics %dx%d on %u cpus: filtered copy %.2f ms, ImageMinMax %.2f ms\n", fs.width, fs.height,
+           std::thread::hardware_concurrency(), oldMs, newMs);
+}
+
+static const FrameSize FrameSizes[] = {
+    { 752, 480 },       // QHY5L-II, Lodestar class
+    { 1280, 960 },      // ASI120
+    { 1936, 1216 },     // ASI174
+    { 3, 700 },
+};
+
+INSTANTIATE_TEST_CASE_P(FrameSizes, ImageMinMaxTest, ::testing::ValuesIn(FrameSizes));
+
+int main(int argc, char **argv)
+{
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,260 @@
+/*
+ *  json_parser_test.cpp
+ *  PHD Guiding
+ *
+ *  Created by Arran Dengate
+ *  Copyright (c) 2017 Arran Dengate
+ *  All rights reserved.
+ *
+ *  This source code is distributed under the following "BSD" license
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *    Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *    Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *    Neither the name of Bret McKee, Dad Dog Development,
+ *     Craig Stark, Stark Labs nor the names of its
+ *     contributors may be used to endorse or promote products derived from
+ *     this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "phd.h"
+#include "json_parser.h"
+
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <fstream>
+#include <string>
+#include <vector>
+
+// The JSON parser on a session of event server requests, as an imaging
+// program sends them while connecting, guiding and dithering, plus a large
+// request that overflows the first arena block. The DISABLED_ benchmark
+// prints the parse rate of one parser kept per client, as the event server
+// does, along with that of a new parser per request; run it with
+// --gtest_also_run_disabled_tests.
+
+static std::vector<std::string> LoadSession()
+{
+    std::vector<std::string> reqs;
+    std::ifstream in(PHD_SOURCE_DIR "/tests/json_parser/rpc_session.txt");
+    std::string line;
+    while (std::getline(in, line))
+    {
+        if (!line.empty() && line[line.size() - 1] == '\r')
+            line.erase(line.size() - 1);
+        if (!line.empty())
+            reqs.push_back(line);
+    }
+    return reqs;
+}
+
+static std::string LargeRequest(int items)
+{
+    std::string req = "{\"method\":\"set_lock_shift_params\",\"params\":{\"items\":[";
+    for (int i = 0; i < items; i++)
+    {
+        char buf[64];
+        snprintf(buf, sizeof(buf), "%s{\"k\":%d,\"v\":[%d,%d.5]}", i ? "," : "", i, i, i);
+        req += buf;
+    }
+    req += "]},\"id\":99}";
+    return req;
+}
+
+static const json_value *Member(const json_value *obj, const char *name)
+{
+    json_for_each(item, obj)
+    {
+        if (item->name && strcmp(item->name, name) == 0)
+            return item;
+    }
+    return 0;
+}
+
+TEST(JsonParserTest, ParsesSession)
+{
+    std::vector<std::string> reqs = LoadSession();
+    ASSERT_EQ(50U, reqs.size());
+
+    JsonParser parser;
+    for (size_t i = 0; i < reqs.size(); i++)
+    {
+        std::string buf(reqs[i]);
+        ASSERT_TRUE(parser.Parse(&buf[0])) << reqs[i] << ": " << parser.ErrorDesc();
+
+        const json_value *root = parser.Root();
+        ASSERT_EQ(JSON_OBJECT, root->type);
+        const json_value *method = Member(root, "method");
+        ASSERT_TRUE(method != 0);
+        EXPECT_EQ(JSON_STRING, method->type);
+        const json_value *id = Member(root, "id");
+        ASSERT_TRUE(id != 0);
+        ASSERT_EQ(JSON_INT, id->type);
+        EXPECT_EQ((int) i + 1, id->int_value);
+    }
+}
+
+TEST(JsonParserTest, Values)
+{
+    char req[] = "{\"method\":\"dither\",\"params\":{\"amount\":5.5,\"raOnly\":true,"
+        "\"settle\":{\"pixels\":0.8,\"time\":10,\"timeout\":100},\"name\":\"a\\\"b\",\"none\":null},\"id\":37}";
+    JsonParser parser;
+    ASSERT_TRUE(parser.Parse(req));
+
+    const json_value *params = Member(parser.Root(), "params");
+    ASSERT_TRUE(params != 0);
+    ASSERT_EQ(JSON_OBJECT, params->type);
+
+    const json_value *v = Member(params, "amount");
+    ASSERT_TRUE(v != 0);
+    ASSERT_EQ(JSON_FLOAT, v->type);
+    EXPECT_FLOAT_EQ(5.5f, v->float_value);
+
+    v = Member(params, "raOnly");
+    ASSERT_TRUE(v != 0);
+    ASSERT_EQ(JSON_BOOL, v->type);
+    EXPECT_EQ(1, v->int_value);
+
+    const json_value *settle = Member(params, "settle");
+    ASSERT_TRUE(settle != 0);
+    v = Member(settle, "timeout");
+    ASSERT_TRUE(v != 0);
+    ASSERT_EQ(JSON_INT, v->type);
+    EXPECT_EQ(100, v->int_value);
+    EXPECT_EQ(settle, v->parent);
+
+    v = Member(params, "name");
+    ASSERT_TRUE(v != 0);
+    ASSERT_EQ(JSON_STRING, v->type);
+    EXPECT_STREQ("a\"b", v->string_value);
+
+    v = Member(params, "none");
+    ASSERT_TRUE(v != 0);
+    EXPECT_EQ(JSON_NULL, v->type);
+}
+
+TEST(JsonParserTest, ReportsErrors)
+{
+    // the parser is lenient about missing colons and extra commas, but not
+    // about these
+    const char *bad[] = {
+        "{\"method\":\"guide\"",
+        "{\"method\":\"guide\"]",
+        "{\"params\":[1,2}",
+        "{\"id\":tru}",
+        "{\"method\":\"gui",
+        "",
+    };
+
+    JsonParser parser;
+    for (size_t i = 0; i < WXSIZEOF(bad); i++)
+    {
+        std::string buf(bad[i]);
+        EXPECT_FALSE(parser.Parse(&buf[0])) << bad[i];
+        EXPECT_TRUE(parser.ErrorDesc() != 0) << bad[i];
+    }
+
+    // the parser is still usable afterwards
+    char req[] = "{\"method\":\"get_app_state\",\"id\":1}";
+    EXPECT_TRUE(parser.Parse(req));
+}
+
+// a request that overflows the first block, then small ones, then the large
+// one again, all through the same arena
+TEST(JsonParserTest, LargeRequestThenSmall)
+{
+    std::string large = LargeRequest(300);
+    JsonParser parser;
+
+    for (int pass = 0; pass < 3; pass++)
+    {
+        std::string buf(large);
+        ASSERT_TRUE(parser.Parse(&buf[0]));
+        const json_value *items = Member(Member(parser.Root(), "params"), "items");
+        ASSERT_TRUE(items != 0);
+        int n = 0;
+        json_for_each(item, items)
+        {
+            const json_value *k = Member(item, "k");
+            ASSERT_TRUE(k != 0);
+            EXPECT_EQ(n, k->int_value);
+            ++n;
+        }
+        EXPECT_EQ(300, n);
+
+        char small[] = "{\"method\":\"set_lock_position\",\"params\":[512.25,384.75,true],\"id\":35}";
+        ASSERT_TRUE(parser.Parse(small));
+        const json_value *params = Member(parser.Root(), "params");
+        ASSERT_TRUE(params != 0);
+        ASSERT_EQ(JSON_ARRAY, params->type);
+        EXPECT_FLOAT_EQ(512.25f, params->first_child->float_value);
+    }
+}
+
+static double NanosPerParse(const std::vector<std::string>& reqs, int parses, bool parserPerRequest)
+{
+    std::vector<std::string> bufs(reqs);
+    JsonParser client;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (int i = 0; i < parses; i++)
+    {
+        size_t k = i % reqs.size();
+        std::string& buf = bufs[k];
+        buf.assign(reqs[k]);    // the parser decodes in place
+        if (parserPerRequest)
+        {
+            JsonParser parser;
+            if (!parser.Parse(&buf[0]))
+                return -1.0;
+        }
+        else if (!client.Parse(&buf[0]))
+            return -1.0;
+    }
+    return std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / parses;
+}
+
+TEST(JsonParserBenchmark, DISABLED_RecordedSession)
+{
+    enum { Parses = 200000 };
+
+    std::vector<std::string> reqs = LoadSession();
+    ASSERT_FALSE(reqs.empty());
+
+    double perClient = NanosPerParse(reqs, Parses, false);
+    double perRequest = NanosPerParse(reqs, Parses, true);
+    ASSERT_GT(perClient, 0.0);
+    ASSERT_GT(perRequest, 0.0);
+    printf("session of %u requests: parser per client %.0f ns, parser per request %.0f ns\n",
+           (unsigned int) reqs.size(), perClient, perRequest);
+
+    reqs.push_back(LargeRequest(50));
+    perClient = NanosPerParse(reqs, Parses, false);
+    perRequest = NanosPerParse(reqs, Parses, true);
+    ASSERT_GT(perClient, 0.0);
+    ASSERT_GT(perRequest, 0.0);
+    printf("with a %u byte request: parser per client %.0f ns, parser per request %.0f ns\n",
+           (unsigned int) reqs.back().size(), perClient, perRequest);
+}
+
+int main(int argc, char **argv)
+{
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
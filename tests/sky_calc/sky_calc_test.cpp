@@ -0,0 +1,256 @@
+/*
+ *  sky_calc_test.cpp
+ *  PHD Guiding
+ *
+ *  Created by Arran Dengate
+ *  Copyright (c) 2017 Arran Dengate
+ *  All rights reserved.
+ *
+ *  This source code is distributed under the following "BSD" license
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *    Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *    Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *    Neither the name of Bret McKee, Dad Dog Development,
+ *     Craig Stark, Stark Labs nor the names of its
+ *     contributors may be used to endorse or promote products derived from
+ *     this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "phd.h"
+
+#include <gtest/gtest.h>
+
+// SkyCalc against the worked examples in Meeus, Astronomical Algorithms
+// (2nd edition). Tolerances allow for the truncated series SkyCalc uses and
+// for its dates being UTC where Meeus's are TD, about a minute apart in 1987.
+
+// SkyObserver::FromProfile reads the profile; the tests pass observers in
+double ConfigSection::GetDouble(const wxString& name, double defaultValue)
+{
+    return defaultValue;
+}
+
+static double Dms(double d, double m, double s)
+{
+    return d < 0.0 || (d == 0.0 && m < 0.0) ? d - m / 60.0 - s / 3600.0 : d + m / 60.0 + s / 3600.0;
+}
+
+static double Hms(double h, double m, double s)
+{
+    return 15.0 * (h + m / 60.0 + s / 3600.0);
+}
+
+// difference of two angles in degrees, folded into [-180, 180)
+static double AngleDiff(double a, double b)
+{
+    double d = fmod(a - b, 360.0);
+    if (d < -180.0)
+        d += 360.0;
+    else if (d >= 180.0)
+        d -= 360.0;
+    return d;
+}
+
+static const double ArcSec = 1.0 / 3600.0;
+
+// SkyCalc takes UTC and adds today's TT - UTC; the Julian date that puts it
+// on Meeus's TD instant
+static double FromTd(double jdTd)
+{
+    return jdTd - 69.184 / 86400.0;
+}
+
+// An observer on the line from the Earth's center to the given geocentric
+// place, which is then free of parallax: the observer sees the body where
+// Meeus's geocentric examples put it. The line meets the surface at a
+// geocentric latitude of dec; the observer's latitude is geodetic.
+static SkyObserver SublunarObserver(double jd, double ra, double dec)
+{
+    double const f = 1.0 / 298.257223563;
+    double const lat = atan(tan(dec * M_PI / 180.0) / ((1.0 - f) * (1.0 - f))) * 180.0 / M_PI;
+    return SkyObserver(lat, AngleDiff(ra, SkyCalc::GreenwichApparentSiderealTime(jd)));
+}
+
+// The apparent place BodyPosition gives for a body, from its horizontal
+// coordinates
+static void ObservedPlace(const char *body, double jd, const SkyObserver& obs, double *ra, double *dec)
+{
+    double raJ2000, decJ2000, alt, az;
+    ASSERT_TRUE(SkyCalc::BodyPosition(body, jd, obs, &raJ2000, &decJ2000, &alt, &az));
+    SkyCalc::HorizontalToApparent(jd, obs, alt, az, ra, dec, true);
+}
+
+// Example 7.a and the dates of table 7.a, from Unix times
+TEST(SkyCalcTest, JulianDate)
+{
+    EXPECT_DOUBLE_EQ(2451545.0, SkyCalc::JulianDate(946728000));    // 2000 Jan 1.5
+    EXPECT_DOUBLE_EQ(2446822.5, SkyCalc::JulianDate(538704000));    // 1987 Jan 27.0
+    EXPECT_DOUBLE_EQ(2446966.0, SkyCalc::JulianDate(551102400));    // 1987 Jun 19.5
+    EXPECT_DOUBLE_EQ(2447187.5, SkyCalc::JulianDate(570240000));    // 1988 Jan 27.0
+    EXPECT_DOUBLE_EQ(2446895.5, SkyCalc::JulianDate(545011200));    // 1987 Apr 10.0
+    EXPECT_DOUBLE_EQ(2440587.5 + 0.25 / 86400.0, SkyCalc::JulianDate(0, 0.25));
+}
+
+// Examples 12.a and 12.b
+TEST(SkyCalcTest, SiderealTime)
+{
+    // 1987 April 10, 0h UT: mean 13h10m46.3668s, apparent 13h10m46.1351s
+    EXPECT_NEAR(0.0, AngleDiff(Hms(13, 10, 46.3668), SkyCalc::GreenwichMeanSiderealTime(2446895.5)), 0.001 * ArcSec);
+    EXPECT_NEAR(0.0, AngleDiff(Hms(13, 10, 46.1351), SkyCalc::GreenwichApparentSiderealTime(2446895.5)), 0.05 * ArcSec);
+
+    // 1987 April 10, 19h21m00s UT: mean 128.7378734 degrees
+    EXPECT_NEAR(0.0, AngleDiff(128.7378734, SkyCalc::GreenwichMeanSiderealTime(2446896.30625)), 0.001 * ArcSec);
+
+    // local sidereal time moves with the observer's longitude, east positive
+    SkyObserver washington(Dms(38, 55, 17), -Dms(77, 3, 56));
+    EXPECT_NEAR(0.0, AngleDiff(SkyCalc::GreenwichApparentSiderealTime(2446896.30625) + washington.longitude,
+                               SkyCalc::LocalApparentSiderealTime(2446896.30625, washington)), 1e-9);
+}
+
+// Example 22.a, 1987 April 10 0h TD
+TEST(SkyCalcTest, Nutation)
+{
+    double dPsi, dEps, meanEps, trueEps;
+    SkyCalc::Nutation(2446895.5, &dPsi, &dEps, &meanEps, &trueEps);
+
+    EXPECT_NEAR(-3.788, dPsi, 0.01);
+    EXPECT_NEAR(9.443, dEps, 0.01);
+    EXPECT_NEAR(Dms(23, 26, 27.407), meanEps, 0.01 * ArcSec);
+    EXPECT_NEAR(Dms(23, 26, 36.850), trueEps, 0.02 * ArcSec);
+}
+
+// Example 23.a: theta Persei on 2028 November 13.19 TD. SkyCalc does not
+// apply proper motion, so the J2000 place is moved to the date first.
+TEST(SkyCalcTest, ApparentPlace)
+{
+    double const jd = 2462088.69;
+    double const years = (jd - 2451545.0) / 365.25;
+    double const ra0 = Hms(2, 44, 11.986) + 15.0 * 0.03425 * years * ArcSec;
+    double const dec0 = Dms(49, 13, 42.48) - 0.0895 * years * ArcSec;
+
+    double ra, dec;
+    SkyCalc::J2000ToApparent(jd, ra0, dec0, &ra, &dec);
+    EXPECT_NEAR(0.0, AngleDiff(Hms(2, 46, 14.390), ra) * cos(dec * M_PI / 180.0), 0.05 * ArcSec);
+    EXPECT_NEAR(Dms(49, 21, 7.45), dec, 0.05 * ArcSec);
+
+    double raBack, decBack;
+    SkyCalc::ApparentToJ2000(jd, ra, dec, &raBack, &decBack);
+    EXPECT_NEAR(0.0, AngleDiff(ra0, raBack) * cos(dec0 * M_PI / 180.0), 0.01 * ArcSec);
+    EXPECT_NEAR(dec0, decBack, 0.01 * ArcSec);
+}
+
+// Example 13.b: Venus seen from the US Naval Observatory on 1987 April 10 at
+// 19h21m00s UT. Meeus measures azimuth from the south, SkyCalc from the north.
+TEST(SkyCalcTest, Horizontal)
+{
+    double const jd = 2446896.30625;
+    SkyObserver washington(Dms(38, 55, 17), -Dms(77, 3, 56));
+    double const ra = Hms(23, 9, 16.641);
+    double const dec = Dms(-6, 43, 11.61);
+
+    double alt, az;
+    SkyCalc::ApparentToHorizontal(jd, washington, ra, dec, &alt, &az, false);
+    EXPECT_NEAR(15.1249, alt, 0.0002);
+    EXPECT_NEAR(0.0, AngleDiff(68.0337 + 180.0, az), 0.0002);
+
+    double ra2, dec2;
+    SkyCalc::HorizontalToApparent(jd, washington, alt, az, &ra2, &dec2, false);
+    EXPECT_NEAR(0.0, AngleDiff(ra, ra2), 1e-6);
+    EXPECT_NEAR(dec, dec2, 1e-6);
+
+    // refraction lifts the star, and the inverse removes it again
+    double altR, azR;
+    SkyCalc::ApparentToHorizontal(jd, washington, ra, dec, &altR, &azR, true);
+    EXPECT_NEAR(SkyCalc::Refraction(alt, washington), altR - alt, 1e-9);
+    EXPECT_DOUBLE_EQ(az, azR);
+    SkyCalc::HorizontalToApparent(jd, washington, altR, azR, &ra2, &dec2, true);
+    EXPECT_NEAR(0.0, AngleDiff(ra, ra2), 0.1 * ArcSec);
+    EXPECT_NEAR(dec, dec2, 0.1 * ArcSec);
+}
+
+// Example 47.a: the Moon on 1992 April 12 at 0h TD, apparent place
+// 8h58m45.2s +13d46'06"
+TEST(SkyCalcTest, MoonPosition)
+{
+    double const jd = FromTd(2448724.5);
+    double const ra = 134.688470;
+    double const dec = 13.768368;
+
+    SkyObserver const obs = SublunarObserver(jd, ra, dec);
+    double appRa, appDec;
+    ObservedPlace("Moon", jd, obs, &appRa, &appDec);
+    EXPECT_NEAR(0.0, AngleDiff(ra, appRa) * cos(dec * M_PI / 180.0), 15.0 * ArcSec);
+    EXPECT_NEAR(dec, appDec, 15.0 * ArcSec);
+
+    // with the Moon on the horizon it is displaced by its horizontal
+    // parallax, 0.99 degrees at 368410 km
+    SkyObserver const side(0.0, AngleDiff(obs.longitude, 90.0));
+    double sideRa, sideDec;
+    ObservedPlace("moon", jd, side, &sideRa, &sideDec);
+    EXPECT_NEAR(0.99, hypot(AngleDiff(sideRa, appRa) * cos(dec * M_PI / 180.0), sideDec - appDec), 0.05);
+}
+
+// Example 33.a: Venus on 1992 December 20 at 0h TD, apparent place
+// 21h04m41.454s -18d53'16.84"
+TEST(SkyCalcTest, VenusPosition)
+{
+    double const jd = FromTd(2448976.5);
+    double const ra = Hms(21, 4, 41.454);
+    double const dec = Dms(-18, 53, 16.84);
+
+    SkyObserver const obs = SublunarObserver(jd, ra, dec);
+    double appRa, appDec;
+    ObservedPlace("Venus", jd, obs, &appRa, &appDec);
+    EXPECT_NEAR(0.0, AngleDiff(ra, appRa) * cos(dec * M_PI / 180.0), 10.0 * ArcSec);
+    EXPECT_NEAR(dec, appDec, 10.0 * ArcSec);
+
+    // the astrometric place takes the stars' route to the apparent one
+    double raJ2000, decJ2000, alt, az;
+    ASSERT_TRUE(SkyCalc::BodyPosition("venus", jd, obs, &raJ2000, &decJ2000, &alt, &az));
+    SkyCalc::J2000ToApparent(jd, raJ2000, decJ2000, &appRa, &appDec);
+    EXPECT_NEAR(0.0, AngleDiff(ra, appRa) * cos(dec * M_PI / 180.0), 10.0 * ArcSec);
+    EXPECT_NEAR(dec, appDec, 10.0 * ArcSec);
+
+    EXPECT_FALSE(SkyCalc::BodyPosition("Vulcan", jd, obs, &raJ2000, &decJ2000, &alt, &az));
+}
+
+// Equation 16.4: refraction in arcminutes is 1.02 / tan(h + 10.3 / (h + 5.11))
+// at 1010 hPa and 10 C, and zero at the zenith
+TEST(SkyCalcTest, Refraction)
+{
+    SkyObserver standard(0.0, 0.0);
+    standard.pressure = 1010.0;
+    standard.temperature = 10.0;
+
+    EXPECT_NEAR(0.0, SkyCalc::Refraction(90.0, standard), 0.01 / 60.0);
+    EXPECT_NEAR(1.02 / tan((10.0 + 10.3 / 15.11) * M_PI / 180.0) / 60.0, SkyCalc::Refraction(10.0, standard), 1e-12);
+    EXPECT_GT(SkyCalc::Refraction(0.0, standard), 28.0 / 60.0);
+
+    // thinner, warmer air refracts less
+    SkyObserver mountain = standard;
+    mountain.pressure = 700.0;
+    EXPECT_LT(SkyCalc::Refraction(10.0, mountain), SkyCalc::Refraction(10.0, standard));
+}
+
+int main(int argc, char **argv)
+{
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,540 @@
+/*
+ *  star_find_test.cpp
+ *  PHD Guiding
+ *
+ *  Created by Arran Dengate
+ *  Copyright (c) 2017 Arran Dengate
+ *  All rights reserved.
+ *
+ *  This source code is distributed under the following "BSD" license
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *    Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *    Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *    Neither the name of Bret McKee, Dad Dog Development,
+ *     Craig Stark, Stark Labs nor the names of its
+ *     contributors may be used to endorse or promote products derived from
+ *     this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "phd.h"
+
+#include <gtest/gtest.h>
+
+#include <atomic>
+#include <chrono>
+#include <set>
+#include <stdlib.h>
+#include <thread>
+
+// Star detection on guide camera frame sizes compared with the PSF filter
+// and peak search it replaced, and the cost of handing out row bands to the
+// shared threads compared with starting a thread per band as
+// ParallelRowBands used to. The DISABLED_ benchmarks print timings of both;
+// run them with --gtest_also_run_disabled_tests.
+
+static double Millis(const std::chrono::steady_clock::time_point& start)
+{
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+TEST(ParallelRowBandsTest, CoversEveryRowOnce)
+{
+    for (int rows = 0; rows < 200; rows++)
+    {
+        for (int minBandRows = 1; minBandRows <= 64; minBandRows *= 4)
+        {
+            std::vector<int> hits(rows);
+            ParallelRowBands(rows, minBandRows, [&hits](int begin, int end) {
+                for (int r = begin; r < end; r++)
+                    hits[r]++;
+            });
+            for (int r = 0; r < rows; r++)
+                ASSERT_EQ(1, hits[r]) << "row " << r << " of " << rows << " min band " << minBandRows;
+        }
+    }
+}
+
+// callers on other threads, and bands that use ParallelRowBands themselves,
+// find the pool busy and run on their own thread
+TEST(ParallelRowBandsTest, ConcurrentAndNestedCalls)
+{
+    enum { Threads = 4, Calls = 500, Rows = 64 };
+    std::atomic<long> total(0);
+
+    auto work = [&total]() {
+        for (int i = 0; i < Calls; i++)
+        {
+            ParallelRowBands(Rows, 4, [&total](int begin, int end) {
+                ParallelRowBands(end - begin, 1, [&total](int b, int e) { total += e - b; });
+            });
+        }
+    };
+
+    std::vector<std::thread> threads;
+    for (int i = 1; i < Threads; i++)
+        threads.push_back(std::thread(work));
+    work();
+    for (size_t i = 0; i < threads.size(); i++)
+        threads[i].join();
+
+    EXPECT_EQ((long) Threads * Calls * Rows, total.load());
+}
+
+// ParallelRowBands before the pool: a thread started and joined per band
+static void ThreadPerBand(int rows, int minBandRows, const std::function<void(int, int)>& fn)
+{
+    int cpus = std::max(1, (int) std::thread::hardware_concurrency());
+    int bands = std::max(1, std::min(cpus, rows / std::max(1, minBandRows)));
+
+    if (bands == 1)
+    {
+        fn(0, rows);
+        return;
+    }
+
+    std::vector<std::thread> threads;
+    for (int i = 1; i < bands; i++)
+        threads.push_back(std::thread(fn, rows * i / bands, rows * (i + 1) / bands));
+    fn(0, rows / bands);
+    for (size_t i = 0; i < threads.size(); i++)
+        threads[i].join();
+}
+
+TEST(ParallelRowBandsBenchmark, DISABLED_DispatchOverhead)
+{
+    enum { Calls = 2000 };
+    std::atomic<int> rows(0);
+    auto fn = [&rows](int begin, int end) { rows += end - begin; };
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (int i = 0; i < Calls; i++)
+        ThreadPerBand(480, 32, fn);
+    double threadMs = Millis(start);
+
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < Calls; i++)
+        ParallelRowBands(480, 32, fn);
+    double poolMs = Millis(start);
+
+    printf("480 rows on %u cpus: thread per band %.1f us per call, pool %.1f us per call\n",
+           std::thread::hardware_concurrency(), threadMs * 1000.0 / Calls, poolMs * 1000.0 / Calls);
+
+    EXPECT_EQ(2 * Calls * 480, rows.load());
+}
+
+// The previous PSF filter: each output pixel reads its 81 neighbours
+static void OldPsfConv(std::vector<float>& dst, const std::vector<float>& src, int width, int height)
+{
+    //                       A      B1     B2    C1     C2    C3     D1     D2     D3
+    const double PSF[] = { 0.906, 0.584, 0.365, .117, .049, -0.05, -.064, -.074, -.094 };
+
+    dst.assign(src.size(), 0.0f);
+
+    int psf_size = 4;
+
+    for (int y = psf_size; y < height - psf_size; y++)
+    {
+        for (int x = psf_size; x < width - psf_size; x++)
+        {
+            float A, B1, B2, C1, C2, C3, D1, D2, D3;
+
+#define PX(dx, dy) src[width * (y + (dy)) + x + (dx)]
+            A =  PX(+0, +0);
+            B1 = PX(+0, -1) + PX(+0, +1) + PX(+1, +0) + PX(-1, +0);
+            B2 = PX(-1, -1) + PX(+1, -1) + PX(-1, +1) + PX(+1, +1);
+            C1 = PX(+0, -2) + PX(-2, +0) + PX(+2, +0) + PX(+0, +2);
+            C2 = PX(-1, -2) + PX(+1, -2) + PX(-2, -1) + PX(+2, -1) + PX(-2, +1) + PX(+2, +1) + PX(-1, +2) + PX(+1, +2);
+            C3 = PX(-2, -2) + PX(+2, -2) + PX(-2, +2) + PX(+2, +2);
+            D1 = PX(+0, -3) + PX(-3, +0) + PX(+3, +0) + PX(+0, +3);
+            D2 = PX(-1, -3) + PX(+1, -3) + PX(-3, -1) + PX(+3, -1) + PX(-3, +1) + PX(+3, +1) + PX(-1, +3) + PX(+1, +3);
+            D3 = PX(-4, -2) + PX(-3, -2) + PX(+3, -2) + PX(+4, -2) + PX(-4, -1) + PX(+4, -1) + PX(-4, +0) + PX(+4, +0) + PX(-4, +1) + PX(+4, +1) + PX(-4, +2) + PX(-3, +2) + PX(+3, +2) + PX(+4, +2);
+#undef PX
+            int i;
+            const float *uptr;
+
+            uptr = &src[width * (y - 4) + (x - 4)];
+            for (i = 0; i < 9; i++)
+                D3 += *uptr++;
+
+            uptr = &src[width * (y - 3) + (x - 4)];
+            for (i = 0; i < 3; i++)
+                D3 += *uptr++;
+            uptr += 3;
+            for (i = 0; i < 3; i++)
+                D3 += *uptr++;
+
+            uptr = &src[width * (y + 3) + (x - 4)];
+            for (i = 0; i < 3; i++)
+                D3 += *uptr++;
+            uptr += 3;
+            for (i = 0; i < 3; i++)
+                D3 += *uptr++;
+
+            uptr = &src[width * (y + 4) + (x - 4)];
+            for (i = 0; i < 9; i++)
+                D3 += *uptr++;
+
+            double mean = (A + B1 + B2 + C1 + C2 + C3 + D1 + D2 + D3) / 81.0;
+            double PSF_fit = PSF[0] * (A - mean) + PSF[1] * (B1 - 4.0 * mean) + PSF[2] * (B2 - 4.0 * mean) +
+                PSF[3] * (C1 - 4.0 * mean) + PSF[4] * (C2 - 8.0 * mean) + PSF[5] * (C3 - 4.0 * mean) +
+                PSF[6] * (D1 - 4.0 * mean) + PSF[7] * (D2 - 8.0 * mean) + PSF[8] * (D3 - 44.0 * mean);
+
+            dst[width * y + x] = (float) PSF_fit;
+        }
+    }
+}
+
+static void OldStats(double *mean, double *stdev, const std::vector<float>& img, int width, const wxRect& win)
+{
+    double sum = 0.0;
+    double a = 0.0;
+    double q = 0.0;
+    double k = 1.0;
+    double km1 = 0.0;
+
+    const float *p0 = &img[win.GetTop() * width + win.GetLeft()];
+    for (int y = 0; y < win.GetHeight(); y++)
+    {
+        const float *end = p0 + win.GetWidth();
+        for (const float *p = p0; p < end; p++)
+        {
+            double const x = (double) *p;
+            sum += x;
+            double const a0 = a;
+            a += (x - a) / k;
+            q += (x - a0) * (x - a);
+            km1 = k;
+            k += 1.0;
+        }
+        p0 += width;
+    }
+
+    *mean = sum / km1;
+    *stdev = sqrt(q / km1);
+}
+
+struct OldPeak
+{
+    int x;
+    int y;
+    float val;
+
+    OldPeak(int x_, int y_, float val_) : x(x_), y(y_), val(val_) { }
+    bool operator<(const OldPeak& rhs) const { return val < rhs.val; }
+};
+
+// Star::GetStarList with the previous filter and peak search: a full box
+// compare at every pixel, each candidate inserted into a std::set. What
+// follows the peak search is unchanged and is repeated here without the
+// logging.
+static std::vector<Star> OldStarList(const usImage& image, int searchRegion, int maxStars)
+{
+    usImage smoothed;
+    smoothed.CopyFrom(image);
+    Median3(smoothed);
+
+    int const dw = image.Size.GetWidth();
+    int const dh = image.Size.GetHeight();
+    std::vector<float> src(smoothed.ImageData, smoothed.ImageData + smoothed.NPixels);
+    std::vector<float> conv;
+    OldPsfConv(conv, src, dw, dh);
+
+    enum { CONV_RADIUS = 4 };
+    wxRect convRect(CONV_RADIUS, CONV_RADIUS, dw - 2 * CONV_RADIUS, dh - 2 * CONV_RADIUS);
+
+    enum { TOP_N = 100 };
+    std::set<OldPeak> stars;
+
+    double global_mean, global_stdev;
+    OldStats(&global_mean, &global_stdev, conv, dw, convRect);
+
+    const double threshold = 0.1;
+
+    int srch = 4;
+    for (int y = convRect.GetTop() + srch; y <= convRect.GetBottom() - srch; y++)
+    {
+        for (int x = convRect.GetLeft() + srch; x <= convRect.GetRight() - srch; x++)
+        {
+            float val = conv[dw * y + x];
+            bool ismax = false;
+            if (val > 0.0)
+            {
+                ismax = true;
+                for (int j = -srch; j <= srch; j++)
+                {
+                    for (int i = -srch; i <= srch; i++)
+                    {
+                        if (i == 0 && j == 0)
+                            continue;
+                        if (conv[dw * (y + j) + (x + i)] > val)
+                        {
+                            ismax = false;
+                            break;
+                        }
+                    }
+                }
+            }
+            if (!ismax)
+                continue;
+
+            const int local = 7;
+            double local_mean, local_stdev;
+            wxRect localRect(x - local, y - local, 2 * local + 1, 2 * local + 1);
+            localRect.Intersect(convRect);
+            OldStats(&local_mean, &local_stdev, conv, dw, localRect);
+
+            double h = (val - local_mean) / global_stdev;
+            if (h < threshold)
+                continue;
+
+            stars.insert(OldPeak(x, y, h));
+            if (stars.size() > TOP_N)
+                stars.erase(stars.begin());
+        }
+    }
+
+    // merge stars that are very close into a single star
+    {
+        const int minlimitsq = 5 * 5;
+    repeat:
+        for (std::set<OldPeak>::const_iterator a = stars.begin(); a != stars.end(); ++a)
+        {
+            std::set<OldPeak>::const_iterator b = a;
+            ++b;
+            for (; b != stars.end(); ++b)
+            {
+                int dx = a->x - b->x;
+                int dy = a->y - b->y;
+                if (dx * dx + dy * dy < minlimitsq)
+                {
+                    stars.erase(a);
+                    goto repeat;
+                }
+            }
+        }
+    }
+
+    // exclude stars that would fit within a single searchRegion box
+    {
+        std::set<int> to_erase;
+        const int fullw = searchRegion + 5;
+        for (std::set<OldPeak>::const_iterator a = stars.begin(); a != stars.end(); ++a)
+        {
+            std::set<OldPeak>::const_iterator b = a;
+            ++b;
+            for (; b != stars.end(); ++b)
+            {
+                if (abs(a->x - b->x) <= fullw && abs(a->y - b->y) <= fullw && b->val / a->val < 5.0)
+                {
+                    to_erase.insert(std::distance(stars.begin(), a));
+                    to_erase.insert(std::distance(stars.begin(), b));
+                }
+            }
+        }
+        int n = 0;
+        for (std::set<OldPeak>::iterator it = stars.begin(); it != stars.end(); n++)
+        {
+            if (to_erase.find(n) != to_erase.end())
+                stars.erase(it++);
+            else
+                ++it;
+        }
+    }
+
+    // exclude stars too close to the edge
+    {
+        enum { MIN_EDGE_DIST = 40 };
+        for (std::set<OldPeak>::iterator it = stars.begin(); it != stars.end(); )
+        {
+            if (it->x <= MIN_EDGE_DIST || it->x >= dw - MIN_EDGE_DIST ||
+                it->y <= MIN_EDGE_DIST || it->y >= dh - MIN_EDGE_DIST)
+                stars.erase(it++);
+            else
+                ++it;
+        }
+    }
+
+    std::vector<Star> outStars;
+    int num_stars = 0;
+    for (std::set<OldPeak>::reverse_iterator it = stars.rbegin(); it != stars.rend(); ++it, ++num_stars)
+    {
+        if (num_stars < maxStars)
+        {
+            Star tmp;
+            tmp.Find(&image, searchRegion, it->x, it->y, Star::FIND_CENTROID);
+            if (tmp.WasFound())
+                outStars.push_back(tmp);
+        }
+    }
+
+    return outStars;
+}
+
+struct SyntheticStar
+{
+    double x;
+    double y;
+    double peak;
+};
+
+// sky background with read noise and gaussian stars spread over the frame
+static void MakeFrame(usImage& img, int width, int height, std::vector<SyntheticStar>& stars)
+{
+    srand(width + height);
+    img.Init(wxSize(width, height));
+    for (int i = 0; i < img.NPixels; i++)
+        img.ImageData[i] = (unsigned short) (1000 + rand() % 40);
+
+    const int Cols = 4, Rows = 3;
+    const double sigma = 1.5;
+    stars.clear();
+    for (int j = 0; j < Rows; j++)
+    {
+        for (int i = 0; i < Cols; i++)
+        {
+            SyntheticStar s;
+            s.x = (i + 0.5) * width / Cols + rand() % 20 - 10 + 0.3;
+            s.y = (j + 0.5) * height / Rows + rand() % 20 - 10 + 0.6;
+            s.peak = 3000.0 + 1500.0 * (j * Cols + i);
+            stars.push_back(s);
+
+            for (int y = (int) s.y - 8; y <= (int) s.y + 8; y++)
+            {
+                for (int x = (int) s.x - 8; x <= (int) s.x + 8; x++)
+                {
+                    double r2 = (x - s.x) * (x - s.x) + (y - s.y) * (y - s.y);
+                    img.Pixel(x, y) += (unsigned short) (s.peak * exp(-r2 / (2.0 * sigma * sigma)));
+                }
+            }
+        }
+    }
+}
+
+struct FrameSize
+{
+    int width;
+    int height;
+};
+
+class StarFindTest : public ::testing::TestWithParam<FrameSize>
+{
+};
+
+TEST_P(StarFindTest, FindsSyntheticStars)
+{
+    FrameSize const fs = GetParam();
+    usImage img;
+    std::vector<SyntheticStar> stars;
+    MakeFrame(img, fs.width, fs.height, stars);
+
+    std::vector<Star> found;
+    bool ok = false;
+
+    // off the main thread, as the plate solver runs it, so there is no busy cursor
+    std::thread finder([&]() { ok = Star().GetStarList(img, 0, 15, found, 20); });
+    finder.join();
+
+    ASSERT_TRUE(ok);
+
+    // every star is found, and nothing else is; a dim noise peak beside a
+    // bright star can centroid on the star and list it twice
+    for (size_t i = 0; i < stars.size(); i++)
+    {
+        const SyntheticStar& s = stars[i];
+        bool match = false;
+        for (size_t j = 0; j < found.size() && !match; j++)
+            match = fabs(found[j].X - s.x) < 0.5 && fabs(found[j].Y - s.y) < 0.5;
+        EXPECT_TRUE(match) << "star at " << s.x << "," << s.y;
+    }
+    for (size_t j = 0; j < found.size(); j++)
+    {
+        bool match = false;
+        for (size_t i = 0; i < stars.size() && !match; i++)
+            match = fabs(found[j].X - stars[i].x) < 0.5 && fabs(found[j].Y - stars[i].y) < 0.5;
+        EXPECT_TRUE(match) << "found " << found[j].X << "," << found[j].Y;
+    }
+}
+
+TEST_P(StarFindTest, MatchesPrevious)
+{
+    FrameSize const fs = GetParam();
+    usImage img;
+    std::vector<SyntheticStar> stars;
+    MakeFrame(img, fs.width, fs.height, stars);
+
+    std::vector<Star> found;
+    std::thread finder([&]() { Star().GetStarList(img, 0, 15, found, 20); });
+    finder.join();
+
+    std::vector<Star> expected = OldStarList(img, 15, 20);
+
+    ASSERT_EQ(expected.size(), found.size());
+    for (size_t i = 0; i < found.size(); i++)
+    {
+        EXPECT_EQ(expected[i].X, found[i].X) << "star " << i;
+        EXPECT_EQ(expected[i].Y, found[i].Y) << "star " << i;
+    }
+}
+
+TEST_P(StarFindTest, DISABLED_Benchmark)
+{
+    FrameSize const fs = GetParam();
+    usImage img;
+    std::vector<SyntheticStar> stars;
+    MakeFrame(img, fs.width, fs.height, stars);
+
+    enum { Runs = 10 };
+    double ms = 0.0, oldMs = 0.0;
+
+    std::thread timer([&]() {
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        for (int i = 0; i < Runs; i++)
+        {
+            std::vector<Star> list;
+            Star().GetStarList(img, 0, 15, list, 20);
+        }
+        ms = Millis(start) / Runs;
+
+        start = std::chrono::steady_clock::now();
+        for (int i = 0; i < Runs; i++)
+            OldStarList(img, 15, 20);
+        oldMs = Millis(start) / Runs;
+    });
+    timer.join();
+
+    printf("star list %dx%d on %u cpus: %.1f ms, previous %.1f ms\n", fs.width, fs.height,
+           std::thread::hardware_concurrency(), ms, oldMs);
+}
+
+static const FrameSize FrameSizes[] = {
+    { 752, 480 },       // QHY5L-II, Lodestar class
+    { 1280, 960 },      // ASI120
+    { 1936, 1216 },     // ASI174
+};
+
+INSTANTIATE_TEST_CASE_P(FrameSizes, StarFindTest, ::testing::ValuesIn(FrameSizes));
+
+int main(int argc, char **argv)
+{
+    // records this as the main thread for wxThread::IsMain
+    wxInitializer initializer;
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,379 @@
+/*
+ *  star_solver_test.cpp
+ *  PHD Guiding
+ *
+ *  Created by Arran Dengate
+ *  Copyright (c) 2017 Arran Dengate
+ *  All rights reserved.
+ *
+ *  This source code is distributed under the following "BSD" license
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *    Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *    Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *    Neither the name of Bret McKee, Dad Dog Development,
+ *     Craig Stark, Stark Labs nor the names of its
+ *     contributors may be used to endorse or promote products derived from
+ *     this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "star_solver.h"
+
+#include <gtest/gtest.h>
+
+#include <fitsio.h>
+
+#include <algorithm>
+#include <chrono>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+// PHD_SOURCE_DIR is defined by the build so the test can find the sample
+// frames
+
+static const double Deg = M_PI / 180.0;
+static const int Width = 752;
+static const int Height = 480;
+static const double Scale = 6.2;           // arcsec / pixel, about a 1.5 degree field
+
+struct CatalogStar
+{
+    double ra;      // degrees
+    double dec;
+    double mag;
+};
+
+// A random catalog covering ra 100-120, dec -10..10 with a realistic
+// magnitude distribution, written as a HYG export
+class StarSolverTest : public ::testing::Test
+{
+protected:
+    static std::vector<CatalogStar> s_catalog;
+    static std::string s_catalogFile;
+    static StarIndex *s_index;
+
+    static void SetUpTestCase()
+    {
+        srand(1);
+        s_catalogFile = "star_solver_test_catalog.csv";
+        FILE *fp = fopen(s_catalogFile.c_str(), "w");
+        ASSERT_TRUE(fp != 0);
+        fprintf(fp, "id,proper,ra,dec,mag\n");
+        for (int i = 0; i < 8000; i++)
+        {
+            double u = rand() / (RAND_MAX + 1.0);
+            double v = rand() / (RAND_MAX + 1.0);
+            double w = rand() / (RAND_MAX + 1.0);
+            CatalogStar s;
+            s.ra = 100.0 + 20.0 * u;
+            s.dec = asin(sin(-10.0 * Deg) + v * 2.0 * sin(10.0 * Deg)) / Deg;
+            s.mag = floor(std::max(-1.0, 9.0 + 2.0 * log10(1.0 - w)) * 100.0 + 0.5) / 100.0;
+            fprintf(fp, "%d,,%f,%f,%.2f\n", i, s.ra / 15.0, s.dec, s.mag);
+            s_catalog.push_back(s);
+        }
+        fclose(fp);
+
+        s_index = new StarIndex();
+        ASSERT_TRUE(s_index->Load(s_catalogFile, "star_solver_test.idx", 1.6, 99.0));
+    }
+
+    static void TearDownTestCase()
+    {
+        delete s_index;
+        s_index = 0;
+        unlink("star_solver_test.idx");
+        unlink(s_catalogFile.c_str());
+    }
+
+    // The catalog stars that fall in a frame centered on ra0, dec0, with up
+    // rot degrees E of N
+    static std::vector<SolverStar> Render(double ra0, double dec0, double rot, bool flip)
+    {
+        std::vector<SolverStar> stars;
+        double r0 = ra0 * Deg, d0 = dec0 * Deg, th = rot * Deg;
+        for (unsigned int i = 0; i < s_catalog.size(); i++)
+        {
+            const CatalogStar& c = s_catalog[i];
+            if (c.mag > 8.5)
+                continue;
+            double ra = c.ra * Deg, dec = c.dec * Deg;
+            double cosc = sin(d0) * sin(dec) + cos(d0) * cos(dec) * cos(ra - r0);
+            if (cosc <= 0.0)
+                continue;
+            double xi = cos(dec) * sin(ra - r0) / cosc / (Scale / 3600.0 * Deg);
+            double eta = (cos(d0) * sin(dec) - sin(d0) * cos(dec) * cos(ra - r0)) / cosc / (Scale / 3600.0 * Deg);
+            double x = xi * cos(th) - eta * sin(th);
+            double y = xi * sin(th) + eta * cos(th);
+            if (flip)
+                x = -x;
+            x += Width / 2;
+            y += Height / 2;
+            if (x < 0 || y < 0 || x >= Width || y >= Height)
+                continue;
+            SolverStar s = { x, y, pow(10.0, -0.4 * c.mag) * 1e5 };
+            stars.push_back(s);
+        }
+        return stars;
+    }
+};
+
+std::vector<CatalogStar> StarSolverTest::s_catalog;
+std::string StarSolverTest::s_catalogFile;
+StarIndex *StarSolverTest::s_index = 0;
+
+TEST_F(StarSolverTest, IndexHasTriangles)
+{
+    EXPECT_EQ(s_catalog.size(), s_index->StarCount());
+    EXPECT_GT(s_index->TriangleCount(), s_index->StarCount());
+}
+
+TEST_F(StarSolverTest, MagnitudeLimit)
+{
+    StarIndex bright;
+    ASSERT_TRUE(bright.Load(s_catalogFile, "star_solver_test_bright.idx", 1.6, 7.0));
+    unsigned int expected = 0;
+    for (unsigned int i = 0; i < s_catalog.size(); i++)
+        if (s_catalog[i].mag <= 7.0)
+            expected++;
+    EXPECT_EQ(expected, bright.StarCount());
+    for (unsigned int i = 0; i < bright.StarCount(); i++)
+        EXPECT_LE(bright.GetStar(i).mag, 7.0f);
+    unlink("star_solver_test_bright.idx");
+}
+
+TEST_F(StarSolverTest, SolvesWithAndWithoutHint)
+{
+    StarPatternSolver solver(*s_index);
+    int solved = 0, trials = 0;
+    for (int i = 0; i < 20; i++)
+    {
+        double ra0 = 103.0 + (i % 5) * 3.1;
+        double dec0 = -6.0 + (i / 5) * 3.5;
+        double rot = i * 37.0;
+        bool flip = i % 3 == 0;
+        std::vector<SolverStar> stars = Render(ra0, dec0, rot, flip);
+        if (stars.size() < 6)
+            continue;
+        trials++;
+
+        for (int hinted = 0; hinted < 2; hinted++)
+        {
+            PlateSolveHint hint;
+            hint.scaleLow = 6.0;
+            hint.scaleHigh = 6.5;
+            if (hinted)
+            {
+                hint.hasPosition = true;
+                hint.ra = ra0 + 2.0;
+                hint.dec = dec0 + 1.0;
+                hint.radius = 5.0;
+            }
+
+            StarSolution sol;
+            if (!solver.Solve(stars, Width, Height, hint, &sol))
+                continue;
+            double err = hypot((sol.ra - ra0) * cos(dec0 * Deg), sol.dec - dec0) * 3600.0;
+            EXPECT_LT(err, 5.0) << "field " << i;
+            EXPECT_NEAR(0.0, remainder(sol.rotation - rot, 360.0), 0.1) << "field " << i;
+            EXPECT_NEAR(Scale, sol.pixelScale, 0.01) << "field " << i;
+            EXPECT_EQ(flip, sol.flipped) << "field " << i;
+            if (hinted)
+                solved++;
+        }
+    }
+    EXPECT_GE(solved, trials * 9 / 10);
+}
+
+// ---------------------------------------------------------------------------
+// Comparison with astrometry.net on the sample frames, disabled by default:
+// run it with --gtest_also_run_disabled_tests. Both solvers are timed; the
+// test only fails when they disagree. Set PHD2_STAR_CATALOG to a catalog
+// covering the frames (eg. hygdata_v3.csv) and PHD2_SOLVE_FIELD to override
+// the solve-field location.
+
+static bool ReadFrame(const std::string& fileName, std::vector<float> *pixels, int *width, int *height)
+{
+    fitsfile *fptr;
+    int status = 0;
+    if (fits_open_diskfile(&fptr, fileName.c_str(), READONLY, &status))
+        return false;
+    long naxes[2] = { 0, 0 };
+    int naxis;
+    fits_get_img_dim(fptr, &naxis, &status);
+    fits_get_img_size(fptr, 2, naxes, &status);
+    if (status == 0 && naxis == 2)
+    {
+        pixels->resize(naxes[0] * naxes[1]);
+        long fpixel[2] = { 1, 1 };
+        fits_read_pix(fptr, TFLOAT, fpixel, pixels->size(), 0, &(*pixels)[0], 0, &status);
+    }
+    fits_close_file(fptr, &status);
+    *width = naxes[0];
+    *height = naxes[1];
+    return status == 0 && naxis == 2;
+}
+
+// Local maxima well above the background, centroided over a 7x7 box
+static std::vector<SolverStar> FindStars(const std::vector<float>& img, int width, int height)
+{
+    std::vector<float> sorted(img);
+    std::nth_element(sorted.begin(), sorted.begin() + sorted.size() / 2, sorted.end());
+    double median = sorted[sorted.size() / 2];
+    for (unsigned int i = 0; i < sorted.size(); i++)
+        sorted[i] = fabs(sorted[i] - median);
+    std::nth_element(sorted.begin(), sorted.begin() + sorted.size() / 2, sorted.end());
+    double threshold = median + 8.0 * 1.4826 * std::max(1.0f, sorted[sorted.size() / 2]);
+
+    std::vector<SolverStar> stars;
+    for (int y = 3; y < height - 3; y++)
+    {
+        for (int x = 3; x < width - 3; x++)
+        {
+            float v = img[y * width + x];
+            if (v < threshold)
+                continue;
+            bool peak = true;
+            for (int dy = -1; dy <= 1 && peak; dy++)
+                for (int dx = -1; dx <= 1; dx++)
+                    if ((dx || dy) && img[(y + dy) * width + x + dx] > v)
+                        peak = false;
+            if (!peak)
+                continue;
+            double sum = 0.0, sx = 0.0, sy = 0.0;
+            for (int dy = -3; dy <= 3; dy++)
+            {
+                for (int dx = -3; dx <= 3; dx++)
+                {
+                    double w = std::max(0.0, img[(y + dy) * width + x + dx] - median);
+                    sum += w;
+                    sx += w * dx;
+                    sy += w * dy;
+                }
+            }
+            SolverStar s = { x + sx / sum, y + sy / sum, sum };
+            stars.push_back(s);
+        }
+    }
+    std::sort(stars.begin(), stars.end(), [](const SolverStar& a, const SolverStar& b) { return a.brightness > b.brightness; });
+    if (stars.size() > 30)
+        stars.resize(30);
+    return stars;
+}
+
+static double Millis(const std::chrono::steady_clock::time_point& start)
+{
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+// Runs solve-field and reads the solved center back from its .wcs output
+static bool RunSolveField(const std::string& solveField, const std::string& frame, double *ra, double *dec)
+{
+    std::string dir = "star_solver_test_sf";
+    std::string cmd = "rm -rf " + dir + " && mkdir " + dir + " && " + solveField +
+        " --overwrite --no-plots --no-verify --crpix-center --cpulimit 60 --dir " + dir + " --new-fits none " + frame +
+        " > /dev/null 2>&1";
+    if (system(cmd.c_str()) != 0)
+        return false;
+
+    std::string base = frame.substr(frame.find_last_of('/') + 1);
+    std::string wcs = dir + "/" + base.substr(0, base.find_last_of('.')) + ".wcs";
+    fitsfile *fptr;
+    int status = 0;
+    if (fits_open_diskfile(&fptr, wcs.c_str(), READONLY, &status))
+        return false;
+    fits_read_key(fptr, TDOUBLE, "CRVAL1", ra, 0, &status);
+    fits_read_key(fptr, TDOUBLE, "CRVAL2", dec, 0, &status);
+    fits_close_file(fptr, &status);
+    return status == 0;
+}
+
+TEST(StarSolverBenchmark, DISABLED_CompareWithSolveField)
+{
+    const char *catalog = getenv("PHD2_STAR_CATALOG");
+    const char *solveField = getenv("PHD2_SOLVE_FIELD");
+    std::string catalogFile = catalog ? catalog : "/usr/local/phd2/goto/data/hygdata_v3.csv";
+    std::string solveFieldFile = solveField ? solveField : "/usr/local/astrometry/bin/solve-field";
+
+    StarIndex index;
+    bool haveIndex = access(catalogFile.c_str(), R_OK) == 0 &&
+        index.Load(catalogFile, "star_solver_test_bench.idx", 2.0, 9.0);
+    bool haveSolveField = access(solveFieldFile.c_str(), X_OK) == 0;
+    if (!haveIndex)
+        printf("no star catalog at %s, native solver not timed\n", catalogFile.c_str());
+    if (!haveSolveField)
+        printf("no solve-field at %s, astrometry.net not timed\n", solveFieldFile.c_str());
+
+    const char *frames[] = { "savetest.fit", "simimage.fit" };
+    for (unsigned int i = 0; i < sizeof(frames) / sizeof(frames[0]); i++)
+    {
+        std::string frame = std::string(PHD_SOURCE_DIR) + "/" + frames[i];
+        std::vector<float> pixels;
+        int width, height;
+        ASSERT_TRUE(ReadFrame(frame, &pixels, &width, &height)) << frame;
+
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        std::vector<SolverStar> stars = FindStars(pixels, width, height);
+        double findMs = Millis(start);
+
+        bool nativeSolved = false;
+        StarSolution sol;
+        double nativeMs = 0.0;
+        if (haveIndex)
+        {
+            start = std::chrono::steady_clock::now();
+            nativeSolved = StarPatternSolver(index).Solve(stars, width, height, PlateSolveHint(), &sol);
+            nativeMs = Millis(start);
+        }
+
+        bool sfSolved = false;
+        double sfRa = 0.0, sfDec = 0.0, sfMs = 0.0;
+        if (haveSolveField)
+        {
+            start = std::chrono::steady_clock::now();
+            sfSolved = RunSolveField(solveFieldFile, frame, &sfRa, &sfDec);
+            sfMs = Millis(start);
+        }
+
+        printf("%-14s %2u stars in %6.1f ms | native: %-8s %8.1f ms | solve-field: %-8s %8.1f ms\n", frames[i],
+               (unsigned int) stars.size(), findMs, !haveIndex ? "skipped" : nativeSolved ? "solved" : "failed",
+               nativeMs, !haveSolveField ? "skipped" : sfSolved ? "solved" : "failed", sfMs);
+
+        if (nativeSolved && sfSolved)
+        {
+            double sep = hypot((sol.ra - sfRa) * cos(sfDec * Deg), sol.dec - sfDec);
+            EXPECT_LT(sep, 0.05) << frames[i] << ": native " << sol.ra << "," << sol.dec << " solve-field " << sfRa
+                                 << "," << sfDec;
+        }
+    }
+
+    unlink("star_solver_test_bench.idx");
+    if (system("rm -rf star_solver_test_sf") != 0)
+        printf("could not remove star_solver_test_sf\n");
+}
+
+int main(int argc, char **argv)
+{
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,206 @@
+/*
+ *  star_tracker_test.cpp
+ *  PHD Guiding
+ *
+ *  Created by Arran Dengate
+ *  Copyright (c) 2017 Arran Dengate
+ *  All rights reserved.
+ *
+ *  This source code is distributed under the following "BSD" license
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *    Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *    Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *    Neither the name of Bret McKee, Dad Dog Development,
+ *     Craig Stark, Stark Labs nor the names of its
+ *     contributors may be used to endorse or promote products derived from
+ *     this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "phd.h"
+
+#include <gtest/gtest.h>
+
+#include <chrono>
+#include <stdlib.h>
+#include <thread>
+
+// StarTracker following stars from frame to frame, and the time for its
+// single pass over all the stars compared with calling Star::Find on each
+// star, as the secondary stars were tracked before. The DISABLED_ benchmark
+// prints timings of both; run it with --gtest_also_run_disabled_tests.
+
+enum { SearchRegion = 15 };
+
+static double Millis(const std::chrono::steady_clock::time_point& start)
+{
+    return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+}
+
+// sky background with read noise and count gaussian stars on a grid, all
+// shifted by (dx, dy); star skip is left out
+static void MakeFrame(usImage& img, int count, double dx, double dy, int skip = -1)
+{
+    const int width = 1280, height = 960, cols = 16;
+    const double sigma = 1.5;
+
+    srand(count);
+    img.Init(wxSize(width, height));
+    for (int i = 0; i < img.NPixels; i++)
+        img.ImageData[i] = (unsigned short) (1000 + rand() % 40);
+
+    for (int k = 0; k < count; k++)
+    {
+        if (k == skip)
+            continue;
+        double sx = 60.0 + (k % cols) * 75.0 + 0.3 + dx;
+        double sy = 60.0 + (k / cols) * 75.0 + 0.6 + dy;
+        double peak = 4000.0 + 200.0 * (k % 20);
+        for (int y = (int) sy - 8; y <= (int) sy + 8; y++)
+        {
+            for (int x = (int) sx - 8; x <= (int) sx + 8; x++)
+            {
+                double r2 = (x - sx) * (x - sx) + (y - sy) * (y - sy);
+                img.Pixel(x, y) += (unsigned short) (peak * exp(-r2 / (2.0 * sigma * sigma)));
+            }
+        }
+    }
+}
+
+// stars at their positions on an unshifted frame, rounded as a star list
+// from AutoFind would start them
+static std::vector<Star> StartingStars(int count)
+{
+    std::vector<Star> stars(count);
+    for (int k = 0; k < count; k++)
+        stars[k].SetXY(60.0 + (k % 16) * 75.0, 60.0 + (k / 16) * 75.0);
+    return stars;
+}
+
+TEST(StarTrackerTest, FollowsStars)
+{
+    enum { Count = 40 };
+    StarTracker tracker;
+    tracker.Reset(StartingStars(Count));
+
+    usImage img;
+    MakeFrame(img, Count, 0.0, 0.0);
+    EXPECT_EQ((unsigned int) Count, tracker.Update(&img, SearchRegion, Star::FIND_CENTROID));
+
+    MakeFrame(img, Count, 2.0, -1.5);
+    ASSERT_EQ((unsigned int) Count, tracker.Update(&img, SearchRegion, Star::FIND_CENTROID));
+
+    for (unsigned int k = 0; k < Count; k++)
+    {
+        EXPECT_TRUE(tracker.IsValid(k));
+        EXPECT_NEAR(60.0 + (k % 16) * 75.0 + 2.3, tracker.X[k], 0.1) << "star " << k;
+        EXPECT_NEAR(60.0 + (k / 16) * 75.0 - 0.9, tracker.Y[k], 0.1) << "star " << k;
+        ASSERT_EQ(2U, tracker.TrailLength(k));
+        EXPECT_NEAR(tracker.X[k] - 2.0, tracker.TrailPoint(k, 0).X, 0.1);
+        EXPECT_NEAR(tracker.Y[k] + 1.5, tracker.TrailPoint(k, 0).Y, 0.1);
+    }
+}
+
+TEST(StarTrackerTest, DropsLostStar)
+{
+    enum { Count = 20, Lost = 7 };
+    StarTracker tracker;
+    tracker.Reset(StartingStars(Count));
+
+    usImage img;
+    MakeFrame(img, Count, 0.0, 0.0, Lost);
+    for (int i = 0; i < StarTracker::INITIAL_CHANCES - 1; i++)
+    {
+        EXPECT_EQ((unsigned int) Count - 1, tracker.Update(&img, SearchRegion, Star::FIND_CENTROID));
+        ASSERT_EQ((unsigned int) Count, tracker.Count());
+        EXPECT_FALSE(tracker.IsValid(Lost));
+    }
+
+    EXPECT_EQ((unsigned int) Count - 1, tracker.Update(&img, SearchRegion, Star::FIND_CENTROID));
+    ASSERT_EQ((unsigned int) Count - 1, tracker.Count());
+
+    // the stars after it moved down with their trails
+    for (unsigned int k = 0; k < tracker.Count(); k++)
+    {
+        int star = k < Lost ? k : k + 1;
+        EXPECT_NEAR(60.0 + (star % 16) * 75.0 + 0.3, tracker.X[k], 0.1) << "star " << star;
+        EXPECT_NEAR(60.0 + (star / 16) * 75.0 + 0.6, tracker.Y[k], 0.1) << "star " << star;
+        EXPECT_EQ((unsigned int) StarTracker::INITIAL_CHANCES, tracker.TrailLength(k));
+    }
+}
+
+class StarTrackerCountTest : public ::testing::TestWithParam<int>
+{
+};
+
+TEST_P(StarTrackerCountTest, MatchesStarFind)
+{
+    int const count = GetParam();
+
+    usImage img;
+    MakeFrame(img, count, 0.0, 0.0);
+
+    StarTracker tracker;
+    tracker.Reset(StartingStars(count));
+    ASSERT_EQ((unsigned int) count, tracker.Update(&img, SearchRegion, Star::FIND_CENTROID));
+
+    std::vector<Star> stars = StartingStars(count);
+    for (size_t k = 0; k < stars.size(); k++)
+        ASSERT_TRUE(stars[k].Find(&img, SearchRegion, Star::FIND_CENTROID));
+
+    for (int k = 0; k < count; k++)
+    {
+        EXPECT_DOUBLE_EQ(stars[k].X, tracker.X[k]);
+        EXPECT_DOUBLE_EQ(stars[k].Y, tracker.Y[k]);
+    }
+}
+
+TEST_P(StarTrackerCountTest, DISABLED_Benchmark)
+{
+    int const count = GetParam();
+    enum { Frames = 50 };
+
+    usImage img;
+    MakeFrame(img, count, 0.0, 0.0);
+
+    StarTracker tracker;
+    tracker.Reset(StartingStars(count));
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (int i = 0; i < Frames; i++)
+        ASSERT_EQ((unsigned int) count, tracker.Update(&img, SearchRegion, Star::FIND_CENTROID));
+    double trackerMs = Millis(start) / Frames;
+
+    std::vector<Star> stars = StartingStars(count);
+    start = std::chrono::steady_clock::now();
+    for (int i = 0; i < Frames; i++)
+        for (size_t k = 0; k < stars.size(); k++)
+            ASSERT_TRUE(stars[k].Find(&img, SearchRegion, Star::FIND_CENTROID));
+    double findMs = Millis(start) / Frames;
+
+    printf("%d stars on %u cpus: Star::Find each %.3f ms, StarTracker::Update %.3f ms per frame\n", count,
+           std::thread::hardware_concurrency(), findMs, trackerMs);
+}
+
+INSTANTIATE_TEST_CASE_P(StarCounts, StarTrackerCountTest, ::testing::Values(4, 8, 16, 32, 64, 128));
+
+int main(int argc, char **argv)
+{
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
@@ -0,0 +1,117 @@
+/*
+ *  test_stubs.cpp
+ *  PHD Guiding
+ *
+ *  Created by Arran Dengate
+ *  Copyright (c) 2017 Arran Dengate
+ *  All rights reserved.
+ *
+ *  This source code is distributed under the following "BSD" license
+ *  Redistribution and use in source and binary forms, with or without
+ *  modification, are permitted provided that the following conditions are met:
+ *    Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *    Redistributions in binary form must reproduce the above copyright notice,
+ *     this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *    Neither the name of Bret McKee, Dad Dog Development,
+ *     Craig Stark, Stark Labs nor the names of its
+ *     contributors may be used to endorse or promote products derived from
+ *     this software without specific prior written permission.
+ *
+ *  THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ *  AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ *  IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ *  ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT HOLDER OR CONTRIBUTORS BE
+ *  LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ *  CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ *  SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ *  INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ *  CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ *  ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ *  POSSIBILITY OF SUCH DAMAGE.
+ *
+ */
+
+#include "phd.h"
+
+#include <wx/filename.h>
+
+// Globals owned by the application (phd.cpp). The tests run without a
+// frame, camera or mount, so these stay null.
+
+PhdConfig *pConfig = NULL;
+Mount *pMount = NULL;
+Mount *pSecondaryMount = NULL;
+Scope *pPointingSource = NULL;
+MyFrame *pFrame = NULL;
+GuideCamera *pCamera = NULL;
+
+// The image modules refer to these on error paths and when saving files
+
+void MyFrame::Alert(const wxString& msg, int flags)
+{
+}
+
+wxString MyFrame::GetDarksDir()
+{
+    return wxFileName::GetTempDir();
+}
+
+double MyFrame::GetCameraPixelScale(void) const
+{
+    return 1.0;
+}
+
+// The modules under test log through Debug. These replace debuglog.cpp and
+// logger.cpp, which need a running application, with versions that discard
+// the output.
+
+DebugLog Debug;
+
+Logger::Logger(void)
+{
+    m_Initialized = false;
+}
+
+Logger::~Logger(void)
+{
+}
+
+bool Logger::ChangeDirLog(const wxString& newdir)
+{
+    return false;
+}
+
+wxString Logger::GetLogDir(void)
+{
+    return wxFileName::GetTempDir();
+}
+
+void Logger::RemoveMatchingFiles(const wxString& filePattern, int DaysOld)
+{
+}
+
+DebugLog::DebugLog(void)
+{
+    m_bEnabled = false;
+}
+
+DebugLog::~DebugLog(void)
+{
+}
+
+bool DebugLog::ChangeDirLog(const wxString& newdir)
+{
+    return false;
+}
+
+wxString DebugLog::AddLine(const wxString& str)
+{
+    return Write(str + "\n");
+}
+
+wxString DebugLog::Write(const wxString& str)
+{
+    return str;
+}
@@ -35,42 +35,85 @@
 #include "phd.h"
 #include "image_math.h"
 
+#include <wx/time.h>
+
 bool usImage::Init(const wxSize& size)
 {
     // Allocates space for image and sets params up
     // returns true on error
 
-    int prev = NPixels;
     NPixels = size.GetWidth() * size.GetHeight();
     Size = size;
     Subframe = wxRect(0, 0, 0, 0);
     Min = Max = 0;
 
-    if (NPixels != prev)
+    if (NPixels > (int) m_capacity || NPixels == 0 || m_dataOwner)
     {
-        delete[] ImageData;
+        if (!m_dataOwner)
+            FreePixels(ImageData);
+        m_dataOwner.reset();
+        ImageData = NULL;
+        m_capacity = 0;
 
         if (NPixels)
         {
-            ImageData = new unsigned short[NPixels];
+            ImageData = AllocPixels(NPixels);
             if (!ImageData)
             {
                 NPixels = 0;
                 return true;
             }
+            m_capacity = NPixels;
         }
-        else
-            ImageData = NULL;
     }
 
     return false;
 }
 
+unsigned short *usImage::AllocPixels(unsigned int count)
+{
+    size_t const bytes = (size_t) count * sizeof(unsigned short);
+#ifdef __WINDOWS__
+    return static_cast<unsigned short *>(_aligned_malloc(bytes, ALIGNMENT));
+#else
+    void *p;
+    if (posix_memalign(&p, ALIGNMENT, bytes) != 0)
+        return NULL;
+    return static_cast<unsigned short *>(p);
+#endif
+}
+
+void usImage::FreePixels(unsigned short *data)
+{
+#ifdef __WINDOWS__
+    _aligned_free(data);
+#else
+    free(data);
+#endif
+}
+
 void usImage::SwapImageData(usImage& other)
 {
     unsigned short *t = ImageData;
     ImageData = other.ImageData;
     other.ImageData = t;
+    m_dataOwner.swap(other.m_dataOwner);
+    std::swap(m_capacity, other.m_capacity);
+}
+
+// Uses pixel data held by owner, which is kept alive for as long as this
+// image refers to it
+void usImage::SetData(unsigned short *data, const wxSize& size, const std::shared_ptr<void>& owner)
+{
+    if (!m_dataOwner)
+        FreePixels(ImageData);
+    m_dataOwner = owner;
+    m_capacity = 0;
+    ImageData = data;
+    Size = size;
+    NPixels = size.GetWidth() * size.GetHeight();
+    Subframe = wxRect(0, 0, 0, 0);
+    Min = Max = 0;
 }
 
 void usImage::CalcStats()
@@ -78,77 +121,20 @@ void usImage::CalcStats()
     if (!ImageData || !NPixels)
         return;
 
-    Min = 65535; Max = 0;
-    FiltMin = 65535; FiltMax = 0;
-
-    if (Subframe.IsEmpty())
-    {
-        // full frame, no subframe
-
-        const unsigned short *src;
-
-        src = ImageData;
-        for (int i = 0; i < NPixels; i++)
-        {
-            int d = (int) *src++;
-            if (d < Min) Min = d;
-            if (d > Max) Max = d;
-        }
-
-        unsigned short *tmpdata = new unsigned short[NPixels];
-
-        Median3(tmpdata, ImageData, Size, wxRect(Size));
-
-        src = tmpdata;
-        for (int i = 0; i < NPixels; i++)
-        {
-            int d = (int) *src++;
-            if (d < FiltMin) FiltMin = d;
-            if (d > FiltMax) FiltMax = d;
-        }
-
-        delete[] tmpdata;
-    }
-    else
-    {
-        // Subframe
-
-        unsigned int pixcnt = Subframe.width * Subframe.height;
-        unsigned short *tmpdata = new unsigned short[pixcnt];
-
-        unsigned short *dst;
-
-        dst = tmpdata;
-        for (int y = 0; y < Subframe.height; y++)
-        {
-            const unsigned short *src = ImageData + Subframe.x + (Subframe.y + y) * Size.GetWidth();
-            for (int x = 0; x < Subframe.width; x++)
-            {
-               int d = (int) *src;
-               if (d < Min) Min = d;
-               if (d > Max) Max = d;
-               *dst++ = *src++;
-            }
-        }
-
-        dst = new unsigned short[pixcnt];
-
-        Median3(dst, tmpdata, Subframe.GetSize(), wxRect(Subframe.GetSize()));
-
-        const unsigned short *src = dst;
-        for (unsigned int i = 0; i < pixcnt; i++)
-        {
-            int d = (int) *src++;
-            if (d < FiltMin) FiltMin = d;
-            if (d > FiltMax) FiltMax = d;
-        }
-
-        delete[] dst;
-        delete[] tmpdata;
-    }
+    // Raw and median filtered extremes of the valid data, in one sweep and
+    // without copying the subframe or storing the filtered image
+    wxRect rect = Subframe.IsEmpty() ? wxRect(Size) : Subframe;
+    ImageMinMax(*this, rect, &Min, &Max, &FiltMin, &FiltMax);
 }
 
 bool usImage::CopyToImage(wxImage **rawimg, int blevel, int wlevel, double power)
+{
+    ImageStretch stretch;
+    stretch.Set(blevel, wlevel, power);
+    return CopyToImage(rawimg, stretch);
+}
+
+bool usImage::CopyToImage(wxImage **rawimg, const ImageStretch& stretch)
 {
     wxImage *img = *rawimg;
 
@@ -158,45 +144,7 @@ bool usImage::CopyToImage(wxImage **rawimg, int blevel, int wlevel, double power
         img = new wxImage(Size.GetWidth(), Size.GetHeight(), false);
     }
 
-    unsigned char *ImgPtr = img->GetData();
-    unsigned short *RawPtr = ImageData;
-
-    if (power == 1.0 || blevel >= wlevel)
-    {
-        float range = (float) wxMax(1, wlevel);  // Go 0-max
-        for (int i = 0; i < NPixels; i++, RawPtr++)
-        {
-            float d;
-            if (*RawPtr >= range)
-                d = 255.0;
-            else
-                d = ((float) (*RawPtr) / range) * 255.0;
-
-            *ImgPtr++ = (unsigned char) d;
-            *ImgPtr++ = (unsigned char) d;
-            *ImgPtr++ = (unsigned char) d;
-        }
-    }
-    else
-    {
-        float range = (float) (wlevel - blevel);
-        for (int i = 0; i < NPixels; i++, RawPtr++ )
-        {
-            float d;
-            if (*RawPtr <= blevel)
-                d = 0.0;
-            else if (*RawPtr >= wlevel)
-                d = 255.0;
-            else
-            {
-                d = ((float) (*RawPtr) - (float) blevel) / range;
-                d = pow(d, (float) power) * 255.0;
-            }
-            *ImgPtr++ = (unsigned char) d;
-            *ImgPtr++ = (unsigned char) d;
-            *ImgPtr++ = (unsigned char) d;
-        }
-    }
+    stretch.ToRGB(img->GetData(), ImageData, NPixels);
 
     *rawimg = img;
     return false;
@@ -204,80 +152,34 @@ bool usImage::CopyToImage(wxImage **rawimg, int blevel, int wlevel, double power
 
 bool usImage::BinnedCopyToImage(wxImage **rawimg, int blevel, int wlevel, double power)
 {
-    wxImage *img;
-    unsigned char *ImgPtr;
-    unsigned short *RawPtr;
-    int x,y;
-    float d;
-    //, s_factor;
-    int full_xsize, full_ysize;
-    int use_xsize, use_ysize;
-
-    full_xsize = Size.GetWidth();
-    full_ysize = Size.GetHeight();
-    use_xsize = full_xsize;
-    use_ysize = full_ysize;
-    if (use_xsize % 2) use_xsize--;
-    if (use_ysize % 2) use_ysize--;
-//  Binsize = 2;
-
-    img = *rawimg;
-    if ((!img->Ok()) || (img->GetWidth() != (full_xsize/2)) || (img->GetHeight() != (full_ysize/2)) ) {  // can't reuse bitmap
-        if (img->Ok()) {
-            delete img;  // Clear out current image if it exists
-            img = (wxImage *) NULL;
-        }
+    ImageStretch stretch;
+    stretch.Set(blevel, wlevel, power);
+    return BinnedCopyToImage(rawimg, stretch);
+}
+
+bool usImage::BinnedCopyToImage(wxImage **rawimg, const ImageStretch& stretch)
+{
+    wxImage *img = *rawimg;
+    int full_xsize = Size.GetWidth();
+    int full_ysize = Size.GetHeight();
+
+    if (!img || !img->Ok() || (img->GetWidth() != (full_xsize/2)) || (img->GetHeight() != (full_ysize/2)) ) // can't reuse bitmap
+    {
+        delete img;
         img = new wxImage(full_xsize/2, full_ysize/2, false);
     }
-    ImgPtr = img->GetData();
-    RawPtr = ImageData;
-//  s_factor = (((float) Max - (float) Min) / 255.0);
-    float range = (float) (wlevel - blevel);
-
-    if ((power == 1.0) || (range == 0.0)) {
-        range = wlevel;  // Go 0-max
-        if (range == 0.0) range = 0.001;
-        for (y=0; y<use_ysize; y+=2) {
-            for (x=0; x<use_xsize; x+=2) {
-                RawPtr = ImageData + x + y*full_xsize;
-                d = (float) (*RawPtr + *(RawPtr+1) + *(RawPtr+full_xsize) + *(RawPtr+1+full_xsize)) / 4.0;
-                d = (d / range) * 255.0;
-                if (d < 0.0) d = 0.0;
-                else if (d > 255.0) d = 255.0;
-                *ImgPtr = (unsigned char) d;
-                ImgPtr++;
-                *ImgPtr = (unsigned char) d;
-                ImgPtr++;
-                *ImgPtr = (unsigned char) d;
-                ImgPtr++;
-            }
-        }
-    }
-    else {
-        for (y=0; y<use_ysize; y+=2) {
-            for (x=0; x<use_xsize; x+=2) {
-                RawPtr = ImageData + x + y*full_xsize;
-                d = (float) (*RawPtr + *(RawPtr+1) + *(RawPtr+full_xsize) + *(RawPtr+1+full_xsize)) / 4.0;
-                d = (d - (float) blevel) / range ;
-                if (d < 0.0) d= 0.0;
-                else if (d > 1.0) d = 1.0;
-                d = pow(d, (float) power) * 255.0;
-                *ImgPtr = (unsigned char) d;
-                ImgPtr++;
-                *ImgPtr = (unsigned char) d;
-                ImgPtr++;
-                *ImgPtr = (unsigned char) d;
-                ImgPtr++;
-            }
-        }
-    }
+
+    stretch.BinnedToRGB(img->GetData(), ImageData, full_xsize, full_ysize);
+
     *rawimg = img;
     return false;
 }
 
 void usImage::InitImgStartTime()
 {
-    ImgStartTime = wxDateTime::GetTimeNow();
+    wxLongLong now = wxGetUTCTimeMillis();
+    ImgStartTime = (now / 1000).ToLong();
+    ImgStartMillis = (now % 1000).ToLong();
 }
 
 wxString usImage::GetImgStartTime() const
@@ -285,9 +187,11 @@ wxString usImage::GetImgStartTime() const
     if (!ImgStartTime)
         return wxEmptyString;
 
-    struct tm *timestruct = gmtime(&ImgStartTime);
-    return wxString::Format("%.4d-%.2d-%.2dT%.2d:%.2d:%.2d",timestruct->tm_year+1900,timestruct->tm_mon+1,
-        timestruct->tm_mday,timestruct->tm_hour,timestruct->tm_min,timestruct->tm_sec);
+    // reentrant, snapshots are written from a background thread
+    struct tm timestruct;
+    wxGmtime_r(&ImgStartTime, &timestruct);
+    return wxString::Format("%.4d-%.2d-%.2dT%.2d:%.2d:%.2d.%.3d",timestruct.tm_year+1900,timestruct.tm_mon+1,
+        timestruct.tm_mday,timestruct.tm_hour,timestruct.tm_min,timestruct.tm_sec,ImgStartMillis);
 }
 
 struct FITSHdrWriter
@@ -46,32 +46,38 @@ public:
     int                 Max;
     int                 FiltMin, FiltMax;
     time_t              ImgStartTime;
+    int                 ImgStartMillis; // milliseconds past ImgStartTime
     int                 ImgExpDur;
     int                 ImgStackCnt;
     wxByte              BitsPerPixel;
     unsigned short      Pedestal;
 
     usImage() {
-        Min = Max = FiltMin = FiltMax = 0;
         NPixels = 0;
         ImageData = NULL;
-        ImgStartTime = 0;
-        ImgExpDur = 0;
-        ImgStackCnt = 1;
-        BitsPerPixel = 0;
-        Pedestal = 0;
+        m_capacity = 0;
+        Recycle();
     }
-    ~usImage() { delete[] ImageData; }
+    ~usImage() { if (!m_dataOwner) FreePixels(ImageData); }
+
+    // Pixel storage is aligned to ALIGNMENT bytes and is only reallocated
+    // when an image grows, so switching between full frames and subframes
+    // does not allocate
+    enum { ALIGNMENT = 64 };
 
     bool                Init(const wxSize& size);
     bool                Init(int width, int height) { return Init(wxSize(width, height)); }
     void                SwapImageData(usImage& other);
+    void                SetData(unsigned short *data, const wxSize& size, const std::shared_ptr<void>& owner);
+    void                Recycle(void);
     void                CalcStats();
     void                InitImgStartTime();
     wxString            GetImgStartTime() const;
     bool                CopyFrom(const usImage& src);
     bool                CopyToImage(wxImage **img, int blevel, int wlevel, double power);
+    bool                CopyToImage(wxImage **img, const ImageStretch& stretch);
     bool                BinnedCopyToImage(wxImage **img, int blevel, int wlevel, double power); // Does 2x2 bin during copy
+    bool                BinnedCopyToImage(wxImage **img, const ImageStretch& stretch);
     bool                CopyFromImage(const wxImage& img);
     bool                Load(const wxString& fname);
     bool                Save(const wxString& fname, const wxString& hdrComment = wxEmptyString) const;
@@ -79,8 +85,29 @@ public:
     unsigned short&     Pixel(int x, int y) { return ImageData[y * Size.x + x]; }
     const unsigned short& Pixel(int x, int y) const { return ImageData[y * Size.x + x]; }
     void                Clear(void);
+
+private:
+    std::shared_ptr<void> m_dataOwner;  // set when ImageData belongs to someone else, e.g. a mapped file
+    unsigned int m_capacity;            // pixels allocated at ImageData when it is our own
+
+    static unsigned short *AllocPixels(unsigned int count);
+    static void FreePixels(unsigned short *data);
 };
 
+// Restores the header of a newly constructed image, keeping the pixel buffer
+// for the next Init
+inline void usImage::Recycle(void)
+{
+    Subframe = wxRect(0, 0, 0, 0);
+    Min = Max = FiltMin = FiltMax = 0;
+    ImgStartTime = 0;
+    ImgStartMillis = 0;
+    ImgExpDur = 0;
+    ImgStackCnt = 1;
+    BitsPerPixel = 0;
+    Pedestal = 0;
+}
+
 inline void usImage::Clear(void)
 {
     memset(ImageData, 0, NPixels * sizeof(unsigned short));
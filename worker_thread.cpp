@@ -35,6 +35,8 @@
 
 #include "phd.h"
 
+#include <wx/time.h>
+
 WorkerThread::WorkerThread(MyFrame *pFrame)
     : wxThread(wxTHREAD_JOINABLE),
       m_interruptRequested(0),
@@ -76,8 +78,7 @@ void WorkerThread::EnqueueWorkerThreadTerminateRequest(void)
 {
     m_interruptRequested = INT_STOP | INT_TERMINATE;
 
-    WORKER_THREAD_REQUEST message;
-    memset(&message, 0, sizeof(message));
+    WORKER_THREAD_REQUEST message = WORKER_THREAD_REQUEST();
 
     message.request = REQUEST_TERMINATE;
     EnqueueMessage(message);
@@ -85,17 +86,16 @@ void WorkerThread::EnqueueWorkerThreadTerminateRequest(void)
 
 /*************      Expose      **************************/
 
-void WorkerThread::EnqueueWorkerThreadExposeRequest(usImage *pImage, int exposureDuration, int exposureOptions, const wxRect& subframe)
+void WorkerThread::EnqueueWorkerThreadExposeRequest(const FramePtr& image, int exposureDuration, int exposureOptions, const wxRect& subframe)
 {
     m_interruptRequested &= ~INT_STOP;
 
-    WORKER_THREAD_REQUEST message;
-    memset(&message, 0, sizeof(message));
+    WORKER_THREAD_REQUEST message = WORKER_THREAD_REQUEST();
 
     Debug.Write("Enqueuing Expose request\n");
 
     message.request                      = REQUEST_EXPOSE;
-    message.args.expose.pImage           = pImage;
+    message.args.expose.image            = image;
     message.args.expose.exposureDuration = exposureDuration;
     message.args.expose.options          = exposureOptions;
     message.args.expose.subframe         = subframe;
@@ -152,7 +152,7 @@ bool WorkerThread::HandleExpose(EXPOSE_REQUEST *req)
             Debug.Write(wxString::Format("Handling exposure in thread, d=%d o=%x r=(%d,%d,%d,%d)\n", req->exposureDuration,
                                          req->options, req->subframe.x, req->subframe.y, req->subframe.width, req->subframe.height));
 
-            if (GuideCamera::Capture(pCamera, req->exposureDuration, *req->pImage, req->options, req->subframe))
+            if (GuideCamera::Capture(pCamera, req->exposureDuration, *req->image, req->options, req->subframe))
             {
                 throw ERROR_INFO("Capture failed");
             }
@@ -185,14 +185,14 @@ bool WorkerThread::HandleExpose(EXPOSE_REQUEST *req)
                 case NR_NONE:
                     break;
                 case NR_2x2MEAN:
-                    QuickLRecon(*req->pImage);
+                    QuickLRecon(*req->image, m_nrScratch);
                     break;
                 case NR_3x3MEDIAN:
-                    Median3(*req->pImage);
+                    Median3(*req->image, m_nrScratch);
                     break;
             }
 
-            req->pImage->CalcStats();
+            req->image->CalcStats();
         }
     }
     catch (const wxString& Msg)
@@ -204,22 +204,21 @@ bool WorkerThread::HandleExpose(EXPOSE_REQUEST *req)
     return  bError;
 }
 
-void WorkerThread::SendWorkerThreadExposeComplete(usImage *pImage, bool bError)
+void WorkerThread::SendWorkerThreadExposeComplete(const FramePtr& image, bool bError)
 {
     wxThreadEvent *event = new wxThreadEvent(wxEVT_THREAD, MYFRAME_WORKER_THREAD_EXPOSE_COMPLETE);
-    event->SetPayload<usImage *>(pImage);
+    event->SetPayload<FramePtr>(image);
     event->SetInt(bError);
     wxQueueEvent(m_pFrame, event);
 }
 
 /*************      Move       **************************/
 
-void WorkerThread::EnqueueWorkerThreadMoveRequest(Mount *mount, const PHD_Point& vectorEndpoint, MountMoveType moveType, double rotationDeg)
+void WorkerThread::EnqueueWorkerThreadMoveRequest(Mount *mount, const PHD_Point& vectorEndpoint, MountMoveType moveType, const GuideCorrection& correction, int deadlineMs)
 {
     m_interruptRequested &= ~INT_STOP;
 
-    WORKER_THREAD_REQUEST message;
-    memset(&message, 0, sizeof(message));
+    WORKER_THREAD_REQUEST message = WORKER_THREAD_REQUEST();
 
     Debug.Write(wxString::Format("Enqueuing Move request for %s (%.2f, %.2f)\n", mount->GetMountClassName(), vectorEndpoint.X, vectorEndpoint.Y));
 
@@ -229,7 +228,11 @@ void WorkerThread::EnqueueWorkerThreadMoveRequest(Mount *mount, const PHD_Point&
     message.args.move.vectorEndpoint  = vectorEndpoint;
     message.args.move.moveType        = moveType;
     message.args.move.pSemaphore      = NULL;
-    message.args.move.rotationDeg     = rotationDeg;
+    message.args.move.rotationDeg     = correction.rotationDeg;
+    message.args.move.correction      = correction;
+    message.args.move.requestTime     = wxGetUTCTimeMillis();
+    if (deadlineMs > 0)
+        message.args.move.deadline    = message.args.move.requestTime + deadlineMs;
 
     EnqueueMessage(message);
 }
@@ -238,8 +241,7 @@ void WorkerThread::EnqueueWorkerThreadMoveRequest(Mount *mount, const GUIDE_DIRE
 {
     m_interruptRequested &= ~INT_STOP;
 
-    WORKER_THREAD_REQUEST message;
-    memset(&message, 0, sizeof(message));
+    WORKER_THREAD_REQUEST message = WORKER_THREAD_REQUEST();
 
     Debug.Write(wxString::Format("Enqueuing Calibration Move request for direction %d\n", direction));
 
@@ -251,10 +253,65 @@ void WorkerThread::EnqueueWorkerThreadMoveRequest(Mount *mount, const GUIDE_DIRE
     message.args.move.moveType        = MOVETYPE_DIRECT;
     message.args.move.pSemaphore      = NULL;
     message.args.move.rotationDeg     = rotationDeg;
+    message.args.move.requestTime     = wxGetUTCTimeMillis();
 
     EnqueueMessage(message);
 }
 
+static bool is_correction(const MOVE_REQUEST& move)
+{
+    return !move.calibrationMove && move.moveType != MOVETYPE_DIRECT;
+}
+
+// When the mount falls behind, a guide correction can still be queued when
+// the correction from a later frame arrives for the same mount. Rather than
+// send both, the older pulse is added to the newer one and sent with it, so
+// the mount gets one command and moves as far as the two would have taken it.
+// Only the pulse is merged: the guide algorithms ran for both frames when the
+// moves were scheduled, and both steps are still logged. Direct and
+// calibration moves are always sent on their own.
+bool WorkerThread::MergeIntoNewer(const MOVE_REQUEST& move, unsigned int *newerId)
+{
+    if (!is_correction(move))
+        return false;
+
+    // look at everything queued behind this move; the wakeups for these
+    // requests are still pending, so Entry() takes them from m_pending
+    WORKER_THREAD_REQUEST next;
+    while (m_highPriorityQueue.ReceiveTimeout(0, next) == wxMSGQUEUE_NO_ERROR)
+        m_pending.push_back(next);
+
+    for (std::deque<WORKER_THREAD_REQUEST>::iterator it = m_pending.begin(); it != m_pending.end(); ++it)
+    {
+        if (it->request != REQUEST_MOVE || it->args.move.pMount != move.pMount || !is_correction(it->args.move))
+            continue;
+
+        const GuideCorrection& older = move.correction;
+        GuideCorrection& newer = it->args.move.correction;
+
+        if (older.send)
+        {
+            if (newer.send)
+            {
+                newer.moveVector += older.moveVector;
+                newer.rotationDeg += older.rotationDeg;
+            }
+            else
+            {
+                newer.send = true;
+                newer.moveVector = older.moveVector;
+                newer.rotationDeg = older.rotationDeg;
+                newer.moveLengthMs = older.moveLengthMs;
+            }
+        }
+
+        *newerId = newer.id;
+        return true;
+    }
+
+    return false;
+}
+
 Mount::MOVE_RESULT WorkerThread::HandleMove(MOVE_REQUEST *pArgs)
 {
     Mount::MOVE_RESULT result = Mount::MOVE_OK;
@@ -282,7 +339,7 @@ Mount::MOVE_RESULT WorkerThread::HandleMove(MOVE_REQUEST *pArgs)
             else
             {
                 //Debug.Write(wxString::Format("endpoint = (%.2f, %.2f)\n", pArgs->vectorEndpoint.X, pArgs->vectorEndpoint.Y));
-                result = pArgs->pMount->Move(pArgs->vectorEndpoint, pArgs->moveType, pArgs->rotationDeg);
+                result = pArgs->pMount->SendMove(pArgs->correction);
 
                 if (result != Mount::MOVE_OK)
                 {
@@ -328,11 +385,10 @@ Mount::MOVE_RESULT WorkerThread::HandleMove(MOVE_REQUEST *pArgs)
     return result;
 }
 
-void WorkerThread::SendWorkerThreadMoveComplete(Mount *mount, Mount::MOVE_RESULT moveResult)
+void WorkerThread::SendWorkerThreadMoveComplete(const MOVE_COMPLETE& done)
 {
     wxThreadEvent *event = new wxThreadEvent(wxEVT_THREAD, MYFRAME_WORKER_THREAD_MOVE_COMPLETE);
-    event->SetInt(moveResult);
-    event->SetPayload<Mount *>(mount);
+    event->SetPayload<MOVE_COMPLETE>(done);
     wxQueueEvent(m_pFrame, event);
 }
 
@@ -360,7 +416,14 @@ wxThread::ExitCode WorkerThread::Entry()
 
         assert(queueError == wxMSGQUEUE_NO_ERROR);
 
-        queueError = m_highPriorityQueue.ReceiveTimeout(0, message);
+        if (!m_pending.empty())
+        {
+            message = m_pending.front();
+            m_pending.pop_front();
+            queueError = wxMSGQUEUE_NO_ERROR;
+        }
+        else
+            queueError = m_highPriorityQueue.ReceiveTimeout(0, message);
 
         if (queueError == wxMSGQUEUE_TIMEOUT)
         {
@@ -386,20 +449,43 @@ wxThread::ExitCode WorkerThread::Entry()
                 if (m_skipSendExposeComplete)
                 {
                     Debug.Write("worker thread skipping SendWorkerThreadExposeComplete\n");
-                    delete message.args.expose.pImage; // should be null though
-                    message.args.expose.pImage = 0;
+                    message.args.expose.image.reset(); // back to the pool
                     m_skipSendExposeComplete = false;
                 }
                 else
-                    SendWorkerThreadExposeComplete(message.args.expose.pImage, bError);
+                    SendWorkerThreadExposeComplete(message.args.expose.image, bError);
                 break;
 
             case REQUEST_MOVE: {
                 Debug.Write(wxString::Format("worker thread servicing REQUEST_MOVE %s dir %d (%.2f, %.2f)\n",
                     message.args.move.pMount->GetMountClassName(), message.args.move.direction,
                     message.args.move.vectorEndpoint.X, message.args.move.vectorEndpoint.Y));
-                Mount::MOVE_RESULT moveResult = HandleMove(&message.args.move);
-                SendWorkerThreadMoveComplete(message.args.move.pMount, moveResult);
+                const MOVE_REQUEST& move = message.args.move;
+
+                MOVE_COMPLETE done = MOVE_COMPLETE();
+                done.pMount = move.pMount;
+                done.step = move.correction.step;
+                done.correctionId = move.correction.id;
+
+                wxLongLong start = wxGetUTCTimeMillis();
+                done.queuedMs = (start - move.requestTime).ToLong();
+                done.late = move.deadline != 0 && start > move.deadline;
+
+                if (MergeIntoNewer(move, &done.mergedInto))
+                {
+                    Debug.Write(wxString::Format("worker thread merges move for frame %d into a newer one, queued %ldms\n",
+                        move.correction.step.frameNumber, done.queuedMs));
+                    done.merged = true;
+                    done.moveResult = Mount::MOVE_OK;
+                }
+                else
+                {
+                    done.moveResult = HandleMove(&message.args.move);
+                    done.sentTime = wxGetUTCTimeMillis();
+                    done.executeMs = (done.sentTime - start).ToLong();
+                }
+
+                SendWorkerThreadMoveComplete(done);
                 break;
             }
 
@@ -58,7 +58,7 @@ class MyFrame;
 
 struct EXPOSE_REQUEST
 {
-    usImage         *pImage;
+    FramePtr         image;
     int              exposureDuration;
     int              options;
     wxRect           subframe;
@@ -77,6 +77,24 @@ struct MOVE_REQUEST
     PHD_Point          vectorEndpoint;
     wxSemaphore       *pSemaphore;
     double             rotationDeg;
+    GuideCorrection    correction;      // guide moves, prepared on the main thread
+    wxLongLong         requestTime;     // when the move was queued (UTC ms)
+    wxLongLong         deadline;        // when the next correction is due, 0 if none
+};
+
+// payload of MYFRAME_WORKER_THREAD_MOVE_COMPLETE
+struct MOVE_COMPLETE
+{
+    Mount             *pMount;
+    Mount::MOVE_RESULT moveResult;
+    GuideStepInfo      step;            // logged on the main thread
+    unsigned int       correctionId;    // GuideCorrection::id
+    unsigned int       mergedInto;      // id of the correction this one was sent with
+    wxLongLong         sentTime;        // when the move was sent (UTC ms)
+    bool               merged;          // not sent alone, added to a newer correction
+    bool               late;            // started after its deadline
+    long               queuedMs;
+    long               executeMs;
 };
 
 class WorkerThread : public wxThread
@@ -110,7 +128,9 @@ class WorkerThread : public wxThread
     wxMessageQueue<bool> m_wakeupQueue;
     wxMessageQueue<WORKER_THREAD_REQUEST> m_highPriorityQueue;
     wxMessageQueue<WORKER_THREAD_REQUEST> m_lowPriorityQueue;
+    std::deque<WORKER_THREAD_REQUEST> m_pending; // taken off the high priority queue by MergeIntoNewer
     bool m_skipSendExposeComplete;
+    usImage m_nrScratch;    // noise reduction swaps buffers with this instead of allocating
 
 public:
 
@@ -172,20 +192,21 @@ protected:
 
     /*************      Expose      **************************/
 public:
-    void EnqueueWorkerThreadExposeRequest(usImage *pImage, int exposureDuration, int exposureOptions, const wxRect& subframe);
+    void EnqueueWorkerThreadExposeRequest(const FramePtr& image, int exposureDuration, int exposureOptions, const wxRect& subframe);
     void SetSkipExposeComplete();
 protected:
     bool HandleExpose(EXPOSE_REQUEST *pArgs);
-    void SendWorkerThreadExposeComplete(usImage *pImage, bool bError);
+    void SendWorkerThreadExposeComplete(const FramePtr& image, bool bError);
     // in the frame class: void MyFrame::OnWorkerThreadExposeComplete(wxThreadEvent& event);
 
     /*************      Guide       **************************/
 public:
-    void EnqueueWorkerThreadMoveRequest(Mount *pMount, const PHD_Point& vectorEndpoint, MountMoveType moveType, double rotationDeg);
+    void EnqueueWorkerThreadMoveRequest(Mount *pMount, const PHD_Point& vectorEndpoint, MountMoveType moveType, const GuideCorrection& correction, int deadlineMs);
     void EnqueueWorkerThreadMoveRequest(Mount *pMount, const GUIDE_DIRECTION direction, int duration, double rotationDeg);
 protected:
+    bool MergeIntoNewer(const MOVE_REQUEST& move, unsigned int *newerId);
     Mount::MOVE_RESULT HandleMove(MOVE_REQUEST *pArgs);
-    void SendWorkerThreadMoveComplete(Mount *pMount, Mount::MOVE_RESULT moveResult);
+    void SendWorkerThreadMoveComplete(const MOVE_COMPLETE& done);
     // in the frame class: void MyFrame::OnWorkerThreadGuideComplete(wxThreadEvent& event);
 
     void EnqueueMessage(const WORKER_THREAD_REQUEST& message);